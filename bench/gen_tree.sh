@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# gen_tree.sh: Creates a reproducible directory tree for the benchmarks. The
+#              same shape and scale always give the same names, sizes and
+#              links, so timings of different builds can be compared.
+#
+# Usage: gen_tree.sh SHAPE DIR [SCALE]
+#   SHAPE: wide      - one directory of 100000 empty files
+#          deep      - a chain of 1000 nested directories, 10 files in each
+#          smalldirs - 100 directories of 200 subdirectories, 3 files in each
+#          longnames - 20 directories of 1000 files with 200-byte names
+#          symlinks  - a tree of 5000 files and 10 symbolic link farms of it
+#                      (cp -rs), plus 1000 dangling links
+#   DIR:   Directory to create; it must not exist yet.
+#   SCALE: Positive integer multiplying the sizes above (default: 1).
+#
+set -eu
+
+if [ $# -lt 2 ] || [ $# -gt 3 ]; then
+    echo "Usage: $0 SHAPE DIR [SCALE]" >&2
+    exit 2
+fi
+shape=$1
+dir=$2
+scale=${3:-1}
+case $scale in
+    ''|*[!0-9]*|0) echo "Error: Invalid scale '$scale'" >&2; exit 2 ;;
+esac
+if [ -e "$dir" ]; then
+    echo "Error: '$dir' already exists" >&2
+    exit 1
+fi
+
+# names PREFIX COUNT: prints PREFIX000000 ... one per line
+names() {
+    awk -v prefix="$1" -v count="$2" 'BEGIN { for (i = 0; i < count; i++) printf "%s%06d\n", prefix, i }'
+}
+
+# fill DIR PREFIX COUNT: creates COUNT empty files in DIR
+fill() {
+    (cd "$1" && names "$2" "$3" | xargs touch)
+}
+
+mkdir -p "$dir"
+case $shape in
+    wide)
+        fill "$dir" f $((100000 * scale))
+        ;;
+    deep)
+        # Built with relative, physical steps: a logical cd (as in dash) keeps
+        # the whole path in $PWD and fails past PATH_MAX, cd -P does not.
+        (
+            cd "$dir"
+            level=0
+            while [ $level -lt $((1000 * scale)) ]; do
+                names f 10 | xargs touch
+                mkdir d
+                cd -P d
+                level=$((level + 1))
+            done
+        )
+        ;;
+    smalldirs)
+        # All paths come from one awk run, so there is no process per directory.
+        (
+            cd "$dir"
+            awk -v count=$((200 * scale)) 'BEGIN {
+                for (t = 0; t < 100; t++) for (s = 0; s < count; s++) printf "t%06d/s%06d\n", t, s }' |
+                xargs mkdir -p
+            awk -v count=$((200 * scale)) 'BEGIN {
+                for (t = 0; t < 100; t++) for (s = 0; s < count; s++) for (f = 0; f < 3; f++)
+                    printf "t%06d/s%06d/f%06d\n", t, s, f }' |
+                xargs touch
+        )
+        ;;
+    longnames)
+        long=$(awk 'BEGIN { for (i = 0; i < 194; i++) printf "n" }')
+        for top in $(names t 20); do
+            mkdir "$dir/$top"
+            fill "$dir/$top" "$long" $((1000 * scale))
+        done
+        ;;
+    symlinks)
+        # cp -rs needs an absolute source to create links that resolve.
+        abs=$(cd "$dir" && pwd)
+        mkdir "$abs/target"
+        for top in $(names t 10); do
+            mkdir "$abs/target/$top"
+            fill "$abs/target/$top" f $((500 * scale))
+        done
+        for farm in $(names farm 10); do
+            cp -rs "$abs/target" "$abs/$farm"
+        done
+        mkdir "$abs/dangling"
+        (cd "$abs/dangling" && names l $((1000 * scale)) | awk '{ print "missing/" $0; print $0 }' |
+            xargs -n 2 ln -s)
+        ;;
+    *)
+        echo "Error: Unknown shape '$shape'" >&2
+        rmdir "$dir"
+        exit 2
+        ;;
+esac
@@ -0,0 +1,131 @@
+#!/bin/sh
+#
+# run.sh: Times dirwalk against find on the trees of gen_tree.sh and prints
+#         one CSV row per shape, command and cache state to stdout.
+#
+# Usage: run.sh [-w WORKDIR] [-s SCALE] [-n RUNS] [-j THREADS] [-c] [-r READDIR_BUILD] DIRWALK
+#   -w WORKDIR: Directory holding the generated trees (default: /tmp/dirwalk-bench).
+#               A tree is generated once per shape and scale and then reused.
+#   -s SCALE:   Scale of the trees, see gen_tree.sh (default: 1).
+#   -n RUNS:    Timed runs per command and cache state (default: 5).
+#   -j THREADS: Worker threads of the -j runs (default: 4).
+#   -c:         Also time cold-cache runs, dropping the page, dentry and inode
+#               caches before each run (needs root; skipped with a warning otherwise).
+#   -r READDIR_BUILD: dirwalk built with BACKEND=readdir, timed as a backend too.
+#   DIRWALK:    The dirwalk binary to time.
+#   SHAPES:     Environment variable with the shapes to run (default: all).
+#
+# Columns: shape, entries (as counted by find), command, cache (warm or cold),
+# runs, then the minimum, median and maximum wall time in seconds. Warm runs
+# follow one untimed run that loads the caches. Every command runs under
+# LC_ALL=C, so sorted runs are comparable between machines, with its output
+# sent to /dev/null.
+#
+set -eu
+
+workdir=/tmp/dirwalk-bench
+scale=1
+runs=5
+threads=4
+cold=0
+readdir_build=
+while getopts w:s:n:j:cr: opt; do
+    case $opt in
+        w) workdir=$OPTARG ;;
+        s) scale=$OPTARG ;;
+        n) runs=$OPTARG ;;
+        j) threads=$OPTARG ;;
+        c) cold=1 ;;
+        r) readdir_build=$OPTARG ;;
+        *) exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 [-w WORKDIR] [-s SCALE] [-n RUNS] [-j THREADS] [-c] [-r READDIR_BUILD] DIRWALK" >&2
+    exit 2
+fi
+dirwalk=$1
+case $runs in
+    ''|*[!0-9]*|0) echo "Error: Invalid number of runs '$runs'" >&2; exit 2 ;;
+esac
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+export LC_ALL=C
+
+if [ "$cold" = 1 ] && ! { [ -w /proc/sys/vm/drop_caches ] && sync && echo 3 > /proc/sys/vm/drop_caches; } 2>/dev/null; then
+    echo "Warning: Cannot drop caches (needs root), so cold-cache runs are skipped." >&2
+    cold=0
+fi
+
+# now: prints the wall-clock time in nanoseconds (GNU date; the shell has no
+# monotonic clock, so a clock step during a run skews that run)
+now() {
+    date +%s%N
+}
+
+# time_command CACHE CMD...: runs CMD the given number of times and prints
+# "runs,min,median,max" of the wall times in seconds
+time_command() {
+    cache=$1
+    shift
+    if [ "$cache" = warm ]; then
+        "$@" > /dev/null 2>&1 || true
+    fi
+    run=0
+    while [ $run -lt "$runs" ]; do
+        if [ "$cache" = cold ]; then
+            sync
+            echo 3 > /proc/sys/vm/drop_caches
+        fi
+        start=$(now)
+        "$@" > /dev/null 2>&1 || true
+        end=$(now)
+        echo $((end - start))
+        run=$((run + 1))
+    done | sort -n | awk -v runs="$runs" '
+        { t[NR] = $1 / 1e9 }
+        END { printf "%d,%.6f,%.6f,%.6f\n", runs, t[1], (t[int((NR + 1) / 2)] + t[int(NR / 2) + 1]) / 2, t[NR] }'
+}
+
+# find_sorted DIR: the find equivalent of dirwalk -s
+find_sorted() {
+    find "$1" | sort
+}
+
+echo "shape,entries,command,cache,runs,min_s,median_s,max_s"
+for shape in ${SHAPES:-wide deep smalldirs longnames symlinks}; do
+    tree="$workdir/$shape-$scale"
+    if [ ! -e "$tree/.complete" ]; then
+        rm -rf "$tree"
+        mkdir -p "$workdir"
+        echo "Generating $tree..." >&2
+        "$bench_dir/gen_tree.sh" "$shape" "$tree/root" "$scale"
+        touch "$tree/.complete"
+    fi
+    entries=$(find "$tree/root" | wc -l | tr -d ' ')
+
+    # Each entry: the command as reported, then the command line.
+    for cache in warm cold; do
+        if [ "$cache" = cold ] && [ "$cold" = 0 ]; then
+            continue
+        fi
+        while IFS='|' read -r name command; do
+            [ -n "$name" ] || continue
+            # shellcheck disable=SC2086 # the command line is split on purpose
+            echo "$shape,$entries,$name,$cache,$(time_command "$cache" $command)"
+        done <<LIST
+find|find $tree/root
+find -type f|find $tree/root -type f
+find+sort|find_sorted $tree/root
+dirwalk|$dirwalk $tree/root
+dirwalk -f|$dirwalk $tree/root -f
+dirwalk -s|$dirwalk $tree/root -s
+dirwalk -j$threads|$dirwalk $tree/root -j$threads
+dirwalk -s -j$threads|$dirwalk $tree/root -s -j$threads
+dirwalk --uring|$dirwalk $tree/root --uring
+dirwalk -L|$dirwalk $tree/root -L
+${readdir_build:+dirwalk (readdir)|$readdir_build $tree/root}
+${readdir_build:+dirwalk -s (readdir)|$readdir_build $tree/root -s}
+LIST
+    done
+done
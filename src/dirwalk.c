@@ -1,54 +1,790 @@
 /*
  * dirwalk: Recursively scans a directory and prints file paths based on type filters.
  *
- * Usage: dirwalk [dir] [-l] [-d] [-f] [-s]
- *   dir: Starting directory (default: current directory "./").
- *   -l:  List only symbolic links.
- *   -d:  List only directories.
- *   -f:  List only regular files.
- *   -s:  Sort the output according to LC_COLLATE.
+ * Usage: dirwalk [dir...] [-l] [-d] [-f] [-s] [-L] [-0] [-j N] [--binary] [--compact] [--sort-mem=SIZE]
+ *               [--tmpdir=DIR] [--output-buffer=SIZE] [--uring] [--prefetch=N] [--max-fds=N]
+ *               [--name=GLOB] [--iname=GLOB] [--regex=RE]
+ *               [--size=[+-]N[cwbkMG]] [--mtime=[+-]N] [--newer=FILE] [--user=NAME]
+ *               [--maxdepth=N] [--mindepth=N] [--xdev] [--prune=GLOB] [--index=FILE] [--watch]
+ *               [--summarize[=N]] [--roots-from=FILE] [--shard=I/N] [--shard-depth=K]
+ *               [--checkpoint=FILE] [--stats[=json]] [--max-errors=N] [--front-coded[=zstd]]
+ *        dirwalk --diff OLD NEW [-0] [--binary]
+ *   dir:       Starting directories (default: current directory "./"); any
+ *              number may be given, before, between or after the options.
+ *   -l:        List only symbolic links.
+ *   -d:        List only directories.
+ *   -f:        List only regular files.
+ *   -s:        Sort the output according to LC_COLLATE.
+ *   -L:        Follow symbolic links. Entries are listed with the type of
+ *              their target and linked directories are walked; directories
+ *              reached again (cycles, repeated links) are listed but not
+ *              walked a second time.
+ *   -0:        Terminate each path with a NUL byte instead of a newline.
+ *   -j N:      Walk with N worker threads (default: 1).
+ *   --binary:  Write length-prefixed binary records instead of lines (see below).
+ *   --compact: With -s, store collected entries as (parent, name) nodes
+ *              instead of full paths, trading sort time for memory.
+ *   --sort-mem=SIZE: With -s, keep at most about SIZE bytes (K, M or G suffix)
+ *              of collected entries in memory, spilling sorted runs to
+ *              temporary files that are merged at the end.
+ *   --tmpdir=DIR: Directory for the --sort-mem run files (default: $TMPDIR or /tmp).
+ *   --output-buffer=SIZE: Size of each output buffer (default: 256K).
+ *   --uring:   Resolve entries of unknown type with batched io_uring statx
+ *              requests instead of one fstatat each (Linux; falls back to
+ *              fstatat when io_uring is unavailable).
+ *   --prefetch=N: Resolve entries of unknown type with N helper threads per
+ *              walker that stat the next N such entries of a directory while
+ *              the current one is being processed (getdents64 backend).
+ *   --max-fds=N: Keep at most N directories open at once (default: half of
+ *              RLIMIT_NOFILE, at most 4096). Deeper ancestors are closed and
+ *              their remaining entries buffered, so depth is unlimited.
+ *   --name=GLOB: List only entries whose name matches the shell pattern GLOB
+ *              (*, ?, [...] with ranges, negation and [:class:]; \ escapes).
+ *   --iname=GLOB: Like --name, ignoring ASCII letter case.
+ *   --regex=RE: List only entries whose name contains a match of the POSIX
+ *              extended regular expression RE (anchor with ^ and $).
+ *   --size=[+-]N[cwbkMG]: List only entries of (more than, less than) N units
+ *              of size, rounded up as find does; the unit defaults to
+ *              512-byte blocks (b), c is bytes, w 2 bytes, k/M/G powers of 1024.
+ *   --mtime=[+-]N: List only entries modified (more than, less than) N whole
+ *              days before the walk started.
+ *   --newer=FILE: List only entries modified more recently than FILE.
+ *   --user=NAME: List only entries owned by user NAME (or numeric ID).
+ *   --maxdepth=N: Descend at most N levels below the starting path (0: the
+ *              starting path only).
+ *   --mindepth=N: List only entries at least N levels below the starting path.
+ *   --xdev:    Do not descend into directories on other file systems.
+ *   --prune=GLOB: Skip directories whose name matches GLOB, with everything
+ *              below them (repeatable); they are not listed nor opened.
+ *   --index=FILE: Reuse the entry lists of directories unchanged (by mtime
+ *              and ctime) since the snapshot in FILE was taken, then replace
+ *              FILE with a snapshot of this walk.
+ *   --watch:   After the walk, keep running and print the paths added below
+ *              the starting directory as "+path" and removed ones as "-path"
+ *              (the walk's own paths get the "+" too), until the starting
+ *              directory itself is removed or moved.
+ *   --summarize[=N]: Instead of listing entries, add up the space used by
+ *              each directory with everything below it and print the N
+ *              (default: 20) biggest ones.
+ *   --roots-from=FILE: Also walk the starting paths listed in FILE ("-" for
+ *              stdin), one per line, or NUL-terminated with -0; they follow
+ *              those of the command line.
+ *   --shard=I/N: List only shard I (1 to N) of N disjoint parts of the tree,
+ *              chosen by a hash of the path of each entry at the --shard-depth
+ *              level below the starting path, which takes its subtree along.
+ *   --shard-depth=K: Level of the entries --shard hashes (default: 1, the
+ *              entries directly below the starting path).
+ *   --checkpoint=FILE: Record in FILE the directories whose entries have been
+ *              written; if FILE already holds such a record, resume the walk
+ *              after them, cutting stdout back to the last recorded output
+ *              (start again with ">>"). FILE is removed once the walk is done.
+ *   --stats[=json]: At exit, print to stderr what the run spent its time on:
+ *              phase timings, directories opened, entries seen, stat calls
+ *              saved by d_type, errors by errno, bytes written and latency
+ *              histograms of each class of system calls (as one JSON object
+ *              with =json).
+ *   --max-errors=N: Print only the first N errors met while walking (0 for
+ *              none); at exit, print how many there were by errno and the
+ *              directories holding most of them.
+ *   --front-coded[=zstd]: Write the sorted entries (implies -s) as a compact
+ *              listing file instead of paths (see below), its blocks
+ *              compressed with zstd with =zstd.
+ *   --diff:    Instead of walking, compare the --front-coded listings OLD and
+ *              NEW and print the entries only in OLD as "-path" and those only
+ *              in NEW as "+path" (both when the type changed), in sorted order.
  *
  * If no type options (-l, -d, -f) are given, all entry types (files, directories,
  * links, sockets, fifos, etc.) are listed, similar to find's default behavior.
- * Options can be combined (e.g., -ld) and appear before or after the directory.
+ * Name filters (--name, --iname, --regex) may be repeated; an entry passes if it
+ * matches any of them, and must also pass the type filters. Like find, they
+ * test the last component only and never stop the walk from descending.
+ * Metadata filters (--size, --mtime, --newer, --user) all have to hold. They are
+ * checked last, with one statx call that asks only for the fields they test,
+ * and only for entries that passed the name and type filters.
+ * Options can be combined (e.g., -ld) and appear before or after the directories.
+ * Several starting paths are listed in the order given, each as a separate
+ * walk; with -s their entries are sorted together. With -j they share the
+ * worker pool, and the output of each path is held back (in memory, then in a
+ * temporary file below --tmpdir) until the paths before it are finished.
  * The output format matches the 'find' utility for the equivalent options.
+ * Output is written in large buffered blocks of whole lines (line by line when
+ * stdout is a terminal). With -j, unsorted output from different threads
+ * interleaves block by block;
+ * sorted output is identical to a single-threaded run.
+ *
+ * With --binary, every entry is one record: a 4-byte path length in host byte
+ * order, a 1-byte entry type (the DT_* value, e.g. DT_REG or DT_DIR), and the
+ * path bytes with no terminator. Records are packed back to back.
+ *
+ * With --watch, changes are collected until events pause for 50 ms (or for at
+ * most a second) and printed in batches, unsorted even with -s. A removed
+ * directory stands for everything below it and is printed even when
+ * directories are filtered out; removals skip the metadata filters, and a
+ * path may be printed as added twice when it appears while its directory is
+ * being walked. Events come from fanotify where permitted (CAP_SYS_ADMIN and
+ * CAP_DAC_READ_SEARCH, not with -L), otherwise from one inotify watch per
+ * directory, subject to fs.inotify.max_user_watches.
+ *
+ * With --summarize, each printed line holds the allocated bytes (st_blocks
+ * times 512), the apparent bytes (st_size), the number of entries and the
+ * path of a directory, separated by tabs, biggest allocation first. The
+ * totals include the directory itself and every entry below it that passes
+ * the filters; a file with several hard links counts once, at the first
+ * path the walk finds it under. -s and --watch do not apply.
+ *
+ * With --shard, every run with the same N, K and starting paths lists a
+ * disjoint part of the entries, and the N runs together list every entry
+ * exactly once, on any machine: the hash is the 64-bit FNV-1a of the path
+ * below the starting path, not of anything local. Entries above level K are
+ * walked by every shard, since their subtrees are split, but listed only by
+ * the one their own path hashes to (the starting paths by shard 1); entries
+ * at level K are listed and walked by their shard only, and nothing below
+ * them is looked at by the others. The -s output of the N shards, merged
+ * under the same LC_COLLATE (sort -m), is the -s output of the whole tree.
+ * With --summarize the totals cover the entries of the shard. --watch does
+ * not apply.
+ *
+ * With --front-coded, the output is a listing file in host byte order: a
+ * header naming the LC_COLLATE the entries are sorted by, blocks of entries,
+ * an index of the blocks and a trailer pointing to the index. Each entry of a
+ * block is the number of leading bytes it shares with the previous entry of
+ * the block, the number of bytes that follow, its DT_* type and those bytes;
+ * the first entry of a block shares nothing, so a block decodes on its own.
+ * The index records the offset, sizes, entry count and first path of every
+ * block, so a reader can seek to the block holding a path by binary search.
+ * Blocks end where the hash of a path says so once they are big enough,
+ * which makes the listings of two walks of a slowly changing tree share
+ * most of their blocks byte for byte; --diff compares those by their stored
+ * bytes without decoding them, and merges the rest entry by entry, in one
+ * pass over both files. Both listings must be sorted for the same collation.
+ *
+ * The walker itself is libdirwalk (libdirwalk.c, see dirwalk.h), which the
+ * program is linked with; this file holds what only the program uses: main
+ * and the option parsing, the walk loops and the worker pool, --index,
+ * --checkpoint, --watch, --summarize, --front-coded, --diff and the reports.
  */
 
 #define _POSIX_C_SOURCE 200809L // Required for feature test macros like S_ISLNK, strdup
+#define _DEFAULT_SOURCE         // Required for d_type, DT_* constants and IFTODT
+
+#include <getopt.h>     // getopt_long, struct option
+
+#include "dirwalk_internal.h" // Types and library functions shared with the program
+
+// Maximum number of worker threads accepted by -j
+#define MAX_WALKER_THREADS 256
+
+// Initial capacity of each worker's directory task deque
+#define INITIAL_DEQUE_CAPACITY 64
+
+// Default size of each output buffer (--output-buffer)
+#define DEFAULT_OUTPUT_BUFFER_SIZE (256 * 1024)
+
+// Maximum number of stat prefetch threads per walker accepted by --prefetch
+#define MAX_PREFETCH_THREADS 64
+
+// Initial number of directory records and minimum table size of an --index snapshot
+#define INITIAL_INDEX_CAPACITY 1024
+
+// Magic bytes at the start of an --index file; the last one is the format version
+#define INDEX_MAGIC "DWINDEX2"
+
+// Size of the write buffer of a new --index snapshot
+#define INDEX_BUFFER_SIZE (1024 * 1024)
+
+// Flag of an index record whose directory changed too close to the walk for
+// its timestamps to prove that it is unchanged later
+#define INDEX_RECORD_UNSTABLE 0x1u
+
+// Time without new events after which --watch prints a batch of changes, in milliseconds
+#define WATCH_COALESCE_MS 50
+
+// Longest time --watch holds back a change while events keep coming, in milliseconds
+#define WATCH_MAX_DELAY_MS 1000
+
+// Number of changes after which --watch prints a batch at once
+#define WATCH_BATCH_MAX 4096
+
+// Slots of the table merging the changes of a batch (a power of two, at least twice the batch)
+#define WATCH_BATCH_SLOTS (2 * WATCH_BATCH_MAX)
+
+// Size of the buffer --watch reads events into
+#define WATCH_EVENT_BUFFER_SIZE (64 * 1024)
+
+// Slots of the cache of directory paths resolved from fanotify handles (a power of two)
+#define WATCH_CACHE_SLOTS 256
+
+// Initial number of slots of the inotify watch table (a power of two)
+#define INITIAL_WATCH_CAPACITY 1024
+
+// Magic numbers at the start of a --checkpoint file and of each batch in it
+#define CHECKPOINT_MAGIC "DWCKPT1\n"
+#define CHECKPOINT_BATCH_MAGIC 0x31484354414257ULL
+
+// Run number of a --checkpoint batch whose entries are in the output, not in a run
+#define CHECKPOINT_NO_RUN UINT64_MAX
+
+// Longest time a worker holds finished directories back from the --checkpoint
+// file in an unsorted walk, in milliseconds
+#define CHECKPOINT_INTERVAL_MS 5000
+
+// Bytes of sorted results after which a worker commits them to a --checkpoint run
+#define CHECKPOINT_RUN_SIZE (256 * 1024 * 1024)
+
+// Magic bytes at the start and at the end of a --front-coded listing; the
+// last but one is the format version
+#define LISTING_MAGIC "DWLIST1\n"
+#define LISTING_END_MAGIC "DWLEND1\n"
+
+// Flag of a listing header: blocks may be compressed with zstd
+#define LISTING_FLAG_ZSTD 0x1u
+
+// Initial number of slots of the table of directories read back from a
+// --checkpoint file (a power of two)
+#define INITIAL_CHECKPOINT_CAPACITY 1024
+
+// Number of directories printed by --summarize without an argument, and largest accepted number
+#define DEFAULT_SUMMARY_COUNT 20
+#define MAX_SUMMARY_COUNT (1024 * 1024)
+
+// Largest number of shards accepted by --shard, and deepest level --shard-depth may hash
+#define MAX_SHARD_COUNT 65536
+#define MAX_SHARD_DEPTH 4096
+
+// Initial capacity of the list of starting paths
+#define INITIAL_ROOT_CAPACITY 16
+
+// Exit status of --diff when the listings differ, and on errors, as diff(1)
+#define DIFF_DIFFERENT 1
+#define DIFF_TROUBLE 2
+
+// Short options accepted on the command line. The leading '+' stops parsing at
+// the first non-option, so the directory argument splits the two parsing passes.
+#define SHORT_OPTIONS "+ldfsL0j:"
+
+// Identifiers of options that only have a long form
+enum {
+    OPT_COMPACT = 256,
+    OPT_SORT_MEM,
+    OPT_TMPDIR,
+    OPT_OUTPUT_BUFFER,
+    OPT_BINARY,
+    OPT_URING,
+    OPT_PREFETCH,
+    OPT_MAX_FDS,
+    OPT_NAME,
+    OPT_INAME,
+    OPT_REGEX,
+    OPT_SIZE,
+    OPT_MTIME,
+    OPT_NEWER,
+    OPT_USER,
+    OPT_MAXDEPTH,
+    OPT_MINDEPTH,
+    OPT_XDEV,
+    OPT_PRUNE,
+    OPT_INDEX,
+    OPT_WATCH,
+    OPT_SUMMARIZE,
+    OPT_ROOTS_FROM,
+    OPT_SHARD,
+    OPT_SHARD_DEPTH,
+    OPT_CHECKPOINT,
+    OPT_STATS,
+    OPT_MAX_ERRORS,
+    OPT_FRONT_CODED,
+    OPT_DIFF
+};
+
+// Long options accepted on the command line
+static const struct option long_options[] = {
+    {"compact", no_argument, NULL, OPT_COMPACT},
+    {"sort-mem", required_argument, NULL, OPT_SORT_MEM},
+    {"tmpdir", required_argument, NULL, OPT_TMPDIR},
+    {"output-buffer", required_argument, NULL, OPT_OUTPUT_BUFFER},
+    {"binary", no_argument, NULL, OPT_BINARY},
+    {"uring", no_argument, NULL, OPT_URING},
+    {"prefetch", required_argument, NULL, OPT_PREFETCH},
+    {"max-fds", required_argument, NULL, OPT_MAX_FDS},
+    {"name", required_argument, NULL, OPT_NAME},
+    {"iname", required_argument, NULL, OPT_INAME},
+    {"regex", required_argument, NULL, OPT_REGEX},
+    {"size", required_argument, NULL, OPT_SIZE},
+    {"mtime", required_argument, NULL, OPT_MTIME},
+    {"newer", required_argument, NULL, OPT_NEWER},
+    {"user", required_argument, NULL, OPT_USER},
+    {"maxdepth", required_argument, NULL, OPT_MAXDEPTH},
+    {"mindepth", required_argument, NULL, OPT_MINDEPTH},
+    {"xdev", no_argument, NULL, OPT_XDEV},
+    {"prune", required_argument, NULL, OPT_PRUNE},
+    {"index", required_argument, NULL, OPT_INDEX},
+    {"watch", no_argument, NULL, OPT_WATCH},
+    {"summarize", optional_argument, NULL, OPT_SUMMARIZE},
+    {"roots-from", required_argument, NULL, OPT_ROOTS_FROM},
+    {"shard", required_argument, NULL, OPT_SHARD},
+    {"shard-depth", required_argument, NULL, OPT_SHARD_DEPTH},
+    {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+    {"stats", optional_argument, NULL, OPT_STATS},
+    {"max-errors", required_argument, NULL, OPT_MAX_ERRORS},
+    {"front-coded", optional_argument, NULL, OPT_FRONT_CODED},
+    {"diff", no_argument, NULL, OPT_DIFF},
+    {NULL, 0, NULL, 0}
+};
+
+// Kinds of --front-coded listings
+enum {
+    LISTING_NONE,  // Paths in the output format (default)
+    LISTING_PLAIN, // Uncompressed blocks (--front-coded)
+    LISTING_ZSTD   // zstd-compressed blocks (--front-coded=zstd)
+};
+
+// Formats of the --stats report
+enum {
+    STATS_NONE, // No report
+    STATS_TEXT, // Table for people (--stats)
+    STATS_JSON  // One JSON object (--stats=json)
+};
+
+// A directory kept by --summarize.
+typedef struct summary_item_s {
+    dir_sum_t sum;      // Totals of the directory
+    char *path;         // Path of the directory (owned)
+} summary_item_t;
+
+// The biggest directories seen by one walker, as a min-heap on the allocated
+// size, so a directory smaller than all of the kept ones costs one comparison.
+typedef struct summary_s {
+    summary_item_t *items; // Heap of at most limit directories
+    size_t count;          // Number of kept directories
+    size_t limit;          // Number of directories to keep
+} summary_t;
+
+// A directory of a parallel --summarize walk whose subtree is not finished.
+// Workers add the sums of their entries into it with atomic additions, and
+// whoever drops the last reference records the directory and adds its
+// totals into the parent, so no lock is shared between the workers.
+typedef struct sum_node_s {
+    struct sum_node_s *parent; // Node of the parent directory, or NULL for the starting directory
+    _Atomic uint64_t apparent; // Totals collected so far
+    _Atomic uint64_t allocated;
+    _Atomic uint64_t entries;
+    atomic_size_t refs;        // References: the directory's own task plus its unfinished subdirectories
+    char *path;                // Path of the directory (owned)
+} sum_node_t;
+
+// Options collected from the command line
+typedef struct cli_options_s {
+    int show_l;               // Flag: list symbolic links (-l)
+    int show_d;               // Flag: list directories (-d)
+    int show_f;               // Flag: list regular files (-f)
+    int explicit_type_filter; // Flag: was -l, -d, or -f explicitly given?
+    int sort_output;          // Flag: sort output (-s)
+    size_t thread_count;      // Number of walker threads (-j)
+    int compact_paths;        // Flag: store sorted entries as path nodes (--compact)
+    size_t sort_mem;          // Memory budget of the sorted results, 0 for none (--sort-mem)
+    const char *tmp_dir;      // Directory for external sort runs (--tmpdir), or NULL
+    size_t output_buffer;     // Size of each output buffer (--output-buffer)
+    int output_format;        // OUTPUT_* format of the listed paths (-0, --binary)
+    int use_uring;            // Flag: resolve unknown types with io_uring statx (--uring)
+    size_t prefetch;          // Stat prefetch threads per walker, 0 for none (--prefetch)
+    size_t max_open_dirs;     // Budget of open directories, 0 for the default (--max-fds)
+    int follow_links;         // Flag: follow symbolic links (-L)
+    name_filter_t names;      // Compiled --name, --iname and --regex patterns
+    meta_filter_t meta;       // Parsed --size, --mtime, --newer and --user tests
+    size_t max_depth;         // Deepest level to descend to (--maxdepth), SIZE_MAX for no limit
+    size_t min_depth;         // Shallowest level to list (--mindepth)
+    int xdev;                 // Flag: stay on the starting file system (--xdev)
+    name_filter_t prune;      // Compiled --prune patterns
+    const char *index_path;   // Snapshot to reuse and update (--index), or NULL
+    int watch;                // Flag: keep running and print changes (--watch)
+    size_t summarize;         // Number of directories to print instead of listing, 0 to list (--summarize)
+    const char *roots_from;   // File listing more starting paths, "-" for stdin (--roots-from), or NULL
+    size_t shard_index;       // Shard to list, counted from 0 (--shard=I/N gives I - 1)
+    size_t shard_count;       // Number of shards, 1 to list everything (--shard)
+    size_t shard_depth;       // Level below the starting path whose entries are hashed (--shard-depth)
+    const char *checkpoint_path; // Progress file to resume from and append to (--checkpoint), or NULL
+    int stats;                // STATS_* format of the report on stderr (--stats)
+    size_t max_errors;        // Walk errors printed in full, SIZE_MAX for all (--max-errors)
+    int front_coded;          // LISTING_* kind of listing to write instead of paths (--front-coded)
+    int diff;                 // Flag: compare two listings instead of walking (--diff)
+    uint64_t filter_hash;     // Hash of the name, metadata and --prune options as given, for --checkpoint
+} cli_options_t;
+
+// The starting paths of the walk, in order.
+typedef struct root_list_s {
+    const char **paths;       // Starting paths (command line arguments or pointers into data)
+    size_t count;             // Number of paths
+    size_t capacity;          // Allocated capacity of paths
+    char *data;               // Contents of the --roots-from file, or NULL
+} root_list_t;
+
+// Header of an --index file, in host byte order. The directory records follow
+// it, then a hash table of table_size record offsets (0 for a free slot) keyed
+// by the hash of the directory path.
+typedef struct index_header_s {
+    char magic[8];          // INDEX_MAGIC
+    uint64_t dir_count;     // Number of directory records
+    uint64_t table_offset;  // Offset of the hash table in the file
+    uint64_t table_size;    // Number of slots of the hash table, a power of two
+} index_header_t;
+
+// One directory in an --index file, followed by its path and its entries as
+// packed records (type byte, NUL-terminated name). The next record starts at
+// the following multiple of 8 bytes.
+typedef struct index_record_s {
+    uint64_t hash;          // Hash of the path
+    uint64_t dev;           // Device of the directory
+    uint64_t ino;           // Inode of the directory
+    int64_t mtime_sec;      // Modification time of the directory
+    int64_t ctime_sec;      // Status change time of the directory
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint64_t entries_len;   // Size of the packed entries
+    uint32_t path_len;      // Length of the path
+    uint32_t flags;         // INDEX_RECORD_* flags
+    uint64_t checksum;      // FNV-1a of the path and entries, continued over this record with checksum 0
+} index_record_t;
+
+// Kinds of change printed by --watch, which are also the prefix of their paths
+enum {
+    WATCH_ADDED = '+',
+    WATCH_REMOVED = '-'
+};
+
+// A file handle as passed to open_by_handle_at (struct file_handle with room
+// for the largest handle; the struct itself needs _GNU_SOURCE).
+typedef struct watch_handle_s {
+    uint32_t handle_bytes;  // Length of f_handle
+    int32_t handle_type;    // Type of the handle
+    unsigned char f_handle[WATCH_HANDLE_MAX]; // Handle data
+} watch_handle_t;
+
+// One starting path, with the state its walk does not share with the others.
+typedef struct walk_root_s {
+    const char *path;         // Starting path, as given
+    size_t index;             // Position of the starting path
+    walk_config_t config;     // Shared configuration with this path's device and visited set
+    visited_set_t visited;    // With -L, the directories entered below this path
+    root_stream_t *stream;    // In a parallel listing of several paths, stream of this one; else NULL
+    int failed;               // Flag: the starting path could not be examined
+} walk_root_t;
+
+// Header of a --checkpoint file, in host byte order. Batches follow it.
+typedef struct checkpoint_header_s {
+    char magic[8];            // CHECKPOINT_MAGIC
+    uint64_t fingerprint;     // Hash of the starting paths and the options shaping the output
+    uint64_t out_start;       // Size of the output when the walk started
+} checkpoint_header_t;
+
+// One commit of a worker to a --checkpoint file, followed by size bytes of
+// directory records: each is a checkpoint_dir_t, the NUL-terminated path of
+// the directory, then the NUL-terminated names of the subdirectories it
+// queued. The entries of those directories are in the output up to
+// out_offset, or in the run of the batch.
+typedef struct checkpoint_batch_s {
+    uint64_t magic;           // CHECKPOINT_BATCH_MAGIC
+    uint64_t checksum;        // FNV-1a of the records, continued over this header with checksum 0
+    uint64_t size;            // Bytes of directory records that follow
+    uint64_t out_offset;      // Size of the output once the batch was written
+    uint64_t run;             // With -s, number of the run file holding the entries, or CHECKPOINT_NO_RUN
+    uint64_t run_count;       // With -s, number of records in the run
+} checkpoint_batch_t;
+
+// Head of a directory record in a --checkpoint batch.
+typedef struct checkpoint_dir_s {
+    uint32_t root;            // Index of the starting path the directory is below
+    uint32_t depth;           // Depth of the directory below it
+    uint32_t child_count;     // Number of subdirectory names after the path
+} checkpoint_dir_t;
+
+// A directory read back from a --checkpoint file, in the table of those done.
+typedef struct checkpoint_slot_s {
+    uint64_t hash;            // Hash of the starting path index and the path
+    const char *path;         // NUL-terminated path in the mapped file, or NULL for a free slot
+    uint32_t root;            // Index of the starting path
+} checkpoint_slot_t;
+
+// A directory left to walk by a resumed --checkpoint run.
+typedef struct checkpoint_task_s {
+    size_t root;              // Index of the starting path
+    size_t depth;             // Depth below it
+    size_t path_offset;       // Offset of the NUL-terminated path in checkpoint_t.pending_paths
+    size_t name_offset;       // Offset of the last component within the path
+} checkpoint_task_t;
+
+// State of --checkpoint. Workers commit the directories they finished, with
+// their output (or a run of their sorted entries), as one batch appended to
+// the file under output_lock, so the batches and the output agree.
+typedef struct checkpoint_s {
+    const char *path;         // Checkpoint file, also the prefix of its run files
+    int fd;                   // The file, open for appending
+    int sort_output;          // Flag: entries are committed as runs rather than output
+    size_t flush_size;        // Unsorted: output a worker gathers before committing it
+    uint64_t out_offset;      // Size of stdout with the output committed so far (under output_lock)
+    atomic_size_t next_run;   // Number of the next run file
+    unsigned char *root_done; // Resuming: per starting path, whether its own entry was committed
+    checkpoint_task_t *pending; // Resuming: directories left to walk
+    size_t pending_count;     // Number of pending directories
+    path_buf_t pending_paths; // Their paths, back to back
+    sort_run_t *runs;         // Resuming with -s: runs committed before, opened for the merge
+    size_t run_count;         // Number of runs
+    checkpoint_slot_t *done;  // Resuming: table of the directories committed before, or NULL
+    size_t done_slots;        // Number of slots of done, a power of two
+    const char *map;          // Resuming: the mapped file, which holds the paths in done
+    size_t map_size;          // Size of the mapping
+} checkpoint_t;
+
+// Header of a --front-coded listing, in host byte order, followed by the name
+// of the collation its entries are sorted by (setlocale(LC_COLLATE) when it
+// was written), then by the blocks.
+typedef struct listing_header_s {
+    char magic[8];            // LISTING_MAGIC
+    uint32_t flags;           // LISTING_FLAG_* flags
+    uint32_t collation_len;   // Length of the collation name
+} listing_header_t;
+
+// End of a listing. The block index before it holds, for each block, its
+// 8-byte offset, a copy of its header, then the LEB128 length and the bytes
+// of its first path.
+typedef struct listing_trailer_s {
+    uint64_t index_offset;    // Offset of the block index
+    uint64_t block_count;     // Number of blocks
+    uint64_t entry_count;     // Number of entries
+    char magic[8];            // LISTING_END_MAGIC
+} listing_trailer_t;
+
+// A block of a listing being read, as described by the block index.
+typedef struct listing_block_s {
+    uint64_t offset;          // Offset of the block header in the file
+    listing_block_header_t header; // Copy of the header
+    const char *first;        // First path, in the reader's index data (not terminated)
+    size_t first_len;         // Length of first
+} listing_block_t;
+
+// A --front-coded listing being read by --diff. Blocks are read with pread
+// one at a time and decoded entry by entry.
+typedef struct listing_reader_s {
+    const char *path;         // Path of the file
+    int fd;                   // Open file descriptor
+    char *collation;          // Name of the collation the entries are sorted by
+    char *index_data;         // Block index of the file
+    listing_block_t *blocks;  // Blocks of the file
+    size_t block_count;       // Number of blocks
+    size_t next_block;        // Number of the next block to decode
+    path_buf_t stored;        // Stored bytes of block stored_block
+    size_t stored_block;      // Block in stored, SIZE_MAX for none
+    path_buf_t raw;           // Decoded entries of the current block
+    size_t pos;               // Offset of the next entry in raw
+    path_buf_t entry;         // Path of the current entry
+    int type;                 // DT_* type of the current entry
+} listing_reader_t;
+
+// A directory whose entries have been read by a worker in parallel mode. It is
+// kept open while child tasks still need its descriptor for openat, and closed
+// by whichever thread drops the last reference.
+typedef struct dir_handle_s {
+    dir_reader_t reader;  // Reader owning the directory descriptor
+    atomic_size_t refs;   // References: the reading worker plus pending child tasks
+} dir_handle_t;
+
+// A directory waiting to be walked in parallel mode.
+typedef struct dir_task_s {
+    walk_root_t *root;    // Starting path the directory is below
+    dir_handle_t *parent; // Parent directory to open relative to, or NULL to open by path (starting
+                          // paths at depth 0, directories resumed from a --checkpoint below)
+    char *path;           // Full path of the directory (owned by the task)
+    size_t name_offset;   // Offset of the last path component within path
+    size_t depth;         // Depth of the directory below the starting path
+    sum_node_t *sum;      // With --summarize, totals of the directory (a reference is owned); else NULL
+} dir_task_t;
+
+// Per-worker double-ended queue of directory tasks, stored as a ring buffer.
+// The owner pushes and pops at the bottom (newest first, for locality); idle
+// workers steal from the top, where the oldest and usually largest subtrees are.
+typedef struct task_deque_s {
+    pthread_mutex_t lock; // Protects all fields below
+    dir_task_t *tasks;    // Ring buffer of tasks
+    size_t head;          // Index of the oldest task
+    size_t count;         // Number of queued tasks
+    size_t capacity;      // Allocated capacity of tasks
+} task_deque_t;
+
+struct walk_pool_s;
+
+// State owned by one worker thread.
+typedef struct worker_s {
+    struct walk_pool_s *pool; // Pool this worker belongs to
+    size_t index;             // Position of this worker in the pool
+    pthread_t thread;         // Thread running the worker
+    task_deque_t deque;       // Directories discovered by this worker
+    path_buf_t path;          // Path buffer for the directory being walked
+    dirent_buf_t entries;     // Directory entry buffer for this worker
+    results_t results;        // Shard of sorted-mode results found by this worker
+    out_buf_t out;            // Output buffer of this worker (unsorted mode)
+    summary_t summary;        // With --summarize, biggest directories finished by this worker
+    size_t stream_tasks;      // Tasks of out.stream's path finished since its last hand-over
+    path_buf_t batch;         // With --checkpoint, the batch of the directories finished since the last commit
+    size_t record;            // With --checkpoint, offset in batch of the record of the running task
+    int64_t committed_at;     // With --checkpoint, time of the last commit in milliseconds
+} worker_t;
 
-#include <stdio.h>      // printf, fprintf, stderr, perror, snprintf
-#include <stdlib.h>     // malloc, realloc, free, exit, qsort, getenv, abort
-#include <string.h>     // strcmp, strdup, strlen, strcoll, strerror
-#include <dirent.h>     // opendir, readdir, closedir, DIR, struct dirent
-#include <sys/stat.h>   // lstat, struct stat, S_ISLNK, S_ISDIR, S_ISREG
-#include <unistd.h>     // getopt
-#include <errno.h>      // errno
-#include <locale.h>     // setlocale, LC_COLLATE
-
-// Initial capacity for the results array when sorting
-#define INITIAL_RESULTS_CAPACITY 64
-
-// Structure to hold results for sorting
-typedef struct results_s {
-    char **paths;    // Dynamically allocated array of path strings
-    size_t count;    // Number of paths currently stored
-    size_t capacity; // Allocated capacity of the paths array
-} results_t;
+// Shared state of a parallel walk.
+typedef struct walk_pool_s {
+    worker_t *workers;        // Array of workers
+    size_t worker_count;      // Number of workers
+    atomic_size_t pending;    // Tasks queued or being processed; 0 means the walk is done
+    atomic_size_t queued;     // Tasks sitting in any deque
+    atomic_size_t sleepers;   // Workers waiting on idle_cond
+    pthread_mutex_t idle_lock; // Protects waiting on idle_cond
+    pthread_cond_t idle_cond;  // Signaled when work appears or the walk finishes
+    const walk_config_t *config; // What to list and how
+    checkpoint_t *checkpoint; // With --checkpoint, where finished directories are committed; else NULL
+} walk_pool_t;
 
 // Function Prototypes
 static void print_usage(const char *prog_name);
-static int compare_strings(const void *a, const void *b);
-static void add_result(results_t *results, const char *path);
-static void free_results(results_t *results);
-static int process_entry(const char *path, int show_l, int show_d, int show_f,
-                         int explicit_type_filter, int sort_output, results_t *results);
-static void walk_directory_contents(const char *dir_path, int show_l, int show_d, int show_f,
-                                    int explicit_type_filter, int sort_output, results_t *results);
+static int parse_option(int opt, const char *arg, cli_options_t *cli);
+static int parse_count(const char *arg, const char *option, size_t max, size_t *count);
+static int parse_depth(const char *arg, const char *option, size_t *depth);
+static int parse_limit(const char *arg, const char *option, size_t *limit);
+static int parse_size(const char *arg, const char *option, size_t *size);
+static int parse_shard(const char *arg, cli_options_t *cli);
+static int name_filter_add(name_filter_t *filter, const char *pattern, int kind, int fold_case);
+static void name_filter_free(name_filter_t *filter);
+static size_t glob_class_compile(const char *pattern, uint32_t *set, int fold_case);
+static glob_token_t *glob_compile(const char *pattern, int fold_case, size_t *token_count);
+static meta_test_t *meta_filter_add(meta_filter_t *filter, int kind, unsigned fields);
+static int parse_meta_number(const char *arg, const char *option, int *cmp, int64_t *value,
+                             const char **suffix);
+static int parse_meta_option(int opt, const char *arg, meta_filter_t *filter);
+static void meta_filter_free(meta_filter_t *filter);
+static uint32_t directory_node(results_t *results, const char *path);
+static void emit_sorted_results(results_t *shards, size_t shard_count, listing_t *listing, out_buf_t *out);
+static void out_init(out_buf_t *out, size_t capacity, int format);
+static void out_free(out_buf_t *out);
+static int index_open(tree_index_t *index, const char *path);
+static void index_load(tree_index_t *index);
+static void index_close(tree_index_t *index, int commit);
+static int index_entries_valid(const char *entries, size_t len);
+static const char *index_lookup(const tree_index_t *index, const char *path, size_t path_len,
+                                const struct stat *st, size_t *entries_len);
+static void index_write(tree_index_t *index, const void *data, size_t len);
+static void index_flush(tree_index_t *index);
+static void index_add(tree_index_t *index, const char *path, size_t path_len, const struct stat *st,
+                      const char *entries, size_t entries_len);
+static void dir_reader_use_index(dir_reader_t *reader, tree_index_t *index, const char *path,
+                                 size_t path_len);
+static void walk_directory_contents(int dir_fd, path_buf_t *dir_path, dirent_buf_t *entries,
+                                    const walk_config_t *config, results_t *results,
+                                    out_buf_t *out, size_t max_open_dirs, summary_t *summary,
+                                    const dir_sum_t *start_sum);
+static void deque_init(task_deque_t *deque);
+static void deque_destroy(task_deque_t *deque);
+static void deque_push(task_deque_t *deque, const dir_task_t *task);
+static int deque_pop(task_deque_t *deque, dir_task_t *task);
+static int deque_steal(task_deque_t *deque, dir_task_t *task);
+static void dir_handle_release(dir_handle_t *handle);
+static void pool_submit(worker_t *worker, walk_root_t *root, dir_handle_t *parent, const char *path,
+                        size_t name_offset, size_t depth, sum_node_t *sum);
+static int pool_take(worker_t *worker, dir_task_t *task);
+static void pool_finish_task(walk_pool_t *pool);
+static void walk_directory_task(worker_t *worker, dir_task_t *task);
+static void *worker_main(void *arg);
+static void worker_hand_over(worker_t *worker);
+static void walk_parallel(walk_root_t *roots, size_t root_count, const walk_config_t *config,
+                          size_t thread_count, size_t output_buffer, int output_format,
+                          int use_uring, size_t prefetch, const char *tmp_dir, results_t *shards,
+                          summary_t *summaries, checkpoint_t *checkpoint);
+static int root_open(walk_root_t *root);
+static void walk_root(walk_root_t *root, path_buf_t *path, dirent_buf_t *entries, results_t *results,
+                      out_buf_t *out, size_t max_open_dirs, summary_t *summary);
+static void root_list_add(root_list_t *list, const char *path);
+static int root_list_read(root_list_t *list, const char *file, int nul_separated);
+static void root_list_free(root_list_t *list);
+static void root_order_init(root_order_t *order, size_t count, const char *tmp_dir);
+static void root_order_destroy(root_order_t *order);
+static void root_stream_drain(root_stream_t *stream);
+static void root_stream_finish(root_stream_t *stream);
+static uint64_t checkpoint_fingerprint(const cli_options_t *cli, const root_list_t *roots);
+static int checkpoint_open(checkpoint_t *checkpoint, const char *path, int sort_output, size_t flush_size,
+                           uint64_t fingerprint, size_t root_count);
+static int checkpoint_load(checkpoint_t *checkpoint, const char *map, size_t size, size_t root_count,
+                           size_t *valid_len);
+static int checkpoint_next_dir(const char **pos, const char *end, size_t root_count, checkpoint_dir_t *dir,
+                               const char **path);
+static int checkpoint_committed(const checkpoint_t *checkpoint, size_t root, const char *path);
+static int checkpoint_done(checkpoint_slot_t *slots, size_t slot_count, uint32_t root, const char *path,
+                           int insert);
+static uint64_t checkpoint_output_size(void);
+static int checkpoint_resume_output(checkpoint_t *checkpoint);
+static char *checkpoint_run_name(const checkpoint_t *checkpoint, size_t run);
+static FILE *checkpoint_run_create(const checkpoint_t *checkpoint, size_t run);
+static void checkpoint_write(checkpoint_t *checkpoint, const void *data, size_t len);
+static void checkpoint_begin(worker_t *worker, const walk_root_t *root, const char *path, size_t depth);
+static void checkpoint_child(worker_t *worker, const char *name);
+static void checkpoint_commit(worker_t *worker);
+static void checkpoint_close(checkpoint_t *checkpoint, int complete);
+static void stats_enable(void);
+static void stats_phase(int phase, uint64_t started);
+static void stats_visited(const visited_set_t *set);
+static uint64_t stats_bucket_high(size_t bucket);
+static uint64_t stats_percentile(const latency_hist_t *hist, double fraction);
+static void stats_json_string(const char *text);
+static void stats_report(int format);
+static void error_setup(size_t limit);
+static int compare_error_dirs(const void *a, const void *b);
+static int compare_error_counts(const void *a, const void *b);
+static void error_report(void);
+static void listing_begin(listing_t *listing, int compress);
+static void listing_finish(listing_t *listing);
+static int listing_pread(listing_reader_t *reader, void *buf, size_t len, uint64_t offset);
+static int listing_open(listing_reader_t *reader, const char *path);
+static void listing_close(listing_reader_t *reader);
+static int listing_read_stored(listing_reader_t *reader, size_t index);
+static int listing_load(listing_reader_t *reader);
+static int listing_next(listing_reader_t *reader);
+static int listing_skip_equal(listing_reader_t *old_reader, listing_reader_t *new_reader);
+static int listing_diff(const char *old_path, const char *new_path, out_buf_t *out);
+static void sum_add(dir_sum_t *sum, const dir_sum_t *other);
+static void summary_init(summary_t *summary, size_t limit);
+static void summary_free(summary_t *summary);
+static int summary_less(const summary_item_t *a, const summary_item_t *b);
+static void summary_sift_down(summary_t *summary, size_t i);
+static void summary_add(summary_t *summary, const char *path, const dir_sum_t *sum);
+static int compare_summary_items(const void *a, const void *b);
+static void emit_summary(summary_t *summaries, size_t summary_count, size_t limit, out_buf_t *out);
+static sum_node_t *sum_node_new(sum_node_t *parent, const char *path, const dir_sum_t *own);
+static void sum_node_add(sum_node_t *node, const dir_sum_t *sum);
+static void sum_node_release(sum_node_t *node, summary_t *summary);
+static int watch_init(watch_t *watch, const char *start_dir, int follow_links);
+static void watch_free(watch_t *watch);
+#if DIRWALK_USE_FANOTIFY
+static int watch_fanotify_init(watch_t *watch, const char *start_dir, int start_fd);
+static ssize_t watch_fd_path(int fd, path_buf_t *out);
+static void watch_cache_clear(watch_t *watch);
+static const watch_cache_slot_t *watch_resolve(watch_t *watch, const unsigned char *key, size_t key_len);
+static void watch_fanotify_event(watch_t *watch, const char *info, size_t info_len, uint64_t mask);
+static void watch_read_fanotify(watch_t *watch, const char *events, size_t len);
+#endif
+#if DIRWALK_USE_INOTIFY
+static void watch_node_remove(watch_t *watch, int wd);
+static size_t watch_node_path(watch_t *watch, const watch_node_t *node, path_buf_t *out);
+static void watch_forget_subtree(watch_t *watch, int wd);
+static void watch_adopt(watch_t *watch, int parent_wd, const char *name, size_t depth);
+static void watch_read_inotify(watch_t *watch, const char *events, size_t len);
+#endif
+#if DIRWALK_USE_WATCH
+static void watch_queue(watch_t *watch, const char *name, size_t depth, char change, int is_dir);
+#endif
+static void watch_flush(watch_t *watch);
+static int64_t watch_now(void);
+static void watch_run(watch_t *watch, const walk_config_t *config, dirent_buf_t *entries,
+                      out_buf_t *out, size_t max_open_dirs);
 
 /*
  * main: Entry point of the program. Parses command-line arguments,
- *       initializes structures, processes the starting path, calls the
- *       directory walking function if applicable, handles sorting and printing
+ *       initializes structures, processes the starting paths, calls the
+ *       directory walking functions if applicable, handles sorting and printing
  *       of results, and cleans up resources.
  *
  * Parameters:
@@ -61,120 +797,376 @@ static void walk_directory_contents(const char *dir_path, int show_l, int show_d
  */
 int main(int argc, char *argv[]) {
     int opt;
-    int show_l = 0;
-    int show_d = 0;
-    int show_f = 0;
-    int sort_output = 0;
-    int explicit_type_filter = 0; // Flag: Was -l, -d, or -f explicitly given?
-    const char *start_dir = "."; // Default starting directory
-    results_t results = {NULL, 0, 0}; // Initialize results structure for sorting
-    struct stat start_stat; // To check the type of the starting path
+    // Parsed options; the others start as 0 or NULL
+    cli_options_t cli = {
+        .thread_count = 1,
+        .output_buffer = DEFAULT_OUTPUT_BUFFER_SIZE,
+        .output_format = OUTPUT_LINES,
+        .max_depth = SIZE_MAX,
+        .shard_count = 1,
+        .shard_depth = 1,
+        .stats = STATS_NONE,
+        .max_errors = SIZE_MAX,
+        .front_coded = LISTING_NONE,
+        .filter_hash = FNV_OFFSET_BASIS,
+    };
+    root_list_t root_list = {NULL, 0, 0, NULL}; // Starting paths, in order
+    walk_root_t *roots; // Walk state of each starting path
+    int failed = 0; // Flag: some starting path could not be examined
+    results_t *shards = NULL; // Results for sorting: main's own, then one per worker
+    size_t shard_count = 1; // Number of entries in shards
+    results_t *results; // Results collected by the main thread (shards[0])
+    path_buf_t path; // Reusable path buffer for the traversal
+    dirent_buf_t entries; // Reusable directory entry buffer for the traversal
+    out_buf_t out; // Output buffer of the main thread
+    walk_config_t config; // What the walkers list and how
+    tree_index_t index; // Snapshots of --index
+    watch_t watch; // Event source and pending changes of --watch
+    visited_set_t links; // Files with several links counted by --summarize
+    summary_t *summaries = NULL; // Biggest directories of --summarize: main's own, then one per worker
+    size_t summary_count = 0; // Number of entries in summaries
+    checkpoint_t checkpoint; // Progress of --checkpoint
+    int parallel; // Flag: walk with the worker pool
+    listing_t listing; // Output of --front-coded
 
     // Set locale for strcoll sorting and potentially multibyte characters
     if (setlocale(LC_COLLATE, "") == NULL) {
         fprintf(stderr, "Warning: Failed to set locale, sorting might be incorrect.\n");
     }
 
-    // --- Argument Parsing (Handling options before/after directory) ---
+    // --- Argument Parsing (Handling options before/after directories) ---
     optind = 1; // Ensure getopt starts from the beginning
 
-    // Pass 1: Parse options that appear *before* the directory argument
-    while ((opt = getopt(argc, argv, "ldfs")) != -1) {
-        switch (opt) {
-            case 'l': show_l = 1; explicit_type_filter = 1; break;
-            case 'd': show_d = 1; explicit_type_filter = 1; break;
-            case 'f': show_f = 1; explicit_type_filter = 1; break;
-            case 's': sort_output = 1; break;
-            case '?': // Invalid option
-            default:
+    // Options and starting paths may alternate: getopt stops at each
+    // non-option, which is taken as the next starting path, and parsing
+    // then resumes from the argument after it.
+    for (;;) {
+        while ((opt = getopt_long(argc, argv, SHORT_OPTIONS, long_options, NULL)) != -1) {
+            if (parse_option(opt, optarg, &cli) == -1) {
+                if (opt == '?' && optopt != 0 && root_list.count > 0) {
+                    fprintf(stderr, "Error: Invalid option '%c' after directory argument.\n", optopt);
+                }
                 print_usage(argv[0]);
                 return EXIT_FAILURE;
+            }
         }
-    }
-
-    // Check if a non-option argument (the directory) exists
-    if (optind < argc) {
-        // Assume the first non-option is the directory
-        start_dir = argv[optind];
+        if (optind >= argc) {
+            break;
+        }
+        root_list_add(&root_list, argv[optind]);
         optind++; // Consume the directory argument index
+    }
+    if (cli.roots_from != NULL &&
+        root_list_read(&root_list, cli.roots_from, cli.output_format == OUTPUT_NUL) == -1) {
+        return EXIT_FAILURE;
+    }
+    // --diff takes two listings instead of starting paths and walks nothing.
+    // Like diff(1), it exits with 0 for equal listings, 1 if they differ and
+    // 2 on trouble.
+    if (cli.diff) {
+        int status;
+        if (root_list.count != 2) {
+            fprintf(stderr, "Error: --diff needs two listings, OLD and NEW.\n");
+            print_usage(argv[0]);
+            root_list_free(&root_list);
+            return DIFF_TROUBLE;
+        }
+        write_failure_status = DIFF_TROUBLE;
+        out_init(&out, cli.output_buffer, cli.output_format);
+        status = listing_diff(root_list.paths[0], root_list.paths[1], &out);
+        out_free(&out);
+        root_list_free(&root_list);
+        return status == 0 ? EXIT_SUCCESS : status == 1 ? DIFF_DIFFERENT : DIFF_TROUBLE;
+    }
+    if (root_list.count == 0) {
+        root_list_add(&root_list, "."); // Default starting directory
+    }
+    // --- End Argument Parsing ---
 
-        // Pass 2: Continue parsing options that appear *after* the directory argument
-        // getopt will naturally continue from the current optind
-        while ((opt = getopt(argc, argv, "ldfs")) != -1) {
-            switch (opt) {
-                case 'l': show_l = 1; explicit_type_filter = 1; break;
-                case 'd': show_d = 1; explicit_type_filter = 1; break;
-                case 'f': show_f = 1; explicit_type_filter = 1; break;
-                case 's': sort_output = 1; break;
-                case '?': // Invalid option
-                default:
-                    fprintf(stderr, "Error: Invalid option '%c' after directory argument.\n", optopt);
-                    print_usage(argv[0]);
-                    return EXIT_FAILURE;
+    // Runs spilled by the external sort hold full paths, so it replaces --compact.
+    if (cli.sort_mem > 0 && cli.compact_paths) {
+        fprintf(stderr, "Warning: --compact is ignored with --sort-mem.\n");
+        cli.compact_paths = 0;
+    }
+    if (cli.max_open_dirs == 0) {
+        cli.max_open_dirs = default_max_open_dirs();
+    }
+    // A summary replaces the listing, so there is nothing to sort or watch.
+    if (cli.summarize > 0 && cli.front_coded != LISTING_NONE) {
+        fprintf(stderr, "Warning: --front-coded is ignored with --summarize.\n");
+        cli.front_coded = LISTING_NONE;
+    }
+    if (cli.summarize > 0 && cli.sort_output) {
+        fprintf(stderr, "Warning: -s is ignored with --summarize.\n");
+        cli.sort_output = 0;
+    }
+    if (cli.summarize > 0 && cli.watch) {
+        fprintf(stderr, "Warning: --watch is ignored with --summarize.\n");
+        cli.watch = 0;
+    }
+    if (root_list.count > 1 && cli.watch) {
+        fprintf(stderr, "Warning: --watch is ignored with several starting paths.\n");
+        cli.watch = 0;
+    }
+    if (cli.shard_count > 1 && cli.watch) {
+        fprintf(stderr, "Warning: --watch is ignored with --shard.\n");
+        cli.watch = 0;
+    }
+    // A summary is only complete once the walk is, so there is nothing to
+    // commit along the way. A resumed walk reads only part of the tree, which
+    // would replace the snapshot of --index with part of one.
+    if (cli.checkpoint_path != NULL && cli.summarize > 0) {
+        fprintf(stderr, "Warning: --checkpoint is ignored with --summarize.\n");
+        cli.checkpoint_path = NULL;
+    }
+    if (cli.checkpoint_path != NULL && cli.watch) {
+        fprintf(stderr, "Warning: --watch is ignored with --checkpoint.\n");
+        cli.watch = 0;
+    }
+    if (cli.checkpoint_path != NULL && cli.index_path != NULL) {
+        fprintf(stderr, "Warning: --index is ignored with --checkpoint.\n");
+        cli.index_path = NULL;
+    }
+    // Committed runs hold full paths, as those of --sort-mem do.
+    if (cli.checkpoint_path != NULL && cli.sort_output && cli.compact_paths) {
+        fprintf(stderr, "Warning: --compact is ignored with --checkpoint.\n");
+        cli.compact_paths = 0;
+    }
+    // A listing is written in one go by the sorted merge: its index comes
+    // last, so it can neither be resumed nor followed by changes.
+    if (cli.front_coded != LISTING_NONE) {
+        cli.sort_output = 1;
+        if (cli.output_format == OUTPUT_BINARY) {
+            fprintf(stderr, "Warning: --binary is ignored with --front-coded.\n");
+        }
+        if (cli.watch) {
+            fprintf(stderr, "Warning: --watch is ignored with --front-coded.\n");
+            cli.watch = 0;
+        }
+        if (cli.checkpoint_path != NULL) {
+            fprintf(stderr, "Warning: --checkpoint is ignored with --front-coded.\n");
+            cli.checkpoint_path = NULL;
+        }
+    }
+    // Commits happen between the directories of the worker pool, which then
+    // runs even with a single thread.
+    parallel = cli.thread_count > 1 || cli.checkpoint_path != NULL;
+    if (cli.stats != STATS_NONE) {
+        stats_enable();
+    }
+    error_setup(cli.max_errors);
+    if (cli.tmp_dir == NULL) {
+        cli.tmp_dir = getenv("TMPDIR");
+        if (cli.tmp_dir == NULL || cli.tmp_dir[0] == '\0') {
+            cli.tmp_dir = "/tmp";
+        }
+    }
+    if (cli.checkpoint_path != NULL &&
+        checkpoint_open(&checkpoint, cli.checkpoint_path, cli.sort_output, cli.output_buffer,
+                        checkpoint_fingerprint(&cli, &root_list), root_list.count) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (cli.index_path != NULL && index_open(&index, cli.index_path) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (cli.watch) {
+        int status = watch_init(&watch, root_list.paths[0], cli.follow_links);
+        if (status == -1) {
+            if (cli.index_path != NULL) {
+                index_close(&index, 0);
             }
+            return EXIT_FAILURE;
         }
+        cli.watch = status == 0; // A starting path that is no directory has nothing to watch
     }
-    // Else: No directory argument found after initial options, use default "."
 
-    // Check for any remaining non-option arguments (errors)
-    if (optind < argc) {
-        fprintf(stderr, "Error: Unexpected argument '%s'\n", argv[optind]);
-        print_usage(argv[0]);
-        return EXIT_FAILURE;
+    // Initialize results arrays. With -j and -s, every worker sorts its own shard
+    // and gets an equal part of the --sort-mem budget.
+    if (cli.sort_output && parallel) {
+        shard_count += cli.thread_count;
+    }
+    shards = (results_t *)calloc(shard_count, sizeof(results_t));
+    if (shards == NULL) {
+        perror("Error allocating results array");
+        abort();
+    }
+    results = &shards[0];
+    if (cli.sort_output) {
+        init_results(results, cli.compact_paths, cli.sort_mem, cli.tmp_dir);
+        for (size_t i = 1; i < shard_count; ++i) {
+            size_t shard_mem = cli.sort_mem / cli.thread_count;
+            if (cli.checkpoint_path != NULL && (shard_mem == 0 || shard_mem > CHECKPOINT_RUN_SIZE)) {
+                shard_mem = CHECKPOINT_RUN_SIZE;
+            }
+            init_results(&shards[i], cli.compact_paths,
+                         cli.sort_mem > 0 && shard_mem == 0 ? 1 : shard_mem, cli.tmp_dir);
+            shards[i].checkpoint_runs = cli.checkpoint_path != NULL;
+        }
+        // The runs committed before an interruption join the final merge.
+        if (cli.checkpoint_path != NULL) {
+            for (size_t i = 0; i < checkpoint.run_count; ++i) {
+                results_add_run(results, &checkpoint.runs[i]);
+            }
+            checkpoint.run_count = 0;
+        }
     }
-    // --- End Argument Parsing ---
 
+    // --- Core Logic ---
 
-    // Initialize results array if sorting is enabled
-    if (sort_output) {
-        results.paths = (char **)malloc(INITIAL_RESULTS_CAPACITY * sizeof(char *));
-        if (results.paths == NULL) {
-            perror("Error allocating initial results array");
+    config.type_mask = TYPE_MASK_ALL;
+    if (cli.explicit_type_filter) {
+        config.type_mask = (cli.show_l ? TYPE_BIT(DT_LNK) : 0) | (cli.show_d ? TYPE_BIT(DT_DIR) : 0) |
+                           (cli.show_f ? TYPE_BIT(DT_REG) : 0);
+    }
+    config.sort_output = cli.sort_output;
+    config.follow_links = cli.follow_links;
+    config.visited = NULL;
+    config.names = &cli.names;
+    config.meta = &cli.meta;
+    config.max_depth = cli.max_depth;
+    config.min_depth = cli.min_depth;
+    config.xdev = cli.xdev;
+    config.root_dev = 0;
+    config.prune = &cli.prune;
+    config.index = cli.index_path != NULL ? &index : NULL;
+    config.watch = cli.watch ? &watch : NULL;
+    config.summarize = cli.summarize > 0;
+    config.links = NULL;
+    config.shard_index = cli.shard_index;
+    config.shard_count = cli.shard_count;
+    config.shard_depth = cli.shard_depth;
+    config.root_len = 0;
+    if (cli.summarize > 0) {
+        summary_count = 1 + (cli.thread_count > 1 ? cli.thread_count : 0);
+        summaries = (summary_t *)malloc(summary_count * sizeof(summary_t));
+        if (summaries == NULL) {
+            perror("Error allocating summaries");
             abort();
         }
-        results.capacity = INITIAL_RESULTS_CAPACITY;
-        results.count = 0;
+        for (size_t i = 0; i < summary_count; ++i) {
+            summary_init(&summaries[i], cli.summarize);
+        }
+        visited_init(&links);
+        config.links = &links;
     }
+    config.handle_entry = select_entry_handler(&config, cli.compact_paths);
 
-    // --- Core Logic ---
+    // Every starting path is walked with its own copy of the configuration,
+    // holding its device for --xdev, its length for --shard and, with -L,
+    // its own visited set, so overlapping paths are each listed in full as
+    // find does.
+    roots = (walk_root_t *)calloc(root_list.count, sizeof(walk_root_t));
+    if (roots == NULL) {
+        perror("Error allocating starting paths");
+        abort();
+    }
+    for (size_t i = 0; i < root_list.count; ++i) {
+        roots[i].path = root_list.paths[i];
+        roots[i].index = i;
+        roots[i].config = config;
+        roots[i].config.root_len = strlen(roots[i].path);
+        if (cli.follow_links) {
+            visited_init(&roots[i].visited);
+            roots[i].config.visited = &roots[i].visited;
+        }
+    }
 
-    // 1. Process the starting path itself first.
-    process_entry(start_dir, show_l, show_d, show_f, explicit_type_filter, sort_output, sort_output ? &results : NULL);
+    path_init(&path);
+    dirent_buf_init(&entries, cli.use_uring, cli.prefetch);
+    out_init(&out, cli.output_buffer, cli.output_format);
+    if (cli.watch) {
+        out.prefix = WATCH_ADDED;
+    }
 
-    // 2. Check the type of the starting path to see if we should descend into it.
-    if (lstat(start_dir, &start_stat) == 0) {
-        // If the starting path is a directory (and not a symlink to one),
-        // proceed to walk its contents recursively.
-        if (S_ISDIR(start_stat.st_mode)) {
-            walk_directory_contents(start_dir, show_l, show_d, show_f, explicit_type_filter, sort_output, sort_output ? &results : NULL);
-        }
-        // If it's not a directory (file, link, socket, etc.), we've already processed it
-        // with process_entry above, so we do nothing more.
+    // With -j, the starting paths are scheduled onto the worker pool
+    // together; otherwise they are walked one after the other.
+    uint64_t walk_started = stats_clock();
+    if (parallel) {
+        walk_parallel(roots, root_list.count, &config, cli.thread_count, cli.output_buffer,
+                      cli.output_format, cli.use_uring, cli.prefetch, cli.tmp_dir,
+                      cli.sort_output ? shards + 1 : NULL, cli.summarize > 0 ? summaries + 1 : NULL,
+                      cli.checkpoint_path != NULL ? &checkpoint : NULL);
     } else {
-        // lstat failed on the starting path. process_entry already printed an error.
-        // We cannot walk its contents. Exit with failure status.
-        if (sort_output) {
-            // Sort and print whatever might have been added before the error
-            qsort(results.paths, results.count, sizeof(char *), compare_strings);
-            for (size_t i = 0; i < results.count; ++i) {
-                printf("%s\n", results.paths[i]);
-            }
-            free_results(&results);
+        for (size_t i = 0; i < root_list.count; ++i) {
+            walk_root(&roots[i], &path, &entries, cli.sort_output ? results : NULL, &out,
+                      cli.max_open_dirs, cli.summarize > 0 ? summaries : NULL);
+        }
+    }
+    stats_phase(STATS_PHASE_WALK, walk_started);
+    for (size_t i = 0; i < root_list.count; ++i) {
+        failed |= roots[i].failed;
+        if (cli.follow_links) {
+            stats_visited(&roots[i].visited);
         }
-        return EXIT_FAILURE; // Indicate an error occurred
     }
     // --- End Core Logic ---
 
+    // Print the biggest directories
+    if (cli.summarize > 0) {
+        emit_summary(summaries, summary_count, cli.summarize, &out);
+        for (size_t i = 0; i < summary_count; ++i) {
+            summary_free(&summaries[i]);
+        }
+        free(summaries);
+        visited_free(&links);
+    }
+
     // If sorting, sort and print the collected results
-    if (sort_output) {
-        qsort(results.paths, results.count, sizeof(char *), compare_strings);
-        for (size_t i = 0; i < results.count; ++i) {
-            printf("%s\n", results.paths[i]);
+    if (cli.sort_output) {
+        if (cli.front_coded != LISTING_NONE) {
+            listing_begin(&listing, cli.front_coded == LISTING_ZSTD);
+        }
+        emit_sorted_results(shards, shard_count, cli.front_coded != LISTING_NONE ? &listing : NULL, &out);
+        if (cli.front_coded != LISTING_NONE) {
+            listing_finish(&listing);
+        }
+        for (size_t i = 0; i < shard_count; ++i) {
+            free_results(&shards[i]); // Free memory allocated for results
         }
-        free_results(&results); // Free memory allocated for results
+    }
+    // With --watch, keep printing changes until the starting directory goes
+    // away. The snapshot of --index describes the walk above, so it is
+    // written before.
+    if (cli.watch) {
+        if (config.index != NULL) {
+            index_close(&index, !failed);
+            config.index = NULL;
+        }
+        if (!failed) {
+            watch_run(&watch, &roots[0].config, &entries, &out, cli.max_open_dirs);
+        }
+        watch_free(&watch);
+    }
+    out_flush(&out);
+    out_free(&out);
+    free(shards);
+    // Everything is written, so there is nothing left to resume.
+    if (cli.checkpoint_path != NULL) {
+        checkpoint_close(&checkpoint, 1);
     }
 
-    return EXIT_SUCCESS;
+    path_free(&path);
+    dirent_buf_free(&entries);
+    for (size_t i = 0; i < root_list.count; ++i) {
+        if (cli.follow_links) {
+            visited_free(&roots[i].visited);
+        }
+    }
+    free(roots);
+    // The snapshot of a walk with missing starting paths would drop their
+    // directories, so the previous one is kept then.
+    if (config.index != NULL) {
+        index_close(&index, !failed);
+    }
+    root_list_free(&root_list);
+    name_filter_free(&cli.names);
+    meta_filter_free(&cli.meta);
+    name_filter_free(&cli.prune);
+    error_report();
+    if (cli.stats != STATS_NONE) {
+        stats_report(cli.stats);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /*
@@ -187,231 +1179,5390 @@ int main(int argc, char *argv[]) {
  *   Nothing.
  */
 static void print_usage(const char *prog_name) {
-    fprintf(stderr, "Usage: %s [dir] [-l] [-d] [-f] [-s]\n", prog_name);
-    fprintf(stderr, "  dir: Starting directory (default: .)\n");
-    fprintf(stderr, "  -l:  List only symbolic links.\n");
-    fprintf(stderr, "  -d:  List only directories.\n");
-    fprintf(stderr, "  -f:  List only regular files.\n");
-    fprintf(stderr, "  -s:  Sort output by name (LC_COLLATE).\n");
+    fprintf(stderr, "Usage: %s [dir...] [-l] [-d] [-f] [-s] [-L] [-0] [-j N] [--binary] [--compact] [--sort-mem=SIZE]\n"
+            "       [--tmpdir=DIR] [--output-buffer=SIZE] [--uring] [--prefetch=N] [--max-fds=N]\n"
+            "       [--name=GLOB] [--iname=GLOB] [--regex=RE]\n"
+            "       [--size=[+-]N[cwbkMG]] [--mtime=[+-]N] [--newer=FILE] [--user=NAME]\n"
+            "       [--maxdepth=N] [--mindepth=N] [--xdev] [--prune=GLOB] [--index=FILE] [--watch]\n"
+            "       [--summarize[=N]] [--roots-from=FILE] [--shard=I/N] [--shard-depth=K]\n"
+            "       [--checkpoint=FILE] [--stats[=json]] [--max-errors=N] [--front-coded[=zstd]]\n"
+            "       %s --diff OLD NEW [-0] [--binary]\n", prog_name, prog_name);
+    fprintf(stderr, "  dir:       Starting directories, listed in order (default: .)\n");
+    fprintf(stderr, "  -l:        List only symbolic links.\n");
+    fprintf(stderr, "  -d:        List only directories.\n");
+    fprintf(stderr, "  -f:        List only regular files.\n");
+    fprintf(stderr, "  -s:        Sort output by name (LC_COLLATE).\n");
+    fprintf(stderr, "  -L:        Follow symbolic links (each directory is walked once). With -j,\n");
+    fprintf(stderr, "             a directory reached through several paths is walked below any one\n");
+    fprintf(stderr, "             of them, which may change from run to run, even with -s.\n");
+    fprintf(stderr, "  -0:        Terminate paths with NUL instead of newline.\n");
+    fprintf(stderr, "  -j N:      Walk with N worker threads (1-%d, default: 1).\n", MAX_WALKER_THREADS);
+    fprintf(stderr, "  --binary:  Write records of 4-byte length, 1-byte type and path bytes.\n");
+    fprintf(stderr, "  --compact: With -s, store shared path prefixes once (less memory, slower sort).\n");
+    fprintf(stderr, "  --sort-mem=SIZE: With -s, sort in about SIZE bytes of memory (K, M, G suffixes),\n");
+    fprintf(stderr, "             spilling sorted runs to temporary files.\n");
+    fprintf(stderr, "  --tmpdir=DIR: Directory for --sort-mem runs (default: $TMPDIR or /tmp).\n");
+    fprintf(stderr, "  --output-buffer=SIZE: Size of each output buffer (default: %dK).\n",
+            DEFAULT_OUTPUT_BUFFER_SIZE / 1024);
+    fprintf(stderr, "  --uring:   Resolve entries of unknown type with batched io_uring statx.\n");
+    fprintf(stderr, "  --prefetch=N: Stat up to N entries of unknown type ahead with N threads (1-%d).\n",
+            MAX_PREFETCH_THREADS);
+    fprintf(stderr, "  --max-fds=N: Keep at most N directories open (default: RLIMIT_NOFILE / 2, up to %d).\n",
+            DEFAULT_MAX_OPEN_DIRS);
+    fprintf(stderr, "  --name=GLOB: List only entries whose name matches GLOB (repeatable).\n");
+    fprintf(stderr, "  --iname=GLOB: Like --name, ignoring letter case.\n");
+    fprintf(stderr, "  --regex=RE: List only entries whose name matches extended regex RE.\n");
+    fprintf(stderr, "  --size=[+-]N[cwbkMG]: List only entries of more than/less than/exactly N units\n");
+    fprintf(stderr, "             (default: 512-byte blocks).\n");
+    fprintf(stderr, "  --mtime=[+-]N: List only entries last modified N whole days ago (+N: more).\n");
+    fprintf(stderr, "  --newer=FILE: List only entries modified more recently than FILE.\n");
+    fprintf(stderr, "  --user=NAME: List only entries owned by NAME (or a numeric user ID).\n");
+    fprintf(stderr, "  --maxdepth=N: Descend at most N levels below the starting path.\n");
+    fprintf(stderr, "  --mindepth=N: List only entries at least N levels below the starting path.\n");
+    fprintf(stderr, "  --xdev:    Do not descend into other file systems.\n");
+    fprintf(stderr, "  --prune=GLOB: Skip directories named GLOB and their contents (repeatable).\n");
+    fprintf(stderr, "  --index=FILE: Read only directories changed since the snapshot in FILE,\n");
+    fprintf(stderr, "             then update it.\n");
+    fprintf(stderr, "  --watch:   Then keep printing added (+path) and removed (-path) entries.\n");
+    fprintf(stderr, "  --summarize[=N]: Print the N biggest directories with their subtrees instead\n");
+    fprintf(stderr, "             (1-%d, default: %d): allocated bytes, apparent bytes, entries, path.\n",
+            MAX_SUMMARY_COUNT, DEFAULT_SUMMARY_COUNT);
+    fprintf(stderr, "  --roots-from=FILE: Also walk the paths in FILE (- for stdin), one per line\n");
+    fprintf(stderr, "             (NUL-terminated with -0).\n");
+    fprintf(stderr, "  --shard=I/N: List only part I of N (1-%d), split by a hash of the paths\n", MAX_SHARD_COUNT);
+    fprintf(stderr, "             at --shard-depth=K (1-%d, default: 1) below the starting path.\n",
+            MAX_SHARD_DEPTH);
+    fprintf(stderr, "  --checkpoint=FILE: Record progress in FILE and resume from it when it exists\n");
+    fprintf(stderr, "             (append stdout with >>); FILE is removed when the walk is done.\n");
+    fprintf(stderr, "  --stats[=json]: Print counters and system call latencies to stderr at exit.\n");
+    fprintf(stderr, "  --max-errors=N: Print only the first N walk errors, then a summary of all of\n");
+    fprintf(stderr, "             them by errno and directory at exit.\n");
+    fprintf(stderr, "  --front-coded[=zstd]: Write the sorted entries (-s) as a listing file with\n");
+    fprintf(stderr, "             front-coded blocks (zstd-compressed with =zstd) and a block index.\n");
+    fprintf(stderr, "  --diff:    Print -path/+path for the entries removed/added from listing OLD\n");
+    fprintf(stderr, "             to listing NEW, without walking. Exits with 0 if they hold the same\n");
+    fprintf(stderr, "             entries, 1 if they differ and 2 on errors, as diff(1).\n");
     fprintf(stderr, "If no type options (-l, -d, -f) are given, all types are listed.\n");
 }
 
 /*
- * compare_strings: Comparison function for qsort, using locale-aware comparison.
+ * parse_option: Applies one option returned by getopt_long to the options structure.
  *
  * Parameters:
- *   a - Pointer to the first string (char **).
- *   b - Pointer to the second string (char **).
+ *   opt - The option character or long option identifier.
+ *   arg - The option argument, if the option takes one.
+ *   cli - Pointer to the cli_options_t structure to update.
  *
  * Returns:
- *   An integer based on strcoll comparison.
+ *    0 on success.
+ *   -1 if the option is invalid or its argument is malformed.
  */
-static int compare_strings(const void *a, const void *b) {
-    return strcoll(*(const char **)a, *(const char **)b);
+static int parse_option(int opt, const char *arg, cli_options_t *cli) {
+    // Filters decide which entries a --checkpoint run lists, so their
+    // arguments, as given, go into its fingerprint.
+    switch (opt) {
+        case OPT_NAME:
+        case OPT_INAME:
+        case OPT_REGEX:
+        case OPT_SIZE:
+        case OPT_MTIME:
+        case OPT_NEWER:
+        case OPT_USER:
+        case OPT_PRUNE:
+            cli->filter_hash = hash_bytes(hash_bytes(cli->filter_hash, &opt, sizeof(opt)), arg, strlen(arg) + 1);
+            break;
+        default:
+            break;
+    }
+
+    switch (opt) {
+        case 'l': cli->show_l = 1; cli->explicit_type_filter = 1; break;
+        case 'd': cli->show_d = 1; cli->explicit_type_filter = 1; break;
+        case 'f': cli->show_f = 1; cli->explicit_type_filter = 1; break;
+        case 's': cli->sort_output = 1; break;
+        case 'L': cli->follow_links = 1; break;
+        case '0': cli->output_format = OUTPUT_NUL; break;
+        case 'j': return parse_count(arg, "-j", MAX_WALKER_THREADS, &cli->thread_count);
+        case OPT_COMPACT: cli->compact_paths = 1; break;
+        case OPT_SORT_MEM: return parse_size(arg, "--sort-mem", &cli->sort_mem);
+        case OPT_OUTPUT_BUFFER: return parse_size(arg, "--output-buffer", &cli->output_buffer);
+        case OPT_TMPDIR: cli->tmp_dir = arg; break;
+        case OPT_BINARY: cli->output_format = OUTPUT_BINARY; break;
+        case OPT_URING: cli->use_uring = 1; break;
+        case OPT_PREFETCH: return parse_count(arg, "--prefetch", MAX_PREFETCH_THREADS, &cli->prefetch);
+        case OPT_MAX_FDS: return parse_count(arg, "--max-fds", MAX_OPEN_DIRS, &cli->max_open_dirs);
+        case OPT_NAME: return name_filter_add(&cli->names, arg, NAME_MATCH_GLOB, 0);
+        case OPT_INAME: return name_filter_add(&cli->names, arg, NAME_MATCH_GLOB, 1);
+        case OPT_REGEX: return name_filter_add(&cli->names, arg, NAME_MATCH_REGEX, 0);
+        case OPT_SIZE:
+        case OPT_MTIME:
+        case OPT_NEWER:
+        case OPT_USER: return parse_meta_option(opt, arg, &cli->meta);
+        case OPT_MAXDEPTH: return parse_depth(arg, "--maxdepth", &cli->max_depth);
+        case OPT_MINDEPTH: return parse_depth(arg, "--mindepth", &cli->min_depth);
+        case OPT_XDEV: cli->xdev = 1; break;
+        case OPT_PRUNE: return name_filter_add(&cli->prune, arg, NAME_MATCH_GLOB, 0);
+        case OPT_INDEX: cli->index_path = arg; break;
+        case OPT_WATCH: cli->watch = 1; break;
+        case OPT_SUMMARIZE:
+            if (arg == NULL) {
+                cli->summarize = DEFAULT_SUMMARY_COUNT;
+                break;
+            }
+            return parse_count(arg, "--summarize", MAX_SUMMARY_COUNT, &cli->summarize);
+        case OPT_ROOTS_FROM: cli->roots_from = arg; break;
+        case OPT_SHARD: return parse_shard(arg, cli);
+        case OPT_SHARD_DEPTH: return parse_count(arg, "--shard-depth", MAX_SHARD_DEPTH, &cli->shard_depth);
+        case OPT_CHECKPOINT: cli->checkpoint_path = arg; break;
+        case OPT_STATS:
+            if (arg == NULL) {
+                cli->stats = STATS_TEXT;
+            } else if (strcmp(arg, "json") == 0) {
+                cli->stats = STATS_JSON;
+            } else {
+                fprintf(stderr, "Error: Invalid format '%s' for --stats (expected json)\n", arg);
+                return -1;
+            }
+            break;
+        case OPT_MAX_ERRORS: return parse_limit(arg, "--max-errors", &cli->max_errors);
+        case OPT_FRONT_CODED:
+            if (arg == NULL) {
+                cli->front_coded = LISTING_PLAIN;
+            } else if (strcmp(arg, "zstd") == 0 && DIRWALK_USE_ZSTD) {
+                cli->front_coded = LISTING_ZSTD;
+            } else if (strcmp(arg, "zstd") == 0) {
+                fprintf(stderr, "Error: --front-coded=zstd is not supported by this build (no libzstd)\n");
+                return -1;
+            } else {
+                fprintf(stderr, "Error: Invalid compression '%s' for --front-coded (expected zstd)\n", arg);
+                return -1;
+            }
+            break;
+        case OPT_DIFF: cli->diff = 1; break;
+        case '?': // Invalid option
+        default:
+            return -1;
+    }
+    return 0;
 }
 
 /*
- * add_result: Adds a path string to the dynamic results array, resizing if necessary.
+ * parse_count: Parses the argument of a count option (-j, --prefetch, --max-fds,
+ *              --summarize, --shard-depth).
  *
  * Parameters:
- *   results - Pointer to the results_t structure.
- *   path    - The path string to add (will be duplicated).
+ *   arg    - The option argument string.
+ *   option - Name of the option, for the error message.
+ *   max    - Largest accepted count.
+ *   count  - Receives the parsed count.
  *
  * Returns:
- *   Nothing. Aborts on memory allocation failure.
+ *    0 on success.
+ *   -1 if arg is not an integer between 1 and max.
+ *   Prints an error message to stderr on failure.
  */
-static void add_result(results_t *results, const char *path) {
-    if (results == NULL) return;
+static int parse_count(const char *arg, const char *option, size_t max, size_t *count) {
+    char *end = NULL;
+    long value;
 
-    if (results->count >= results->capacity) {
-        size_t new_capacity = results->capacity * 2;
-        if (new_capacity <= results->capacity) {
-            fprintf(stderr, "Error: Result capacity overflow for results array\n");
-            abort();
+    errno = 0;
+    value = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || value < 1 || (size_t)value > max) {
+        fprintf(stderr, "Error: Invalid count '%s' for %s\n", arg, option);
+        return -1;
+    }
+    *count = (size_t)value;
+    return 0;
+}
+
+/*
+ * parse_depth: Parses the argument of a depth option (--maxdepth, --mindepth).
+ *
+ * Parameters:
+ *   arg    - The option argument string.
+ *   option - Name of the option, for the error message.
+ *   depth  - Receives the parsed depth.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if arg is not a non-negative integer.
+ *   Prints an error message to stderr on failure.
+ */
+static int parse_depth(const char *arg, const char *option, size_t *depth) {
+    char *end = NULL;
+    unsigned long long value;
+
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' || arg[0] == '+' || value >= SIZE_MAX) {
+        fprintf(stderr, "Error: Invalid depth '%s' for %s\n", arg, option);
+        return -1;
+    }
+    *depth = (size_t)value;
+    return 0;
+}
+
+/*
+ * parse_limit: Parses a non-negative limit such as --max-errors=N.
+ *
+ * Parameters:
+ *   arg    - The option's argument.
+ *   option - Option name for the error message.
+ *   limit  - Receives the limit.
+ *
+ * Returns:
+ *   0 on success, -1 (after printing an error) if arg is not a number.
+ */
+static int parse_limit(const char *arg, const char *option, size_t *limit) {
+    char *end = NULL;
+    unsigned long long value;
+
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' || arg[0] == '+' || value >= SIZE_MAX) {
+        fprintf(stderr, "Error: Invalid limit '%s' for %s\n", arg, option);
+        return -1;
+    }
+    *limit = (size_t)value;
+    return 0;
+}
+/*
+ * parse_size: Parses the argument of a size option: a positive number of
+ *             bytes, optionally followed by a K, M or G (binary) suffix.
+ *
+ * Parameters:
+ *   arg    - The option argument string.
+ *   option - Name of the option, for the error message.
+ *   size   - Receives the parsed number of bytes.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if arg is malformed, zero or too large.
+ *   Prints an error message to stderr on failure.
+ */
+static int parse_size(const char *arg, const char *option, size_t *size) {
+    char *end = NULL;
+    unsigned long long value;
+    unsigned shift = 0;
+
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (end != arg) {
+        switch (*end) {
+            case 'K': case 'k': shift = 10; end++; break;
+            case 'M': case 'm': shift = 20; end++; break;
+            case 'G': case 'g': shift = 30; end++; break;
+            default: break;
         }
-        char **new_paths = (char **)realloc(results->paths, new_capacity * sizeof(char *));
-        if (new_paths == NULL) {
-            perror("Error reallocating results array");
-            free_results(results);
-            abort();
+    }
+    if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' || value == 0 ||
+        value > (SIZE_MAX >> shift)) {
+        fprintf(stderr, "Error: Invalid size '%s' for %s\n", arg, option);
+        return -1;
+    }
+    *size = (size_t)(value << shift);
+    return 0;
+}
+
+/*
+ * parse_shard: Parses the I/N argument of --shard.
+ *
+ * Parameters:
+ *   arg - The option argument string.
+ *   cli - Pointer to the cli_options_t structure receiving the shard.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if arg is not two integers I/N with 1 <= I <= N <= MAX_SHARD_COUNT.
+ *   Prints an error message to stderr on failure.
+ */
+static int parse_shard(const char *arg, cli_options_t *cli) {
+    char *end = NULL;
+    long index;
+    long count = 0;
+
+    errno = 0;
+    index = strtol(arg, &end, 10);
+    if (errno == 0 && end != arg && *end == '/' && end[1] != '-' && end[1] != '+') {
+        const char *count_arg = end + 1;
+        count = strtol(count_arg, &end, 10);
+        if (end == count_arg || *end != '\0') {
+            count = 0;
         }
-        results->paths = new_paths;
-        results->capacity = new_capacity;
     }
+    if (errno != 0 || count < 1 || count > MAX_SHARD_COUNT || index < 1 || index > count) {
+        fprintf(stderr, "Error: Invalid shard '%s' for --shard (expected I/N with 1 <= I <= N <= %d)\n",
+                arg, MAX_SHARD_COUNT);
+        return -1;
+    }
+    cli->shard_index = (size_t)index - 1;
+    cli->shard_count = (size_t)count;
+    return 0;
+}
 
-    results->paths[results->count] = strdup(path);
-    if (results->paths[results->count] == NULL) {
-        perror("Error duplicating path string");
-        free_results(results);
-        abort();
+/*
+ * name_filter_add: Compiles a --name, --iname or --regex pattern and adds it
+ *                  to the name filters.
+ *
+ * Parameters:
+ *   filter    - Pointer to the name_filter_t structure.
+ *   pattern   - The pattern as given on the command line.
+ *   kind      - NAME_MATCH_GLOB for a shell pattern, NAME_MATCH_REGEX for a
+ *               POSIX extended regular expression.
+ *   fold_case - Flag: match ASCII letters case-insensitively.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if the regular expression is invalid (an error message is printed).
+ *   Aborts on memory allocation failure.
+ */
+static int name_filter_add(name_filter_t *filter, const char *pattern, int kind, int fold_case) {
+    name_pattern_t compiled;
+
+    memset(&compiled, 0, sizeof(compiled));
+    compiled.fold_case = fold_case;
+    if (kind == NAME_MATCH_REGEX) {
+        int rc = regcomp(&compiled.regex, pattern, REG_EXTENDED | REG_NOSUB);
+        if (rc != 0) {
+            char message[256];
+            regerror(rc, &compiled.regex, message, sizeof(message));
+            fprintf(stderr, "Error: Invalid regular expression '%s' for --regex: %s\n", pattern, message);
+            return -1;
+        }
+        compiled.kind = NAME_MATCH_REGEX;
+    } else {
+        compiled.tokens = glob_compile(pattern, fold_case, &compiled.token_count);
+        compiled.kind = NAME_MATCH_GLOB;
+
+        // A run of literals with at most one star at either end needs no matcher.
+        size_t first = 0;
+        size_t last = compiled.token_count;
+        int leading_star = last > 0 && compiled.tokens[0].kind == GLOB_STAR;
+        int trailing_star = last > (size_t)leading_star && compiled.tokens[last - 1].kind == GLOB_STAR;
+        first += (size_t)leading_star;
+        last -= (size_t)trailing_star;
+        int plain = !(leading_star && trailing_star);
+        for (size_t i = first; i < last && plain; ++i) {
+            plain = compiled.tokens[i].kind == GLOB_LITERAL;
+        }
+        if (plain) {
+            compiled.literal_len = last - first;
+            compiled.literal = (char *)malloc(compiled.literal_len + 1);
+            if (compiled.literal == NULL) {
+                perror("Error allocating name pattern");
+                abort();
+            }
+            for (size_t i = first; i < last; ++i) {
+                compiled.literal[i - first] = (char)compiled.tokens[i].byte;
+            }
+            compiled.literal[compiled.literal_len] = '\0';
+            compiled.kind = leading_star ? NAME_MATCH_SUFFIX
+                          : trailing_star ? NAME_MATCH_PREFIX : NAME_MATCH_EXACT;
+            free(compiled.tokens);
+            compiled.tokens = NULL;
+            compiled.token_count = 0;
+        }
+    }
+
+    if (filter->count >= filter->capacity) {
+        size_t new_capacity = filter->capacity > 0 ? filter->capacity * 2 : 4;
+        name_pattern_t *new_patterns = (name_pattern_t *)realloc(filter->patterns,
+                                                                  new_capacity * sizeof(name_pattern_t));
+        if (new_patterns == NULL) {
+            perror("Error reallocating name patterns");
+            abort();
+        }
+        filter->patterns = new_patterns;
+        filter->capacity = new_capacity;
     }
-    results->count++;
+    filter->patterns[filter->count++] = compiled;
+    return 0;
 }
 
 /*
- * free_results: Frees the memory allocated for the results array and its contents.
+ * name_filter_free: Frees the compiled name filters.
  *
  * Parameters:
- *   results - Pointer to the results_t structure.
+ *   filter - Pointer to the name_filter_t structure.
  *
  * Returns:
  *   Nothing.
  */
-static void free_results(results_t *results) {
-    if (results && results->paths) {
-        for (size_t i = 0; i < results->count; ++i) {
-            free(results->paths[i]);
+static void name_filter_free(name_filter_t *filter) {
+    for (size_t i = 0; i < filter->count; ++i) {
+        name_pattern_t *pattern = &filter->patterns[i];
+        if (pattern->kind == NAME_MATCH_REGEX) {
+            regfree(&pattern->regex);
         }
-        free(results->paths);
-        results->paths = NULL;
-        results->count = 0;
-        results->capacity = 0;
+        free(pattern->literal);
+        free(pattern->tokens);
     }
+    free(filter->patterns);
+    filter->patterns = NULL;
+    filter->count = 0;
+    filter->capacity = 0;
 }
 
 /*
- * process_entry: Checks a file system entry against the filters and either prints
- *                its path or adds it to the results list. Uses lstat.
+ * glob_class_compile: Compiles a bracket expression into a byte set. Supports
+ *                     ranges (a-z), negation ([!...] or [^...]), a leading ']'
+ *                     as a member, and named classes such as [:digit:].
  *
  * Parameters:
- *   path                 - The full path to the file system entry.
- *   show_l               - Flag indicating whether to list symbolic links.
- *   show_d               - Flag indicating whether to list directories.
- *   show_f               - Flag indicating whether to list regular files.
- *   explicit_type_filter - Flag indicating if -l, -d, or -f was specified.
- *   sort_output          - Flag indicating whether output should be sorted.
- *   results              - Pointer to the results_t structure (if sorting).
+ *   pattern   - Pattern text just after the opening '['.
+ *   set       - Receives the 256-bit byte set.
+ *   fold_case - Flag: add both cases of every letter.
  *
  * Returns:
- *    1 if the entry was processed (printed or added).
- *    0 otherwise (including lstat errors or filter mismatch).
- *   Prints error messages to stderr if lstat fails.
+ *   The number of bytes consumed including the closing ']', or 0 if the
+ *   expression is not terminated (the '[' is then an ordinary byte).
  */
-static int process_entry(const char *path, int show_l, int show_d, int show_f,
-                         int explicit_type_filter, int sort_output, results_t *results) {
-    struct stat stat_buf;
-    int processed = 0;
+static size_t glob_class_compile(const char *pattern, uint32_t *set, int fold_case) {
+    static const struct {
+        const char *name;
+        int (*test)(int c);
+    } classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+        {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+        {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}
+    };
+    size_t i = 0;
+    int negate = 0;
 
-    if (lstat(path, &stat_buf) == -1) {
-        fprintf(stderr, "Error getting status for '%s': %s\n", path, strerror(errno));
-        return 0;
+    memset(set, 0, 8 * sizeof(uint32_t));
+    if (pattern[i] == '!' || pattern[i] == '^') {
+        negate = 1;
+        i++;
     }
+    for (int first = 1; pattern[i] != ']' || first; first = 0) {
+        unsigned char low;
+        unsigned char high;
 
-    int should_output = 0;
+        if (pattern[i] == '\0') {
+            return 0;
+        }
+        if (pattern[i] == '[' && pattern[i + 1] == ':') {
+            const char *end = strstr(pattern + i + 2, ":]");
+            size_t c = 0;
+            for (; end != NULL && c < sizeof(classes) / sizeof(classes[0]); ++c) {
+                size_t len = strlen(classes[c].name);
+                if ((size_t)(end - (pattern + i + 2)) == len &&
+                    strncmp(pattern + i + 2, classes[c].name, len) == 0) {
+                    break;
+                }
+            }
+            if (end != NULL && c < sizeof(classes) / sizeof(classes[0])) {
+                for (int b = 0; b < 256; ++b) {
+                    if (classes[c].test(b)) {
+                        set[b >> 5] |= 1u << (b & 31);
+                    }
+                }
+                i = (size_t)(end - pattern) + 2;
+                continue;
+            }
+        }
+        if (pattern[i] == '\\' && pattern[i + 1] != '\0') {
+            i++;
+        }
+        low = (unsigned char)pattern[i++];
+        high = low;
+        if (pattern[i] == '-' && pattern[i + 1] != ']' && pattern[i + 1] != '\0') {
+            i++;
+            if (pattern[i] == '\\' && pattern[i + 1] != '\0') {
+                i++;
+            }
+            high = (unsigned char)pattern[i++];
+        }
+        for (unsigned b = low; b <= high; ++b) {
+            set[b >> 5] |= 1u << (b & 31);
+        }
+    }
 
-    // --- Logic Change: Handle default (all types) vs explicit filters ---
-    if (!explicit_type_filter) {
-        // Default behavior: No specific type flags given (-l, -d, -f). Output everything.
-        should_output = 1;
-    } else {
-        // Explicit filters (-l, -d, -f) were given. Check only those types.
-        if (S_ISLNK(stat_buf.st_mode) && show_l) {
-            should_output = 1;
-        } else if (S_ISDIR(stat_buf.st_mode) && show_d) {
-            should_output = 1;
-        } else if (S_ISREG(stat_buf.st_mode) && show_f) {
-            should_output = 1;
+    if (fold_case) {
+        for (int b = 'A'; b <= 'Z'; ++b) {
+            int lower = tolower(b);
+            if ((set[b >> 5] >> (b & 31)) & 1u) {
+                set[lower >> 5] |= 1u << (lower & 31);
+            }
+            if ((set[lower >> 5] >> (lower & 31)) & 1u) {
+                set[b >> 5] |= 1u << (b & 31);
+            }
         }
-        // Other types (sockets, fifos, etc.) are implicitly ignored when explicit filters are used.
     }
-    // --- End Logic Change ---
+    if (negate) {
+        for (int w = 0; w < 8; ++w) {
+            set[w] = ~set[w];
+        }
+    }
+    return i + 1;
+}
 
-    if (should_output) {
-        if (sort_output) {
-            add_result(results, path);
+/*
+ * glob_compile: Compiles a shell pattern into tokens. Consecutive stars are
+ *               merged; a backslash makes the next byte literal.
+ *
+ * Parameters:
+ *   pattern     - The shell pattern.
+ *   fold_case   - Flag: store literal letters in lower case.
+ *   token_count - Receives the number of tokens.
+ *
+ * Returns:
+ *   The token array (owned by the caller). Aborts on memory allocation failure.
+ */
+static glob_token_t *glob_compile(const char *pattern, int fold_case, size_t *token_count) {
+    size_t len = strlen(pattern);
+    size_t count = 0;
+    glob_token_t *tokens = (glob_token_t *)calloc(len > 0 ? len : 1, sizeof(glob_token_t));
+
+    if (tokens == NULL) {
+        perror("Error allocating glob pattern");
+        abort();
+    }
+    for (size_t i = 0; i < len; ) {
+        glob_token_t *token = &tokens[count];
+        size_t class_len;
+
+        if (pattern[i] == '*') {
+            i++;
+            if (count > 0 && tokens[count - 1].kind == GLOB_STAR) {
+                continue;
+            }
+            token->kind = GLOB_STAR;
+        } else if (pattern[i] == '?') {
+            i++;
+            token->kind = GLOB_ANY;
+        } else if (pattern[i] == '[' && (class_len = glob_class_compile(pattern + i + 1, token->set,
+                                                                         fold_case)) > 0) {
+            i += 1 + class_len;
+            token->kind = GLOB_CLASS;
         } else {
-            if (printf("%s\n", path) < 0) {
-                perror("Error writing to stdout");
-                if (sort_output) free_results(results);
-                exit(EXIT_FAILURE);
-            }
-        }
-        processed = 1;
-    }
-    return processed;
-                         }
-
-
-                         /*
-                          * walk_directory_contents: Recursively traverses the *contents* of a directory.
-                          *
-                          * Parameters:
-                          *   dir_path             - Path to the directory whose contents are traversed.
-                          *   show_l               - Flag: list symbolic links.
-                          *   show_d               - Flag: list directories.
-                          *   show_f               - Flag: list regular files.
-                          *   explicit_type_filter - Flag: were -l, -d, or -f specified?
-                          *   sort_output          - Flag: sort output?
-                          *   results              - Pointer to results structure (if sorting).
-                          *
-                          * Returns:
-                          *   Nothing. Prints error messages to stderr for directory access issues.
-                          */
-                         static void walk_directory_contents(const char *dir_path, int show_l, int show_d, int show_f,
-                                                             int explicit_type_filter, int sort_output, results_t *results) {
-                             DIR *dir_stream = NULL;
-                             struct dirent *entry = NULL;
-
-                             dir_stream = opendir(dir_path);
-                             if (dir_stream == NULL) {
-                                 fprintf(stderr, "Error opening directory '%s': %s\n", dir_path, strerror(errno));
-                                 return;
-                             }
-
-                             errno = 0;
-                             while ((entry = readdir(dir_stream)) != NULL) {
-                                 if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                                     continue;
-                                 }
-
-                                 size_t dir_len = strlen(dir_path);
-                                 int needs_slash = (dir_len > 0 && dir_path[dir_len - 1] != '/');
-                                 size_t name_len = strlen(entry->d_name);
-                                 size_t full_path_len = dir_len + (needs_slash ? 1 : 0) + name_len + 1;
-
-                                 char *full_path = (char *)malloc(full_path_len);
-                                 if (full_path == NULL) {
-                                     perror("Error allocating memory for path string");
-                                     if (sort_output) free_results(results);
-                                     closedir(dir_stream);
-                                     abort();
-                                 }
-
-                                 int written = snprintf(full_path, full_path_len, "%s%s%s",
-                                                        dir_path, (needs_slash ? "/" : ""), entry->d_name);
-
-                                 if (written < 0 || (size_t)written >= full_path_len) {
-                                     fprintf(stderr, "Error constructing path for '%s' in '%s'\n", entry->d_name, dir_path);
-                                     free(full_path);
-                                     errno = 0;
-                                     continue;
-                                 }
-
-                                 // 1. Process this entry (file, link, dir, socket, etc.)
-                                 process_entry(full_path, show_l, show_d, show_f, explicit_type_filter, sort_output, results);
-
-                                 // 2. If the entry is a directory (use lstat to check without following links), recurse.
-                                 struct stat entry_stat;
-                                 if (lstat(full_path, &entry_stat) == 0) {
-                                     if (S_ISDIR(entry_stat.st_mode)) {
-                                         walk_directory_contents(full_path, show_l, show_d, show_f, explicit_type_filter, sort_output, results);
-                                     }
-                                 } else {
-                                     // lstat failed on this entry. process_entry already printed an error.
-                                     // Cannot determine if it's a directory, so cannot recurse.
-                                     ; // Error handled in process_entry
-                                 }
-
-                                 free(full_path);
-                                 full_path = NULL;
-                                 errno = 0; // Reset errno before next readdir
-                             }
-
-                             if (errno != 0) {
-                                 fprintf(stderr, "Error reading directory '%s': %s\n", dir_path, strerror(errno));
-                             }
-
-                             if (closedir(dir_stream) == -1) {
-                                 fprintf(stderr, "Error closing directory '%s': %s\n", dir_path, strerror(errno));
-                             }
-                                                             }
+            if (pattern[i] == '\\' && i + 1 < len) {
+                i++;
+            }
+            token->kind = GLOB_LITERAL;
+            token->byte = (unsigned char)pattern[i++];
+            if (fold_case) {
+                token->byte = (unsigned char)tolower(token->byte);
+            }
+        }
+        count++;
+    }
+    *token_count = count;
+    return tokens;
+}
+/*
+ * meta_filter_add: Appends an empty metadata test.
+ *
+ * Parameters:
+ *   filter - Pointer to the meta_filter_t structure.
+ *   kind   - META_TEST_* kind of the test.
+ *   fields - META_* fields the test reads.
+ *
+ * Returns:
+ *   Pointer to the new test. Aborts on memory allocation failure.
+ */
+static meta_test_t *meta_filter_add(meta_filter_t *filter, int kind, unsigned fields) {
+    meta_test_t *test;
+
+    if (filter->count >= filter->capacity) {
+        size_t new_capacity = filter->capacity > 0 ? filter->capacity * 2 : 4;
+        meta_test_t *new_tests = (meta_test_t *)realloc(filter->tests, new_capacity * sizeof(meta_test_t));
+        if (new_tests == NULL) {
+            perror("Error reallocating metadata filters");
+            abort();
+        }
+        filter->tests = new_tests;
+        filter->capacity = new_capacity;
+    }
+    test = &filter->tests[filter->count++];
+    memset(test, 0, sizeof(*test));
+    test->kind = kind;
+    filter->fields |= fields;
+    return test;
+}
+
+/*
+ * parse_meta_number: Parses a find-style numeric argument: an optional '+'
+ *                    (more than) or '-' (less than), then a decimal number.
+ *
+ * Parameters:
+ *   arg    - The option argument string.
+ *   option - Name of the option, for the error message, or NULL to print none.
+ *   cmp    - Receives +1, -1 or 0 (exactly).
+ *   value  - Receives the number.
+ *   suffix - Receives a pointer to the text after the number, or NULL if no
+ *            text may follow it.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if arg is malformed. Prints an error message to stderr on failure,
+ *      unless option is NULL.
+ */
+static int parse_meta_number(const char *arg, const char *option, int *cmp, int64_t *value,
+                             const char **suffix) {
+    char *end = NULL;
+    unsigned long long number;
+
+    *cmp = 0;
+    if (arg[0] == '+' || arg[0] == '-') {
+        *cmp = arg[0] == '+' ? 1 : -1;
+        arg++;
+    }
+    errno = 0;
+    number = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || arg[0] == '-' || arg[0] == '+' || number > INT64_MAX ||
+        (suffix == NULL && *end != '\0')) {
+        if (option != NULL) {
+            fprintf(stderr, "Error: Invalid number '%s' for %s\n", arg, option);
+        }
+        return -1;
+    }
+    *value = (int64_t)number;
+    if (suffix != NULL) {
+        *suffix = end;
+    }
+    return 0;
+}
+
+/*
+ * parse_meta_option: Parses --size, --mtime, --newer or --user into a test.
+ *
+ * Parameters:
+ *   opt    - OPT_SIZE, OPT_MTIME, OPT_NEWER or OPT_USER.
+ *   arg    - The option argument string.
+ *   filter - Pointer to the meta_filter_t structure receiving the test.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if the argument is invalid (an error message is printed).
+ */
+static int parse_meta_option(int opt, const char *arg, meta_filter_t *filter) {
+    int cmp;
+    int64_t value;
+    const char *suffix;
+    meta_test_t *test;
+
+    if (opt == OPT_SIZE) {
+        int64_t unit = 512;
+        if (parse_meta_number(arg, "--size", &cmp, &value, &suffix) == -1) {
+            return -1;
+        }
+        switch (*suffix) {
+            case '\0': break;
+            case 'c': unit = 1; break;
+            case 'w': unit = 2; break;
+            case 'b': unit = 512; break;
+            case 'k': unit = 1024; break;
+            case 'M': unit = 1024 * 1024; break;
+            case 'G': unit = 1024 * 1024 * 1024; break;
+            default: unit = 0; break;
+        }
+        if (unit == 0 || (*suffix != '\0' && suffix[1] != '\0')) {
+            fprintf(stderr, "Error: Invalid size '%s' for --size\n", arg);
+            return -1;
+        }
+        test = meta_filter_add(filter, META_TEST_SIZE, META_SIZE);
+        test->unit = unit;
+    } else if (opt == OPT_MTIME) {
+        if (parse_meta_number(arg, "--mtime", &cmp, &value, NULL) == -1) {
+            return -1;
+        }
+        test = meta_filter_add(filter, META_TEST_MTIME, META_MTIME);
+        filter->now = (int64_t)time(NULL);
+    } else if (opt == OPT_NEWER) {
+        struct stat stat_buf;
+        if (stat(arg, &stat_buf) == -1) {
+            fprintf(stderr, "Error getting status for '%s': %s\n", arg, strerror(errno));
+            return -1;
+        }
+        test = meta_filter_add(filter, META_TEST_NEWER, META_MTIME);
+        cmp = 1;
+        value = (int64_t)stat_buf.st_mtim.tv_sec;
+        test->unit = (int64_t)stat_buf.st_mtim.tv_nsec;
+    } else {
+        const struct passwd *user = getpwnam(arg);
+        if (user != NULL) {
+            value = (int64_t)user->pw_uid;
+        } else if (parse_meta_number(arg, NULL, &cmp, &value, NULL) == -1 || cmp != 0 ||
+                   (uint64_t)value > (uint64_t)(uid_t)-1) {
+            // Neither a user name nor a numeric ID: the number is parsed
+            // quietly, so only this error is printed.
+            fprintf(stderr, "Error: Unknown user '%s' for --user\n", arg);
+            return -1;
+        }
+        test = meta_filter_add(filter, META_TEST_USER, META_UID);
+        cmp = 0;
+    }
+    test->cmp = cmp;
+    test->value = value;
+    return 0;
+}
+
+/*
+ * meta_filter_free: Frees the metadata filters.
+ *
+ * Parameters:
+ *   filter - Pointer to the meta_filter_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void meta_filter_free(meta_filter_t *filter) {
+    free(filter->tests);
+    filter->tests = NULL;
+    filter->count = 0;
+    filter->capacity = 0;
+    filter->fields = 0;
+}
+/*
+ * directory_node: Returns the node under which the entries of a directory
+ *                 are recorded. In compact mode this is the node of the
+ *                 directory itself when it was listed, otherwise a new
+ *                 unlisted node (a root node holding the full path when the
+ *                 directory has no recorded parent).
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure.
+ *   path    - Name of the directory relative to results->dir_node, or its full
+ *             path when results->dir_node is PATH_NODE_NONE.
+ *
+ * Returns:
+ *   Index of the directory node, or PATH_NODE_NONE outside compact mode.
+ */
+static uint32_t directory_node(results_t *results, const char *path) {
+    if (!results->compact) {
+        return PATH_NODE_NONE;
+    }
+    if (results->last_node != PATH_NODE_NONE &&
+        results->nodes[results->last_node].parent == results->dir_node) {
+        return results->last_node;
+    }
+
+    size_t len = strlen(path);
+    char *copy = (char *)arena_alloc(&results->arena, len);
+    memcpy(copy, path, len);
+    return add_node(results, results->dir_node, copy, len, -1);
+}
+/*
+ * emit_sorted_results: Sorts the collected results and prints them to stdout.
+ *                      Each shard (one per worker in parallel mode) is sorted
+ *                      on its own, and its in-memory part and spilled runs all
+ *                      take part in one streaming k-way merge, so printing
+ *                      starts right away and no merged array is built.
+ *
+ * Parameters:
+ *   shards      - Array of results_t structures. Shards that have not been
+ *                 sorted yet are sorted here.
+ *   shard_count - Number of shards.
+ *   listing     - --front-coded listing receiving the sorted paths, or NULL.
+ *   out         - Output buffer receiving the sorted paths otherwise.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing to stdout fails.
+ */
+static void emit_sorted_results(results_t *shards, size_t shard_count, listing_t *listing, out_buf_t *out) {
+    merge_cursor_t *cursors;
+    size_t cursor_count = shard_count;
+    size_t next = 0;
+
+    for (size_t i = 0; i < shard_count; ++i) {
+        cursor_count += shards[i].run_count;
+    }
+    cursors = (merge_cursor_t *)calloc(cursor_count, sizeof(merge_cursor_t));
+    if (cursors == NULL) {
+        perror("Error allocating merge cursors");
+        abort();
+    }
+
+    for (size_t i = 0; i < shard_count; ++i) {
+        uint64_t sort_started = stats_clock();
+        sort_results(&shards[i]);
+        stats_phase(STATS_PHASE_SORT, sort_started);
+        cursors[next].shard = &shards[i];
+        cursors[next].count = shards[i].count;
+        if (shards[i].compact) {
+            path_init(&cursors[next].scratch);
+        }
+        next++;
+        for (size_t r = 0; r < shards[i].run_count; ++r) {
+            cursors[next].run = shards[i].runs[r].file;
+            cursors[next].count = shards[i].runs[r].count;
+            next++;
+        }
+    }
+
+    uint64_t merge_started = stats_clock();
+    merge_cursors(cursors, cursor_count, NULL, listing, out);
+    out_flush(out);
+    stats_phase(STATS_PHASE_MERGE, merge_started);
+    free(cursors);
+}
+/*
+ * out_init: Initializes an empty output buffer.
+ *
+ * Parameters:
+ *   out      - Pointer to the out_buf_t structure.
+ *   capacity - Size of the buffer in bytes.
+ *   format   - OUTPUT_* format of the entries.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void out_init(out_buf_t *out, size_t capacity, int format) {
+    out->data = (char *)malloc(capacity);
+    if (out->data == NULL) {
+        perror("Error allocating output buffer");
+        abort();
+    }
+    out->len = 0;
+    out->capacity = capacity;
+    out->format = format;
+    out->line_buffered = isatty(STDOUT_FILENO);
+    out->prefix = '\0';
+    out->stream = NULL;
+    out->hold = 0;
+}
+/*
+ * out_free: Frees an output buffer. Pending entries must have been flushed.
+ *
+ * Parameters:
+ *   out - Pointer to the out_buf_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void out_free(out_buf_t *out) {
+    free(out->data);
+    out->data = NULL;
+    out->len = 0;
+    out->capacity = 0;
+}
+/*
+ * index_open: Maps the previous snapshot of an --index file, if there is a
+ *             valid one, and creates the temporary file for the new one.
+ *
+ * Parameters:
+ *   index - Pointer to the tree_index_t structure to initialize.
+ *   path  - Path of the index file.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if the temporary file cannot be created (an error message is printed).
+ *   Aborts on memory allocation failure.
+ */
+static int index_open(tree_index_t *index, const char *path) {
+    size_t path_len = strlen(path);
+
+    index->path = path;
+    index->map = NULL;
+    index->map_size = 0;
+    index->table = NULL;
+    index->table_size = 0;
+    index->scan_start = (int64_t)time(NULL);
+    index_load(index);
+
+    index->tmp_path = (char *)malloc(path_len + sizeof(".XXXXXX"));
+    index->buf = (char *)malloc(INDEX_BUFFER_SIZE);
+    index->dir_capacity = INITIAL_INDEX_CAPACITY;
+    index->dirs = (index_slot_t *)malloc(index->dir_capacity * sizeof(index_slot_t));
+    if (index->tmp_path == NULL || index->buf == NULL || index->dirs == NULL) {
+        perror("Error allocating index");
+        abort();
+    }
+    memcpy(index->tmp_path, path, path_len);
+    memcpy(index->tmp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+    index->fd = mkstemp(index->tmp_path);
+    if (index->fd == -1) {
+        fprintf(stderr, "Error creating index '%s': %s\n", path, strerror(errno));
+        free(index->tmp_path);
+        free(index->buf);
+        free(index->dirs);
+        if (index->map != NULL) {
+            munmap((void *)index->map, index->map_size);
+        }
+        return -1;
+    }
+
+    // The header goes first but is written last, once the table is placed.
+    memset(index->buf, 0, sizeof(index_header_t));
+    index->buf_len = sizeof(index_header_t);
+    index->size = sizeof(index_header_t);
+    index->dir_count = 0;
+    pthread_mutex_init(&index->lock, NULL);
+    return 0;
+}
+
+/*
+ * index_load: Maps the previous snapshot of an --index file and checks its
+ *             header. A missing file is a first run; an unreadable or
+ *             invalid one is ignored with a warning, so the walk reads every
+ *             directory and the file is rebuilt.
+ *
+ * Parameters:
+ *   index - Pointer to the tree_index_t structure, with path set.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void index_load(tree_index_t *index) {
+    index_header_t header;
+    struct stat st;
+    void *map;
+    int fd = open(index->path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Warning: Cannot read index '%s': %s\n", index->path, strerror(errno));
+        }
+        return;
+    }
+    if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(header) || (uint64_t)st.st_size > SIZE_MAX) {
+        fprintf(stderr, "Warning: Ignoring invalid index '%s'.\n", index->path);
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Warning: Cannot map index '%s': %s\n", index->path, strerror(errno));
+        return;
+    }
+
+    memcpy(&header, map, sizeof(header));
+    uint64_t size = (uint64_t)st.st_size;
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.table_offset < sizeof(header) || header.table_offset > size || header.table_offset % 8 != 0 ||
+        header.table_size == 0 || (header.table_size & (header.table_size - 1)) != 0 ||
+        header.table_size > (size - header.table_offset) / sizeof(uint64_t)) {
+        fprintf(stderr, "Warning: Ignoring invalid index '%s'.\n", index->path);
+        munmap(map, (size_t)st.st_size);
+        return;
+    }
+    index->map = (const char *)map;
+    index->map_size = (size_t)st.st_size;
+    index->table = (const uint64_t *)(const void *)(index->map + header.table_offset);
+    index->table_size = header.table_size;
+}
+
+/*
+ * index_close: Finishes the new --index snapshot and releases both. When
+ *              committing, the hash table and the header are written and the
+ *              temporary file replaces the index file; otherwise (or after
+ *              a write error) it is removed and the previous snapshot stays.
+ *
+ * Parameters:
+ *   index  - Pointer to an open tree_index_t structure.
+ *   commit - Flag: install the new snapshot.
+ *
+ * Returns:
+ *   Nothing. Prints an error message to stderr if the snapshot cannot be
+ *   written. Aborts on memory allocation failure.
+ */
+static void index_close(tree_index_t *index, int commit) {
+    if (commit && index->fd != -1) {
+        index_header_t header;
+        uint64_t table_size = INITIAL_INDEX_CAPACITY;
+        uint64_t *table;
+
+        while (table_size < 2 * (uint64_t)index->dir_count) {
+            table_size *= 2;
+        }
+        table = (uint64_t *)calloc(table_size, sizeof(uint64_t));
+        if (table == NULL) {
+            perror("Error allocating index table");
+            abort();
+        }
+        for (size_t i = 0; i < index->dir_count; ++i) {
+            uint64_t slot = index->dirs[i].hash & (table_size - 1);
+            while (table[slot] != 0) {
+                slot = (slot + 1) & (table_size - 1);
+            }
+            table[slot] = index->dirs[i].offset;
+        }
+
+        memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+        header.dir_count = index->dir_count;
+        header.table_offset = index->size;
+        header.table_size = table_size;
+        index_write(index, table, table_size * sizeof(uint64_t));
+        index_flush(index);
+        free(table);
+
+        if (index->fd != -1 && pwrite(index->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+            fprintf(stderr, "Error writing index '%s': %s\n", index->tmp_path, strerror(errno));
+            close(index->fd);
+            index->fd = -1;
+        }
+        if (index->fd != -1) {
+            int rc = close(index->fd);
+            index->fd = -1;
+            if (rc == -1) {
+                fprintf(stderr, "Error writing index '%s': %s\n", index->tmp_path, strerror(errno));
+            } else if (rename(index->tmp_path, index->path) == -1) {
+                fprintf(stderr, "Error replacing index '%s': %s\n", index->path, strerror(errno));
+            } else {
+                index->tmp_path[0] = '\0'; // Installed, nothing to remove
+            }
+        }
+    }
+
+    if (index->fd != -1) {
+        close(index->fd);
+    }
+    if (index->tmp_path[0] != '\0') {
+        unlink(index->tmp_path);
+    }
+    if (index->map != NULL) {
+        munmap((void *)index->map, index->map_size);
+    }
+    free(index->tmp_path);
+    free(index->buf);
+    free(index->dirs);
+    pthread_mutex_destroy(&index->lock);
+}
+/*
+ * index_entries_valid: Checks that packed entries read from a snapshot are
+ *                      well formed, so a damaged file cannot send the reader
+ *                      past the end of the record, hand it an unknown type or
+ *                      make it open anything but an entry of the directory.
+ *
+ * Parameters:
+ *   entries - The packed entries (type byte, NUL-terminated name).
+ *   len     - Their size.
+ *
+ * Returns:
+ *   1 if every record has a DT_* type byte and a terminated name that is a
+ *   single path component other than "." and "..", 0 otherwise.
+ */
+static int index_entries_valid(const char *entries, size_t len) {
+    size_t pos = 0;
+
+    while (pos < len) {
+        const char *name = entries + pos + 1;
+        const char *end;
+        if (len - pos < 3) {
+            return 0;
+        }
+        switch ((unsigned char)entries[pos]) {
+            case DT_UNKNOWN: case DT_FIFO: case DT_CHR: case DT_DIR:
+            case DT_BLK: case DT_REG: case DT_LNK: case DT_SOCK:
+                break;
+            default:
+                return 0;
+        }
+        end = (const char *)memchr(name, '\0', len - pos - 1);
+        if (end == NULL || end == name || memchr(name, '/', (size_t)(end - name)) != NULL ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            return 0;
+        }
+        pos = (size_t)(end - entries) + 1;
+    }
+    return 1;
+}
+
+/*
+ * index_lookup: Finds the entries of a directory in the previous snapshot,
+ *               provided the directory has not changed since: same device,
+ *               inode, mtime and ctime. Adding, removing or renaming an entry
+ *               updates the directory's mtime, so its list is still exact.
+ *
+ * Parameters:
+ *   index       - Pointer to the tree_index_t structure.
+ *   path        - Path of the directory.
+ *   path_len    - Length of the path.
+ *   st          - Current status of the directory.
+ *   entries_len - Receives the size of the packed entries.
+ *
+ * Returns:
+ *   The packed entries (type byte, NUL-terminated name) within the mapping,
+ *   or NULL if the directory must be read.
+ */
+static const char *index_lookup(const tree_index_t *index, const char *path, size_t path_len,
+                                const struct stat *st, size_t *entries_len) {
+    uint64_t hash;
+    uint64_t mask = index->table_size - 1;
+
+    if (index->map == NULL) {
+        return NULL;
+    }
+    hash = index_hash(path, path_len);
+    for (uint64_t i = 0; i < index->table_size; ++i) {
+        uint64_t offset = index->table[(hash + i) & mask];
+        index_record_t record;
+
+        if (offset == 0 || offset > index->map_size || index->map_size - offset < sizeof(record)) {
+            return NULL;
+        }
+        memcpy(&record, index->map + offset, sizeof(record));
+        if (record.hash != hash || record.path_len != path_len) {
+            continue;
+        }
+        const char *data = index->map + offset + sizeof(record);
+        size_t room = index->map_size - (size_t)offset - sizeof(record);
+        if (room < path_len || room - path_len < record.entries_len) {
+            return NULL;
+        }
+        if (memcmp(data, path, path_len) != 0) {
+            continue;
+        }
+        if ((record.flags & INDEX_RECORD_UNSTABLE) != 0 ||
+            record.dev != (uint64_t)st->st_dev || record.ino != (uint64_t)st->st_ino ||
+            record.mtime_sec != (int64_t)st->st_mtim.tv_sec ||
+            record.mtime_nsec != (uint32_t)st->st_mtim.tv_nsec ||
+            record.ctime_sec != (int64_t)st->st_ctim.tv_sec ||
+            record.ctime_nsec != (uint32_t)st->st_ctim.tv_nsec) {
+            return NULL;
+        }
+        // A damaged record is read again rather than trusted.
+        uint64_t checksum = record.checksum;
+        record.checksum = 0;
+        if (hash_bytes(hash_bytes(FNV_OFFSET_BASIS, data, path_len + (size_t)record.entries_len), &record,
+                       sizeof(record)) != checksum ||
+            !index_entries_valid(data + path_len, (size_t)record.entries_len)) {
+            return NULL;
+        }
+        *entries_len = (size_t)record.entries_len;
+        return data + path_len;
+    }
+    return NULL;
+}
+
+/*
+ * index_write: Appends bytes to the new snapshot through its write buffer.
+ *              After a write error, only the size is tracked. The caller
+ *              holds the index lock.
+ *
+ * Parameters:
+ *   index - Pointer to the tree_index_t structure.
+ *   data  - Bytes to append.
+ *   len   - Number of bytes.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void index_write(tree_index_t *index, const void *data, size_t len) {
+    index->size += len;
+    if (index->fd == -1) {
+        return;
+    }
+    if (INDEX_BUFFER_SIZE - index->buf_len < len) {
+        index_flush(index);
+    }
+    if (len <= INDEX_BUFFER_SIZE) {
+        memcpy(index->buf + index->buf_len, data, len);
+        index->buf_len += len;
+        return;
+    }
+
+    // Entry lists larger than the buffer are written straight through.
+    index_flush(index);
+    index->buf_len = len;
+    while (index->buf_len > 0 && index->fd != -1) {
+        ssize_t written = write(index->fd, (const char *)data + (len - index->buf_len), index->buf_len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            fprintf(stderr, "Error writing index '%s': %s\n", index->tmp_path, strerror(errno));
+            close(index->fd);
+            index->fd = -1;
+        } else {
+            index->buf_len -= (size_t)written;
+        }
+    }
+    index->buf_len = 0;
+}
+
+/*
+ * index_flush: Writes out the buffered bytes of the new snapshot. On error,
+ *              the snapshot is abandoned. The caller holds the index lock.
+ *
+ * Parameters:
+ *   index - Pointer to the tree_index_t structure.
+ *
+ * Returns:
+ *   Nothing. Prints an error message to stderr on failure.
+ */
+static void index_flush(tree_index_t *index) {
+    size_t pos = 0;
+
+    while (pos < index->buf_len && index->fd != -1) {
+        ssize_t written = write(index->fd, index->buf + pos, index->buf_len - pos);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            fprintf(stderr, "Error writing index '%s': %s\n", index->tmp_path, strerror(errno));
+            close(index->fd);
+            index->fd = -1;
+        } else {
+            pos += (size_t)written;
+        }
+    }
+    index->buf_len = 0;
+}
+
+/*
+ * index_add: Records the entries of a directory in the new snapshot. If the
+ *            directory changed shortly before the walk started, a later
+ *            change could leave its timestamps as they are (they have a
+ *            coarse granularity), so the record is marked unstable and the
+ *            directory is read again next time.
+ *
+ * Parameters:
+ *   index       - Pointer to the tree_index_t structure.
+ *   path        - Path of the directory.
+ *   path_len    - Length of the path.
+ *   st          - Status of the directory when it was opened.
+ *   entries     - Its packed entries (type byte, NUL-terminated name).
+ *   entries_len - Size of the packed entries.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void index_add(tree_index_t *index, const char *path, size_t path_len, const struct stat *st,
+                      const char *entries, size_t entries_len) {
+    static const char padding[8] = {0};
+    index_record_t record;
+
+    if (path_len > UINT32_MAX) {
+        return;
+    }
+    memset(&record, 0, sizeof(record));
+    record.hash = index_hash(path, path_len);
+    record.dev = (uint64_t)st->st_dev;
+    record.ino = (uint64_t)st->st_ino;
+    record.mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    record.mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+    record.ctime_sec = (int64_t)st->st_ctim.tv_sec;
+    record.ctime_nsec = (uint32_t)st->st_ctim.tv_nsec;
+    record.entries_len = entries_len;
+    record.path_len = (uint32_t)path_len;
+    if (record.mtime_sec >= index->scan_start - 1 || record.ctime_sec >= index->scan_start - 1) {
+        record.flags |= INDEX_RECORD_UNSTABLE;
+    }
+    record.checksum = hash_bytes(hash_bytes(hash_bytes(FNV_OFFSET_BASIS, path, path_len), entries, entries_len),
+                                 &record, sizeof(record));
+
+    pthread_mutex_lock(&index->lock);
+    if (index->dir_count == index->dir_capacity) {
+        size_t new_capacity = index->dir_capacity * 2;
+        index_slot_t *new_dirs = (index_slot_t *)realloc(index->dirs, new_capacity * sizeof(index_slot_t));
+        if (new_dirs == NULL) {
+            perror("Error reallocating index");
+            abort();
+        }
+        index->dirs = new_dirs;
+        index->dir_capacity = new_capacity;
+    }
+    index->dirs[index->dir_count].hash = record.hash;
+    index->dirs[index->dir_count].offset = index->size;
+    index->dir_count++;
+    index_write(index, &record, sizeof(record));
+    index_write(index, path, path_len);
+    index_write(index, entries, entries_len);
+    index_write(index, padding, (size_t)(-index->size & 7));
+    pthread_mutex_unlock(&index->lock);
+}
+
+/*
+ * dir_reader_use_index: Serves a directory just opened from the previous
+ *                       --index snapshot if it is unchanged since, or else
+ *                       reads it in full, and records its entries in the new
+ *                       snapshot. The descriptor stays open for fstatat and
+ *                       openat; only the getdents64 or readdir calls are saved.
+ *
+ * Parameters:
+ *   reader   - Pointer to a dir_reader_t structure fresh from dir_reader_open.
+ *   index    - Pointer to the tree_index_t structure.
+ *   path     - Path of the directory.
+ *   path_len - Length of the path.
+ *
+ * Returns:
+ *   Nothing. If the directory cannot be examined, it is read as usual and
+ *   left out of the new snapshot. Aborts on memory allocation failure.
+ */
+static void dir_reader_use_index(dir_reader_t *reader, tree_index_t *index, const char *path,
+                                 size_t path_len) {
+    struct stat st;
+    size_t entries_len;
+    const char *entries;
+
+    if (fstat(dir_reader_fd(reader), &st) == -1) {
+        return;
+    }
+    entries = index_lookup(index, path, path_len, &st, &entries_len);
+    if (entries != NULL) {
+        // Borrowed from the mapping, which outlives the walk (capacity 0: not freed).
+        reader->spill = (char *)entries;
+        reader->spill_len = entries_len;
+        reader->spill_capacity = 0;
+    } else {
+        dir_reader_buffer(reader);
+        if (reader->spill_errno != 0) {
+            return; // Incomplete: the error is reported as the entries run out
+        }
+    }
+    index_add(index, path, path_len, &st, reader->spill, reader->spill_len);
+}
+/*
+ * walk_directory_contents: Traverses the *contents* of a directory through its
+ *                          descriptor, depth first, with an explicit stack of
+ *                          open directories instead of recursion. Entry types
+ *                          come from d_type (one fstatat at most for DT_UNKNOWN)
+ *                          and subdirectories are opened with openat relative
+ *                          to their parent. When more than max_open_dirs
+ *                          directories would be open, the outermost open
+ *                          ancestor is detached (its remaining entries are
+ *                          buffered and it is closed) and reopened by path once
+ *                          the walk returns to it (through the ".." entry of
+ *                          its child, or by path), so depth is unlimited.
+ *
+ * Parameters:
+ *   dir_fd               - Open descriptor of the directory. Ownership passes to
+ *                          this function, which closes it before returning.
+ *   dir_path             - Path of the directory, used for output and error messages.
+ *                          Extended and restored in place while descending.
+ *   entries              - Per-worker directory entry buffer shared by all levels.
+ *   config               - Walk configuration (type filters, sorting, -L).
+ *   results              - Pointer to results structure (if sorting).
+ *   out                  - Output buffer for the listed paths (if not sorting).
+ *   max_open_dirs        - Budget of directories kept open at once (at least 1;
+ *                          one more is open briefly while a child is opened).
+ *   summary              - With --summarize, receives the totals of every
+ *                          directory walked, the starting one included, as
+ *                          its subtree is finished; else NULL.
+ *   start_sum            - With --summarize, what the directory counts for itself.
+ *
+ * Returns:
+ *   Nothing. Prints error messages to stderr for directory access issues.
+ *   Aborts on memory allocation failure.
+ */
+static void walk_directory_contents(int dir_fd, path_buf_t *dir_path, dirent_buf_t *entries,
+                                    const walk_config_t *config, results_t *results,
+                                    out_buf_t *out, size_t max_open_dirs, summary_t *summary,
+                                    const dir_sum_t *start_sum) {
+    int sort_output = config->sort_output;
+    int open_flags = directory_open_flags(config);
+    walk_frame_t *stack;
+    size_t capacity = INITIAL_WALK_STACK_CAPACITY;
+    size_t depth = 0;
+    size_t lowest_open = 0; // Frames [lowest_open, depth) hold an open descriptor
+    const char *name = NULL;
+    unsigned char d_type = DT_UNKNOWN;
+
+    stack = (walk_frame_t *)malloc(capacity * sizeof(walk_frame_t));
+    if (stack == NULL) {
+        perror("Error allocating traversal stack");
+        abort();
+    }
+    if (dir_reader_open(&stack[0].reader, dir_fd, entries) == -1) {
+        walk_error(errno, "opening directory", dir_path->data, dir_path->len);
+        free(stack);
+        return;
+    }
+    if (config->index != NULL) {
+        dir_reader_use_index(&stack[0].reader, config->index, dir_path->data, dir_path->len);
+    }
+    stack[0].parent_len = dir_path->len;
+    stack[0].path_len = dir_path->len;
+    stack[0].parent_node = sort_output ? results->dir_node : PATH_NODE_NONE;
+    if (summary != NULL) {
+        stack[0].sum = *start_sum;
+    }
+    depth = 1;
+
+    while (depth > 0) {
+        walk_frame_t *frame = &stack[depth - 1];
+        int status;
+
+        // 1. A detached directory back on top of the stack whose reopening
+        //    through ".." failed is reopened by path.
+        if (depth - 1 < lowest_open) {
+            int fd = stats_openat(AT_FDCWD, dir_path->data, open_flags);
+            if (fd == -1) {
+                walk_error(errno, "reopening directory", dir_path->data, dir_path->len);
+                status = 0; // Give up on its remaining entries
+            } else {
+                dir_reader_reattach(&frame->reader, fd);
+                lowest_open = depth - 1;
+                status = dir_reader_next(&frame->reader, &name, &d_type);
+            }
+        } else {
+            status = dir_reader_next(&frame->reader, &name, &d_type);
+        }
+
+        // 2. At the end of the directory, pop it and resume its parent.
+        if (status != 1) {
+            if (status == -1) {
+                walk_error(errno, "reading directory", dir_path->data, dir_path->len);
+            }
+            // A detached parent is reopened through "..", which works at any
+            // depth, as long as it is still the directory that was closed.
+            if (depth - 1 == lowest_open && lowest_open > 0) {
+                reopen_parent(&stack[depth - 2], dir_reader_fd(&frame->reader));
+                if (dir_reader_fd(&stack[depth - 2].reader) != -1) {
+                    lowest_open--;
+                }
+            }
+            dir_reader_release(&frame->reader);
+            if (dir_reader_close(&frame->reader) == -1) {
+                walk_error(errno, "closing directory", dir_path->data, dir_path->len);
+            }
+            // Its subtree is complete: record it and roll it up into the parent.
+            if (summary != NULL) {
+                summary_add(summary, dir_path->data, &frame->sum);
+                if (depth > 1) {
+                    sum_add(&stack[depth - 2].sum, &frame->sum);
+                }
+            }
+            path_pop(dir_path, frame->parent_len);
+            if (sort_output) {
+                results->dir_node = frame->parent_node;
+            }
+            depth--;
+            continue;
+        }
+
+        // 3. Process this entry (file, link, dir, socket, etc.) and learn its type.
+        int frame_fd = dir_reader_fd(&frame->reader);
+        dir_sum_t counted;
+        int type = config->handle_entry(frame_fd, name, d_type, depth, dir_path, config, results, out,
+                                        summary != NULL ? &counted : NULL);
+        if (summary != NULL) {
+            sum_add(&frame->sum, &counted);
+        }
+
+        // 4. If the entry is a directory (a link to one only with -L) above
+        //    --maxdepth, push it. A type of -1 means fstatat failed and
+        //    process_entry already printed an error.
+        if (type != DT_DIR || depth >= config->max_depth) {
+            continue;
+        }
+        size_t parent_len = path_push(dir_path, name);
+        int child_fd = stats_openat(frame_fd, name, open_flags);
+        if (child_fd == -1) {
+            walk_error(errno, "opening directory", dir_path->data, dir_path->len);
+            path_pop(dir_path, parent_len);
+            continue;
+        }
+        if (!enter_directory(config, child_fd, dir_path->data)) {
+            close(child_fd);
+            path_pop(dir_path, parent_len);
+            continue;
+        }
+
+        // In compact mode, the entries below are recorded under this directory's node.
+        // This needs name, which detaching a readdir stream would invalidate.
+        uint32_t parent_node = sort_output ? results->dir_node : PATH_NODE_NONE;
+        if (sort_output) {
+            results->dir_node = directory_node(results, name);
+        }
+
+        // Stay within the budget by detaching the outermost open ancestor.
+        if (depth + 1 - lowest_open > max_open_dirs && lowest_open < depth) {
+            walk_frame_t *ancestor = &stack[lowest_open];
+            struct stat st;
+            if (fstat(dir_reader_fd(&ancestor->reader), &st) == 0) {
+                ancestor->dev = st.st_dev;
+                ancestor->ino = st.st_ino;
+            } else {
+                ancestor->dev = 0;
+                ancestor->ino = 0;
+            }
+            if (dir_reader_detach(&ancestor->reader) == -1) {
+                walk_error(errno, "closing directory", dir_path->data, ancestor->path_len);
+            }
+            lowest_open++;
+        }
+
+        if (depth >= capacity) {
+            capacity *= 2;
+            walk_frame_t *new_stack = (walk_frame_t *)realloc(stack, capacity * sizeof(walk_frame_t));
+            if (new_stack == NULL) {
+                perror("Error reallocating traversal stack");
+                abort();
+            }
+            stack = new_stack;
+        }
+        walk_frame_t *child = &stack[depth];
+        if (dir_reader_open(&child->reader, child_fd, entries) == -1) {
+            walk_error(errno, "opening directory", dir_path->data, dir_path->len);
+            path_pop(dir_path, parent_len);
+            if (sort_output) {
+                results->dir_node = parent_node;
+            }
+            continue;
+        }
+        if (config->index != NULL) {
+            dir_reader_use_index(&child->reader, config->index, dir_path->data, dir_path->len);
+        }
+        child->parent_len = parent_len;
+        child->path_len = dir_path->len;
+        child->parent_node = parent_node;
+        // The directory's own size moves from its parent to its frame, which
+        // hands it back with the subtree when it is popped.
+        if (summary != NULL) {
+            stack[depth - 1].sum.apparent -= counted.apparent;
+            stack[depth - 1].sum.allocated -= counted.allocated;
+            stack[depth - 1].sum.entries -= counted.entries;
+            child->sum = counted;
+        }
+        depth++;
+    }
+
+    free(stack);
+}
+
+/*
+ * deque_init: Initializes an empty task deque.
+ *
+ * Parameters:
+ *   deque - Pointer to the task_deque_t structure.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void deque_init(task_deque_t *deque) {
+    deque->tasks = (dir_task_t *)malloc(INITIAL_DEQUE_CAPACITY * sizeof(dir_task_t));
+    if (deque->tasks == NULL) {
+        perror("Error allocating task deque");
+        abort();
+    }
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->head = 0;
+    deque->count = 0;
+    deque->capacity = INITIAL_DEQUE_CAPACITY;
+}
+
+/*
+ * deque_destroy: Releases the memory held by an empty task deque.
+ *
+ * Parameters:
+ *   deque - Pointer to the task_deque_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void deque_destroy(task_deque_t *deque) {
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->tasks);
+    deque->tasks = NULL;
+    deque->count = 0;
+    deque->capacity = 0;
+}
+
+/*
+ * deque_push: Adds a task at the bottom (owner's end) of a deque, growing it if necessary.
+ *
+ * Parameters:
+ *   deque - Pointer to the task_deque_t structure.
+ *   task  - The task to add (copied).
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void deque_push(task_deque_t *deque, const dir_task_t *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        size_t new_capacity = deque->capacity * 2;
+        dir_task_t *new_tasks = (dir_task_t *)malloc(new_capacity * sizeof(dir_task_t));
+        if (new_tasks == NULL) {
+            perror("Error reallocating task deque");
+            abort();
+        }
+        for (size_t i = 0; i < deque->count; ++i) {
+            new_tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = new_tasks;
+        deque->head = 0;
+        deque->capacity = new_capacity;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = *task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/*
+ * deque_pop: Removes the newest task from the bottom of a deque (owner side).
+ *
+ * Parameters:
+ *   deque - Pointer to the task_deque_t structure.
+ *   task  - Receives the removed task.
+ *
+ * Returns:
+ *   1 if a task was removed, 0 if the deque was empty.
+ */
+static int deque_pop(task_deque_t *deque, dir_task_t *task) {
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        *task = deque->tasks[(deque->head + deque->count) % deque->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/*
+ * deque_steal: Removes the oldest task from the top of a deque (thief side).
+ *
+ * Parameters:
+ *   deque - Pointer to the task_deque_t structure.
+ *   task  - Receives the removed task.
+ *
+ * Returns:
+ *   1 if a task was removed, 0 if the deque was empty.
+ */
+static int deque_steal(task_deque_t *deque, dir_task_t *task) {
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/*
+ * dir_handle_release: Drops one reference to a directory handle, closing the
+ *                     directory and freeing the handle when it was the last.
+ *
+ * Parameters:
+ *   handle - Pointer to the dir_handle_t structure.
+ *
+ * Returns:
+ *   Nothing. Prints an error message to stderr if closing fails.
+ */
+static void dir_handle_release(dir_handle_t *handle) {
+    if (atomic_fetch_sub(&handle->refs, 1) == 1) {
+        if (dir_reader_close(&handle->reader) == -1) {
+            walk_error(errno, "closing directory", NULL, 0);
+        }
+        free(handle);
+    }
+}
+
+/*
+ * pool_submit: Queues a directory on a worker's own deque and wakes an idle
+ *              worker if one is waiting.
+ *
+ * Parameters:
+ *   worker      - The submitting worker.
+ *   root        - Starting path the directory is below. With ordered output,
+ *                 the task holds a pending count on its stream.
+ *   parent      - Handle of the parent directory to open relative to, or NULL
+ *                 for the starting path itself (or, below it, a directory
+ *                 resumed from a --checkpoint). A reference is taken on
+ *                 behalf of the task.
+ *   path        - Full path of the directory (copied).
+ *   name_offset - Offset of the last path component within path.
+ *   depth       - Depth of the directory below the starting path.
+ *   sum         - With --summarize, the directory's node, whose reference
+ *                 passes to the task; else NULL.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void pool_submit(worker_t *worker, walk_root_t *root, dir_handle_t *parent, const char *path,
+                        size_t name_offset, size_t depth, sum_node_t *sum) {
+    walk_pool_t *pool = worker->pool;
+    dir_task_t task;
+
+    task.root = root;
+    task.parent = parent;
+    task.name_offset = name_offset;
+    task.depth = depth;
+    task.sum = sum;
+    task.path = strdup(path);
+    if (task.path == NULL) {
+        perror("Error duplicating path string");
+        abort();
+    }
+    if (parent != NULL) {
+        atomic_fetch_add(&parent->refs, 1);
+    }
+    if (root->stream != NULL) {
+        atomic_fetch_add(&root->stream->pending, 1);
+    }
+
+    atomic_fetch_add(&pool->pending, 1);
+    deque_push(&worker->deque, &task);
+    atomic_fetch_add(&pool->queued, 1);
+
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+/*
+ * pool_take: Gets the next directory for a worker: the newest task from its own
+ *            deque, otherwise the oldest task stolen from another worker. Waits
+ *            while other workers are busy and may still produce work.
+ *
+ * Parameters:
+ *   worker - The worker asking for work.
+ *   task   - Receives the task.
+ *
+ * Returns:
+ *   1 if a task was obtained, 0 once the whole walk is finished.
+ */
+static int pool_take(worker_t *worker, dir_task_t *task) {
+    walk_pool_t *pool = worker->pool;
+
+    for (;;) {
+        if (deque_pop(&worker->deque, task)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            return 1;
+        }
+        for (size_t i = 1; i < pool->worker_count; ++i) {
+            worker_t *victim = &pool->workers[(worker->index + i) % pool->worker_count];
+            if (deque_steal(&victim->deque, task)) {
+                atomic_fetch_sub(&pool->queued, 1);
+                return 1;
+            }
+        }
+
+        // Nothing to take right now. Sleep until a task is queued or the walk
+        // ends, after handing over the output of the last tasks, which may be
+        // all their starting path is waiting for.
+        worker_hand_over(worker);
+        pthread_mutex_lock(&pool->idle_lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) > 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (atomic_load(&pool->pending) == 0) {
+            return 0;
+        }
+    }
+}
+
+/*
+ * pool_finish_task: Marks a task as done, waking all workers if it was the last one.
+ *
+ * Parameters:
+ *   pool - Pointer to the walk_pool_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void pool_finish_task(walk_pool_t *pool) {
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+/*
+ * walk_directory_task: Walks the entries of one queued directory in parallel mode.
+ *                      Every entry goes through process_entry exactly as in the
+ *                      single-threaded walk; subdirectories are queued on the
+ *                      worker's deque instead of being recursed into.
+ *                      With --summarize, the sums of the entries that are not
+ *                      queued are added into the directory's node at the end.
+ *                      The task of a starting path first processes the path
+ *                      itself, as main does in the single-threaded walk.
+ *                      With --checkpoint, the directory and the subdirectories
+ *                      it queues are recorded in the worker's batch.
+ *
+ * Parameters:
+ *   worker - The worker running the task.
+ *   task   - The task to run. Its path and parent reference are consumed;
+ *            its summary node reference (created here for a starting path)
+ *            is kept for the caller.
+ *
+ * Returns:
+ *   Nothing. Prints error messages to stderr for directory access issues.
+ */
+static void walk_directory_task(worker_t *worker, dir_task_t *task) {
+    const walk_config_t *config = &task->root->config;
+    checkpoint_t *checkpoint = worker->pool->checkpoint;
+    results_t *results = config->sort_output ? &worker->results : NULL;
+    dir_handle_t *handle = NULL;
+    const char *name = NULL;
+    unsigned char d_type = DT_UNKNOWN;
+    int dir_fd;
+    int status;
+    dir_sum_t local = {0, 0, 0}; // With --summarize, sums of the entries not queued
+
+    if (task->parent == NULL && task->depth == 0) {
+        // A starting path, listed relative to the working directory with an
+        // empty parent so that its printed path is the argument verbatim.
+        dir_sum_t counted;
+        path_pop(&worker->path, 0);
+        if (results != NULL) {
+            results->dir_node = PATH_NODE_NONE;
+            results->last_node = PATH_NODE_NONE;
+        }
+        int type = process_entry(AT_FDCWD, task->path, DT_UNKNOWN, 0, &worker->path, config, results,
+                                 &worker->out, config->summarize ? &counted : NULL);
+        if (type == -1) {
+            task->root->failed = 1;
+            free(task->path);
+            return;
+        }
+        if (config->summarize) {
+            task->sum = sum_node_new(NULL, task->path, &counted);
+        }
+        // It is done once listed; a failure to open it is not retried on resume.
+        if (checkpoint != NULL) {
+            checkpoint_begin(worker, task->root, task->path, 0);
+        }
+        dir_fd = type == DT_DIR && config->max_depth > 0 ? root_open(task->root) : -1;
+        if (dir_fd == -1) {
+            free(task->path);
+            return;
+        }
+    } else {
+        // A subdirectory, opened relative to its parent, or by path when a
+        // --checkpoint run resumes it.
+        int saved_errno;
+        if (task->parent != NULL) {
+            dir_fd = stats_openat(dir_reader_fd(&task->parent->reader), task->path + task->name_offset,
+                                  directory_open_flags(config));
+            saved_errno = errno;
+            dir_handle_release(task->parent);
+        } else {
+            dir_fd = stats_openat(AT_FDCWD, task->path, directory_open_flags(config));
+            saved_errno = errno;
+        }
+        if (dir_fd == -1) {
+            walk_error(saved_errno, "opening directory", task->path, strlen(task->path));
+            free(task->path);
+            return;
+        }
+        if (!enter_directory(config, dir_fd, task->path)) {
+            close(dir_fd);
+            free(task->path);
+            return;
+        }
+        if (checkpoint != NULL) {
+            checkpoint_begin(worker, task->root, task->path, task->depth);
+        }
+    }
+
+    path_pop(&worker->path, 0);
+    path_push(&worker->path, task->path);
+    free(task->path);
+    task->path = NULL;
+
+    // In compact mode, this worker records the entries under a root node
+    // holding the directory's full path.
+    if (results != NULL) {
+        results->dir_node = PATH_NODE_NONE;
+        results->last_node = PATH_NODE_NONE;
+        results->dir_node = directory_node(results, worker->path.data);
+    }
+
+    handle = (dir_handle_t *)malloc(sizeof(dir_handle_t));
+    if (handle == NULL) {
+        perror("Error allocating directory handle");
+        abort();
+    }
+    atomic_init(&handle->refs, 1);
+
+    if (dir_reader_open(&handle->reader, dir_fd, &worker->entries) == -1) {
+        walk_error(errno, "opening directory", worker->path.data, worker->path.len);
+        free(handle);
+        return;
+    }
+    if (config->index != NULL) {
+        dir_reader_use_index(&handle->reader, config->index, worker->path.data, worker->path.len);
+    }
+    dir_fd = dir_reader_fd(&handle->reader);
+
+    while ((status = dir_reader_next(&handle->reader, &name, &d_type)) == 1) {
+        dir_sum_t counted;
+        int type = config->handle_entry(dir_fd, name, d_type, task->depth + 1, &worker->path, config,
+                                        results, &worker->out, task->sum != NULL ? &counted : NULL);
+
+        if (type == DT_DIR && task->depth + 1 < config->max_depth) {
+            size_t parent_len = path_push(&worker->path, name);
+            // A resumed walk lists the directories committed before once.
+            if (checkpoint == NULL || !checkpoint_committed(checkpoint, task->root->index, worker->path.data)) {
+                pool_submit(worker, task->root, handle, worker->path.data, worker->path.len - strlen(name),
+                            task->depth + 1,
+                            task->sum != NULL ? sum_node_new(task->sum, worker->path.data, &counted) : NULL);
+            }
+            path_pop(&worker->path, parent_len);
+            if (checkpoint != NULL) {
+                checkpoint_child(worker, name);
+            }
+        } else if (task->sum != NULL) {
+            sum_add(&local, &counted);
+        }
+    }
+
+    if (status == -1) {
+        walk_error(errno, "reading directory", worker->path.data, worker->path.len);
+    }
+    if (task->sum != NULL) {
+        sum_node_add(task->sum, &local);
+    }
+
+    dir_reader_release(&handle->reader);
+    dir_handle_release(handle);
+}
+
+/*
+ * worker_main: Thread entry point of a parallel walk worker.
+ *
+ * Parameters:
+ *   arg - Pointer to the worker_t structure of this thread.
+ *
+ * Returns:
+ *   NULL.
+ */
+static void *worker_main(void *arg) {
+    worker_t *worker = (worker_t *)arg;
+    checkpoint_t *checkpoint = worker->pool->checkpoint;
+    dir_task_t task;
+
+    stats_attach();
+    while (pool_take(worker, &task)) {
+        // Output of one starting path is handed over before the worker
+        // lists entries of another.
+        if (task.root->stream != worker->out.stream) {
+            worker_hand_over(worker);
+            worker->out.stream = task.root->stream;
+        }
+        walk_directory_task(worker, &task);
+        if (task.sum != NULL) {
+            sum_node_release(task.sum, &worker->summary);
+        }
+        if (worker->out.stream != NULL) {
+            worker->stream_tasks++;
+        }
+        // With --checkpoint, finished directories are committed once their
+        // output fills the buffer (their sorted entries make a run) or after
+        // a while.
+        if (checkpoint != NULL &&
+            (checkpoint->sort_output ? worker->results.mem_used > worker->results.mem_limit
+                                     : worker->out.len >= checkpoint->flush_size ||
+                                       watch_now() - worker->committed_at >= CHECKPOINT_INTERVAL_MS)) {
+            checkpoint_commit(worker);
+        }
+        pool_finish_task(worker->pool);
+    }
+
+    // The walk is over: sort this worker's shard while the others sort theirs,
+    // or write out its last lines. Sorted entries not in a run yet are only
+    // committed by the end of the whole walk.
+    if (worker->pool->config->sort_output) {
+        sort_results(&worker->results);
+    } else {
+        worker_hand_over(worker);
+    }
+    error_flush();
+    return NULL;
+}
+
+/*
+ * worker_hand_over: Flushes a worker's output buffer. With ordered output,
+ *                   the tasks whose entries it held are then released from
+ *                   their starting path's stream, which finishes once none
+ *                   are left. With --checkpoint, the output is committed.
+ *
+ * Parameters:
+ *   worker - Pointer to the worker_t structure.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing the output fails.
+ */
+static void worker_hand_over(worker_t *worker) {
+    root_stream_t *stream = worker->out.stream;
+
+    if (worker->pool->checkpoint != NULL) {
+        if (!worker->pool->checkpoint->sort_output) {
+            checkpoint_commit(worker);
+        }
+        return;
+    }
+    out_flush(&worker->out);
+    if (stream != NULL && worker->stream_tasks > 0) {
+        if (atomic_fetch_sub(&stream->pending, worker->stream_tasks) == worker->stream_tasks) {
+            root_stream_finish(stream);
+        }
+        worker->stream_tasks = 0;
+    }
+}
+
+/*
+ * walk_parallel: Traverses the starting paths with a pool of worker threads.
+ *                Each worker keeps a deque of directories it discovered and
+ *                steals from the others when its own deque runs dry. The
+ *                starting paths are queued up front, spread over the workers.
+ *                When several are listed without sorting, each one's output
+ *                goes to its own stream, so they appear in argument order.
+ *
+ * Parameters:
+ *   roots                - Array of the starting paths.
+ *   root_count           - Number of starting paths.
+ *   config               - Walk configuration (type filters, sorting, -L).
+ *   thread_count         - Number of worker threads.
+ *   output_buffer        - Size of each worker's output buffer.
+ *   output_format        - OUTPUT_* format of the listed paths.
+ *   use_uring            - Flag: give each worker an io_uring for unknown entry types.
+ *   prefetch             - Number of stat prefetch threads per worker, or 0.
+ *   tmp_dir              - Directory for the files of output held back.
+ *   shards               - Array of thread_count initialized results structures
+ *                          (if sorting). Each one is handed to a worker and
+ *                          receives its already sorted results.
+ *   summaries            - Array of thread_count initialized summaries (with
+ *                          --summarize, else NULL). Each one is handed to a
+ *                          worker and receives the directories it finished.
+ *   checkpoint           - With --checkpoint, the opened checkpoint, whose
+ *                          pending directories are queued along with the
+ *                          starting paths not done yet; else NULL. Its
+ *                          starting paths are not kept in order.
+ *
+ * Returns:
+ *   Nothing. Aborts if threads cannot be created.
+ */
+static void walk_parallel(walk_root_t *roots, size_t root_count, const walk_config_t *config,
+                          size_t thread_count, size_t output_buffer, int output_format,
+                          int use_uring, size_t prefetch, const char *tmp_dir, results_t *shards,
+                          summary_t *summaries, checkpoint_t *checkpoint) {
+    walk_pool_t pool;
+    root_order_t order;
+    int sort_output = config->sort_output;
+    int ordered = root_count > 1 && !sort_output && !config->summarize && checkpoint == NULL;
+
+    pool.workers = (worker_t *)calloc(thread_count, sizeof(worker_t));
+    if (pool.workers == NULL) {
+        perror("Error allocating workers");
+        abort();
+    }
+    pool.worker_count = thread_count;
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.queued, 0);
+    atomic_init(&pool.sleepers, 0);
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+    pool.config = config;
+    pool.checkpoint = checkpoint;
+
+    if (ordered) {
+        root_order_init(&order, root_count, tmp_dir);
+        for (size_t i = 0; i < root_count; ++i) {
+            roots[i].stream = &order.streams[i];
+        }
+    }
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        worker_t *worker = &pool.workers[i];
+        worker->pool = &pool;
+        worker->index = i;
+        deque_init(&worker->deque);
+        path_init(&worker->path);
+        dirent_buf_init(&worker->entries, use_uring, prefetch);
+        if (sort_output) {
+            worker->results = shards[i];
+        } else {
+            out_init(&worker->out, output_buffer, output_format);
+            if (config->watch != NULL) {
+                worker->out.prefix = WATCH_ADDED;
+            }
+        }
+        if (summaries != NULL) {
+            worker->summary = summaries[i];
+        }
+        if (checkpoint != NULL) {
+            path_init(&worker->batch);
+            worker->batch.len = 0;
+            worker->committed_at = watch_now();
+            worker->out.hold = 1;
+        }
+    }
+
+    // Starting path i goes to worker i % thread_count. Deques pop their
+    // newest task first, so each one is filled from its last path back.
+    // A resumed --checkpoint run skips those done, apart from learning the
+    // device --xdev stays on, and queues the directories left to walk.
+    for (size_t i = root_count; i-- > 0;) {
+        if (checkpoint != NULL && checkpoint->root_done != NULL && checkpoint->root_done[i]) {
+            struct stat st;
+            if (roots[i].config.xdev && stat(roots[i].path, &st) == 0) {
+                roots[i].config.root_dev = st.st_dev;
+            }
+            continue;
+        }
+        pool_submit(&pool.workers[i % thread_count], &roots[i], NULL, roots[i].path, 0, 0, NULL);
+    }
+    for (size_t i = 0; checkpoint != NULL && i < checkpoint->pending_count; ++i) {
+        const checkpoint_task_t *pending = &checkpoint->pending[i];
+        pool_submit(&pool.workers[i % thread_count], &roots[pending->root], NULL,
+                    checkpoint->pending_paths.data + pending->path_offset, pending->name_offset,
+                    pending->depth, NULL);
+    }
+    // Every stream now holds one count for its starting path's task, which
+    // the workers release as they hand over its output.
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        int rc = pthread_create(&pool.workers[i].thread, NULL, worker_main, &pool.workers[i]);
+        if (rc != 0) {
+            fprintf(stderr, "Error creating worker thread: %s\n", strerror(rc));
+            abort();
+        }
+    }
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        worker_t *worker = &pool.workers[i];
+        if (sort_output) {
+            shards[i] = worker->results;
+        } else {
+            out_free(&worker->out);
+        }
+        if (summaries != NULL) {
+            summaries[i] = worker->summary;
+        }
+        if (checkpoint != NULL) {
+            path_free(&worker->batch);
+        }
+        deque_destroy(&worker->deque);
+        path_free(&worker->path);
+        dirent_buf_free(&worker->entries);
+    }
+
+    if (ordered) {
+        root_order_destroy(&order);
+        for (size_t i = 0; i < root_count; ++i) {
+            roots[i].stream = NULL;
+        }
+    }
+    pthread_cond_destroy(&pool.idle_cond);
+    pthread_mutex_destroy(&pool.idle_lock);
+    free(pool.workers);
+}
+
+/*
+ * root_open: Opens a starting directory for walking. With --xdev, its device
+ *            becomes the one the walk stays on.
+ *
+ * Parameters:
+ *   root - Pointer to the walk_root_t structure of the starting path.
+ *
+ * Returns:
+ *   The open descriptor, or -1 if the directory could not be opened (an
+ *   error message is printed) or is not to be walked (see enter_directory).
+ */
+static int root_open(walk_root_t *root) {
+    walk_config_t *config = &root->config;
+    struct stat start_stat;
+    int start_fd = stats_openat(AT_FDCWD, root->path, directory_open_flags(config));
+
+    if (start_fd == -1) {
+        walk_error(errno, "opening directory", root->path, strlen(root->path));
+        return -1;
+    }
+    if (config->xdev && fstat(start_fd, &start_stat) == 0) {
+        config->root_dev = start_stat.st_dev;
+    }
+    if (!enter_directory(config, start_fd, root->path)) {
+        close(start_fd);
+        return -1;
+    }
+    return start_fd;
+}
+
+/*
+ * walk_root: Processes one starting path in the single-threaded walk: the
+ *            path itself first, then the contents of a directory.
+ *
+ * Parameters:
+ *   root          - Pointer to the walk_root_t structure of the starting path.
+ *                   Its failed flag is set if the path cannot be examined.
+ *   path          - Reusable path buffer (left empty).
+ *   entries       - Reusable directory entry buffer.
+ *   results       - Pointer to results structure (if sorting).
+ *   out           - Output buffer for the listed paths (if not sorting).
+ *   max_open_dirs - Budget of directories kept open at once.
+ *   summary       - With --summarize, receives the totals of the directories; else NULL.
+ *
+ * Returns:
+ *   Nothing. Prints error messages to stderr.
+ */
+static void walk_root(walk_root_t *root, path_buf_t *path, dirent_buf_t *entries, results_t *results,
+                      out_buf_t *out, size_t max_open_dirs, summary_t *summary) {
+    walk_config_t *config = &root->config;
+    dir_sum_t start_sum;
+    int start_type;
+    int start_fd;
+
+    // 1. Process the starting path itself first (relative to the working directory,
+    //    with an empty parent so that its printed path is the argument verbatim).
+    //    Its type is not known from a directory entry, so this costs one fstatat.
+    path_pop(path, 0);
+    if (results != NULL) {
+        results->dir_node = PATH_NODE_NONE;
+        results->last_node = PATH_NODE_NONE;
+    }
+    start_type = process_entry(AT_FDCWD, root->path, DT_UNKNOWN, 0, path, config, results, out,
+                               summary != NULL ? &start_sum : NULL);
+    if (start_type == -1) {
+        root->failed = 1; // process_entry already printed an error
+        return;
+    }
+
+    // 2. If the starting path is a directory (and not a symlink to one, unless
+    //    -L is given), walk its contents. Anything else was handled above; in a
+    //    summary it stands for itself, like du.
+    start_fd = start_type == DT_DIR && config->max_depth > 0 ? root_open(root) : -1;
+    if (start_fd == -1) {
+        if (summary != NULL) {
+            summary_add(summary, root->path, &start_sum);
+        }
+        return;
+    }
+    path_push(path, root->path);
+    if (results != NULL) {
+        results->dir_node = directory_node(results, root->path);
+    }
+    walk_directory_contents(start_fd, path, entries, config, results, out, max_open_dirs, summary,
+                            &start_sum);
+    path_pop(path, 0);
+}
+
+/*
+ * root_list_add: Appends a starting path to the list, growing it if necessary.
+ *
+ * Parameters:
+ *   list - Pointer to the root_list_t structure.
+ *   path - The starting path (not copied; it must outlive the list).
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void root_list_add(root_list_t *list, const char *path) {
+    if (list->count == list->capacity) {
+        size_t new_capacity = list->capacity == 0 ? INITIAL_ROOT_CAPACITY : list->capacity * 2;
+        const char **new_paths = (const char **)realloc((void *)list->paths, new_capacity * sizeof(char *));
+        if (new_paths == NULL) {
+            perror("Error reallocating starting paths");
+            abort();
+        }
+        list->paths = new_paths;
+        list->capacity = new_capacity;
+    }
+    list->paths[list->count++] = path;
+}
+
+/*
+ * root_list_read: Appends the starting paths listed in a file (--roots-from).
+ *                 The whole file is read into one buffer, which the list
+ *                 keeps, and split in place; empty entries are skipped.
+ *
+ * Parameters:
+ *   list          - Pointer to the root_list_t structure.
+ *   file          - Path of the file, or "-" for stdin.
+ *   nul_separated - Flag: paths end with NUL bytes (-0) instead of newlines.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if the file cannot be read. Prints an error message to stderr.
+ *   Aborts on memory allocation failure.
+ */
+static int root_list_read(root_list_t *list, const char *file, int nul_separated) {
+    FILE *in = strcmp(file, "-") == 0 ? stdin : fopen(file, "rb");
+    size_t capacity = RUN_BUFFER_SIZE;
+    size_t len = 0;
+    char separator = nul_separated ? '\0' : '\n';
+    char *data;
+
+    if (in == NULL) {
+        fprintf(stderr, "Error opening '%s': %s\n", file, strerror(errno));
+        return -1;
+    }
+    data = (char *)malloc(capacity + 1);
+    if (data == NULL) {
+        perror("Error allocating starting paths");
+        abort();
+    }
+    for (;;) {
+        if (len == capacity) {
+            capacity *= 2;
+            char *new_data = (char *)realloc(data, capacity + 1);
+            if (new_data == NULL) {
+                perror("Error reallocating starting paths");
+                abort();
+            }
+            data = new_data;
+        }
+        size_t got = fread(data + len, 1, capacity - len, in);
+        if (got == 0) {
+            break;
+        }
+        len += got;
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "Error reading '%s': %s\n", file, strerror(errno));
+        if (in != stdin) {
+            fclose(in);
+        }
+        free(data);
+        return -1;
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    data[len] = '\0';
+    size_t start = 0;
+    for (size_t i = 0; i <= len; ++i) {
+        if (i == len || data[i] == separator) {
+            data[i] = '\0';
+            if (i > start) {
+                root_list_add(list, data + start);
+            }
+            start = i + 1;
+        }
+    }
+    free(list->data);
+    list->data = data;
+    return 0;
+}
+
+/*
+ * root_list_free: Frees a list of starting paths.
+ *
+ * Parameters:
+ *   list - Pointer to the root_list_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void root_list_free(root_list_t *list) {
+    free((void *)list->paths);
+    free(list->data);
+    list->paths = NULL;
+    list->data = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+/*
+ * root_order_init: Creates one empty stream per starting path; the first
+ *                  one writes straight to stdout.
+ *
+ * Parameters:
+ *   order   - Pointer to the root_order_t structure.
+ *   count   - Number of starting paths.
+ *   tmp_dir - Directory for the spill files.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void root_order_init(root_order_t *order, size_t count, const char *tmp_dir) {
+    order->streams = (root_stream_t *)calloc(count, sizeof(root_stream_t));
+    if (order->streams == NULL) {
+        perror("Error allocating output streams");
+        abort();
+    }
+    for (size_t i = 0; i < count; ++i) {
+        order->streams[i].order = order;
+        order->streams[i].index = i;
+        atomic_init(&order->streams[i].pending, 0);
+    }
+    pthread_mutex_init(&order->lock, NULL);
+    order->count = count;
+    order->head = 0;
+    order->tmp_dir = tmp_dir;
+}
+
+/*
+ * root_order_destroy: Frees the streams once all of them are finished and written.
+ *
+ * Parameters:
+ *   order - Pointer to the root_order_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void root_order_destroy(root_order_t *order) {
+    pthread_mutex_destroy(&order->lock);
+    free(order->streams);
+    order->streams = NULL;
+    order->count = 0;
+}
+/*
+ * root_stream_drain: Writes the output a stream held back to stdout, the
+ *                    spill file first, and frees it. The caller holds the
+ *                    order lock, and the stream has just become the first
+ *                    unfinished one.
+ *
+ * Parameters:
+ *   stream - Pointer to the root_stream_t structure.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if reading or writing fails.
+ */
+static void root_stream_drain(root_stream_t *stream) {
+    struct iovec iov;
+
+    pthread_mutex_lock(&output_lock);
+    if (stream->spill != NULL) {
+        char *buffer = (char *)malloc(RUN_BUFFER_SIZE);
+        size_t got;
+        if (buffer == NULL) {
+            perror("Error allocating held output buffer");
+            abort();
+        }
+        if (fflush(stream->spill) != 0 || fseek(stream->spill, 0, SEEK_SET) != 0) {
+            perror("Error writing held output");
+            exit(EXIT_FAILURE);
+        }
+        while ((got = fread(buffer, 1, RUN_BUFFER_SIZE, stream->spill)) > 0) {
+            iov.iov_base = buffer;
+            iov.iov_len = got;
+            out_write_all(&iov, 1);
+        }
+        if (ferror(stream->spill)) {
+            perror("Error reading held output");
+            exit(EXIT_FAILURE);
+        }
+        fclose(stream->spill);
+        stream->spill = NULL;
+        free(buffer);
+    }
+    if (stream->held_len > 0) {
+        iov.iov_base = stream->held;
+        iov.iov_len = stream->held_len;
+        out_write_all(&iov, 1);
+    }
+    pthread_mutex_unlock(&output_lock);
+    free(stream->held);
+    stream->held = NULL;
+    stream->held_len = 0;
+    stream->held_capacity = 0;
+}
+
+/*
+ * root_stream_finish: Marks a stream as complete. If it was the first
+ *                     unfinished one, the next streams in order write out
+ *                     what they held back, passing over those that are
+ *                     complete too. Thread-safe.
+ *
+ * Parameters:
+ *   stream - Pointer to the root_stream_t structure.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing fails.
+ */
+static void root_stream_finish(root_stream_t *stream) {
+    root_order_t *order = stream->order;
+
+    pthread_mutex_lock(&order->lock);
+    stream->finished = 1;
+    while (order->head < order->count && order->streams[order->head].finished) {
+        order->head++;
+        if (order->head < order->count) {
+            root_stream_drain(&order->streams[order->head]);
+        }
+    }
+    pthread_mutex_unlock(&order->lock);
+}
+
+/*
+ * checkpoint_fingerprint: Hashes what a resumed run must share with the
+ *                         interrupted one: the starting paths and the options
+ *                         that decide which entries are listed and how,
+ *                         the filters by their arguments as given.
+ *
+ * Parameters:
+ *   cli   - Pointer to the parsed options.
+ *   roots - Pointer to the list of starting paths.
+ *
+ * Returns:
+ *   The fingerprint stored in the checkpoint header.
+ */
+static uint64_t checkpoint_fingerprint(const cli_options_t *cli, const root_list_t *roots) {
+    uint64_t options[] = {
+        (uint64_t)cli->show_l, (uint64_t)cli->show_d, (uint64_t)cli->show_f, (uint64_t)cli->sort_output,
+        (uint64_t)cli->follow_links, (uint64_t)cli->output_format, cli->max_depth, cli->min_depth,
+        (uint64_t)cli->xdev, cli->shard_index, cli->shard_count, cli->shard_depth, roots->count
+    };
+    uint64_t hash = hash_bytes(FNV_OFFSET_BASIS, options, sizeof(options));
+
+    hash = hash_bytes(hash, &cli->filter_hash, sizeof(cli->filter_hash));
+    for (size_t i = 0; i < roots->count; ++i) {
+        hash = hash_bytes(hash, roots->paths[i], strlen(roots->paths[i]) + 1);
+    }
+    return hash;
+}
+
+/*
+ * checkpoint_open: Opens a --checkpoint file. A missing or empty file starts
+ *                  a new walk; otherwise the walk it records is resumed: the
+ *                  file is cut back to its last complete batch, and so is
+ *                  stdout, which must then be the output of the interrupted
+ *                  run (appended to with >>).
+ *
+ * Parameters:
+ *   checkpoint  - Pointer to the checkpoint_t structure to initialize.
+ *   path        - Path of the checkpoint file.
+ *   sort_output - Flag: the walk is sorted, so entries are committed as runs.
+ *   flush_size  - Output a worker gathers before committing it.
+ *   fingerprint - Fingerprint of the starting paths and options.
+ *   root_count  - Number of starting paths.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if the file cannot be used (an error message is printed).
+ */
+static int checkpoint_open(checkpoint_t *checkpoint, const char *path, int sort_output, size_t flush_size,
+                           uint64_t fingerprint, size_t root_count) {
+    checkpoint_header_t header;
+    struct stat st;
+    size_t valid_len = sizeof(header);
+    int resumed = 0;
+
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    checkpoint->path = path;
+    checkpoint->sort_output = sort_output;
+    checkpoint->flush_size = flush_size;
+    atomic_init(&checkpoint->next_run, 0);
+    path_init(&checkpoint->pending_paths);
+    checkpoint->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (checkpoint->fd == -1 || fstat(checkpoint->fd, &st) == -1) {
+        fprintf(stderr, "Error opening checkpoint '%s': %s\n", path, strerror(errno));
+        checkpoint_close(checkpoint, 0);
+        return -1;
+    }
+
+    // A file too short for its header was cut off while being created.
+    if ((uint64_t)st.st_size >= sizeof(header)) {
+        int status = -1;
+        void *map = (uint64_t)st.st_size <= SIZE_MAX
+            ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, checkpoint->fd, 0) : MAP_FAILED;
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Error reading checkpoint '%s': %s\n", path, strerror(errno));
+        } else {
+            memcpy(&header, map, sizeof(header));
+            if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+                fprintf(stderr, "Error: '%s' is not a dirwalk checkpoint.\n", path);
+            } else if (header.fingerprint != fingerprint) {
+                fprintf(stderr, "Error: Checkpoint '%s' was written for other starting paths or options.\n",
+                        path);
+            } else {
+                checkpoint->out_offset = header.out_start;
+                status = checkpoint_load(checkpoint, (const char *)map, (size_t)st.st_size, root_count,
+                                         &valid_len);
+            }
+            // The table of committed directories points into the mapping,
+            // which stays for the whole walk. The file is only cut back
+            // beyond the batches it covers.
+            checkpoint->map = (const char *)map;
+            checkpoint->map_size = (size_t)st.st_size;
+        }
+        if (status == -1 || checkpoint_resume_output(checkpoint) == -1) {
+            checkpoint_close(checkpoint, 0);
+            return -1;
+        }
+        resumed = 1;
+    }
+
+    if (ftruncate(checkpoint->fd, resumed ? (off_t)valid_len : 0) == -1) {
+        fprintf(stderr, "Error truncating checkpoint '%s': %s\n", path, strerror(errno));
+        checkpoint_close(checkpoint, 0);
+        return -1;
+    }
+    if (!resumed) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+        header.fingerprint = fingerprint;
+        header.out_start = checkpoint_output_size();
+        checkpoint->out_offset = header.out_start;
+        checkpoint_write(checkpoint, &header, sizeof(header));
+    }
+    return 0;
+}
+
+/*
+ * checkpoint_load: Reads back the batches of a checkpoint file: the
+ *                  directories they committed, the subdirectories those
+ *                  queued that are not among them (which become the pending
+ *                  directories), the output offset of the last batch and,
+ *                  with -s, the runs holding the committed entries. The
+ *                  table of committed directories is kept for the walk. Reading
+ *                  stops at the first batch that is incomplete or damaged,
+ *                  which is what an interrupted commit leaves behind.
+ *
+ * Parameters:
+ *   checkpoint - Pointer to the checkpoint_t structure receiving the state.
+ *   map        - The mapped file, starting with a valid header; it must stay
+ *                mapped as long as the checkpoint is open.
+ *   size       - Size of the file.
+ *   root_count - Number of starting paths.
+ *   valid_len  - Receives the length of the file up to the end of the last
+ *                complete batch.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if a run file cannot be opened (an error message is printed).
+ *   Aborts on memory allocation failure.
+ */
+static int checkpoint_load(checkpoint_t *checkpoint, const char *map, size_t size, size_t root_count,
+                           size_t *valid_len) {
+    const char *first = map + sizeof(checkpoint_header_t);
+    const char *end = first;
+    const char *pos;
+    checkpoint_batch_t batch;
+    checkpoint_dir_t dir;
+    const char *record;
+    const char *records_end;
+    const char *path;
+    checkpoint_slot_t *slots;
+    size_t slot_count = INITIAL_CHECKPOINT_CAPACITY;
+    size_t dir_count = 0;
+    size_t run_count = 0;
+    path_buf_t child;
+
+    // 1. Find the complete batches, counting their directories and runs.
+    while ((size_t)(map + size - end) >= sizeof(batch)) {
+        uint64_t checksum;
+        int valid = 1;
+
+        memcpy(&batch, end, sizeof(batch));
+        if (batch.magic != CHECKPOINT_BATCH_MAGIC || batch.size > (size_t)(map + size - end) - sizeof(batch)) {
+            break;
+        }
+        record = end + sizeof(batch);
+        records_end = record + batch.size;
+        checksum = batch.checksum;
+        batch.checksum = 0;
+        if (hash_bytes(hash_bytes(FNV_OFFSET_BASIS, record, (size_t)batch.size), &batch, sizeof(batch)) != checksum) {
+            break;
+        }
+        size_t batch_dirs = 0;
+        while (record < records_end) {
+            if (checkpoint_next_dir(&record, records_end, root_count, &dir, &path) == -1) {
+                valid = 0;
+                break;
+            }
+            batch_dirs++;
+        }
+        if (!valid) {
+            break;
+        }
+        dir_count += batch_dirs;
+        run_count += batch.run != CHECKPOINT_NO_RUN;
+        checkpoint->out_offset = batch.out_offset;
+        end = records_end;
+    }
+    *valid_len = (size_t)(end - map);
+
+    checkpoint->root_done = (unsigned char *)calloc(root_count, 1);
+    checkpoint->runs = (sort_run_t *)malloc((run_count > 0 ? run_count : 1) * sizeof(sort_run_t));
+    while (slot_count < 2 * dir_count) {
+        slot_count *= 2;
+    }
+    slots = (checkpoint_slot_t *)calloc(slot_count, sizeof(checkpoint_slot_t));
+    if (checkpoint->root_done == NULL || checkpoint->runs == NULL || slots == NULL) {
+        perror("Error allocating checkpoint state");
+        abort();
+    }
+    checkpoint->done = slots;
+    checkpoint->done_slots = slot_count;
+
+    // 2. Enter every committed directory into the table of those done, and
+    //    open the runs.
+    for (pos = first; pos < end; pos += sizeof(batch) + batch.size) {
+        memcpy(&batch, pos, sizeof(batch));
+        records_end = pos + sizeof(batch) + batch.size;
+        for (record = pos + sizeof(batch); record < records_end;) {
+            checkpoint_next_dir(&record, records_end, root_count, &dir, &path);
+            checkpoint_done(slots, slot_count, dir.root, path, 1);
+            if (dir.depth == 0) {
+                checkpoint->root_done[dir.root] = 1;
+            }
+        }
+        if (batch.run != CHECKPOINT_NO_RUN) {
+            char *name = checkpoint_run_name(checkpoint, (size_t)batch.run);
+            FILE *file = fopen(name, "rb");
+            if (file == NULL) {
+                fprintf(stderr, "Error opening checkpoint run '%s': %s\n", name, strerror(errno));
+                free(name);
+                return -1;
+            }
+            free(name);
+            setvbuf(file, NULL, _IOFBF, RUN_BUFFER_SIZE);
+            checkpoint->runs[checkpoint->run_count++] = (sort_run_t){file, (size_t)batch.run_count, 0};
+            if (batch.run >= atomic_load(&checkpoint->next_run)) {
+                atomic_store(&checkpoint->next_run, (size_t)batch.run + 1);
+            }
+        }
+    }
+
+    // 3. Every queued subdirectory not done yet is pending. Its path is
+    //    built as the walk built it, from the path of its parent.
+    path_init(&child);
+    for (pos = first; pos < end; pos += sizeof(batch) + batch.size) {
+        memcpy(&batch, pos, sizeof(batch));
+        records_end = pos + sizeof(batch) + batch.size;
+        for (record = pos + sizeof(batch); record < records_end;) {
+            const char *name;
+            checkpoint_next_dir(&record, records_end, root_count, &dir, &path);
+            name = path + strlen(path) + 1;
+            for (uint32_t i = 0; i < dir.child_count; ++i, name += strlen(name) + 1) {
+                path_pop(&child, 0);
+                path_push(&child, path);
+                path_push(&child, name);
+                if (checkpoint_done(slots, slot_count, dir.root, child.data, 0)) {
+                    continue;
+                }
+                if (checkpoint->pending_count % INITIAL_CHECKPOINT_CAPACITY == 0) {
+                    checkpoint_task_t *new_pending = (checkpoint_task_t *)realloc(
+                        checkpoint->pending,
+                        (checkpoint->pending_count + INITIAL_CHECKPOINT_CAPACITY) * sizeof(checkpoint_task_t));
+                    if (new_pending == NULL) {
+                        perror("Error reallocating pending directories");
+                        abort();
+                    }
+                    checkpoint->pending = new_pending;
+                }
+                checkpoint->pending[checkpoint->pending_count++] =
+                    (checkpoint_task_t){dir.root, (size_t)dir.depth + 1, checkpoint->pending_paths.len,
+                                        child.len - strlen(name)};
+                path_reserve(&checkpoint->pending_paths, checkpoint->pending_paths.len + child.len + 1);
+                memcpy(checkpoint->pending_paths.data + checkpoint->pending_paths.len, child.data, child.len + 1);
+                checkpoint->pending_paths.len += child.len + 1;
+            }
+        }
+    }
+    path_free(&child);
+    return 0;
+}
+
+/*
+ * checkpoint_next_dir: Reads one directory record of a checkpoint batch,
+ *                      checking that it lies within the batch.
+ *
+ * Parameters:
+ *   pos        - Position of the record; advanced past it.
+ *   end        - End of the records of the batch.
+ *   root_count - Number of starting paths.
+ *   dir        - Receives the head of the record.
+ *   path       - Receives the path of the directory, which the names of its
+ *                subdirectories follow.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if the record is malformed.
+ */
+static int checkpoint_next_dir(const char **pos, const char *end, size_t root_count, checkpoint_dir_t *dir,
+                               const char **path) {
+    const char *next = *pos + sizeof(*dir);
+
+    if ((size_t)(end - *pos) < sizeof(*dir)) {
+        return -1;
+    }
+    memcpy(dir, *pos, sizeof(*dir));
+    if (dir->root >= root_count || dir->depth == UINT32_MAX) {
+        return -1;
+    }
+    *path = next;
+    for (uint64_t i = 0; i <= dir->child_count; ++i) {
+        const char *nul = next < end ? (const char *)memchr(next, '\0', (size_t)(end - next)) : NULL;
+        if (nul == NULL || nul == next) {
+            return -1;
+        }
+        next = nul + 1;
+    }
+    *pos = next;
+    return 0;
+}
+
+/*
+ * checkpoint_committed: Tells whether a resumed walk committed a directory
+ *                       before. Workers commit independently, so a
+ *                       subdirectory may have been committed while the
+ *                       batch of its parent was not; walking the parent
+ *                       again must not queue it again.
+ *
+ * Parameters:
+ *   checkpoint - Pointer to the checkpoint_t structure.
+ *   root       - Index of the starting path.
+ *   path       - Path of the directory.
+ *
+ * Returns:
+ *   1 if the directory was committed, 0 otherwise (and for a new walk).
+ */
+static int checkpoint_committed(const checkpoint_t *checkpoint, size_t root, const char *path) {
+    if (checkpoint->done == NULL) {
+        return 0;
+    }
+    return checkpoint_done(checkpoint->done, checkpoint->done_slots, (uint32_t)root, path, 0);
+}
+
+/*
+ * checkpoint_done: Looks up a directory in the table of those a checkpoint
+ *                  file commits, optionally entering it.
+ *
+ * Parameters:
+ *   slots      - The table.
+ *   slot_count - Number of slots, a power of two larger than the number of entries.
+ *   root       - Index of the starting path.
+ *   path       - Path of the directory. When entered, it must outlive the table.
+ *   insert     - Flag: enter the directory if it is missing.
+ *
+ * Returns:
+ *   1 if the directory was in the table, 0 otherwise.
+ */
+static int checkpoint_done(checkpoint_slot_t *slots, size_t slot_count, uint32_t root, const char *path,
+                           int insert) {
+    uint64_t hash = hash_bytes(hash_bytes(FNV_OFFSET_BASIS, &root, sizeof(root)), path, strlen(path));
+    size_t i = (size_t)hash & (slot_count - 1);
+
+    while (slots[i].path != NULL) {
+        if (slots[i].hash == hash && slots[i].root == root && strcmp(slots[i].path, path) == 0) {
+            return 1;
+        }
+        i = (i + 1) & (slot_count - 1);
+    }
+    if (insert) {
+        slots[i].hash = hash;
+        slots[i].path = path;
+        slots[i].root = root;
+    }
+    return 0;
+}
+
+/*
+ * checkpoint_output_size: Tells where the output of a new walk starts: the
+ *                         end of stdout when it is a regular file appended to,
+ *                         its position when it is one written in place.
+ *
+ * Returns:
+ *   The offset, or 0 if stdout is no regular file.
+ */
+static uint64_t checkpoint_output_size(void) {
+    struct stat st;
+    off_t offset;
+
+    if (fstat(STDOUT_FILENO, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    if (fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND) {
+        return (uint64_t)st.st_size;
+    }
+    offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    return offset > 0 ? (uint64_t)offset : 0;
+}
+
+/*
+ * checkpoint_resume_output: Cuts stdout back to the output committed by the
+ *                           last complete batch, so that nothing written
+ *                           after it appears twice.
+ *
+ * Parameters:
+ *   checkpoint - Pointer to the checkpoint_t structure, with out_offset read back.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if stdout is a regular file shorter than the committed output, or
+ *      cannot be truncated (an error message is printed).
+ */
+static int checkpoint_resume_output(checkpoint_t *checkpoint) {
+    struct stat st;
+
+    if (fstat(STDOUT_FILENO, &st) == -1 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Warning: Output is not a regular file, so what was written after the last commit "
+                        "to checkpoint '%s' may be repeated.\n", checkpoint->path);
+        return 0;
+    }
+    if ((uint64_t)st.st_size < checkpoint->out_offset) {
+        fprintf(stderr, "Error: Output holds %" PRIu64 " bytes, but checkpoint '%s' committed %" PRIu64
+                        "; append (>>) to the output of the interrupted run.\n",
+                (uint64_t)st.st_size, checkpoint->path, checkpoint->out_offset);
+        return -1;
+    }
+    if (ftruncate(STDOUT_FILENO, (off_t)checkpoint->out_offset) == -1 ||
+        (!(fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND) &&
+         lseek(STDOUT_FILENO, (off_t)checkpoint->out_offset, SEEK_SET) == -1)) {
+        fprintf(stderr, "Error truncating output to checkpoint '%s': %s\n", checkpoint->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * checkpoint_run_name: Builds the name of a run file of a checkpoint: the
+ *                      checkpoint's path followed by the run number.
+ *
+ * Parameters:
+ *   checkpoint - Pointer to the checkpoint_t structure.
+ *   run        - Number of the run.
+ *
+ * Returns:
+ *   The name, to be freed by the caller. Aborts on memory allocation failure.
+ */
+static char *checkpoint_run_name(const checkpoint_t *checkpoint, size_t run) {
+    size_t size = strlen(checkpoint->path) + 3 * sizeof(size_t) + 2;
+    char *name = (char *)malloc(size);
+
+    if (name == NULL) {
+        perror("Error allocating run file name");
+        abort();
+    }
+    snprintf(name, size, "%s.%zu", checkpoint->path, run);
+    return name;
+}
+
+/*
+ * checkpoint_run_create: Creates a run file of a checkpoint. Unlike the runs
+ *                        of --sort-mem it is named, so a resumed run finds it;
+ *                        a leftover of an interrupted commit is overwritten.
+ *
+ * Parameters:
+ *   checkpoint - Pointer to the checkpoint_t structure.
+ *   run        - Number of the run.
+ *
+ * Returns:
+ *   The open run file. Exits with failure if it cannot be created.
+ */
+static FILE *checkpoint_run_create(const checkpoint_t *checkpoint, size_t run) {
+    char *name = checkpoint_run_name(checkpoint, run);
+    int fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    FILE *file = fd != -1 ? fdopen(fd, "w+b") : NULL;
+
+    if (file == NULL) {
+        fprintf(stderr, "Error creating checkpoint run '%s': %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(name);
+    setvbuf(file, NULL, _IOFBF, RUN_BUFFER_SIZE);
+    return file;
+}
+
+/*
+ * checkpoint_write: Appends bytes to a checkpoint file, retrying after short
+ *                   writes and interruptions.
+ *
+ * Parameters:
+ *   checkpoint - Pointer to the checkpoint_t structure.
+ *   data       - The bytes.
+ *   len        - Number of bytes.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing fails.
+ */
+static void checkpoint_write(checkpoint_t *checkpoint, const void *data, size_t len) {
+    const char *bytes = (const char *)data;
+
+    while (len > 0) {
+        ssize_t written = write(checkpoint->fd, bytes, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error writing checkpoint '%s': %s\n", checkpoint->path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        bytes += written;
+        len -= (size_t)written;
+    }
+}
+
+/*
+ * checkpoint_begin: Starts the record of a directory a worker is walking in
+ *                   its pending batch. The entries the worker lists from now
+ *                   on are committed together with the record.
+ *
+ * Parameters:
+ *   worker - Pointer to the worker_t structure.
+ *   root   - Starting path the directory is below.
+ *   path   - Path of the directory.
+ *   depth  - Depth of the directory below the starting path.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void checkpoint_begin(worker_t *worker, const walk_root_t *root, const char *path, size_t depth) {
+    checkpoint_dir_t dir = {(uint32_t)root->index, (uint32_t)depth, 0};
+    path_buf_t *batch = &worker->batch;
+    size_t path_size = strlen(path) + 1;
+
+    // The batch header goes first, and is filled in on commit.
+    if (batch->len == 0) {
+        batch->len = sizeof(checkpoint_batch_t);
+    }
+    path_reserve(batch, batch->len + sizeof(dir) + path_size);
+    worker->record = batch->len;
+    memcpy(batch->data + batch->len, &dir, sizeof(dir));
+    memcpy(batch->data + batch->len + sizeof(dir), path, path_size);
+    batch->len += sizeof(dir) + path_size;
+}
+
+/*
+ * checkpoint_child: Adds a queued subdirectory to the record of the directory
+ *                   a worker is walking.
+ *
+ * Parameters:
+ *   worker - Pointer to the worker_t structure.
+ *   name   - Name of the subdirectory.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void checkpoint_child(worker_t *worker, const char *name) {
+    path_buf_t *batch = &worker->batch;
+    size_t name_size = strlen(name) + 1;
+    checkpoint_dir_t dir;
+
+    path_reserve(batch, batch->len + name_size);
+    memcpy(batch->data + batch->len, name, name_size);
+    batch->len += name_size;
+    memcpy(&dir, batch->data + worker->record, sizeof(dir));
+    dir.child_count++;
+    memcpy(batch->data + worker->record, &dir, sizeof(dir));
+}
+
+/*
+ * checkpoint_commit: Commits the directories a worker finished since its last
+ *                    commit: their output is written to stdout, or with -s
+ *                    their sorted entries to a new run file, and then the
+ *                    batch of their records to the checkpoint file. Output
+ *                    and batch are written under output_lock, so every batch
+ *                    records the size stdout has once its output is in.
+ *
+ * Parameters:
+ *   worker - Pointer to the worker_t structure.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing fails.
+ */
+static void checkpoint_commit(worker_t *worker) {
+    checkpoint_t *checkpoint = worker->pool->checkpoint;
+    path_buf_t *batch = &worker->batch;
+    checkpoint_batch_t header;
+    uint64_t hash;
+    struct iovec iov;
+
+    worker->committed_at = watch_now();
+    if (batch->len == 0) {
+        out_flush(&worker->out);
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CHECKPOINT_BATCH_MAGIC;
+    header.size = batch->len - sizeof(header);
+    header.run = CHECKPOINT_NO_RUN;
+    if (checkpoint->sort_output && worker->results.count > 0) {
+        size_t run = atomic_fetch_add(&checkpoint->next_run, 1);
+        header.run = run;
+        header.run_count = worker->results.count;
+        spill_results(&worker->results, checkpoint_run_create(checkpoint, run));
+    }
+    hash = hash_bytes(FNV_OFFSET_BASIS, batch->data + sizeof(header), (size_t)header.size);
+
+    pthread_mutex_lock(&output_lock);
+    if (worker->out.len > 0) {
+        iov.iov_base = worker->out.data;
+        iov.iov_len = worker->out.len;
+        out_write_all(&iov, 1);
+        checkpoint->out_offset += worker->out.len;
+        worker->out.len = 0;
+    }
+    header.out_offset = checkpoint->out_offset;
+    header.checksum = hash_bytes(hash, &header, sizeof(header));
+    memcpy(batch->data, &header, sizeof(header));
+    checkpoint_write(checkpoint, batch->data, batch->len);
+    pthread_mutex_unlock(&output_lock);
+    batch->len = 0;
+}
+
+/*
+ * checkpoint_close: Closes a checkpoint file and frees its state. Once the
+ *                   walk is complete, the file and its run files are removed.
+ *
+ * Parameters:
+ *   checkpoint - Pointer to the checkpoint_t structure.
+ *   complete   - Flag: the walk is complete and its output written.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void checkpoint_close(checkpoint_t *checkpoint, int complete) {
+    if (checkpoint->fd != -1) {
+        close(checkpoint->fd);
+    }
+    if (complete) {
+        size_t run_count = atomic_load(&checkpoint->next_run);
+        for (size_t i = 0; i < run_count; ++i) {
+            char *name = checkpoint_run_name(checkpoint, i);
+            unlink(name);
+            free(name);
+        }
+        if (unlink(checkpoint->path) == -1) {
+            fprintf(stderr, "Warning: Cannot remove checkpoint '%s': %s\n", checkpoint->path, strerror(errno));
+        }
+    }
+    for (size_t i = 0; i < checkpoint->run_count; ++i) {
+        fclose(checkpoint->runs[i].file);
+    }
+    free(checkpoint->runs);
+    free(checkpoint->root_done);
+    free(checkpoint->pending);
+    path_free(&checkpoint->pending_paths);
+    free(checkpoint->done);
+    if (checkpoint->map != NULL) {
+        munmap((void *)checkpoint->map, checkpoint->map_size);
+    }
+}
+
+/*
+ * stats_enable: Turns on --stats for the rest of the run, starting with the
+ *               calling thread. Threads started later attach themselves.
+ *
+ * Parameters:
+ *   None.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void stats_enable(void) {
+    stats_registry.enabled = 1;
+    stats_attach();
+    stats_registry.started = stats_clock();
+}
+/*
+ * stats_phase: Adds the time since started to a phase of the run. Only the
+ *              main thread times phases.
+ *
+ * Parameters:
+ *   phase   - STATS_PHASE_* phase.
+ *   started - Value of stats_clock when the phase began.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void stats_phase(int phase, uint64_t started) {
+    if (current_stats != NULL) {
+        stats_registry.phases[phase] += stats_clock() - started;
+    }
+}
+
+/*
+ * stats_visited: Adds the size of a -L visited set to the report. Must be
+ *                called by the main thread once the walk has finished.
+ *
+ * Parameters:
+ *   set - Pointer to the visited_set_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void stats_visited(const visited_set_t *set) {
+    if (current_stats != NULL) {
+        stats_registry.visited_entries += set->count;
+        stats_registry.visited_bytes += set->capacity * sizeof(visited_slot_t);
+    }
+}
+/*
+ * stats_bucket_high: Returns the largest latency a histogram bucket counts.
+ *
+ * Parameters:
+ *   bucket - Index into latency_hist_t.buckets.
+ *
+ * Returns:
+ *   The latency in nanoseconds.
+ */
+static uint64_t stats_bucket_high(size_t bucket) {
+    unsigned shift;
+
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    shift = (unsigned)(bucket / STATS_SUB_BUCKETS) - 1;
+    return ((uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << shift) + ((UINT64_C(1) << shift) - 1);
+}
+
+/*
+ * stats_percentile: Returns the latency below or at which a fraction of the
+ *                   calls of a histogram completed, rounded up to the end of
+ *                   its bucket (but not beyond the longest latency).
+ *
+ * Parameters:
+ *   hist     - Pointer to the histogram.
+ *   fraction - Fraction of the calls, between 0 and 1.
+ *
+ * Returns:
+ *   The latency in nanoseconds, or 0 for an empty histogram.
+ */
+static uint64_t stats_percentile(const latency_hist_t *hist, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)hist->count + 0.999999);
+    uint64_t seen = 0;
+
+    if (hist->count == 0) {
+        return 0;
+    }
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (size_t i = 0; i < STATS_BUCKET_COUNT; ++i) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t high = stats_bucket_high(i);
+            return high < hist->max ? high : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/*
+ * stats_json_string: Writes a string to stderr as a JSON string literal.
+ *
+ * Parameters:
+ *   text - The string.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void stats_json_string(const char *text) {
+    fputc('"', stderr);
+    for (const unsigned char *p = (const unsigned char *)text; *p != '\0'; ++p) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(stderr, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(stderr, "\\u%04x", *p);
+        } else {
+            fputc(*p, stderr);
+        }
+    }
+    fputc('"', stderr);
+}
+
+/*
+ * stats_report: Adds up the counters of all threads and prints them to
+ *               stderr, then frees them. Must run after the other threads
+ *               have finished.
+ *
+ * Parameters:
+ *   format - STATS_TEXT or STATS_JSON.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void stats_report(int format) {
+    static const char *const class_names[STATS_CLASS_COUNT] = {
+        "open", "read", "stat", "uring", "close", "write", "lock"
+    };
+    static const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+    static const char *const fraction_names[] = {"p50", "p90", "p99", "p999"};
+    size_t fraction_count = sizeof(fractions) / sizeof(fractions[0]);
+    thread_stats_t total;
+    uint64_t elapsed = stats_clock() - stats_registry.started;
+    uint64_t error_count = 0;
+    uint64_t saved;
+    size_t thread_count = 0;
+    int first;
+
+    memset(&total, 0, sizeof(total));
+    for (thread_stats_t *stats = stats_registry.threads; stats != NULL; ) {
+        thread_stats_t *next = stats->next;
+        total.dirs_opened += stats->dirs_opened;
+        total.entries += stats->entries;
+        total.typed_entries += stats->typed_entries;
+        total.ahead_stats += stats->ahead_stats;
+        total.bytes_written += stats->bytes_written;
+        for (size_t i = 0; i < STATS_ERRNO_LIMIT; ++i) {
+            total.errors[i] += stats->errors[i];
+        }
+        for (size_t c = 0; c < STATS_CLASS_COUNT; ++c) {
+            latency_hist_t *sum = &total.latency[c];
+            const latency_hist_t *hist = &stats->latency[c];
+            sum->count += hist->count;
+            sum->total += hist->total;
+            if (hist->max > sum->max) {
+                sum->max = hist->max;
+            }
+            for (size_t i = 0; i < STATS_BUCKET_COUNT; ++i) {
+                sum->buckets[i] += hist->buckets[i];
+            }
+        }
+        thread_count++;
+        free(stats);
+        stats = next;
+    }
+    stats_registry.threads = NULL;
+    current_stats = NULL;
+    for (size_t i = 0; i < STATS_ERRNO_LIMIT; ++i) {
+        error_count += total.errors[i];
+    }
+    // Types resolved ahead arrive at process_entry as if d_type had told.
+    saved = total.typed_entries > total.ahead_stats ? total.typed_entries - total.ahead_stats : 0;
+
+    if (format == STATS_JSON) {
+        fprintf(stderr, "{\"time_ns\":{\"total\":%" PRIu64 ",\"walk\":%" PRIu64 ",\"sort\":%" PRIu64
+                ",\"merge\":%" PRIu64 "},\"threads\":%zu,\"directories_opened\":%" PRIu64
+                ",\"entries\":%" PRIu64 ",\"stat_calls_saved\":%" PRIu64 ",\"bytes_written\":%" PRIu64
+                ",\"visited\":{\"directories\":%" PRIu64 ",\"bytes\":%" PRIu64 "},\"errors\":[",
+                elapsed, stats_registry.phases[STATS_PHASE_WALK], stats_registry.phases[STATS_PHASE_SORT],
+                stats_registry.phases[STATS_PHASE_MERGE], thread_count, total.dirs_opened, total.entries,
+                saved, total.bytes_written, stats_registry.visited_entries, stats_registry.visited_bytes);
+        first = 1;
+        for (size_t i = 0; i < STATS_ERRNO_LIMIT; ++i) {
+            if (total.errors[i] == 0) {
+                continue;
+            }
+            fprintf(stderr, "%s{\"errno\":%zu,\"message\":", first ? "" : ",", i);
+            stats_json_string(i == STATS_ERRNO_LIMIT - 1 ? "other" : strerror((int)i));
+            fprintf(stderr, ",\"count\":%" PRIu64 "}", total.errors[i]);
+            first = 0;
+        }
+        fprintf(stderr, "],\"latency\":{");
+        for (size_t c = 0; c < STATS_CLASS_COUNT; ++c) {
+            const latency_hist_t *hist = &total.latency[c];
+            fprintf(stderr, "%s\"%s\":{\"count\":%" PRIu64 ",\"total_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64,
+                    c == 0 ? "" : ",", class_names[c], hist->count, hist->total, hist->max);
+            for (size_t f = 0; f < fraction_count; ++f) {
+                fprintf(stderr, ",\"%s_ns\":%" PRIu64, fraction_names[f], stats_percentile(hist, fractions[f]));
+            }
+            // Non-empty buckets as [largest latency, calls], in increasing order
+            fprintf(stderr, ",\"buckets\":[");
+            first = 1;
+            for (size_t i = 0; i < STATS_BUCKET_COUNT; ++i) {
+                if (hist->buckets[i] != 0) {
+                    fprintf(stderr, "%s[%" PRIu64 ",%" PRIu64 "]", first ? "" : ",", stats_bucket_high(i),
+                            hist->buckets[i]);
+                    first = 0;
+                }
+            }
+            fprintf(stderr, "]}");
+        }
+        fprintf(stderr, "}}\n");
+        return;
+    }
+
+    fprintf(stderr, "Statistics:\n");
+    fprintf(stderr, "  time:        %.3f s total, %.3f s walk, %.3f s sort, %.3f s merge\n",
+            (double)elapsed / 1e9, (double)stats_registry.phases[STATS_PHASE_WALK] / 1e9,
+            (double)stats_registry.phases[STATS_PHASE_SORT] / 1e9,
+            (double)stats_registry.phases[STATS_PHASE_MERGE] / 1e9);
+    fprintf(stderr, "  threads:     %zu\n", thread_count);
+    fprintf(stderr, "  directories: %" PRIu64 " opened\n", total.dirs_opened);
+    fprintf(stderr, "  entries:     %" PRIu64 " seen, %" PRIu64 " stat calls saved by d_type\n",
+            total.entries, saved);
+    fprintf(stderr, "  output:      %" PRIu64 " bytes written\n", total.bytes_written);
+    if (stats_registry.visited_bytes != 0) {
+        fprintf(stderr, "  visited:     %" PRIu64 " directories, %" PRIu64 " bytes (-L)\n",
+                stats_registry.visited_entries, stats_registry.visited_bytes);
+    }
+    fprintf(stderr, "  errors:      %" PRIu64 "\n", error_count);
+    for (size_t i = 0; i < STATS_ERRNO_LIMIT; ++i) {
+        if (total.errors[i] != 0) {
+            fprintf(stderr, "    %10" PRIu64 "  %s\n", total.errors[i],
+                    i == STATS_ERRNO_LIMIT - 1 ? "other" : strerror((int)i));
+        }
+    }
+    fprintf(stderr, "  latency (us)      calls    total       mean        p50        p90        p99      p99.9"
+                    "        max\n");
+    for (size_t c = 0; c < STATS_CLASS_COUNT; ++c) {
+        const latency_hist_t *hist = &total.latency[c];
+        if (hist->count == 0) {
+            continue;
+        }
+        fprintf(stderr, "    %-6s %12" PRIu64 " %8.0f %10.1f", class_names[c], hist->count,
+                (double)hist->total / 1e3, (double)hist->total / 1e3 / (double)hist->count);
+        for (size_t f = 0; f < fraction_count; ++f) {
+            fprintf(stderr, " %10.1f", (double)stats_percentile(hist, fractions[f]) / 1e3);
+        }
+        fprintf(stderr, " %10.1f\n", (double)hist->max / 1e3);
+    }
+}
+
+/*
+ * error_setup: Sets up the reporting of walk errors for the program. Unless
+ *              stderr is a terminal, messages are written in blocks; a fatal
+ *              exit still writes those of its thread. The library keeps the
+ *              defaults: every message, written at once.
+ *
+ * Parameters:
+ *   limit - Errors printed in full (--max-errors), SIZE_MAX for all.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void error_setup(size_t limit) {
+    error_registry.limit = limit;
+    error_registry.buffered = !isatty(STDERR_FILENO);
+    atexit(error_flush);
+}
+/*
+ * compare_error_dirs: qsort comparator of error directories by path.
+ *
+ * Parameters:
+ *   a - Pointer to the first error_dir_t.
+ *   b - Pointer to the second error_dir_t.
+ *
+ * Returns:
+ *   <0, 0 or >0 as strcmp of the paths.
+ */
+static int compare_error_dirs(const void *a, const void *b) {
+    return strcmp(((const error_dir_t *)a)->path, ((const error_dir_t *)b)->path);
+}
+
+/*
+ * compare_error_counts: qsort comparator of error directories, most errors first.
+ *
+ * Parameters:
+ *   a - Pointer to the first error_dir_t.
+ *   b - Pointer to the second error_dir_t.
+ *
+ * Returns:
+ *   <0 if a has more errors than b, >0 if fewer, else as strcmp of the paths.
+ */
+static int compare_error_counts(const void *a, const void *b) {
+    const error_dir_t *x = (const error_dir_t *)a;
+    const error_dir_t *y = (const error_dir_t *)b;
+
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+/*
+ * error_report: Writes out the error messages still held by any thread (all
+ *               of them have finished) and, with --max-errors, a summary of
+ *               every error reported: the count by errno, and the
+ *               directories with the most of them. Frees the error logs.
+ *
+ * Parameters:
+ *   None.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void error_report(void) {
+    uint64_t by_errno[STATS_ERRNO_LIMIT] = {0};
+    uint64_t other_dirs = 0;
+    size_t reported = atomic_load(&error_registry.reported);
+    size_t dir_count = 0;
+    size_t merged = 0;
+    error_dir_t *dirs;
+    error_log_t *log;
+
+    for (log = error_registry.logs; log != NULL; log = log->next) {
+        current_errors = log;
+        error_flush();
+        dir_count += log->dir_count;
+    }
+    current_errors = NULL;
+
+    if (error_registry.limit != SIZE_MAX && reported > 0) {
+        // Directories counted by several threads are added up.
+        dirs = (error_dir_t *)malloc((dir_count > 0 ? dir_count : 1) * sizeof(error_dir_t));
+        if (dirs == NULL) {
+            perror("Error allocating error summary");
+            abort();
+        }
+        dir_count = 0;
+        for (log = error_registry.logs; log != NULL; log = log->next) {
+            for (size_t i = 0; i < STATS_ERRNO_LIMIT; ++i) {
+                by_errno[i] += log->by_errno[i];
+            }
+            other_dirs += log->other_dirs;
+            for (size_t i = 0; log->dirs != NULL && i < ERROR_DIR_SLOTS; ++i) {
+                if (log->dirs[i].path != NULL) {
+                    dirs[dir_count++] = log->dirs[i];
+                }
+            }
+        }
+        qsort(dirs, dir_count, sizeof(error_dir_t), compare_error_dirs);
+        for (size_t i = 0; i < dir_count; ++i) {
+            if (merged > 0 && strcmp(dirs[merged - 1].path, dirs[i].path) == 0) {
+                dirs[merged - 1].count += dirs[i].count;
+            } else {
+                dirs[merged++] = dirs[i];
+            }
+        }
+        qsort(dirs, merged, sizeof(error_dir_t), compare_error_counts);
+
+        fprintf(stderr, "Errors: %zu", reported);
+        if (reported > error_registry.limit) {
+            fprintf(stderr, " (%zu shown)", error_registry.limit);
+        }
+        fprintf(stderr, "\n");
+        for (size_t i = 1; i < STATS_ERRNO_LIMIT; ++i) {
+            if (by_errno[i] > 0) {
+                fprintf(stderr, "  %10" PRIu64 "  %s\n", by_errno[i],
+                        i < STATS_ERRNO_LIMIT - 1 ? strerror((int)i) : "Other errors");
+            }
+        }
+        fprintf(stderr, "Directories with the most errors:\n");
+        for (size_t i = 0; i < merged; ++i) {
+            if (i < ERROR_SUMMARY_DIRS) {
+                fprintf(stderr, "  %10" PRIu64 "  %s\n", dirs[i].count, dirs[i].path);
+            } else {
+                other_dirs += dirs[i].count;
+            }
+        }
+        if (other_dirs > 0) {
+            fprintf(stderr, "  %10" PRIu64 "  (elsewhere)\n", other_dirs);
+        }
+        free(dirs);
+    }
+
+    while (error_registry.logs != NULL) {
+        log = error_registry.logs;
+        error_registry.logs = log->next;
+        for (size_t i = 0; log->dirs != NULL && i < ERROR_DIR_SLOTS; ++i) {
+            free(log->dirs[i].path);
+        }
+        free(log->dirs);
+        free(log->pending);
+        free(log);
+    }
+}
+
+/*
+ * sum_add: Adds the totals of other into sum.
+ *
+ * Parameters:
+ *   sum   - Pointer to the totals to update.
+ *   other - Pointer to the totals to add.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void sum_add(dir_sum_t *sum, const dir_sum_t *other) {
+    sum->apparent += other->apparent;
+    sum->allocated += other->allocated;
+    sum->entries += other->entries;
+}
+
+/*
+ * summary_init: Initializes an empty summary. Its heap is allocated with the
+ *               first directory added.
+ *
+ * Parameters:
+ *   summary - Pointer to the summary_t structure.
+ *   limit   - Number of directories to keep (at least 1).
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void summary_init(summary_t *summary, size_t limit) {
+    summary->items = NULL;
+    summary->count = 0;
+    summary->limit = limit;
+}
+
+/*
+ * summary_free: Frees the directories kept by a summary.
+ *
+ * Parameters:
+ *   summary - Pointer to the summary_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void summary_free(summary_t *summary) {
+    for (size_t i = 0; i < summary->count; ++i) {
+        free(summary->items[i].path);
+    }
+    free(summary->items);
+    summary->items = NULL;
+    summary->count = 0;
+}
+
+/*
+ * summary_less: Orders kept directories from smallest to biggest: by allocated
+ *               size, then apparent size, then reverse path, which is the
+ *               reverse of the printed order.
+ *
+ * Parameters:
+ *   a, b - Pointers to the directories to compare.
+ *
+ * Returns:
+ *   1 if a comes before b (is smaller), 0 otherwise.
+ */
+static int summary_less(const summary_item_t *a, const summary_item_t *b) {
+    if (a->sum.allocated != b->sum.allocated) {
+        return a->sum.allocated < b->sum.allocated;
+    }
+    if (a->sum.apparent != b->sum.apparent) {
+        return a->sum.apparent < b->sum.apparent;
+    }
+    return strcmp(a->path, b->path) > 0;
+}
+
+/*
+ * summary_sift_down: Moves a directory down the heap of a summary until
+ *                    neither of its children is smaller.
+ *
+ * Parameters:
+ *   summary - Pointer to the summary_t structure.
+ *   i       - Index of the directory to move.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void summary_sift_down(summary_t *summary, size_t i) {
+    summary_item_t *items = summary->items;
+
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < summary->count && summary_less(&items[left], &items[smallest])) {
+            smallest = left;
+        }
+        if (right < summary->count && summary_less(&items[right], &items[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        summary_item_t tmp = items[i];
+        items[i] = items[smallest];
+        items[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+/*
+ * summary_add: Offers a finished directory to a summary, which keeps it if it
+ *              is among the limit biggest seen so far. The path is copied
+ *              only then.
+ *
+ * Parameters:
+ *   summary - Pointer to the summary_t structure.
+ *   path    - Path of the directory.
+ *   sum     - Totals of the directory with its whole subtree.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void summary_add(summary_t *summary, const char *path, const dir_sum_t *sum) {
+    summary_item_t item;
+
+    item.sum = *sum;
+    item.path = (char *)path;
+    if (summary->count == summary->limit) {
+        // Full: replace the smallest kept directory if this one is bigger.
+        if (!summary_less(&summary->items[0], &item)) {
+            return;
+        }
+        free(summary->items[0].path);
+        summary->items[0].sum = *sum;
+        summary->items[0].path = strdup(path);
+        if (summary->items[0].path == NULL) {
+            perror("Error duplicating path string");
+            abort();
+        }
+        summary_sift_down(summary, 0);
+        return;
+    }
+
+    if (summary->items == NULL) {
+        summary->items = (summary_item_t *)malloc(summary->limit * sizeof(summary_item_t));
+        if (summary->items == NULL) {
+            perror("Error allocating summary");
+            abort();
+        }
+    }
+    item.path = strdup(path);
+    if (item.path == NULL) {
+        perror("Error duplicating path string");
+        abort();
+    }
+    // Sift the new directory up from the bottom of the heap.
+    size_t i = summary->count++;
+    while (i > 0 && summary_less(&item, &summary->items[(i - 1) / 2])) {
+        summary->items[i] = summary->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    summary->items[i] = item;
+}
+
+/*
+ * compare_summary_items: Comparison function for qsort, putting the biggest
+ *                        directories first.
+ *
+ * Parameters:
+ *   a - Pointer to the first summary_item_t.
+ *   b - Pointer to the second summary_item_t.
+ *
+ * Returns:
+ *   A negative value if a is printed first, a positive one if b is, 0 if they are equal.
+ */
+static int compare_summary_items(const void *a, const void *b) {
+    const summary_item_t *item_a = (const summary_item_t *)a;
+    const summary_item_t *item_b = (const summary_item_t *)b;
+
+    return summary_less(item_a, item_b) - summary_less(item_b, item_a);
+}
+
+/*
+ * emit_summary: Merges the summaries of all walkers and prints the limit
+ *               biggest directories, one line (or record, of type DT_DIR)
+ *               each: allocated bytes, apparent bytes, number of entries and
+ *               path, separated by tabs.
+ *
+ * Parameters:
+ *   summaries     - Array of summaries.
+ *   summary_count - Number of summaries.
+ *   limit         - Number of directories to print.
+ *   out           - Output buffer.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void emit_summary(summary_t *summaries, size_t summary_count, size_t limit, out_buf_t *out) {
+    summary_item_t *items;
+    size_t count = 0;
+    path_buf_t line;
+
+    for (size_t i = 0; i < summary_count; ++i) {
+        count += summaries[i].count;
+    }
+    if (count == 0) {
+        return;
+    }
+    items = (summary_item_t *)malloc(count * sizeof(summary_item_t));
+    if (items == NULL) {
+        perror("Error allocating summary");
+        abort();
+    }
+    count = 0;
+    for (size_t i = 0; i < summary_count; ++i) {
+        if (summaries[i].count > 0) {
+            memcpy(items + count, summaries[i].items, summaries[i].count * sizeof(summary_item_t));
+            count += summaries[i].count;
+        }
+    }
+    qsort(items, count, sizeof(summary_item_t), compare_summary_items);
+
+    path_init(&line);
+    for (size_t i = 0; i < count && i < limit; ++i) {
+        // Three 20-digit numbers and their tabs, then the path.
+        path_reserve(&line, 3 * 21 + strlen(items[i].path) + 1);
+        int len = snprintf(line.data, line.capacity, "%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s",
+                           items[i].sum.allocated, items[i].sum.apparent, items[i].sum.entries,
+                           items[i].path);
+        out_entry(out, line.data, (size_t)len, DT_DIR);
+    }
+    path_free(&line);
+    free(items); // The paths stay owned by the summaries
+}
+
+/*
+ * sum_node_new: Creates the summary node of a directory queued by a parallel
+ *               walk, holding one reference for the directory's task and
+ *               taking one on the parent.
+ *
+ * Parameters:
+ *   parent - Node of the parent directory, or NULL for the starting directory.
+ *   path   - Path of the directory (copied).
+ *   own    - What the directory counts for itself.
+ *
+ * Returns:
+ *   The new node. Aborts on memory allocation failure.
+ */
+static sum_node_t *sum_node_new(sum_node_t *parent, const char *path, const dir_sum_t *own) {
+    sum_node_t *node = (sum_node_t *)malloc(sizeof(sum_node_t));
+
+    if (node == NULL) {
+        perror("Error allocating summary node");
+        abort();
+    }
+    node->path = strdup(path);
+    if (node->path == NULL) {
+        perror("Error duplicating path string");
+        abort();
+    }
+    node->parent = parent;
+    atomic_init(&node->apparent, own->apparent);
+    atomic_init(&node->allocated, own->allocated);
+    atomic_init(&node->entries, own->entries);
+    atomic_init(&node->refs, 1);
+    if (parent != NULL) {
+        atomic_fetch_add(&parent->refs, 1);
+    }
+    return node;
+}
+
+/*
+ * sum_node_add: Adds totals into a summary node. Thread-safe.
+ *
+ * Parameters:
+ *   node - Pointer to the sum_node_t structure.
+ *   sum  - Totals to add.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void sum_node_add(sum_node_t *node, const dir_sum_t *sum) {
+    if (sum->entries == 0) {
+        return; // Nothing was counted
+    }
+    atomic_fetch_add(&node->apparent, sum->apparent);
+    atomic_fetch_add(&node->allocated, sum->allocated);
+    atomic_fetch_add(&node->entries, sum->entries);
+}
+
+/*
+ * sum_node_release: Drops a reference to a summary node. The last one means
+ *                   the directory's subtree is finished: the directory is
+ *                   offered to the releasing worker's summary, its totals are
+ *                   added into the parent, and the reference it held on the
+ *                   parent is dropped in turn.
+ *
+ * Parameters:
+ *   node    - Pointer to the sum_node_t structure.
+ *   summary - Summary of the releasing worker.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void sum_node_release(sum_node_t *node, summary_t *summary) {
+    while (node != NULL && atomic_fetch_sub(&node->refs, 1) == 1) {
+        sum_node_t *parent = node->parent;
+        dir_sum_t sum;
+        sum.apparent = atomic_load(&node->apparent);
+        sum.allocated = atomic_load(&node->allocated);
+        sum.entries = atomic_load(&node->entries);
+        summary_add(summary, node->path, &sum);
+        if (parent != NULL) {
+            sum_node_add(parent, &sum);
+        }
+        free(node->path);
+        free(node);
+        node = parent;
+    }
+}
+
+/*
+ * watch_init: Prepares --watch for a starting directory: fanotify with a
+ *             file system mark when the kernel grants it (it needs
+ *             CAP_SYS_ADMIN, and CAP_DAC_READ_SEARCH to turn the reported
+ *             directory handles back into paths), inotify otherwise. fanotify
+ *             reports real paths, so it is not used with -L, whose paths go
+ *             through symbolic links. The directories themselves are added by
+ *             enter_directory as the walk enters them.
+ *
+ * Parameters:
+ *   watch        - Pointer to the watch_t structure to initialize.
+ *   start_dir    - The starting path, as given.
+ *   follow_links - Flag: -L was given.
+ *
+ * Returns:
+ *   0 on success, 1 if the starting path is not a directory (there is nothing
+ *   to watch and the structure is left uninitialized), or -1 after printing
+ *   an error message. Aborts on memory allocation failure.
+ */
+static int watch_init(watch_t *watch, const char *start_dir, int follow_links) {
+    int start_fd = open(start_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow_links ? 0 : O_NOFOLLOW));
+
+    if (start_fd == -1) {
+        if (errno == ENOTDIR || errno == ELOOP) {
+            return 1;
+        }
+        fprintf(stderr, "Error opening directory '%s': %s\n", start_dir, strerror(errno));
+        return -1;
+    }
+
+    memset(watch, 0, sizeof(*watch));
+    watch->fd = -1;
+    watch->root = start_dir;
+    watch->root_wd = -1;
+    watch->last_wd = -1;
+    watch->last_parent_wd = -1;
+    pthread_mutex_init(&watch->lock, NULL);
+    path_init(&watch->last_path);
+    path_init(&watch->parent_path);
+    path_init(&watch->scratch);
+    path_init(&watch->walk_path);
+    path_init(&watch->paths);
+    watch->deltas = (watch_delta_t *)malloc(WATCH_BATCH_MAX * sizeof(watch_delta_t));
+    watch->delta_slots = (uint32_t *)calloc(WATCH_BATCH_SLOTS, sizeof(uint32_t));
+    if (watch->deltas == NULL || watch->delta_slots == NULL) {
+        perror("Error allocating change batch");
+        abort();
+    }
+
+#if DIRWALK_USE_FANOTIFY
+    if (!follow_links && watch_fanotify_init(watch, start_dir, start_fd) == 0) {
+        close(start_fd);
+        return 0;
+    }
+#endif
+    close(start_fd);
+#if DIRWALK_USE_INOTIFY
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd != -1) {
+        watch->backend = WATCH_INOTIFY;
+        watch->node_capacity = INITIAL_WATCH_CAPACITY;
+        watch->nodes = (watch_node_t *)malloc(watch->node_capacity * sizeof(watch_node_t));
+        if (watch->nodes == NULL) {
+            perror("Error allocating watch table");
+            abort();
+        }
+        for (size_t i = 0; i < watch->node_capacity; ++i) {
+            watch->nodes[i].wd = -1;
+        }
+        return 0;
+    }
+    fprintf(stderr, "Error initializing inotify: %s\n", strerror(errno));
+#else
+    fprintf(stderr, "Error: Cannot watch '%s' without fanotify or inotify.\n", start_dir);
+#endif
+    watch_free(watch);
+    return -1;
+}
+
+/*
+ * watch_free: Closes the event source of --watch and releases its memory.
+ *
+ * Parameters:
+ *   watch - Pointer to the watch_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void watch_free(watch_t *watch) {
+    if (watch->fd != -1) {
+        close(watch->fd);
+        watch->fd = -1;
+    }
+    for (size_t i = 0; i < watch->mount_count; ++i) {
+        if (watch->mounts[i].fd != -1) {
+            close(watch->mounts[i].fd);
+        }
+    }
+    free(watch->mounts);
+    watch->mounts = NULL;
+    watch->mount_count = 0;
+    if (watch->cache != NULL) {
+        for (size_t i = 0; i < WATCH_CACHE_SLOTS; ++i) {
+            free(watch->cache[i].path);
+        }
+        free(watch->cache);
+        watch->cache = NULL;
+    }
+    free(watch->root_abs);
+    watch->root_abs = NULL;
+    if (watch->nodes != NULL) {
+        for (size_t i = 0; i < watch->node_capacity; ++i) {
+            if (watch->nodes[i].wd != -1) {
+                free(watch->nodes[i].name);
+            }
+        }
+        free(watch->nodes);
+        watch->nodes = NULL;
+    }
+    free(watch->chain);
+    watch->chain = NULL;
+    free(watch->deltas);
+    watch->deltas = NULL;
+    free(watch->delta_slots);
+    watch->delta_slots = NULL;
+    path_free(&watch->last_path);
+    path_free(&watch->parent_path);
+    path_free(&watch->scratch);
+    path_free(&watch->walk_path);
+    path_free(&watch->paths);
+    pthread_mutex_destroy(&watch->lock);
+}
+#if DIRWALK_USE_FANOTIFY
+/*
+ * watch_fanotify_init: Sets up fanotify for --watch and marks the file system
+ *                      of the starting directory. Fails without a message, so
+ *                      that inotify can be used instead.
+ *
+ * Parameters:
+ *   watch     - Pointer to the watch_t structure (batch already set up).
+ *   start_dir - The starting path, as given.
+ *   start_fd  - Open descriptor of the starting directory.
+ *
+ * Returns:
+ *   0 on success, -1 if fanotify cannot be used (nothing is left set up).
+ */
+static int watch_fanotify_init(watch_t *watch, const char *start_dir, int start_fd) {
+    watch_handle_t handle;
+    int mount_id;
+    struct stat st;
+    int probe_fd = -1;
+
+    watch->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK,
+                              O_RDONLY | O_CLOEXEC);
+    if (watch->fd == -1) {
+        return -1;
+    }
+    watch->backend = WATCH_FANOTIFY;
+
+    // open_by_handle_at is checked separately from fanotify_init, so try it once.
+    handle.handle_bytes = WATCH_HANDLE_MAX;
+    if (syscall(SYS_name_to_handle_at, AT_FDCWD, start_dir, &handle, &mount_id, 0) == 0) {
+        probe_fd = (int)syscall(SYS_open_by_handle_at, start_fd, &handle, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (probe_fd != -1) {
+        close(probe_fd);
+        watch->cache = (watch_cache_slot_t *)calloc(WATCH_CACHE_SLOTS, sizeof(watch_cache_slot_t));
+        if (watch->cache == NULL) {
+            perror("Error allocating directory handle cache");
+            abort();
+        }
+        if (watch_fd_path(start_fd, &watch->scratch) != -1) {
+            watch->root_abs = strdup(watch->scratch.data);
+            if (watch->root_abs == NULL) {
+                perror("Error allocating path");
+                abort();
+            }
+            watch->root_abs_len = watch->scratch.len;
+        }
+    }
+
+    if (watch->root_abs != NULL && fstat(start_fd, &st) == 0 && watch_add_mount(watch, start_fd, st.st_dev) == 0) {
+        watch->root_dev = st.st_dev;
+        watch->root_ino = st.st_ino;
+        return 0;
+    }
+
+    close(watch->fd);
+    watch->fd = -1;
+    for (size_t i = 0; i < watch->mount_count; ++i) {
+        if (watch->mounts[i].fd != -1) {
+            close(watch->mounts[i].fd);
+        }
+    }
+    free(watch->mounts);
+    watch->mounts = NULL;
+    watch->mount_count = 0;
+    watch->mount_capacity = 0;
+    free(watch->cache);
+    watch->cache = NULL;
+    free(watch->root_abs);
+    watch->root_abs = NULL;
+    return -1;
+}
+/*
+ * watch_fd_path: Finds the absolute path of an open directory through
+ *                /proc/self/fd.
+ *
+ * Parameters:
+ *   fd  - The open descriptor.
+ *   out - Path buffer receiving the NUL-terminated path.
+ *
+ * Returns:
+ *   The length of the path, or -1 (errno set) on failure. Aborts on memory
+ *   allocation failure.
+ */
+static ssize_t watch_fd_path(int fd, path_buf_t *out) {
+    char link[32];
+    ssize_t len;
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    for (;;) {
+        len = readlink(link, out->data, out->capacity);
+        if (len == -1) {
+            return -1;
+        }
+        if ((size_t)len < out->capacity) {
+            break;
+        }
+        path_reserve(out, out->capacity * 2);
+    }
+    out->data[len] = '\0';
+    out->len = (size_t)len;
+    return len;
+}
+
+/*
+ * watch_cache_clear: Forgets all resolved directory handles, after a
+ *                    directory was renamed and cached paths below it may be
+ *                    wrong.
+ *
+ * Parameters:
+ *   watch - Pointer to the watch_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void watch_cache_clear(watch_t *watch) {
+    for (size_t i = 0; i < WATCH_CACHE_SLOTS; ++i) {
+        free(watch->cache[i].path);
+        watch->cache[i].path = NULL;
+        watch->cache[i].key_len = 0;
+    }
+}
+
+/*
+ * watch_resolve: Turns the directory handle of a fanotify event into the
+ *                printed path of the directory. The result is kept in a
+ *                small direct-mapped cache, so a burst of events in one
+ *                directory costs one open_by_handle_at. Directories outside
+ *                the starting directory, below a --prune match or on another
+ *                device with --xdev map to no path.
+ *
+ * Parameters:
+ *   watch   - Pointer to the watch_t structure (running).
+ *   key     - File system ID followed by the file handle (handle_bytes,
+ *             handle_type, then the handle data).
+ *   key_len - Length of key, at most WATCH_KEY_MAX.
+ *
+ * Returns:
+ *   The cache slot, whose path is NULL if events in the directory are not
+ *   reported. Aborts on memory allocation failure.
+ */
+static const watch_cache_slot_t *watch_resolve(watch_t *watch, const unsigned char *key, size_t key_len) {
+    const walk_config_t *config = watch->config;
+    watch_cache_slot_t *slot = &watch->cache[index_hash((const char *)key, key_len) & (WATCH_CACHE_SLOTS - 1)];
+    watch_handle_t handle;
+    int mount_fd = -1;
+    struct stat st;
+    char *rel;
+    size_t depth = 0;
+    int fd;
+
+    if (slot->key_len == key_len && memcmp(slot->key, key, key_len) == 0) {
+        return slot;
+    }
+    free(slot->path);
+    slot->path = NULL;
+    memcpy(slot->key, key, key_len);
+    slot->key_len = key_len;
+
+    for (size_t i = 0; i < watch->mount_count; ++i) {
+        if (watch->mounts[i].fd != -1 && memcmp(watch->mounts[i].fsid, key, sizeof(watch->mounts[i].fsid)) == 0) {
+            mount_fd = watch->mounts[i].fd;
+            break;
+        }
+    }
+    if (mount_fd == -1) {
+        return slot;
+    }
+    memcpy(&handle, key + sizeof(watch->mounts[0].fsid), key_len - sizeof(watch->mounts[0].fsid));
+    fd = (int)syscall(SYS_open_by_handle_at, mount_fd, &handle, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return slot;
+    }
+    if (fstat(fd, &st) == -1 || (config->xdev && st.st_dev != config->root_dev) ||
+        watch_fd_path(fd, &watch->walk_path) == -1) {
+        close(fd);
+        return slot;
+    }
+    close(fd);
+
+    // Events are read after the fact, so the directory may be gone already;
+    // its last path then carries a " (deleted)" suffix.
+    if (st.st_nlink == 0) {
+        const char *suffix = " (deleted)";
+        size_t suffix_len = strlen(suffix);
+        if (watch->walk_path.len < suffix_len ||
+            strcmp(watch->walk_path.data + watch->walk_path.len - suffix_len, suffix) != 0) {
+            return slot;
+        }
+        path_pop(&watch->walk_path, watch->walk_path.len - suffix_len);
+    }
+
+    // The directory must be the starting directory or below it.
+    rel = watch->walk_path.data;
+    if (watch->root_abs_len > 1) {
+        if (strncmp(rel, watch->root_abs, watch->root_abs_len) != 0 ||
+            (rel[watch->root_abs_len] != '\0' && rel[watch->root_abs_len] != '/')) {
+            return slot;
+        }
+        rel += watch->root_abs_len;
+    }
+
+    path_pop(&watch->scratch, 0);
+    path_push(&watch->scratch, watch->root);
+    while (*rel != '\0') {
+        char *name;
+        while (*rel == '/') {
+            rel++;
+        }
+        if (*rel == '\0') {
+            break;
+        }
+        name = rel;
+        rel = strchr(rel, '/');
+        if (rel != NULL) {
+            *rel++ = '\0';
+        } else {
+            rel = name + strlen(name);
+        }
+        if (config->prune->count > 0 && name_filter_match(config->prune, name)) {
+            return slot;
+        }
+        path_push(&watch->scratch, name);
+        depth++;
+    }
+
+    slot->path = strdup(watch->scratch.data);
+    if (slot->path == NULL) {
+        perror("Error allocating path");
+        abort();
+    }
+    slot->depth = depth;
+    return slot;
+}
+
+/*
+ * watch_fanotify_event: Queues the changes of one fanotify event, described
+ *                       by the handle of the directory and the entry name.
+ *
+ * Parameters:
+ *   watch    - Pointer to the watch_t structure (running).
+ *   info     - The information records of the event.
+ *   info_len - Total length of the records.
+ *   mask     - Event mask.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void watch_fanotify_event(watch_t *watch, const char *info, size_t info_len, uint64_t mask) {
+    struct fanotify_event_info_header header;
+    const size_t fid_size = sizeof(struct fanotify_event_info_fid); // Header and file system ID
+    size_t pos = 0;
+    uint32_t handle_bytes;
+    unsigned char key[WATCH_KEY_MAX];
+    size_t key_len;
+    const char *name;
+    int is_dir = (mask & FAN_ONDIR) != 0;
+    int removed = (mask & (FAN_DELETE | FAN_MOVED_FROM)) != 0;
+    int added = (mask & (FAN_CREATE | FAN_MOVED_TO)) != 0;
+
+    for (;;) {
+        if (info_len - pos < sizeof(header)) {
+            return;
+        }
+        memcpy(&header, info + pos, sizeof(header));
+        if (header.len < sizeof(header) || header.len > info_len - pos) {
+            return;
+        }
+        if (header.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+            break;
+        }
+        pos += header.len;
+    }
+    info += pos;
+    if (header.len < fid_size + 2 * sizeof(uint32_t)) {
+        return;
+    }
+    memcpy(&handle_bytes, info + fid_size, sizeof(handle_bytes));
+    key_len = (fid_size - sizeof(header)) + 2 * sizeof(uint32_t) + handle_bytes;
+    if (handle_bytes > WATCH_HANDLE_MAX || sizeof(header) + key_len >= header.len) {
+        return;
+    }
+    memcpy(key, info + sizeof(header), key_len);
+    name = info + sizeof(header) + key_len;
+    if (memchr(name, '\0', header.len - sizeof(header) - key_len) == NULL || strcmp(name, ".") == 0) {
+        return;
+    }
+
+    const watch_cache_slot_t *slot = watch_resolve(watch, key, key_len);
+    if (slot->path != NULL) {
+        path_pop(&watch->scratch, 0);
+        path_push(&watch->scratch, slot->path);
+        // Events of one entry can be merged into one (a removal and a
+        // creation, in either order); whether the entry exists now tells which
+        // came last.
+        if (removed && added) {
+            struct stat st;
+            size_t dir_len = path_push(&watch->scratch, name);
+            int exists = fstatat(AT_FDCWD, watch->scratch.data, &st, AT_SYMLINK_NOFOLLOW) == 0;
+            path_pop(&watch->scratch, dir_len);
+            watch_queue(watch, name, slot->depth + 1, exists ? WATCH_REMOVED : WATCH_ADDED, is_dir);
+            watch_queue(watch, name, slot->depth + 1, exists ? WATCH_ADDED : WATCH_REMOVED, is_dir);
+        } else if (removed || added) {
+            watch_queue(watch, name, slot->depth + 1, added ? WATCH_ADDED : WATCH_REMOVED, is_dir);
+        }
+    }
+    // The descriptors kept for open_by_handle_at hold back the DELETE_SELF
+    // of the starting directory, so a directory removed outside the walk
+    // could be it, or one of its ancestors.
+    if (slot->path == NULL && is_dir && removed) {
+        struct stat st;
+        if (stat(watch->root_abs, &st) == -1 || st.st_dev != watch->root_dev || st.st_ino != watch->root_ino) {
+            fprintf(stderr, "Warning: Stopped watching '%s': it was removed or moved.\n", watch->root);
+            watch->stopped = 1;
+        }
+    }
+    if (is_dir && (mask & (FAN_MOVED_FROM | FAN_MOVED_TO))) {
+        watch_cache_clear(watch);
+    }
+}
+
+/*
+ * watch_read_fanotify: Queues the changes of a buffer of fanotify events.
+ *
+ * Parameters:
+ *   watch  - Pointer to the watch_t structure (running).
+ *   events - The events, as read from the fanotify descriptor.
+ *   len    - Number of bytes read.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void watch_read_fanotify(watch_t *watch, const char *events, size_t len) {
+    struct fanotify_event_metadata event;
+    size_t pos = 0;
+
+    while (len - pos >= sizeof(event) && !watch->stopped) {
+        memcpy(&event, events + pos, sizeof(event));
+        if (event.vers != FANOTIFY_METADATA_VERSION || event.event_len < event.metadata_len ||
+            event.metadata_len < sizeof(event) || event.event_len > len - pos) {
+            fprintf(stderr, "Error reading changes: unexpected fanotify event format\n");
+            watch->stopped = 1;
+            return;
+        }
+        if (event.mask & FAN_Q_OVERFLOW) {
+            fprintf(stderr, "Warning: Too many changes at once, some were not reported.\n");
+        } else {
+            watch_fanotify_event(watch, events + pos + event.metadata_len, event.event_len - event.metadata_len,
+                                 event.mask);
+        }
+        pos += event.event_len;
+    }
+}
+#endif
+#if DIRWALK_USE_INOTIFY
+/*
+ * watch_node_remove: Removes a watch descriptor from the inotify watch table,
+ *                    shifting later entries of its probe sequence back so
+ *                    that lookups need no tombstones.
+ *
+ * Parameters:
+ *   watch - Pointer to the watch_t structure.
+ *   wd    - The watch descriptor.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void watch_node_remove(watch_t *watch, int wd) {
+    watch_node_t *node = watch_node_find(watch, wd);
+    size_t mask = watch->node_capacity - 1;
+    size_t hole;
+
+    if (node == NULL) {
+        return;
+    }
+    // Invalidate the parent cache of watch_add_inotify.
+    if (wd == watch->last_wd) {
+        watch->last_wd = -1;
+    }
+    if (wd == watch->last_parent_wd) {
+        watch->last_parent_wd = -1;
+    }
+    free(node->name);
+    hole = (size_t)(node - watch->nodes);
+    for (size_t i = (hole + 1) & mask; watch->nodes[i].wd != -1; i = (i + 1) & mask) {
+        size_t home = watch_node_home(watch, watch->nodes[i].wd);
+        // Move the entry into the hole unless its home lies cyclically in (hole, i].
+        if ((i > hole && (home <= hole || home > i)) || (i < hole && home <= hole && home > i)) {
+            watch->nodes[hole] = watch->nodes[i];
+            hole = i;
+        }
+    }
+    watch->nodes[hole].wd = -1;
+    watch->nodes[hole].name = NULL;
+    watch->node_count--;
+}
+
+/*
+ * watch_node_path: Builds the printed path of a watched directory from the
+ *                  names of its ancestors.
+ *
+ * Parameters:
+ *   watch - Pointer to the watch_t structure.
+ *   node  - The watched directory.
+ *   out   - Path buffer receiving the path.
+ *
+ * Returns:
+ *   The depth of the directory below the starting path, or SIZE_MAX if it is
+ *   no longer connected to the starting directory. Aborts on memory
+ *   allocation failure.
+ */
+static size_t watch_node_path(watch_t *watch, const watch_node_t *node, path_buf_t *out) {
+    size_t depth = 0;
+
+    while (node->parent_wd != -1) {
+        if (depth == watch->chain_capacity) {
+            size_t new_capacity = watch->chain_capacity == 0 ? 64 : watch->chain_capacity * 2;
+            watch_node_t **new_chain = (watch_node_t **)realloc(watch->chain, new_capacity * sizeof(watch_node_t *));
+            if (new_chain == NULL) {
+                perror("Error reallocating watch chain");
+                abort();
+            }
+            watch->chain = new_chain;
+            watch->chain_capacity = new_capacity;
+        }
+        watch->chain[depth++] = (watch_node_t *)node;
+        node = watch_node_find(watch, node->parent_wd);
+        if (node == NULL || depth > watch->node_count) {
+            return SIZE_MAX;
+        }
+    }
+    if (node->wd != watch->root_wd) {
+        return SIZE_MAX;
+    }
+
+    path_pop(out, 0);
+    path_push(out, node->name);
+    for (size_t i = depth; i > 0; --i) {
+        path_push(out, watch->chain[i - 1]->name);
+    }
+    return depth;
+}
+
+/*
+ * watch_forget_subtree: Stops watching a directory and every watched
+ *                       directory below it, after it left the walk.
+ *
+ * Parameters:
+ *   watch - Pointer to the watch_t structure.
+ *   wd    - Watch of the directory.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void watch_forget_subtree(watch_t *watch, int wd) {
+    int *wds = (int *)malloc((watch->node_count + 1) * sizeof(int));
+    size_t count = 0;
+
+    if (wds == NULL) {
+        perror("Error allocating watch list");
+        abort();
+    }
+    for (size_t i = 0; i < watch->node_capacity; ++i) {
+        const watch_node_t *node = &watch->nodes[i];
+        size_t hops = 0;
+        if (node->wd == -1) {
+            continue;
+        }
+        while (node != NULL && node->wd != wd && node->parent_wd != -1 && hops++ < watch->node_count) {
+            node = watch_node_find(watch, node->parent_wd);
+        }
+        if (node != NULL && node->wd == wd) {
+            wds[count++] = watch->nodes[i].wd;
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        inotify_rm_watch(watch->fd, wds[i]);
+        watch_node_remove(watch, wds[i]);
+    }
+    free(wds);
+}
+/*
+ * watch_adopt: Moves a watched directory renamed within the walk under its
+ *              new parent, so that the IN_MOVE_SELF that follows does not drop
+ *              its subtree. A directory renamed below --maxdepth or to a
+ *              --prune match stops being watched; one moved in from outside
+ *              is left to the walk of the change.
+ *
+ * Parameters:
+ *   watch     - Pointer to the watch_t structure; scratch holds the path of
+ *               the new parent.
+ *   parent_wd - Watch of the new parent.
+ *   name      - New name of the directory.
+ *   depth     - New depth of the directory.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void watch_adopt(watch_t *watch, int parent_wd, const char *name, size_t depth) {
+    const walk_config_t *config = watch->config;
+    size_t dir_len = path_push(&watch->scratch, name);
+    int wd = inotify_add_watch(watch->fd, watch->scratch.data, WATCH_INOTIFY_MASK);
+    watch_node_t *node;
+
+    path_pop(&watch->scratch, dir_len);
+    if (wd == -1) {
+        return;
+    }
+    node = watch_node_find(watch, wd);
+    if (node == NULL) {
+        inotify_rm_watch(watch->fd, wd);
+        return;
+    }
+    if (node->parent_wd == -1) {
+        return; // The starting directory itself, which cannot move into its own tree
+    }
+    if (depth >= config->max_depth || (config->prune->count > 0 && name_filter_match(config->prune, name))) {
+        watch_forget_subtree(watch, wd);
+        return;
+    }
+    free(node->name);
+    node->name = strdup(name);
+    if (node->name == NULL) {
+        perror("Error allocating path");
+        abort();
+    }
+    node->parent_wd = parent_wd;
+    node->moved = 1;
+}
+
+/*
+ * watch_read_inotify: Queues the changes of a buffer of inotify events and
+ *                     keeps the watch table in step with renamed and removed
+ *                     directories.
+ *
+ * Parameters:
+ *   watch  - Pointer to the watch_t structure (running).
+ *   events - The events, as read from the inotify descriptor.
+ *   len    - Number of bytes read.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void watch_read_inotify(watch_t *watch, const char *events, size_t len) {
+    struct inotify_event event;
+    size_t pos = 0;
+
+    while (len - pos >= sizeof(event) && !watch->stopped) {
+        const char *name = events + pos + sizeof(event);
+        watch_node_t *node;
+        size_t depth;
+
+        memcpy(&event, events + pos, sizeof(event));
+        if (event.len > len - pos - sizeof(event)) {
+            return;
+        }
+        pos += sizeof(event) + event.len;
+
+        if (event.mask & IN_Q_OVERFLOW) {
+            fprintf(stderr, "Warning: Too many changes at once, some were not reported.\n");
+            continue;
+        }
+        node = watch_node_find(watch, event.wd);
+        if (node == NULL) {
+            continue;
+        }
+        if (event.mask & IN_IGNORED) {
+            if (event.wd == watch->root_wd && !watch->stopped) {
+                fprintf(stderr, "Warning: Stopped watching '%s': it was removed or moved.\n", watch->root);
+                watch->stopped = 1;
+            }
+            watch_node_remove(watch, event.wd);
+            continue;
+        }
+        if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            if (event.wd == watch->root_wd) {
+                fprintf(stderr, "Warning: Stopped watching '%s': it was removed or moved.\n", watch->root);
+                watch->stopped = 1;
+            } else if ((event.mask & IN_MOVE_SELF) && node->moved) {
+                node->moved = 0;
+            } else if (event.mask & IN_MOVE_SELF) {
+                watch_forget_subtree(watch, event.wd); // Moved out of the walk
+            }
+            continue;
+        }
+        if (event.len == 0 || name[0] == '\0') {
+            continue;
+        }
+
+        depth = watch_node_path(watch, node, &watch->scratch);
+        if (depth == SIZE_MAX) {
+            continue;
+        }
+        depth++;
+        if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+            watch_queue(watch, name, depth, WATCH_REMOVED, (event.mask & IN_ISDIR) != 0);
+        }
+        if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+            watch_queue(watch, name, depth, WATCH_ADDED, (event.mask & IN_ISDIR) != 0);
+            if ((event.mask & (IN_MOVED_TO | IN_ISDIR)) == (IN_MOVED_TO | IN_ISDIR)) {
+                watch_adopt(watch, event.wd, name, depth);
+            }
+        }
+    }
+}
+#endif
+#if DIRWALK_USE_WATCH
+/*
+ * watch_queue: Adds a change to the pending batch of --watch. A path changed
+ *              again in the same batch keeps one entry, with the first and
+ *              the last change, so a burst of events on it prints at most a
+ *              removal and an addition. A full batch is printed first.
+ *
+ * Parameters:
+ *   watch  - Pointer to the watch_t structure (running); scratch holds the
+ *            path of the directory the change happened in.
+ *   name   - Name of the entry in that directory.
+ *   depth  - Depth of the entry below the starting path.
+ *   change - WATCH_ADDED or WATCH_REMOVED.
+ *   is_dir - Flag: the entry is a directory.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void watch_queue(watch_t *watch, const char *name, size_t depth, char change, int is_dir) {
+    path_buf_t *path = &watch->scratch;
+    watch_delta_t *delta;
+    size_t parent_len;
+    size_t slot;
+
+    if (depth > watch->config->max_depth) {
+        return;
+    }
+    if (watch->delta_count == WATCH_BATCH_MAX) {
+        watch_flush(watch);
+    }
+
+    parent_len = path_push(path, name);
+    slot = index_hash(path->data, path->len) & (WATCH_BATCH_SLOTS - 1);
+    while (watch->delta_slots[slot] != 0) {
+        delta = &watch->deltas[watch->delta_slots[slot] - 1];
+        if (delta->path_len == path->len && memcmp(watch->paths.data + delta->path_offset, path->data, path->len) == 0) {
+            delta->last = change;
+            delta->is_dir = (char)is_dir;
+            path_pop(path, parent_len);
+            return;
+        }
+        slot = (slot + 1) & (WATCH_BATCH_SLOTS - 1);
+    }
+
+    if (watch->delta_count == 0) {
+        watch->batch_start = watch_now();
+    }
+    delta = &watch->deltas[watch->delta_count++];
+    watch->delta_slots[slot] = (uint32_t)watch->delta_count;
+    path_reserve(&watch->paths, watch->paths.len + path->len + 1);
+    memcpy(watch->paths.data + watch->paths.len, path->data, path->len + 1);
+    delta->path_offset = watch->paths.len;
+    delta->path_len = path->len;
+    delta->parent_len = parent_len;
+    delta->name_offset = path->len - strlen(name);
+    delta->depth = depth;
+    delta->first = change;
+    delta->last = change;
+    delta->is_dir = (char)is_dir;
+    delta->covered = 0;
+    watch->paths.len += path->len + 1;
+    path_pop(path, parent_len);
+}
+
+#endif
+/*
+ * watch_flush: Prints the pending batch of --watch. A path whose first change
+ *              was a removal is printed as removed if it matches the filters
+ *              that need no metadata (it is gone, so the metadata filters
+ *              cannot be applied), or if it is a directory that may have had
+ *              listed entries below it. A path whose last change was an
+ *              addition goes through process_entry like an entry of the walk,
+ *              and a new directory is walked, which lists its contents and
+ *              watches it; later changes below it are covered by that walk.
+ *
+ * Parameters:
+ *   watch - Pointer to the watch_t structure (running).
+ *
+ * Returns:
+ *   Nothing. Prints error messages like the walk. Aborts on memory
+ *   allocation failure.
+ */
+static void watch_flush(watch_t *watch) {
+    const walk_config_t *config = watch->config;
+    out_buf_t *out = watch->out;
+    int open_flags = directory_open_flags(config);
+    int parent_fd = -1;
+    const watch_delta_t *parent_delta = NULL; // Change whose parent directory parent_fd is
+
+    for (size_t i = 0; i < watch->delta_count; ++i) {
+        const watch_delta_t *delta = &watch->deltas[i];
+        const char *path = watch->paths.data + delta->path_offset;
+        const char *name = path + delta->name_offset;
+        struct stat st;
+
+        if (delta->covered) {
+            continue;
+        }
+
+        if (delta->first == WATCH_REMOVED) {
+            int listed = delta->depth >= config->min_depth && name_filter_match(config->names, name);
+            listed = listed && (config->type_mask &
+                                (delta->is_dir ? TYPE_BIT(DT_DIR) : TYPE_BIT(DT_REG) | TYPE_BIT(DT_LNK)));
+            // A removed directory takes the listed entries below it along,
+            // so it is reported even if it was not listed itself.
+            if (delta->is_dir) {
+                listed = (listed || delta->depth < config->max_depth) &&
+                         !(config->prune->count > 0 && name_filter_match(config->prune, name));
+            }
+            if (listed) {
+                out->prefix = WATCH_REMOVED;
+                out_entry(out, path, delta->path_len, delta->is_dir ? DT_DIR : DT_UNKNOWN);
+                out->prefix = WATCH_ADDED;
+            }
+        }
+        if (delta->last != WATCH_ADDED) {
+            continue;
+        }
+
+        // Consecutive changes in one directory share its descriptor.
+        path_reserve(&watch->walk_path, delta->parent_len + 1);
+        memcpy(watch->walk_path.data, path, delta->parent_len);
+        path_pop(&watch->walk_path, delta->parent_len);
+        if (parent_delta == NULL || parent_delta->parent_len != delta->parent_len ||
+            memcmp(watch->paths.data + parent_delta->path_offset, path, delta->parent_len) != 0) {
+            if (parent_fd != -1) {
+                close(parent_fd);
+            }
+            parent_fd = open(watch->walk_path.data, open_flags);
+            parent_delta = delta;
+        }
+        // An entry already gone again is skipped quietly.
+        if (parent_fd == -1 || fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+
+        int type = process_entry(parent_fd, name, (unsigned char)IFTODT(st.st_mode), delta->depth,
+                                 &watch->walk_path, config, NULL, out, NULL);
+        if (type != DT_DIR || delta->depth >= config->max_depth) {
+            continue;
+        }
+
+        for (size_t j = i + 1; j < watch->delta_count; ++j) {
+            watch_delta_t *below = &watch->deltas[j];
+            if (below->path_len > delta->path_len && watch->paths.data[below->path_offset + delta->path_len] == '/' &&
+                memcmp(watch->paths.data + below->path_offset, path, delta->path_len) == 0) {
+                below->covered = 1;
+            }
+        }
+
+        // The new directory is walked as if it were the starting path, with
+        // the depth limits shifted to match. With -L it gets its own visited
+        // set, since the directories it leads to may have been walked before
+        // under other paths.
+        walk_config_t sub_config = *config;
+        visited_set_t visited;
+        sub_config.max_depth = config->max_depth - delta->depth;
+        sub_config.min_depth = config->min_depth > delta->depth ? config->min_depth - delta->depth : 0;
+        path_push(&watch->walk_path, name);
+        int child_fd = openat(parent_fd, name, open_flags);
+        if (child_fd == -1) {
+            if (errno != ENOENT) {
+                walk_error(errno, "opening directory", watch->walk_path.data, watch->walk_path.len);
+            }
+            continue;
+        }
+        if (config->follow_links) {
+            visited_init(&visited);
+            sub_config.visited = &visited;
+        }
+        if (!enter_directory(&sub_config, child_fd, watch->walk_path.data)) {
+            close(child_fd);
+        } else {
+            walk_directory_contents(child_fd, &watch->walk_path, watch->entries, &sub_config, NULL, out,
+                                    watch->max_open_dirs, NULL, NULL);
+        }
+        if (config->follow_links) {
+            visited_free(&visited);
+        }
+    }
+    if (parent_fd != -1) {
+        close(parent_fd);
+    }
+
+    watch->delta_count = 0;
+    watch->paths.len = 0;
+    memset(watch->delta_slots, 0, WATCH_BATCH_SLOTS * sizeof(uint32_t));
+    out_flush(out);
+    error_flush();
+}
+
+/*
+ * watch_now: Reads the monotonic clock.
+ *
+ * Returns:
+ *   The current time in milliseconds.
+ */
+static int64_t watch_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * watch_run: Prints the changes below the starting directory as they come,
+ *            after the initial walk, until the starting directory is removed
+ *            or moved. Changes are collected until no event came for
+ *            WATCH_COALESCE_MS (at most WATCH_MAX_DELAY_MS after the first)
+ *            and then printed together, so a burst of events on the same
+ *            paths is printed once.
+ *
+ * Parameters:
+ *   watch         - Pointer to the watch_t structure.
+ *   config        - Walk configuration of the initial walk.
+ *   entries       - Directory entry buffer for the walks of new directories.
+ *   out           - Output buffer, with the WATCH_ADDED prefix.
+ *   max_open_dirs - --max-fds budget of those walks.
+ *
+ * Returns:
+ *   Nothing. Prints an error message if waiting for events fails. Aborts on
+ *   memory allocation failure.
+ */
+static void watch_run(watch_t *watch, const walk_config_t *config, dirent_buf_t *entries,
+                      out_buf_t *out, size_t max_open_dirs) {
+    walk_config_t delta_config = *config; // Changes are printed as they come, not sorted
+    struct pollfd poll_fd;
+    char *events;
+
+    delta_config.sort_output = 0;
+    delta_config.index = NULL;
+    delta_config.handle_entry = select_entry_handler(&delta_config, 0);
+    watch->config = &delta_config;
+    watch->entries = entries;
+    watch->out = out;
+    watch->max_open_dirs = max_open_dirs;
+    events = (char *)malloc(WATCH_EVENT_BUFFER_SIZE);
+    if (events == NULL) {
+        perror("Error allocating event buffer");
+        abort();
+    }
+    out_flush(out); // The initial listing is complete
+    error_flush();
+
+    poll_fd.fd = watch->fd;
+    poll_fd.events = POLLIN;
+    while (!watch->stopped) {
+        int timeout = -1;
+        if (watch->delta_count > 0) {
+            int64_t waited = watch_now() - watch->batch_start;
+            if (waited >= WATCH_MAX_DELAY_MS) {
+                watch_flush(watch);
+                continue;
+            }
+            timeout = WATCH_MAX_DELAY_MS - waited < WATCH_COALESCE_MS ? (int)(WATCH_MAX_DELAY_MS - waited)
+                                                                       : WATCH_COALESCE_MS;
+        }
+
+        int ready = poll(&poll_fd, 1, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error waiting for changes: %s\n", strerror(errno));
+            break;
+        }
+        if (ready == 0) {
+            watch_flush(watch);
+            continue;
+        }
+
+        ssize_t len = read(watch->fd, events, WATCH_EVENT_BUFFER_SIZE);
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error reading changes: %s\n", strerror(errno));
+            break;
+        }
+#if DIRWALK_USE_FANOTIFY
+        if (watch->backend == WATCH_FANOTIFY) {
+            watch_read_fanotify(watch, events, (size_t)len);
+        }
+#endif
+#if DIRWALK_USE_INOTIFY
+        if (watch->backend == WATCH_INOTIFY) {
+            watch_read_inotify(watch, events, (size_t)len);
+        }
+#endif
+    }
+
+    watch_flush(watch);
+    free(events);
+    watch->config = NULL;
+}
+/*
+ * listing_begin: Starts a --front-coded listing on stdout by writing its
+ *                header, which names the collation the entries are sorted by.
+ *
+ * Parameters:
+ *   listing  - Pointer to the listing_t structure.
+ *   compress - Flag: compress the blocks with zstd.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing to stdout fails.
+ */
+static void listing_begin(listing_t *listing, int compress) {
+    const char *collation = setlocale(LC_COLLATE, NULL);
+    listing_header_t header;
+    struct iovec iov[2];
+
+    if (collation == NULL) {
+        collation = "C";
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LISTING_MAGIC, sizeof(header.magic));
+    header.flags = compress ? LISTING_FLAG_ZSTD : 0;
+    header.collation_len = (uint32_t)strlen(collation);
+
+    listing->compress = compress;
+    path_init(&listing->block);
+    path_init(&listing->previous);
+    path_init(&listing->packed);
+    path_init(&listing->index);
+    listing->block_entries = 0;
+    listing->block_count = 0;
+    listing->entry_count = 0;
+    listing->offset = 0;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)collation;
+    iov[1].iov_len = header.collation_len;
+    listing_write(listing, iov, 2);
+}
+/*
+ * listing_finish: Completes a listing with its last block, the block index
+ *                 and the trailer pointing to the index, and frees its
+ *                 buffers.
+ *
+ * Parameters:
+ *   listing - Pointer to the listing_t structure.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing to stdout fails.
+ */
+static void listing_finish(listing_t *listing) {
+    listing_trailer_t trailer;
+    struct iovec iov[2];
+
+    listing_flush_block(listing);
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.index_offset = listing->offset;
+    trailer.block_count = listing->block_count;
+    trailer.entry_count = listing->entry_count;
+    memcpy(trailer.magic, LISTING_END_MAGIC, sizeof(trailer.magic));
+    iov[0].iov_base = listing->index.data;
+    iov[0].iov_len = listing->index.len;
+    iov[1].iov_base = &trailer;
+    iov[1].iov_len = sizeof(trailer);
+    listing_write(listing, iov, 2);
+
+    path_free(&listing->block);
+    path_free(&listing->previous);
+    path_free(&listing->packed);
+    path_free(&listing->index);
+}
+
+/*
+ * listing_pread: Reads bytes of a listing file at an offset.
+ *
+ * Parameters:
+ *   reader - Pointer to the listing_reader_t structure.
+ *   buf    - Receives the bytes.
+ *   len    - Number of bytes to read.
+ *   offset - Offset in the file.
+ *
+ * Returns:
+ *   0 on success, -1 (after printing an error) on failure or a short file.
+ */
+static int listing_pread(listing_reader_t *reader, void *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t got = pread(reader->fd, (char *)buf + done, len - done, (off_t)(offset + done));
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got == -1) {
+            fprintf(stderr, "Error reading listing '%s': %s\n", reader->path, strerror(errno));
+            return -1;
+        }
+        if (got == 0) {
+            fprintf(stderr, "Error: Listing '%s' is truncated.\n", reader->path);
+            return -1;
+        }
+        done += (size_t)got;
+    }
+    return 0;
+}
+
+/*
+ * listing_open: Opens a --front-coded listing for reading: checks its header
+ *               and trailer and loads its block index.
+ *
+ * Parameters:
+ *   reader - Pointer to the listing_reader_t structure to set up.
+ *   path   - Path of the listing file.
+ *
+ * Returns:
+ *   0 on success, -1 (after printing an error) on failure; the reader then
+ *   needs no listing_close. Aborts on memory allocation failure.
+ */
+static int listing_open(listing_reader_t *reader, const char *path) {
+    listing_header_t header;
+    listing_trailer_t trailer;
+    struct stat st;
+    uint64_t data_start;
+    uint64_t index_len;
+    size_t valid = 0;
+    const unsigned char *pos;
+    const unsigned char *end;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->path = path;
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd == -1) {
+        fprintf(stderr, "Error opening listing '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(reader->fd, &st) == -1) {
+        fprintf(stderr, "Error getting status for '%s': %s\n", path, strerror(errno));
+        close(reader->fd);
+        return -1;
+    }
+    if ((uint64_t)st.st_size < sizeof(header) + sizeof(trailer) ||
+        listing_pread(reader, &header, sizeof(header), 0) == -1 ||
+        memcmp(header.magic, LISTING_MAGIC, sizeof(header.magic)) != 0 ||
+        listing_pread(reader, &trailer, sizeof(trailer), (uint64_t)st.st_size - sizeof(trailer)) == -1 ||
+        memcmp(trailer.magic, LISTING_END_MAGIC, sizeof(trailer.magic)) != 0) {
+        fprintf(stderr, "Error: '%s' is not a complete dirwalk listing.\n", path);
+        close(reader->fd);
+        return -1;
+    }
+    data_start = sizeof(header) + header.collation_len;
+    if (trailer.index_offset < data_start || trailer.index_offset > (uint64_t)st.st_size - sizeof(trailer) ||
+        trailer.block_count > (trailer.index_offset - data_start) / sizeof(listing_block_header_t)) {
+        fprintf(stderr, "Error: Listing '%s' is corrupt.\n", path);
+        close(reader->fd);
+        return -1;
+    }
+#if !DIRWALK_USE_ZSTD
+    if (header.flags & LISTING_FLAG_ZSTD) {
+        fprintf(stderr, "Error: Listing '%s' is compressed with zstd, which this build does not support.\n", path);
+        close(reader->fd);
+        return -1;
+    }
+#endif
+
+    index_len = (uint64_t)st.st_size - sizeof(trailer) - trailer.index_offset;
+    reader->collation = (char *)malloc(header.collation_len + 1);
+    reader->index_data = (char *)malloc(index_len > 0 ? index_len : 1);
+    reader->blocks = (listing_block_t *)malloc((trailer.block_count > 0 ? trailer.block_count : 1) *
+                                               sizeof(listing_block_t));
+    if (reader->collation == NULL || reader->index_data == NULL || reader->blocks == NULL) {
+        perror("Error allocating listing index");
+        abort();
+    }
+    reader->collation[header.collation_len] = '\0';
+    reader->block_count = trailer.block_count;
+    if (listing_pread(reader, reader->collation, header.collation_len, sizeof(header)) == -1 ||
+        listing_pread(reader, reader->index_data, index_len, trailer.index_offset) == -1) {
+        listing_close(reader);
+        return -1;
+    }
+
+    // Blocks follow each other from the end of the header to the index.
+    pos = (const unsigned char *)reader->index_data;
+    end = pos + index_len;
+    for (size_t i = 0; i < reader->block_count; ++i) {
+        listing_block_t *block = &reader->blocks[i];
+        uint64_t first_len;
+        if ((size_t)(end - pos) < sizeof(uint64_t) + sizeof(listing_block_header_t)) {
+            break;
+        }
+        memcpy(&block->offset, pos, sizeof(uint64_t));
+        memcpy(&block->header, pos + sizeof(uint64_t), sizeof(listing_block_header_t));
+        pos += sizeof(uint64_t) + sizeof(listing_block_header_t);
+        if (listing_get_varint(&pos, end, &first_len) == -1 || first_len > (uint64_t)(end - pos) ||
+            block->offset != (i == 0 ? data_start : reader->blocks[i - 1].offset + sizeof(listing_block_header_t) +
+                                                        reader->blocks[i - 1].header.stored_len) ||
+            block->offset + sizeof(listing_block_header_t) + block->header.stored_len > trailer.index_offset) {
+            break;
+        }
+        block->first = (const char *)pos;
+        block->first_len = (size_t)first_len;
+        pos += first_len;
+        valid = i + 1;
+    }
+    if (valid != reader->block_count || pos != end) {
+        fprintf(stderr, "Error: Listing '%s' has a corrupt block index.\n", path);
+        listing_close(reader);
+        return -1;
+    }
+    path_init(&reader->stored);
+    path_init(&reader->raw);
+    path_init(&reader->entry);
+    reader->stored_block = SIZE_MAX;
+    return 0;
+}
+
+/*
+ * listing_close: Closes a listing opened by listing_open.
+ *
+ * Parameters:
+ *   reader - Pointer to the listing_reader_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void listing_close(listing_reader_t *reader) {
+    close(reader->fd);
+    free(reader->collation);
+    free(reader->index_data);
+    free(reader->blocks);
+    if (reader->entry.data != NULL) {
+        path_free(&reader->stored);
+        path_free(&reader->raw);
+        path_free(&reader->entry);
+    }
+}
+
+/*
+ * listing_read_stored: Reads the stored (possibly compressed) bytes of a
+ *                      block into the reader's stored buffer.
+ *
+ * Parameters:
+ *   reader - Pointer to the listing_reader_t structure.
+ *   index  - Number of the block.
+ *
+ * Returns:
+ *   0 on success, -1 (after printing an error) on failure.
+ */
+static int listing_read_stored(listing_reader_t *reader, size_t index) {
+    const listing_block_t *block = &reader->blocks[index];
+    listing_block_header_t header;
+
+    if (reader->stored_block == index) {
+        return 0;
+    }
+    reader->stored_block = SIZE_MAX;
+    path_reserve(&reader->stored, block->header.stored_len + 1);
+    if (listing_pread(reader, &header, sizeof(header), block->offset) == -1 ||
+        listing_pread(reader, reader->stored.data, block->header.stored_len, block->offset + sizeof(header)) == -1) {
+        return -1;
+    }
+    if (memcmp(&header, &block->header, sizeof(header)) != 0) {
+        fprintf(stderr, "Error: Listing '%s' is corrupt.\n", reader->path);
+        return -1;
+    }
+    reader->stored.len = block->header.stored_len;
+    reader->stored_block = index;
+    return 0;
+}
+
+/*
+ * listing_load: Decodes the next block of a listing into the reader's entry
+ *               buffer.
+ *
+ * Parameters:
+ *   reader - Pointer to the listing_reader_t structure.
+ *
+ * Returns:
+ *   0 on success, -1 (after printing an error) on failure.
+ */
+static int listing_load(listing_reader_t *reader) {
+    size_t index = reader->next_block;
+    const listing_block_header_t *header = &reader->blocks[index].header;
+
+    if (listing_read_stored(reader, index) == -1) {
+        return -1;
+    }
+    if (header->flags & LISTING_BLOCK_ZSTD) {
+#if DIRWALK_USE_ZSTD
+        path_reserve(&reader->raw, header->raw_len + 1);
+        size_t raw_len = ZSTD_decompress(reader->raw.data, header->raw_len, reader->stored.data, reader->stored.len);
+        if (ZSTD_isError(raw_len) || raw_len != header->raw_len) {
+            fprintf(stderr, "Error: Listing '%s' is corrupt.\n", reader->path);
+            return -1;
+        }
+        reader->raw.len = raw_len;
+#else
+        fprintf(stderr, "Error: Listing '%s' is compressed with zstd, which this build does not support.\n",
+                reader->path);
+        return -1;
+#endif
+    } else {
+        // Uncompressed blocks are decoded in place.
+        path_buf_t swap = reader->raw;
+        reader->raw = reader->stored;
+        reader->stored = swap;
+        reader->stored_block = SIZE_MAX;
+    }
+    reader->next_block++;
+    reader->pos = 0;
+    reader->entry.len = 0;
+    return 0;
+}
+
+/*
+ * listing_next: Advances a listing reader to its next entry.
+ *
+ * Parameters:
+ *   reader - Pointer to the listing_reader_t structure; the entry is left
+ *            in reader->entry and reader->type.
+ *
+ * Returns:
+ *   1 if there was an entry, 0 at the end of the listing, -1 (after printing
+ *   an error) on failure.
+ */
+static int listing_next(listing_reader_t *reader) {
+    const unsigned char *pos;
+    const unsigned char *end;
+    uint64_t shared;
+    uint64_t suffix_len;
+
+    while (reader->pos >= reader->raw.len) {
+        if (reader->next_block >= reader->block_count) {
+            return 0;
+        }
+        if (listing_load(reader) == -1) {
+            return -1;
+        }
+    }
+    pos = (const unsigned char *)reader->raw.data + reader->pos;
+    end = (const unsigned char *)reader->raw.data + reader->raw.len;
+    if (listing_get_varint(&pos, end, &shared) == -1 || listing_get_varint(&pos, end, &suffix_len) == -1 ||
+        shared > reader->entry.len || pos == end || suffix_len > (uint64_t)(end - pos - 1)) {
+        fprintf(stderr, "Error: Listing '%s' is corrupt.\n", reader->path);
+        return -1;
+    }
+    reader->type = *pos++;
+    path_reserve(&reader->entry, (size_t)(shared + suffix_len) + 1);
+    memcpy(reader->entry.data + shared, pos, (size_t)suffix_len);
+    reader->entry.len = (size_t)(shared + suffix_len);
+    reader->entry.data[reader->entry.len] = '\0';
+    reader->pos = (size_t)((const char *)pos + suffix_len - reader->raw.data);
+    return 1;
+}
+
+/*
+ * listing_skip_equal: While both readers are between blocks, skips the pairs
+ *                     of next blocks that are stored identically, without
+ *                     decoding them. Identical stretches of two listings of
+ *                     a tree end up in identical blocks (see listing_add).
+ *
+ * Parameters:
+ *   old_reader - Reader of the older listing.
+ *   new_reader - Reader of the newer listing.
+ *
+ * Returns:
+ *   0 on success, -1 (after printing an error) on failure.
+ */
+static int listing_skip_equal(listing_reader_t *old_reader, listing_reader_t *new_reader) {
+    while (old_reader->pos >= old_reader->raw.len && new_reader->pos >= new_reader->raw.len &&
+           old_reader->next_block < old_reader->block_count && new_reader->next_block < new_reader->block_count) {
+        const listing_block_t *a = &old_reader->blocks[old_reader->next_block];
+        const listing_block_t *b = &new_reader->blocks[new_reader->next_block];
+
+        // The index tells most differing blocks apart without reading them.
+        if (memcmp(&a->header, &b->header, sizeof(a->header)) != 0 || a->first_len != b->first_len ||
+            memcmp(a->first, b->first, a->first_len) != 0) {
+            return 0;
+        }
+        if (listing_read_stored(old_reader, old_reader->next_block) == -1 ||
+            listing_read_stored(new_reader, new_reader->next_block) == -1) {
+            return -1;
+        }
+        if (memcmp(old_reader->stored.data, new_reader->stored.data, a->header.stored_len) != 0) {
+            return 0;
+        }
+        old_reader->next_block++;
+        new_reader->next_block++;
+    }
+    return 0;
+}
+
+/*
+ * listing_diff: Prints the differences between two --front-coded listings
+ *               (--diff) as one merge of both: an entry only in the old
+ *               listing as -path, one only in the new listing as +path (an
+ *               entry whose type changed as both), in the listings' order.
+ *               Blocks stored identically in both are skipped undecoded.
+ *
+ * Parameters:
+ *   old_path - Path of the older listing.
+ *   new_path - Path of the newer listing.
+ *   out      - Output buffer for the differences.
+ *
+ * Returns:
+ *   0 if the listings hold the same entries, 1 if they differ, -1 (after
+ *   printing an error) on failure. Exits with write_failure_status if
+ *   writing to stdout fails.
+ */
+static int listing_diff(const char *old_path, const char *new_path, out_buf_t *out) {
+    listing_reader_t old_reader;
+    listing_reader_t new_reader;
+    int old_status = 0;
+    int new_status = 0;
+    int advance_old = 1;
+    int advance_new = 1;
+    int different = 0;
+    int result = 0;
+
+    if (listing_open(&old_reader, old_path) == -1) {
+        return -1;
+    }
+    if (listing_open(&new_reader, new_path) == -1) {
+        listing_close(&old_reader);
+        return -1;
+    }
+    // The merge needs the order both listings were sorted in.
+    if (strcmp(old_reader.collation, new_reader.collation) != 0) {
+        fprintf(stderr, "Error: Listings '%s' and '%s' are sorted for different collations ('%s', '%s').\n",
+                old_path, new_path, old_reader.collation, new_reader.collation);
+        result = -1;
+    } else if (setlocale(LC_COLLATE, old_reader.collation) == NULL) {
+        fprintf(stderr, "Error: Collation '%s' of listing '%s' is not available.\n", old_reader.collation,
+                old_path);
+        result = -1;
+    }
+
+    while (result == 0) {
+        const char *old_entry;
+        const char *new_entry;
+        int order;
+
+        if (advance_old && advance_new && listing_skip_equal(&old_reader, &new_reader) == -1) {
+            result = -1;
+            break;
+        }
+        if (advance_old && (old_status = listing_next(&old_reader)) == -1) {
+            result = -1;
+            break;
+        }
+        if (advance_new && (new_status = listing_next(&new_reader)) == -1) {
+            result = -1;
+            break;
+        }
+        if (old_status == 0 && new_status == 0) {
+            break;
+        }
+        old_entry = old_reader.entry.data;
+        new_entry = new_reader.entry.data;
+        order = old_status == 0 ? 1 : new_status == 0 ? -1 : compare_strings(&old_entry, &new_entry);
+        advance_old = order <= 0;
+        advance_new = order >= 0;
+        if (order != 0 || old_reader.type != new_reader.type) {
+            different = 1;
+        }
+        if (order < 0 || (order == 0 && old_reader.type != new_reader.type)) {
+            out->prefix = WATCH_REMOVED;
+            out_entry(out, old_reader.entry.data, old_reader.entry.len, old_reader.type);
+        }
+        if (order > 0 || (order == 0 && old_reader.type != new_reader.type)) {
+            out->prefix = WATCH_ADDED;
+            out_entry(out, new_reader.entry.data, new_reader.entry.len, new_reader.type);
+        }
+    }
+    out->prefix = '\0';
+    out_flush(out);
+    listing_close(&old_reader);
+    listing_close(&new_reader);
+    return result == 0 ? different : result;
+}
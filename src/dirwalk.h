@@ -0,0 +1,103 @@
+/*
+ * dirwalk.h: C interface of libdirwalk, the directory walker of the dirwalk
+ *            program as a library. A walk is pulled one entry at a time with
+ *            dirwalk_next_entry, which hands back the entry's path, name and
+ *            type in storage owned by the walker, so nothing is allocated per
+ *            entry.
+ *
+ * Example:
+ *   dirwalk_options_t options;
+ *   dirwalk_entry_t entry;
+ *   dirwalk_t *walker;
+ *
+ *   dirwalk_options_init(&options);
+ *   options.types = DIRWALK_TYPE_FILE;
+ *   walker = dirwalk_open("/srv/data", &options);
+ *   if (walker != NULL) {
+ *       while (dirwalk_next_entry(walker, &entry) == 1) {
+ *           puts(entry.path);
+ *       }
+ *       dirwalk_close(walker);
+ *   }
+ *
+ * Entries are listed exactly as the program lists them with the same options.
+ * Errors on entries and directories below the starting path are reported on
+ * stderr, as by the program, and the walk goes on without them; their number
+ * is kept by dirwalk_error_count. A walker must only be used by one thread at
+ * a time; different walkers are independent.
+ */
+
+#ifndef DIRWALK_H
+#define DIRWALK_H
+
+#include <stddef.h> // size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Entry types listed by a walk, combined in dirwalk_options_t.types
+#define DIRWALK_TYPE_LINK 0x1u // Symbolic links (-l)
+#define DIRWALK_TYPE_DIR  0x2u // Directories (-d)
+#define DIRWALK_TYPE_FILE 0x4u // Regular files (-f)
+
+// What a walk lists and how. Set up with dirwalk_options_init, then change
+// the fields needed.
+typedef struct dirwalk_options_s {
+    unsigned types;       // DIRWALK_TYPE_* types to list, or 0 for every type (default)
+    int sort;             // Flag: return the entries sorted by path according to LC_COLLATE (-s)
+    int follow_links;     // Flag: follow symbolic links, walking each directory once (-L)
+    int xdev;             // Flag: do not enter directories on other file systems (--xdev)
+    size_t max_depth;     // Deepest level to descend to, (size_t)-1 for no limit (--maxdepth)
+    size_t min_depth;     // Shallowest level to list; the starting path is level 0 (--mindepth)
+    size_t max_open_dirs; // Directories kept open at once, 0 for the default (--max-fds)
+} dirwalk_options_t;
+
+// One entry of a walk. The strings belong to the walker and stay valid until
+// the next call of dirwalk_next_entry or dirwalk_close.
+typedef struct dirwalk_entry_s {
+    const char *path;     // Path of the entry, starting with the starting path
+    size_t path_len;      // Length of path
+    const char *name;     // Last component of path (the whole path for the starting path)
+    int type;             // DT_* type of the entry, as in <dirent.h>
+} dirwalk_entry_t;
+
+// An open walk
+typedef struct dirwalk_s dirwalk_t;
+
+/*
+ * dirwalk_options_init: Sets options to the defaults of the dirwalk program:
+ *                       every type, unsorted, no links followed, no limits.
+ */
+void dirwalk_options_init(dirwalk_options_t *options);
+
+/*
+ * dirwalk_open: Starts a walk of path with the given options (NULL for the
+ *               defaults). Returns the walker, or NULL with errno set if path
+ *               cannot be examined. Like the program, the library aborts when
+ *               memory runs out.
+ */
+dirwalk_t *dirwalk_open(const char *path, const dirwalk_options_t *options);
+
+/*
+ * dirwalk_next_entry: Returns the next entry of the walk in entry. Returns 1
+ *                     if an entry was returned and 0 once the walk is done;
+ *                     with the sort option, the first call walks the whole tree.
+ */
+int dirwalk_next_entry(dirwalk_t *walker, dirwalk_entry_t *entry);
+
+/*
+ * dirwalk_error_count: Returns the number of errors reported so far by the walk.
+ */
+size_t dirwalk_error_count(const dirwalk_t *walker);
+
+/*
+ * dirwalk_close: Ends a walk, finished or not, and frees the walker.
+ */
+void dirwalk_close(dirwalk_t *walker);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DIRWALK_H
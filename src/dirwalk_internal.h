@@ -0,0 +1,891 @@
+/*
+ * dirwalk_internal.h: Declarations shared by libdirwalk.c, the directory
+ *                     walker, and dirwalk.c, the program built on it: the
+ *                     build switches, the constants and types both use, and
+ *                     the functions of the walker that the program calls.
+ */
+
+#ifndef DIRWALK_INTERNAL_H
+#define DIRWALK_INTERNAL_H
+
+#include <stdio.h>      // printf, fprintf, stderr, perror, snprintf, fdopen, fread, fwrite
+#include <stdlib.h>     // malloc, realloc, free, exit, qsort, getenv, abort, mkstemp
+#include <string.h>     // strcmp, strdup, strlen, strcoll, strerror
+#include <dirent.h>     // fdopendir, readdir, closedir, DIR, struct dirent, DT_*
+#include <stdint.h>     // uint64_t, int64_t, uint16_t
+#include <stddef.h>     // offsetof
+#include <sys/stat.h>   // fstatat, struct stat, S_ISLNK, S_ISDIR, S_ISREG
+#include <fcntl.h>      // openat, O_DIRECTORY, O_NOFOLLOW, AT_FDCWD, AT_SYMLINK_NOFOLLOW
+#include <unistd.h>     // getopt, close, unlink, write, isatty, ftruncate, lseek
+#include <sys/uio.h>    // writev, struct iovec
+#include <errno.h>      // errno
+#include <locale.h>     // setlocale, LC_COLLATE
+#include <pthread.h>    // pthread_create, pthread_join, pthread_mutex_t, pthread_cond_t
+#include <stdatomic.h>  // atomic_size_t, atomic_fetch_add, atomic_fetch_sub
+#include <sys/resource.h> // getrlimit, RLIMIT_NOFILE
+#include <regex.h>      // regcomp, regexec, regfree, regerror, regex_t
+#include <ctype.h>      // tolower, isalpha and the other character classes
+#include <pwd.h>        // getpwnam, struct passwd
+#include <time.h>       // time, clock_gettime, CLOCK_MONOTONIC
+#include <sys/mman.h>   // mmap, munmap
+#include <poll.h>       // poll, struct pollfd
+#include <inttypes.h>   // PRIu64
+
+#include "dirwalk.h"    // Library interface, implemented in libdirwalk.c
+
+// Directory reading backend. On Linux, entries are read with getdents64 straight
+// into a large reusable buffer; elsewhere (or with BACKEND=readdir at build time)
+// the portable readdir interface is used.
+#ifndef DIRWALK_USE_GETDENTS
+#  ifdef __linux__
+#    define DIRWALK_USE_GETDENTS 1
+#  else
+#    define DIRWALK_USE_GETDENTS 0
+#  endif
+#endif
+
+#if DIRWALK_USE_GETDENTS
+#include <sys/syscall.h> // SYS_getdents64
+#endif
+
+// Metadata filters use the Linux statx system call, which fetches only the
+// requested fields; elsewhere (or without <linux/stat.h>) they use fstatat.
+#ifndef DIRWALK_USE_STATX
+#  if defined(__linux__) && defined(__has_include)
+#    if __has_include(<linux/stat.h>)
+#      define DIRWALK_USE_STATX 1
+#    endif
+#  endif
+#endif
+#ifndef DIRWALK_USE_STATX
+#  define DIRWALK_USE_STATX 0
+#endif
+
+#if DIRWALK_USE_STATX
+#include <sys/syscall.h> // SYS_statx
+#include <linux/stat.h>  // struct statx, STATX_*
+#include <sys/sysmacros.h> // makedev
+#endif
+
+// Batched statx through io_uring (--uring). Needs the getdents64 backend, whose
+// buffer holds the entries of a whole batch, and the kernel io_uring header;
+// the rings are driven with raw system calls, so no library is required.
+#ifndef DIRWALK_USE_IO_URING
+#  if DIRWALK_USE_GETDENTS && defined(__has_include)
+#    if __has_include(<linux/io_uring.h>)
+#      define DIRWALK_USE_IO_URING 1
+#    endif
+#  endif
+#endif
+#ifndef DIRWALK_USE_IO_URING
+#  define DIRWALK_USE_IO_URING 0
+#endif
+
+#if DIRWALK_USE_IO_URING
+#include <linux/io_uring.h> // struct io_uring_params, struct io_uring_sqe, IORING_*
+#include <linux/stat.h>     // struct statx, STATX_TYPE
+#endif
+
+// Watch mode (--watch) takes its events from fanotify, whose file system marks
+// report the directory handle and name of every change without a watch per
+// directory, when the kernel grants it; otherwise from inotify.
+#ifndef DIRWALK_USE_FANOTIFY
+#  if defined(__linux__) && defined(__has_include)
+#    if __has_include(<sys/fanotify.h>)
+#      define DIRWALK_USE_FANOTIFY 1
+#    endif
+#  endif
+#endif
+#ifndef DIRWALK_USE_FANOTIFY
+#  define DIRWALK_USE_FANOTIFY 0
+#endif
+#ifndef DIRWALK_USE_INOTIFY
+#  if defined(__linux__) && defined(__has_include)
+#    if __has_include(<sys/inotify.h>)
+#      define DIRWALK_USE_INOTIFY 1
+#    endif
+#  endif
+#endif
+#ifndef DIRWALK_USE_INOTIFY
+#  define DIRWALK_USE_INOTIFY 0
+#endif
+#define DIRWALK_USE_WATCH (DIRWALK_USE_FANOTIFY || DIRWALK_USE_INOTIFY)
+
+#if DIRWALK_USE_FANOTIFY
+#include <sys/fanotify.h>   // fanotify_init, fanotify_mark, struct fanotify_event_*
+#include <sys/statfs.h>     // fstatfs, struct statfs
+#include <sys/syscall.h>    // SYS_name_to_handle_at, SYS_open_by_handle_at
+#endif
+#if DIRWALK_USE_INOTIFY
+#include <sys/inotify.h>    // inotify_init1, inotify_add_watch, struct inotify_event
+#endif
+
+// --front-coded=zstd compresses the blocks of a listing with libzstd, when it
+// is installed (the Makefile then links it).
+#ifndef DIRWALK_USE_ZSTD
+#  if defined(__has_include)
+#    if __has_include(<zstd.h>)
+#      define DIRWALK_USE_ZSTD 1
+#    endif
+#  endif
+#endif
+#ifndef DIRWALK_USE_ZSTD
+#  define DIRWALK_USE_ZSTD 0
+#endif
+
+#if DIRWALK_USE_ZSTD
+#include <zstd.h>           // ZSTD_compress, ZSTD_decompress, ZSTD_compressBound, ZSTD_isError
+#endif
+
+// stdio buffer size of each external sort run file
+#define RUN_BUFFER_SIZE (64 * 1024)
+
+// Upper bound of the default --max-fds budget and largest accepted value
+#define DEFAULT_MAX_OPEN_DIRS 4096
+#define MAX_OPEN_DIRS (1024 * 1024)
+
+// Initial capacity of the explicit traversal stack
+#define INITIAL_WALK_STACK_CAPACITY 64
+
+// Largest file handle (MAX_HANDLE_SZ) and largest cache key: file system ID, then handle
+#define WATCH_HANDLE_MAX 128
+#define WATCH_KEY_MAX (8 + 8 + WATCH_HANDLE_MAX)
+
+// Flag of a listing block: its bytes are compressed with zstd
+#define LISTING_BLOCK_ZSTD 0x1u
+
+// Offset basis of the 64-bit FNV-1a hash
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+// Histogram buckets of --stats per power of two of nanoseconds (2^bits), so
+// each bucket spans at most 1/8 of the latencies it counts
+#define STATS_SUB_BUCKET_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+
+// Buckets of each --stats latency histogram: exact values below
+// STATS_SUB_BUCKETS, then STATS_SUB_BUCKETS per power of two up to 2^64 ns
+#define STATS_BUCKET_COUNT ((64 - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+// Errors are counted per errno value below this; larger values share the last slot
+#define STATS_ERRNO_LIMIT 256
+
+// Slots of each thread's table of directories with errors, for the
+// --max-errors summary (a power of two, used up to half), and the number of
+// directories the summary lists
+#define ERROR_DIR_SLOTS 4096
+#define ERROR_SUMMARY_DIRS 10
+
+// Formats in which listed paths are written
+enum {
+    OUTPUT_LINES,  // One path per line (default)
+    OUTPUT_NUL,    // NUL-terminated paths (-0)
+    OUTPUT_BINARY  // Length and type prefixed records (--binary)
+};
+
+// Classes of system calls whose latency --stats records
+enum {
+    STATS_OPEN,       // Opening directories (openat)
+    STATS_READ,       // Reading directory entries (getdents64 or readdir)
+    STATS_STAT,       // Reading metadata (fstatat, statx, fstat)
+    STATS_URING,      // Waiting for --uring statx batches (io_uring_enter)
+    STATS_CLOSE,      // Closing directories
+    STATS_WRITE,      // Writing to stdout (write, writev)
+    STATS_LOCK,       // Waiting for other threads' output (output_lock)
+    STATS_CLASS_COUNT
+};
+
+// Phases of a run timed by --stats
+enum {
+    STATS_PHASE_WALK,  // Walking the starting paths (with the unsorted output)
+    STATS_PHASE_SORT,  // Sorting the collected entries (-s)
+    STATS_PHASE_MERGE, // Merging and writing the sorted entries (-s)
+    STATS_PHASE_COUNT
+};
+
+// How a compiled name pattern is matched. Globs that are a plain literal with at
+// most one leading or trailing '*' skip the general matcher: they reduce to a
+// length check and one memcmp of the name's head or tail.
+enum {
+    NAME_MATCH_EXACT,  // "literal"
+    NAME_MATCH_PREFIX, // "literal*"
+    NAME_MATCH_SUFFIX, // "*literal", e.g. "*.log"
+    NAME_MATCH_GLOB,   // Anything else: token matcher
+    NAME_MATCH_REGEX   // --regex
+};
+
+// Kinds of glob tokens
+enum {
+    GLOB_LITERAL, // One byte
+    GLOB_ANY,     // '?': any byte
+    GLOB_STAR,    // '*': any sequence of bytes
+    GLOB_CLASS    // '[...]': any byte in a set
+};
+
+// One token of a compiled glob. A bracket expression is expanded into a
+// 256-bit set, so matching a byte against it is one bit test.
+typedef struct glob_token_s {
+    int kind;               // GLOB_* kind of the token
+    unsigned char byte;     // GLOB_LITERAL: the byte (lower case with --iname)
+    uint32_t set[8];        // GLOB_CLASS: bit b is set if byte b matches
+} glob_token_t;
+
+// A pattern given with --name, --iname or --regex, compiled once at startup.
+typedef struct name_pattern_s {
+    int kind;               // NAME_MATCH_* strategy
+    int fold_case;          // Flag: compare ASCII letters case-insensitively (--iname)
+    char *literal;          // EXACT/PREFIX/SUFFIX: the literal part (lower case with --iname)
+    size_t literal_len;     // Length of literal
+    glob_token_t *tokens;   // GLOB: compiled tokens
+    size_t token_count;     // GLOB: number of tokens
+    regex_t regex;          // REGEX: compiled expression
+} name_pattern_t;
+
+// The name filters of the command line. An entry passes if there are none or
+// if it matches at least one.
+typedef struct name_filter_s {
+    name_pattern_t *patterns; // Compiled patterns
+    size_t count;             // Number of patterns
+    size_t capacity;          // Allocated capacity of patterns
+} name_filter_t;
+
+// Fields of an entry that the metadata filters may need
+#define META_TYPE  0x1u // File type (only when d_type did not tell)
+#define META_SIZE  0x2u // Size in bytes
+#define META_MTIME 0x4u // Modification time
+#define META_UID   0x8u // Owner
+#define META_BLOCKS 0x10u // Allocated 512-byte blocks
+#define META_INODE 0x20u // Device, inode and link count
+
+// Kinds of metadata tests
+enum {
+    META_TEST_SIZE,  // --size: size in units compared with value
+    META_TEST_MTIME, // --mtime: age in whole days compared with value
+    META_TEST_NEWER, // --newer: modified after (value, nsec)
+    META_TEST_USER   // --user: owner equal to value
+};
+
+// One metadata test. cmp is -1, 0 or +1 for a "-N", "N" or "+N" argument.
+typedef struct meta_test_s {
+    int kind;           // META_TEST_* kind
+    int cmp;            // Required sign of (actual - value)
+    int64_t value;      // Number to compare with (units, days, seconds or uid)
+    int64_t unit;       // SIZE: bytes per unit; NEWER: nanoseconds of the reference
+} meta_test_t;
+
+// The metadata tests of the command line, all of which must hold.
+typedef struct meta_filter_s {
+    meta_test_t *tests; // Tests to apply
+    size_t count;       // Number of tests
+    size_t capacity;    // Allocated capacity of tests
+    unsigned fields;    // META_* fields the tests read, 0 if there are no tests
+    int64_t now;        // Start time of the walk, for --mtime
+} meta_filter_t;
+
+// Space used by a directory and everything counted below it (--summarize).
+typedef struct dir_sum_s {
+    uint64_t apparent;  // Sum of the sizes in bytes
+    uint64_t allocated; // Sum of the allocated bytes
+    uint64_t entries;   // Number of entries, the directory itself included
+} dir_sum_t;
+
+// Buffer of complete output entries (lines or records) waiting to be written
+// to stdout. Every thread that prints owns one; flushes hand whole buffers to
+// write/writev under output_lock (or to the stream of their starting path),
+// so entries from different threads never mix.
+typedef struct out_buf_s {
+    char *data;        // Pending output bytes, always ending at an entry boundary
+    size_t len;        // Number of pending bytes
+    size_t capacity;   // Allocated size of data
+    int format;        // OUTPUT_* format of the entries
+    int line_buffered; // Flag: flush after every entry (stdout is a terminal)
+    char prefix;       // With --watch, WATCH_ADDED or WATCH_REMOVED before every path; else '\0'
+    struct root_stream_s *stream; // Stream of the starting path the entries belong to, or NULL for stdout
+    int hold;          // Flag: grow rather than flush, so that --checkpoint commits whole directories
+} out_buf_t;
+
+// Marks the absence of a node in the compact path store
+#define PATH_NODE_NONE UINT32_MAX
+
+// Growable buffer holding the path of the directory currently being walked.
+// Entry names are appended in place only when a full path is actually needed.
+typedef struct path_buf_s {
+    char *data;      // NUL-terminated path string
+    size_t len;      // Length of the path, excluding the terminator
+    size_t capacity; // Allocated size of data
+} path_buf_t;
+
+// One slab of the path arena. Paths are bump-allocated from data.
+typedef struct arena_chunk_s {
+    struct arena_chunk_s *next; // Next (older) chunk in the list
+    size_t used;                // Bytes of data handed out so far
+    size_t size;                // Usable size of data
+    char data[];                // Path bytes
+} arena_chunk_t;
+
+// Bump allocator owning the bytes of every stored path. Individual paths are
+// never freed; the whole arena is released at once, one free per chunk.
+typedef struct arena_s {
+    arena_chunk_t *head; // Chunk currently being filled, followed by older ones
+} arena_t;
+
+// One entry of the compact path store: a name and the node of its parent
+// directory. Root nodes carry a full path prefix (the start directory, or a
+// directory handed to a worker in parallel mode) instead of a single name.
+typedef struct path_node_s {
+    const char *name;  // Name bytes in the results arena (not NUL-terminated)
+    uint32_t parent;   // Index of the parent node, or PATH_NODE_NONE for a root
+    uint32_t name_len; // Length of name, with PATH_NODE_LISTED and the type set for results
+} path_node_t;
+
+// A path paired with its sort key: the path itself when LC_COLLATE orders
+// bytewise, otherwise its strxfrm transformation. Keys compare with plain byte
+// comparisons in the same order that strcoll gives for the paths.
+// The DT_* type of the entry is stored in the byte before the path.
+typedef struct sort_record_s {
+    const unsigned char *key; // NUL-terminated sort key
+    char *path;               // The path being sorted
+} sort_record_t;
+
+// A sorted run spilled to an unlinked temporary file by the external sort.
+// Runs are merged in groups of SORT_MERGE_FANIN runs of equal level into one
+// run of the next level, so each record is rewritten only a logarithmic
+// number of times and few files are open at once.
+typedef struct sort_run_s {
+    FILE *file;   // Run file, positioned at its first record once written
+    size_t count; // Number of records in the run
+    size_t level; // Number of merges that produced this run
+} sort_run_t;
+
+struct results_s;
+
+// Read position in one sorted shard during the final k-way merge.
+typedef struct merge_cursor_s {
+    struct results_s *shard;    // Sorted results being read, or NULL for a run
+    FILE *run;                  // Run file being read, if shard is NULL
+    size_t next;                // Index of the next item to load
+    size_t count;               // Number of items in the shard or run
+    const unsigned char *key;   // Sort key of the current item (NULL in compact mode)
+    const char *path;           // Path of the current item, or NULL when exhausted
+    unsigned char type;         // DT_* type of the current item
+    path_buf_t scratch;         // Compact mode and runs: the current path
+    path_buf_t key_scratch;     // Runs: the current sort key
+} merge_cursor_t;
+
+// Structure to hold results for sorting. By default each result is a full path
+// string in paths. In compact mode, every result and every directory leading to
+// one is a node in nodes, so the common prefixes are stored once; full paths
+// are then only rebuilt for comparisons and printing.
+typedef struct results_s {
+    char **paths;    // Dynamically allocated array of pointers into arena (type byte first)
+    size_t count;    // Number of paths currently stored
+    size_t capacity; // Allocated capacity of the paths array
+    arena_t arena;   // Storage for the path strings (or node names) themselves
+    int compact;     // Flag: results are stored as nodes rather than paths
+    path_node_t *nodes;   // Compact mode: node array
+    size_t node_count;    // Compact mode: number of nodes
+    size_t node_capacity; // Compact mode: allocated capacity of nodes
+    uint32_t dir_node;    // Compact mode: node of the directory being walked
+    uint32_t last_node;   // Compact mode: node added for the last listed entry
+    int sorted;              // Flag: sort_results has run
+    sort_record_t *records;  // After sorting: paths with their keys, in order
+    arena_t keys;            // After sorting: storage for strxfrm keys
+    uint32_t *order;         // After sorting (compact mode): listed nodes, in order
+    size_t mem_limit;        // External sort: spill a run once mem_used exceeds this (0 = never)
+    size_t mem_used;         // External sort: bytes held by the stored paths and their records
+    const char *tmp_dir;     // External sort: directory for run files
+    sort_run_t *runs;        // External sort: runs spilled so far, oldest first
+    size_t run_count;        // External sort: number of runs
+    size_t run_capacity;     // External sort: allocated capacity of runs
+    int checkpoint_runs;     // Flag: with --checkpoint, runs are spilled between directories only, and never merged
+} results_t;
+
+// Per-worker buffer for the getdents64 backend, used as a stack: each open
+// directory owns the region holding its current batch, and a subdirectory is
+// read into the space right after it. Entries are therefore consumed in place,
+// and the buffer is reused by every directory the worker visits. Readers keep
+// offsets rather than pointers so the buffer may grow on very deep trees.
+typedef struct dirent_buf_s {
+    char *data;      // Buffer holding the batches of all open directories
+    size_t top;      // First byte not owned by any open directory
+    size_t capacity; // Allocated size of data
+    struct stat_ring_s *ring; // io_uring resolving DT_UNKNOWN entries of each batch, or NULL
+    struct prefetch_s *prefetch; // Threads resolving DT_UNKNOWN entries ahead of the walker, or NULL
+} dirent_buf_t;
+
+#if DIRWALK_USE_IO_URING
+// An io_uring instance owned by one worker, used to run the statx calls for
+// the DT_UNKNOWN entries of a getdents64 batch concurrently. Each completion
+// writes the entry's type back into its record, so process_entry needs no
+// fstatat for it; entries whose statx failed keep DT_UNKNOWN and go through
+// the synchronous path, which also reports the error.
+typedef struct stat_ring_s {
+    int fd;                      // io_uring descriptor
+    int broken;                  // Flag: a system call failed, the ring is no longer used
+    unsigned entries;            // Number of submission queue entries
+    void *sq_map;                // Mapping of the submission ring
+    size_t sq_map_size;          // Size of sq_map
+    void *cq_map;                // Mapping of the completion ring (may equal sq_map)
+    size_t cq_map_size;          // Size of cq_map
+    struct io_uring_sqe *sqes;   // Mapped submission queue entries
+    size_t sqes_size;            // Size of the sqes mapping
+    unsigned *sq_tail;           // Submission ring: tail index (written by us)
+    unsigned *sq_mask;           // Submission ring: index mask
+    unsigned *sq_array;          // Submission ring: indices into sqes
+    unsigned *cq_head;           // Completion ring: head index (written by us)
+    unsigned *cq_tail;           // Completion ring: tail index (written by the kernel)
+    unsigned *cq_mask;           // Completion ring: index mask
+    struct io_uring_cqe *cqes;   // Completion queue entries
+    struct statx *results;       // One statx buffer per request in flight
+    struct linux_dirent64 **records; // Record resolved by each request in flight
+} stat_ring_t;
+#endif
+
+#if DIRWALK_USE_GETDENTS
+// States of an entry queued for stat prefetching
+enum {
+    PREFETCH_QUEUED,  // Waiting for a prefetch thread
+    PREFETCH_CLAIMED, // Being resolved by a prefetch thread
+    PREFETCH_DONE     // Resolved (or failed, keeping DT_UNKNOWN), or left to the walker
+};
+
+// Stat prefetch stage of one walker (--prefetch). The DT_UNKNOWN records of
+// the directory batch being read are queued in order; the helper threads
+// fstatat them at most depth entries ahead of the walker and write the types
+// back into the records, so the walker only waits for entries still in
+// flight. Queue contents are only touched by the walker while no stat is in
+// flight, and the records stay valid because the walker clears the queue
+// before refilling or releasing their batch.
+typedef struct prefetch_s {
+    pthread_t *threads;    // Prefetch threads
+    size_t thread_count;   // Number of threads, also the prefetch depth
+    pthread_mutex_t lock;  // Protects the fields below
+    pthread_cond_t work_cond; // Signaled when entries become claimable or on stop
+    pthread_cond_t done_cond; // Signaled when a claimed entry is resolved
+    const void *owner;     // Reader whose entries are queued, or NULL
+    int dir_fd;            // Descriptor of the owner's directory
+    struct linux_dirent64 **records; // Queued records, in directory order
+    unsigned char *states; // PREFETCH_* state of each queued record
+    size_t count;          // Number of queued records
+    size_t capacity;       // Allocated capacity of records and states
+    size_t next_claim;     // Index of the next record for a prefetch thread
+    size_t consumed;       // Number of queued records the walker has passed
+    size_t active;         // Number of stats in flight
+    int stop;              // Flag: threads must exit
+} prefetch_t;
+#endif
+
+// Iteration state for one open directory, independent of the backend in use.
+// A reader can be detached: its remaining entries are then buffered in spill
+// as packed records (type byte, NUL-terminated name) and its descriptor is
+// closed, until it is reattached to a reopened descriptor. With --index, the
+// entries are buffered (or borrowed from the previous snapshot) right away.
+typedef struct dir_reader_s {
+#if DIRWALK_USE_GETDENTS
+    int fd;              // Directory descriptor, owned by the reader, or -1 when detached
+    dirent_buf_t *buf;   // Shared per-worker entry buffer
+    size_t base;         // Start of this directory's region in buf
+    size_t pos;          // Offset of the next record to return
+    size_t end;          // End of the current batch
+#else
+    DIR *stream;         // Directory stream wrapping the descriptor, or NULL once detached
+    int fd;              // Descriptor given back by dir_reader_reattach, or -1
+#endif
+    char *spill;         // Buffered remaining entries, or NULL while reading the directory
+    size_t spill_pos;    // Buffered: offset of the next record in spill
+    size_t spill_len;    // Buffered: bytes used in spill
+    size_t spill_capacity; // Buffered: allocated size of spill, 0 if it points into the index
+    int spill_errno;     // Buffered: error hit while buffering the entries, or 0
+} dir_reader_t;
+
+// One directory on the explicit stack of walk_directory_contents.
+typedef struct walk_frame_s {
+    dir_reader_t reader;  // Reader of the directory
+    size_t parent_len;    // Length of the path buffer before this directory's name
+    size_t path_len;      // Length of this directory's path
+    uint32_t parent_node; // Compact mode: directory node to restore when done
+    dev_t dev;            // Detached: device of the directory, to check its reopening
+    ino_t ino;            // Detached: inode of the directory, to check its reopening
+    dir_sum_t sum;        // With --summarize, totals of the directory counted so far
+} walk_frame_t;
+
+// One slot of the visited directory set.
+typedef struct visited_slot_s {
+    dev_t dev;            // Device of the directory
+    ino_t ino;            // Inode of the directory, or 0 for a free slot
+} visited_slot_t;
+
+// Set of the directories walked with -L, keyed by (st_dev, st_ino), so that
+// cycles and directories reached through several links are walked once. Open
+// addressing with linear probing in a power-of-two table kept at most half full.
+typedef struct visited_set_s {
+    pthread_mutex_t lock;  // Protects all fields below (shared by -j workers)
+    visited_slot_t *slots; // Table of capacity slots
+    size_t capacity;       // Number of slots, a power of two
+    size_t count;          // Number of used slots
+} visited_set_t;
+
+// Position of one directory record in the snapshot being written.
+typedef struct index_slot_s {
+    uint64_t hash;          // Hash of the directory path
+    uint64_t offset;        // Offset of the record in the file
+} index_slot_t;
+
+// The --index snapshots: the previous one, mapped read-only, whose entry lists
+// are reused for directories unchanged since, and the new one, written to a
+// temporary file next to it that replaces it once the walk is over.
+typedef struct tree_index_s {
+    const char *path;       // Path of the index file
+    const char *map;        // Previous snapshot, or NULL if there is none
+    size_t map_size;        // Size of the mapping
+    const uint64_t *table;  // Hash table of the previous snapshot
+    uint64_t table_size;    // Number of slots in table
+    int64_t scan_start;     // Start of this walk, in seconds
+    pthread_mutex_t lock;   // Protects the fields below (shared by -j workers)
+    char *tmp_path;         // Temporary file receiving the new snapshot
+    int fd;                 // Descriptor of tmp_path, or -1 after a write error
+    char *buf;              // Write buffer
+    size_t buf_len;         // Bytes pending in buf
+    uint64_t size;          // Bytes of the new snapshot, including those in buf
+    index_slot_t *dirs;     // Records written so far
+    size_t dir_count;       // Number of records written
+    size_t dir_capacity;    // Allocated capacity of dirs
+} tree_index_t;
+
+// Event sources of --watch
+enum {
+    WATCH_FANOTIFY,
+    WATCH_INOTIFY
+};
+
+// A directory watched with inotify. Its path is not stored: each node keeps
+// its name and the watch of its parent, so the table grows with the names of
+// the watched directories only, and a renamed directory is moved in place.
+typedef struct watch_node_s {
+    int wd;               // Watch descriptor, or -1 for a free slot
+    int parent_wd;        // Watch of the parent directory, or -1 for the starting directory
+    int moved;            // Flag: moved by IN_MOVED_TO, its IN_MOVE_SELF is still to come
+    char *name;           // Name in the parent directory (the starting path for the root)
+} watch_node_t;
+
+// A directory handle reported by fanotify, resolved to the directory's path.
+typedef struct watch_cache_slot_s {
+    size_t key_len;       // Length of key, or 0 for a free slot
+    unsigned char key[WATCH_KEY_MAX]; // File system ID, then the file handle
+    char *path;           // Printed path of the directory, or NULL if it is not walked
+    size_t depth;         // Depth of the directory below the starting path
+} watch_cache_slot_t;
+
+// A file system marked by fanotify, with a descriptor on it for open_by_handle_at.
+typedef struct watch_mount_s {
+    unsigned char fsid[8]; // File system ID reported in the events
+    dev_t dev;            // Device of the file system
+    int fd;               // Open directory on the file system, or -1 if it could not be marked
+} watch_mount_t;
+
+// One change of a --watch batch. Repeated changes of a path are merged into
+// the first and the last one.
+typedef struct watch_delta_s {
+    size_t path_offset;   // Offset of the NUL-terminated path in the batch's path buffer
+    size_t path_len;      // Length of the path
+    size_t parent_len;    // Length of the parent directory's path at its start
+    size_t name_offset;   // Offset of the entry name within the path
+    size_t depth;         // Depth of the entry below the starting path
+    char first;           // First change seen (WATCH_ADDED or WATCH_REMOVED)
+    char last;            // Last change seen
+    char is_dir;          // Flag: reported as a directory
+    char covered;         // Flag: already listed by the walk of a new ancestor
+} watch_delta_t;
+
+struct walk_config_s;
+
+// State of --watch: the event source, what turns its events into paths, and
+// the batch of changes not printed yet.
+typedef struct watch_s {
+    int backend;              // WATCH_FANOTIFY or WATCH_INOTIFY
+    int fd;                   // fanotify or inotify descriptor
+    int stopped;              // Flag: the starting directory is gone, or reading failed
+    const char *root;         // Starting path, as given
+    pthread_mutex_t lock;     // Serializes watch_directory between -j workers
+    watch_node_t *nodes;      // inotify: open-addressing table of watched directories by wd
+    size_t node_capacity;     // inotify: number of slots, a power of two
+    size_t node_count;        // inotify: number of watched directories
+    int root_wd;              // inotify: watch of the starting directory, or -1 before it is added
+    watch_node_t **chain;     // inotify: scratch list of the ancestors of a node
+    size_t chain_capacity;    // inotify: allocated capacity of chain
+    path_buf_t last_path;     // inotify: directory added last, to find the parent of the next
+    int last_wd;              // inotify: its watch
+    size_t last_parent_len;   // inotify: length of its parent's path, SIZE_MAX for the root
+    int last_parent_wd;       // inotify: watch of its parent
+    path_buf_t parent_path;   // inotify: scratch path of a parent directory
+    int limit_warned;         // inotify: flag: running out of watches was reported
+    char *root_abs;           // fanotify: absolute path of the starting directory
+    size_t root_abs_len;      // fanotify: its length
+    dev_t root_dev;           // fanotify: device of the starting directory
+    ino_t root_ino;           // fanotify: inode of the starting directory
+    watch_mount_t *mounts;    // fanotify: marked file systems
+    size_t mount_count;       // fanotify: number of marked file systems
+    size_t mount_capacity;    // fanotify: allocated capacity of mounts
+    watch_cache_slot_t *cache; // fanotify: WATCH_CACHE_SLOTS resolved handles
+    path_buf_t scratch;       // Path of the directory of the event being queued
+    path_buf_t walk_path;     // Path buffer for the walks of new directories
+    path_buf_t paths;         // NUL-terminated paths of the batch, back to back
+    watch_delta_t *deltas;    // WATCH_BATCH_MAX changes of the batch, in the order first seen
+    size_t delta_count;       // Number of changes in the batch
+    uint32_t *delta_slots;    // WATCH_BATCH_SLOTS slots: index + 1 of a change, or 0
+    int64_t batch_start;      // Time the first change of the batch came in, in milliseconds
+    const struct walk_config_s *config; // While running: configuration for the changes
+    dirent_buf_t *entries;    // While running: entry buffer for the walks of new directories
+    out_buf_t *out;           // While running: output buffer
+    size_t max_open_dirs;     // While running: --max-fds budget of those walks
+} watch_t;
+
+// Bit of a DT_* type in walk_config_t.type_mask, and the mask listing every type
+#define TYPE_BIT(type) (1u << (type))
+#define TYPE_MASK_ALL (~0u)
+
+// Handler the walk loops call for every directory entry, picked once for the
+// options by select_entry_handler (process_entry in the general case).
+typedef int (*entry_handler_t)(int dir_fd, const char *name, unsigned char d_type, size_t depth,
+                               path_buf_t *parent, const struct walk_config_s *config,
+                               results_t *results, out_buf_t *out, dir_sum_t *counted);
+
+// What the walkers list and how: set up once by main and shared by all walkers.
+typedef struct walk_config_s {
+    unsigned type_mask;       // TYPE_BIT of each type listed (-l, -d, -f), or TYPE_MASK_ALL
+    entry_handler_t handle_entry; // Handler for the entries below the starting paths
+    int sort_output;          // Flag: sort output?
+    int follow_links;         // Flag: follow symbolic links (-L)
+    visited_set_t *visited;   // With -L, the directories entered so far; else NULL
+    const name_filter_t *names; // Name filters; an empty filter passes every entry
+    const meta_filter_t *meta;  // Metadata filters; an empty filter passes every entry
+    size_t max_depth;         // Entries at this depth are listed but not entered
+    size_t min_depth;         // Entries above this depth are entered but not listed
+    int xdev;                 // Flag: do not enter directories on other devices
+    dev_t root_dev;           // With xdev, device of the starting directory
+    const name_filter_t *prune; // Directories neither listed nor entered
+    tree_index_t *index;      // With --index, the snapshots to reuse and update; else NULL
+    watch_t *watch;           // With --watch, where directories entered are watched; else NULL
+    int summarize;            // Flag: count the entries passing the filters instead of listing them
+    visited_set_t *links;     // With --summarize, the files with several links counted so far; else NULL
+    size_t shard_index;       // With --shard, the shard listed, counted from 0
+    size_t shard_count;       // Number of shards; 1 lists every entry
+    size_t shard_depth;       // Entries at this level are listed and walked by their shard only
+    size_t root_len;          // Length of the starting path, which the shard hash skips
+} walk_config_t;
+
+struct root_order_s;
+
+// The output of one starting path in a parallel walk of several. Workers hand
+// over whole output buffers; while earlier paths are unfinished they are held
+// back, in memory up to ROOT_HOLD_SIZE, then appended to a temporary file.
+typedef struct root_stream_s {
+    struct root_order_s *order; // Streams of all starting paths
+    size_t index;             // Position of the starting path
+    atomic_size_t pending;    // Tasks of the path not finished, or whose output was not handed over
+    char *held;               // Output held back in memory
+    size_t held_len;          // Bytes in held
+    size_t held_capacity;     // Allocated size of held
+    FILE *spill;              // Output held back before held, or NULL
+    int finished;             // Flag: all output of the path was handed over
+} root_stream_t;
+
+// The streams of the starting paths of a parallel walk, written to stdout in
+// argument order: the first unfinished path writes straight through, and the
+// output held by the next ones follows as it finishes.
+typedef struct root_order_s {
+    pthread_mutex_t lock;     // Protects the fields below and those of the streams
+    root_stream_t *streams;   // One stream per starting path
+    size_t count;             // Number of starting paths
+    size_t head;              // First unfinished starting path
+    const char *tmp_dir;      // Directory for the spill files
+} root_order_t;
+
+// Header of a block of a listing, followed by its stored_len bytes. Decoded,
+// these are raw_len bytes of front-coded entries: LEB128 shared length,
+// LEB128 suffix length, type byte, suffix.
+typedef struct listing_block_header_s {
+    uint32_t stored_len;      // Bytes stored in the file
+    uint32_t raw_len;         // Bytes of entries once decompressed
+    uint32_t entries;         // Number of entries
+    uint32_t flags;           // LISTING_BLOCK_* flags
+} listing_block_header_t;
+
+// A --front-coded listing being written to stdout by the sorted merge.
+typedef struct listing_s {
+    int compress;             // Flag: compress blocks with zstd
+    path_buf_t block;         // Front-coded entries of the current block
+    path_buf_t previous;      // Previous entry of the current block
+    path_buf_t packed;        // Compressed bytes of the current block
+    path_buf_t index;         // Block index written so far
+    uint32_t block_entries;   // Entries in the current block
+    uint64_t block_count;     // Blocks written
+    uint64_t entry_count;     // Entries in the blocks written
+    uint64_t offset;          // Bytes of the listing written
+} listing_t;
+
+// Latencies of one class of system calls, in nanoseconds. Bucket i below
+// STATS_SUB_BUCKETS holds the value i; above, the buckets of each power of two
+// split it into STATS_SUB_BUCKETS equal parts, as an HDR histogram does.
+typedef struct latency_hist_s {
+    uint64_t count;           // Number of calls
+    uint64_t total;           // Sum of their latencies
+    uint64_t max;             // Longest latency
+    uint64_t buckets[STATS_BUCKET_COUNT]; // Calls per latency bucket
+} latency_hist_t;
+
+// Counters of one thread for --stats. Only their own thread writes them,
+// with plain increments; they are added up when the report is printed.
+typedef struct thread_stats_s {
+    uint64_t dirs_opened;     // Directories opened
+    uint64_t entries;         // Entries seen by process_entry
+    uint64_t typed_entries;   // Entries whose type was known without a stat then
+    uint64_t ahead_stats;     // Types resolved beforehand by --uring or --prefetch
+    uint64_t bytes_written;   // Bytes written to stdout
+    uint64_t errors[STATS_ERRNO_LIMIT]; // Errors reported, by errno
+    latency_hist_t latency[STATS_CLASS_COUNT]; // Latencies by STATS_* class
+    struct thread_stats_s *next; // Next thread in stats_registry
+} thread_stats_t;
+
+// Errors counted under one directory for the --max-errors summary
+typedef struct error_dir_s {
+    char *path;               // The directory holding the failing paths, or NULL for a free slot
+    size_t len;               // Length of path
+    uint64_t hash;            // FNV-1a hash of path
+    uint64_t count;           // Errors counted under it
+} error_dir_t;
+
+// Errors reported by one thread: the messages not written yet and, with
+// --max-errors, the counts of the summary. Only their own thread writes
+// them; error_report writes out and adds up all of them at exit.
+typedef struct error_log_s {
+    char *pending;            // Complete messages not written yet
+    size_t pending_len;       // Number of pending bytes
+    size_t pending_capacity;  // Allocated size of pending
+    uint64_t by_errno[STATS_ERRNO_LIMIT]; // Errors by errno
+    error_dir_t *dirs;        // ERROR_DIR_SLOTS slots of directories with errors, or NULL
+    size_t dir_count;         // Directories in dirs
+    uint64_t other_dirs;      // Errors without a path or beyond the capacity of dirs
+    struct error_log_s *next; // Next thread in error_registry
+} error_log_t;
+
+// Error logs of every thread, and what is done with the errors.
+typedef struct error_registry_s {
+    pthread_mutex_t lock;     // Protects logs
+    error_log_t *logs;        // Logs of every thread that reported an error
+    size_t limit;             // Errors printed in full (--max-errors), SIZE_MAX for all
+    int buffered;             // Flag: hold messages in buffers (stderr is not a terminal)
+    atomic_size_t reported;   // Errors reported so far
+} error_registry_t;
+
+// Counters of all threads of a --stats run, and the phase timings of main.
+typedef struct stats_registry_s {
+    pthread_mutex_t lock;     // Protects threads
+    int enabled;              // Flag: --stats was given
+    thread_stats_t *threads;  // Counters of every thread that ran
+    uint64_t started;         // Clock when the run started, in nanoseconds
+    uint64_t phases[STATS_PHASE_COUNT]; // Time spent in each phase, in nanoseconds
+    uint64_t visited_entries; // Directories held by the -L visited sets
+    uint64_t visited_bytes;   // Memory of the slots of the -L visited sets
+} stats_registry_t;
+
+#if DIRWALK_USE_GETDENTS
+// Record layout returned by the getdents64 system call.
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    uint16_t d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+#if DIRWALK_USE_INOTIFY
+// Events --watch asks inotify for on every directory
+#define WATCH_INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | \
+                            IN_DELETE_SELF | IN_ONLYDIR)
+#endif
+
+// Everything declared from here on is defined in libdirwalk.c and hidden, so
+// that libdirwalk.so exports only the interface of dirwalk.h.
+#pragma GCC visibility push(hidden)
+
+// Exit status when writing to stdout fails (DIFF_TROUBLE with --diff)
+extern int write_failure_status;
+
+// Serializes flushes of the output buffers of all threads
+extern pthread_mutex_t output_lock;
+
+// Counters of every thread of a --stats run
+extern stats_registry_t stats_registry;
+
+// Counters of the calling thread, or NULL without --stats
+extern _Thread_local thread_stats_t *current_stats;
+
+// Error logs of every thread that reported errors while walking
+extern error_registry_t error_registry;
+
+// Error log of the calling thread, or NULL before its first error
+extern _Thread_local error_log_t *current_errors;
+
+// Functions of libdirwalk.c that the program calls
+int name_filter_match(const name_filter_t *filter, const char *name);
+int compare_strings(const void *a, const void *b);
+void *arena_alloc(arena_t *arena, size_t size);
+void free_results(results_t *results);
+void init_results(results_t *results, int compact, size_t mem_limit, const char *tmp_dir);
+uint32_t add_node(results_t *results, uint32_t parent, const char *name, size_t len, int type);
+void sort_results(results_t *results);
+void spill_results(results_t *results, FILE *file);
+void results_add_run(results_t *results, const sort_run_t *run);
+void merge_cursors(merge_cursor_t *cursors, size_t cursor_count, FILE *run, listing_t *listing,
+                          out_buf_t *out);
+void out_write_all(struct iovec *iov, int iov_count);
+void out_flush(out_buf_t *out);
+void out_entry(out_buf_t *out, const char *path, size_t len, int type);
+void path_init(path_buf_t *path);
+void path_reserve(path_buf_t *path, size_t needed);
+size_t path_push(path_buf_t *path, const char *name);
+void path_pop(path_buf_t *path, size_t old_len);
+void path_free(path_buf_t *path);
+void dirent_buf_init(dirent_buf_t *buf, int use_uring, size_t prefetch);
+void dirent_buf_free(dirent_buf_t *buf);
+int dir_reader_open(dir_reader_t *reader, int dir_fd, dirent_buf_t *buf);
+int dir_reader_next(dir_reader_t *reader, const char **name, unsigned char *d_type);
+int dir_reader_fd(const dir_reader_t *reader);
+void dir_reader_release(dir_reader_t *reader);
+int dir_reader_close(dir_reader_t *reader);
+void dir_reader_buffer(dir_reader_t *reader);
+int dir_reader_detach(dir_reader_t *reader);
+void dir_reader_reattach(dir_reader_t *reader, int fd);
+size_t default_max_open_dirs(void);
+void reopen_parent(walk_frame_t *parent, int child_fd);
+void visited_init(visited_set_t *set);
+void visited_free(visited_set_t *set);
+uint64_t index_hash(const char *path, size_t len);
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+int enter_directory(const walk_config_t *config, int dir_fd, const char *path);
+int directory_open_flags(const walk_config_t *config);
+int process_entry(int dir_fd, const char *name, unsigned char d_type, size_t depth,
+                         path_buf_t *parent, const walk_config_t *config, results_t *results,
+                         out_buf_t *out, dir_sum_t *counted);
+entry_handler_t select_entry_handler(const walk_config_t *config, int compact);
+void stats_attach(void);
+uint64_t stats_clock(void);
+int stats_openat(int dir_fd, const char *path, int flags);
+void error_count(error_log_t *log, int errnum, const char *path, size_t path_len);
+void walk_error(int errnum, const char *action, const char *path, size_t path_len);
+void error_flush(void);
+int listing_get_varint(const unsigned char **pos, const unsigned char *end, uint64_t *value);
+void listing_write(listing_t *listing, struct iovec *iov, int count);
+void listing_flush_block(listing_t *listing);
+#if DIRWALK_USE_FANOTIFY
+int watch_add_mount(watch_t *watch, int dir_fd, dev_t dev);
+#endif
+#if DIRWALK_USE_INOTIFY
+size_t watch_node_home(const watch_t *watch, int wd);
+watch_node_t *watch_node_find(const watch_t *watch, int wd);
+#endif
+
+#pragma GCC visibility pop
+
+#endif // DIRWALK_INTERNAL_H
@@ -0,0 +1,4640 @@
+/*
+ * libdirwalk: The directory walker of dirwalk, and the library interface of
+ *             dirwalk.h. A library walk is pulled one entry at a time, with
+ *             the serial walk loop kept on the walker between calls. The
+ *             directory readers, the name and metadata filters, the sorts,
+ *             the output buffers, the -L visited set, the --stats counters
+ *             and the error reports are also used by the program (dirwalk.c),
+ *             through dirwalk_internal.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L // Required for feature test macros like S_ISLNK, strdup
+#define _DEFAULT_SOURCE         // Required for d_type, DT_* constants and IFTODT
+
+#include "dirwalk_internal.h" // Types and functions shared with the program
+
+// Initial capacity for the results array when sorting
+#define INITIAL_RESULTS_CAPACITY 64
+
+// Initial capacity of the reusable path buffer used during traversal
+#define INITIAL_PATH_CAPACITY 4096
+
+// Initial size of the per-worker directory entry buffer (getdents64 backend)
+#define INITIAL_DIRENT_BUFFER_SIZE (1024 * 1024)
+
+// Maximum number of bytes requested from a single getdents64 call
+#define DIRENT_BATCH_SIZE (256 * 1024)
+
+// Buckets below this size are finished with insertion sort instead of radix passes
+#define RADIX_INSERTION_THRESHOLD 32
+
+// Number of runs of one level merged together by the external sort
+#define SORT_MERGE_FANIN 16
+
+// Number of submission queue entries of each worker's io_uring (--uring)
+#define STAT_RING_ENTRIES 256
+
+// Initial number of slots of the -L visited directory set (a power of two)
+#define INITIAL_VISITED_CAPACITY 1024
+
+// Initial capacity of the entries buffered for a directory closed to stay within --max-fds
+#define INITIAL_SPILL_CAPACITY 4096
+
+// Size from which a listing block may end, and size at which it always ends.
+// In between, it ends after an entry whose path hash has the LISTING_CUT_MASK
+// bits clear, once in 1024 entries on average. The minimum is kept well below
+// the average, so that where two listings differ, their blocks soon end at
+// the same entries again.
+#define LISTING_BLOCK_MIN (4 * 1024)
+#define LISTING_BLOCK_MAX (256 * 1024)
+#define LISTING_CUT_MASK 0x3ffu
+
+// Longest LEB128 encoding of a 64-bit integer
+#define LISTING_VARINT_MAX 10
+
+// zstd compression level of --front-coded=zstd
+#define LISTING_ZSTD_LEVEL 3
+
+// Bytes of error messages a thread holds before writing them to stderr,
+// when stderr is not a terminal
+#define ERROR_BUFFER_SIZE 16384
+
+// Bytes of output a starting path holds back in memory, waiting for the paths
+// before it, beyond which it spills to a temporary file
+#define ROOT_HOLD_SIZE (4 * 1024 * 1024)
+
+// Size of the header of a --binary record: path length, then entry type
+#define BINARY_RECORD_HEADER_SIZE (sizeof(uint32_t) + 1)
+
+// Returned by process_entry for a directory matching --prune
+#define ENTRY_PRUNED (-2)
+
+// Fields read for every entry counted by --summarize
+#define SUMMARY_FIELDS (META_SIZE | META_BLOCKS | META_INODE)
+
+// Metadata of an entry, as far as the metadata filters asked for it.
+typedef struct entry_meta_s {
+    int type;           // DT_* type
+    uint64_t size;      // Size in bytes
+    int64_t mtime_sec;  // Modification time, seconds
+    long mtime_nsec;    // Modification time, nanoseconds
+    uid_t uid;          // Owner
+    uint64_t blocks;    // Allocated 512-byte blocks
+    dev_t dev;          // Device
+    ino_t ino;          // Inode
+    uint64_t nlink;     // Number of hard links
+} entry_meta_t;
+
+// Flag bit in path_node_t.name_len marking a node that is itself a result
+#define PATH_NODE_LISTED 0x80000000u
+
+// Bits of path_node_t.name_len holding the name length; bits 24-30 hold the
+// DT_* type of a listed node
+#define PATH_NODE_LEN_MASK 0x00FFFFFFu
+#define PATH_NODE_TYPE_SHIFT 24
+
+// Size of each slab of the path arena used when sorting
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+
+// Pending range of the radix sort: records [lo, hi) share their first depth key bytes.
+typedef struct radix_range_s {
+    size_t lo;
+    size_t hi;
+    size_t depth;
+} radix_range_t;
+
+// Header of one record in a run file, followed by the path bytes and then the
+// key bytes. A key length of 0 means that the path is its own key.
+typedef struct run_record_header_s {
+    uint32_t path_len; // Length of the path
+    uint32_t key_len;  // Length of the sort key, or 0
+    uint8_t type;      // DT_* type of the entry
+} run_record_header_t;
+
+// A walk of the library interface (dirwalk.h): the state that
+// walk_directory_contents keeps on its stack, held between the calls of
+// dirwalk_next_entry.
+struct dirwalk_s {
+    walk_config_t config;     // What is listed, from the dirwalk_options_t
+    name_filter_t names;      // Empty name filters of config
+    meta_filter_t meta;       // Empty metadata filters of config
+    name_filter_t prune;      // Empty prune filters of config
+    visited_set_t visited;    // With follow_links, the directories entered so far
+    char *root;               // Copy of the starting path
+    size_t root_len;          // Length of root
+    int root_type;            // DT_* type of the starting path
+    int root_listed;          // Flag: the starting path is still to be returned
+    path_buf_t path;          // Path of the directory on top of the stack, then of the entry returned
+    size_t pop_len;           // Length to cut the path back to at the next call, or SIZE_MAX
+    dirent_buf_t entries;     // Directory entry buffer of the walk
+    walk_frame_t *stack;      // Directories being read, outermost first
+    size_t capacity;          // Allocated capacity of stack
+    size_t depth;             // Number of frames on the stack
+    size_t lowest_open;       // Frames [lowest_open, depth) hold an open descriptor
+    size_t max_open_dirs;     // Budget of open directories
+    int open_flags;           // Flags for opening directories
+    size_t errors;            // Errors reported so far
+    results_t results;        // With sort: every listed entry
+    int collected;            // Flag: with sort, the walk has been collected and sorted
+    size_t next_result;       // With sort: index of the next record to return
+};
+
+// Exit status when writing to stdout fails (DIFF_TROUBLE with --diff)
+int write_failure_status = EXIT_FAILURE;
+
+// Function Prototypes
+static int glob_match(const glob_token_t *tokens, size_t token_count, const char *name, size_t len,
+                      int fold_case);
+static int literal_equal(const char *name, const char *literal, size_t len, int fold_case);
+static int name_pattern_match(const name_pattern_t *pattern, const char *name, size_t len);
+static int stat_entry(int dir_fd, const char *name, int flags, unsigned fields, entry_meta_t *meta);
+static int entry_metadata(int dir_fd, const char *name, int follow_links, unsigned fields,
+                          entry_meta_t *meta, path_buf_t *parent);
+static int meta_filter_match(const meta_filter_t *filter, const entry_meta_t *meta);
+static int compare_nodes(const void *a, const void *b);
+static void arena_free(arena_t *arena);
+static void add_result(results_t *results, const char *path, size_t len, int type);
+static void node_path(const results_t *results, uint32_t node, path_buf_t *out);
+static int collation_is_bytewise(void);
+static int compare_records_from(const sort_record_t *a, const sort_record_t *b, size_t depth);
+static void radix_sort_records(sort_record_t *records, size_t count);
+static void sort_paths(results_t *results);
+static void sort_nodes(results_t *results);
+static FILE *run_create(const char *tmp_dir);
+static void run_write(FILE *file, const char *path, const unsigned char *key, int type);
+static void run_finish(FILE *file);
+static void merge_runs(results_t *results);
+static void cursor_load(merge_cursor_t *cursor);
+static int compare_cursors(const merge_cursor_t *a, const merge_cursor_t *b);
+static void out_write(out_buf_t *out, struct iovec *iov, int iov_count);
+#if DIRWALK_USE_IO_URING
+static int stat_ring_init(stat_ring_t *ring);
+static void stat_ring_free(stat_ring_t *ring);
+static void stat_ring_wait(stat_ring_t *ring, unsigned to_submit, unsigned in_flight);
+static void stat_ring_resolve(stat_ring_t *ring, int dir_fd, char *batch, size_t len);
+#endif
+#if DIRWALK_USE_GETDENTS
+static void prefetch_init(prefetch_t *prefetch, size_t thread_count);
+static void prefetch_destroy(prefetch_t *prefetch);
+static void *prefetch_main(void *arg);
+static void prefetch_clear(prefetch_t *prefetch);
+static void prefetch_publish(prefetch_t *prefetch, const void *owner, int dir_fd, char *batch, size_t len);
+static void prefetch_wait(prefetch_t *prefetch, const struct linux_dirent64 *record);
+#endif
+#if DIRWALK_USE_GETDENTS
+static void dirent_buf_reserve(dirent_buf_t *buf, size_t base);
+#endif
+static void dir_reader_spill(dir_reader_t *reader, unsigned char d_type, const char *name);
+static size_t visited_hash(dev_t dev, ino_t ino);
+static int visited_insert(visited_set_t *set, dev_t dev, ino_t ino);
+static int shard_owns(const walk_config_t *config, path_buf_t *parent, const char *name, size_t depth);
+static int resolve_entry_type(int dir_fd, const char *name, unsigned char d_type, int follow_links,
+                              path_buf_t *parent);
+static int classify_entry(int dir_fd, const char *name, unsigned char d_type, size_t depth,
+                          path_buf_t *parent, const walk_config_t *config, dir_sum_t *counted,
+                          int *listed);
+static int list_entry_unsorted(int dir_fd, const char *name, unsigned char d_type, size_t depth,
+                               path_buf_t *parent, const walk_config_t *config, results_t *results,
+                               out_buf_t *out, dir_sum_t *counted);
+static int list_entry_sorted(int dir_fd, const char *name, unsigned char d_type, size_t depth,
+                             path_buf_t *parent, const walk_config_t *config, results_t *results,
+                             out_buf_t *out, dir_sum_t *counted);
+static void root_stream_write(root_stream_t *stream, struct iovec *iov, int iov_count);
+static void stats_record(int class_id, uint64_t started);
+static void stats_error(int errnum);
+static size_t stats_bucket(uint64_t value);
+static error_log_t *error_log_get(void);
+static void listing_put_varint(path_buf_t *buf, uint64_t value);
+static void listing_add(listing_t *listing, const char *path, size_t len, int type);
+static int library_push(dirwalk_t *walker, int dir_fd, size_t parent_len);
+static int library_next(dirwalk_t *walker, dirwalk_entry_t *entry);
+static void watch_directory(watch_t *watch, int dir_fd, const char *path, dev_t dev);
+#if DIRWALK_USE_INOTIFY
+static watch_node_t *watch_node_insert(watch_t *watch, int wd);
+static void watch_add_inotify(watch_t *watch, int dir_fd, const char *path);
+#endif
+
+/*
+ * default_max_open_dirs: Computes the default --max-fds budget: half of the
+ *                        soft RLIMIT_NOFILE, leaving the rest for output,
+ *                        sort runs and helper descriptors.
+ *
+ * Parameters:
+ *   None.
+ *
+ * Returns:
+ *   The budget, between 1 and DEFAULT_MAX_OPEN_DIRS.
+ */
+size_t default_max_open_dirs(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY ||
+        limit.rlim_cur / 2 >= DEFAULT_MAX_OPEN_DIRS) {
+        return DEFAULT_MAX_OPEN_DIRS;
+    }
+    return limit.rlim_cur / 2 > 0 ? (size_t)(limit.rlim_cur / 2) : 1;
+}
+
+/*
+ * glob_match: Matches a name against compiled glob tokens. Only the most
+ *             recent star is ever backtracked to, which suffices for globs
+ *             and bounds the work by O(len * tokens) without recursion.
+ *
+ * Parameters:
+ *   tokens      - Compiled tokens.
+ *   token_count - Number of tokens.
+ *   name        - The name to test.
+ *   len         - Length of name.
+ *   fold_case   - Flag: lower-case name bytes before comparing.
+ *
+ * Returns:
+ *   1 if the whole name matches, 0 otherwise.
+ */
+static int glob_match(const glob_token_t *tokens, size_t token_count, const char *name, size_t len,
+                      int fold_case) {
+    size_t t = 0;
+    size_t i = 0;
+    size_t star_token = SIZE_MAX; // Token after the last star seen
+    size_t star_pos = 0;          // Name position that star currently stops at
+
+    while (i < len) {
+        if (t < token_count && tokens[t].kind == GLOB_STAR) {
+            star_token = ++t;
+            star_pos = i;
+            continue;
+        }
+        if (t < token_count) {
+            unsigned char c = (unsigned char)name[i];
+            const glob_token_t *token = &tokens[t];
+            int ok;
+            switch (token->kind) {
+                case GLOB_LITERAL: ok = (fold_case ? (unsigned char)tolower(c) : c) == token->byte; break;
+                case GLOB_CLASS: ok = (token->set[c >> 5] >> (c & 31)) & 1u; break;
+                default: ok = 1; break; // GLOB_ANY
+            }
+            if (ok) {
+                t++;
+                i++;
+                continue;
+            }
+        }
+        if (star_token == SIZE_MAX) {
+            return 0;
+        }
+        // Let the last star swallow one more byte and retry from there.
+        t = star_token;
+        i = ++star_pos;
+    }
+    while (t < token_count && tokens[t].kind == GLOB_STAR) {
+        t++;
+    }
+    return t == token_count;
+}
+
+/*
+ * literal_equal: Compares a name fragment with a pattern literal.
+ *
+ * Parameters:
+ *   name      - Start of the fragment.
+ *   literal   - The literal (lower case if fold_case is set).
+ *   len       - Number of bytes to compare.
+ *   fold_case - Flag: lower-case name bytes before comparing.
+ *
+ * Returns:
+ *   1 if the bytes are equal, 0 otherwise.
+ */
+static int literal_equal(const char *name, const char *literal, size_t len, int fold_case) {
+    if (!fold_case) {
+        return memcmp(name, literal, len) == 0;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        if ((char)tolower((unsigned char)name[i]) != literal[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * name_pattern_match: Matches a name against one compiled pattern.
+ *
+ * Parameters:
+ *   pattern - The compiled pattern.
+ *   name    - The name to test (NUL-terminated at len).
+ *   len     - Length of name.
+ *
+ * Returns:
+ *   1 on a match, 0 otherwise.
+ */
+static int name_pattern_match(const name_pattern_t *pattern, const char *name, size_t len) {
+    switch (pattern->kind) {
+        case NAME_MATCH_EXACT:
+            return len == pattern->literal_len && literal_equal(name, pattern->literal, len, pattern->fold_case);
+        case NAME_MATCH_PREFIX:
+            return len >= pattern->literal_len &&
+                   literal_equal(name, pattern->literal, pattern->literal_len, pattern->fold_case);
+        case NAME_MATCH_SUFFIX:
+            return len >= pattern->literal_len &&
+                   literal_equal(name + len - pattern->literal_len, pattern->literal, pattern->literal_len,
+                                 pattern->fold_case);
+        case NAME_MATCH_GLOB:
+            return glob_match(pattern->tokens, pattern->token_count, name, len, pattern->fold_case);
+        default:
+            return regexec(&pattern->regex, name, 0, NULL, 0) == 0;
+    }
+}
+
+/*
+ * name_filter_match: Tests an entry name against the name filters. It needs
+ *                    only the name, so it runs before any stat or path building.
+ *
+ * Parameters:
+ *   filter - The name filters.
+ *   name   - Name of the entry. For the starting path, which may contain
+ *            slashes, its last component is tested, as find does.
+ *
+ * Returns:
+ *   1 if there are no filters or any of them matches, 0 otherwise.
+ *   Aborts on memory allocation failure.
+ */
+int name_filter_match(const name_filter_t *filter, const char *name) {
+    size_t len;
+    size_t start;
+    char *copy = NULL;
+    int matched = 0;
+
+    if (filter->count == 0) {
+        return 1;
+    }
+
+    // Entry names have no slashes; only the starting path needs trimming.
+    len = strlen(name);
+    while (len > 1 && name[len - 1] == '/') {
+        len--;
+    }
+    start = len;
+    while (start > 0 && name[start - 1] != '/') {
+        start--;
+    }
+    if (start == len) {
+        start = 0; // "/" itself
+    }
+    if (name[len] != '\0') {
+        copy = strndup(name + start, len - start);
+        if (copy == NULL) {
+            perror("Error allocating name");
+            abort();
+        }
+    }
+
+    for (size_t i = 0; i < filter->count && !matched; ++i) {
+        matched = name_pattern_match(&filter->patterns[i], copy != NULL ? copy : name + start, len - start);
+    }
+    free(copy);
+    return matched;
+}
+
+/*
+ * compare_strings: Comparison function for qsort, using locale-aware comparison.
+ *                  Paths that collate equally are ordered bytewise, so the sorted
+ *                  output does not depend on the order in which paths were found.
+ *
+ * Parameters:
+ *   a - Pointer to the first string (char **).
+ *   b - Pointer to the second string (char **).
+ *
+ * Returns:
+ *   An integer based on strcoll comparison, with strcmp as the tie-breaker.
+ */
+int compare_strings(const void *a, const void *b) {
+    int result = strcoll(*(const char **)a, *(const char **)b);
+    if (result != 0) {
+        return result;
+    }
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*
+ * arena_alloc: Allocates bytes from the arena, starting a new chunk when the
+ *              current one is full. Requests larger than a chunk get their own.
+ *
+ * Parameters:
+ *   arena - Pointer to the arena_t structure.
+ *   size  - Number of bytes to allocate.
+ *
+ * Returns:
+ *   Pointer to the allocated bytes. Aborts on memory allocation failure.
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+    arena_chunk_t *chunk = arena->head;
+
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = (arena_chunk_t *)malloc(sizeof(arena_chunk_t) + chunk_size);
+        if (chunk == NULL) {
+            perror("Error allocating path arena chunk");
+            abort();
+        }
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/*
+ * arena_free: Releases every chunk of the arena.
+ *
+ * Parameters:
+ *   arena - Pointer to the arena_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void arena_free(arena_t *arena) {
+    arena_chunk_t *chunk = arena->head;
+
+    while (chunk != NULL) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+}
+
+/*
+ * add_result: Adds a path string to the dynamic results array, resizing if necessary.
+ *             The string is copied into the results arena.
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure.
+ *   path    - The path string to add (will be copied).
+ *   len     - Length of path, excluding the terminator.
+ *   type    - DT_* type of the entry, kept in the byte before the copy.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void add_result(results_t *results, const char *path, size_t len, int type) {
+    if (results == NULL) return;
+
+    if (results->count >= results->capacity) {
+        size_t new_capacity = results->capacity * 2;
+        if (new_capacity <= results->capacity) {
+            fprintf(stderr, "Error: Result capacity overflow for results array\n");
+            abort();
+        }
+        char **new_paths = (char **)realloc(results->paths, new_capacity * sizeof(char *));
+        if (new_paths == NULL) {
+            perror("Error reallocating results array");
+            free_results(results);
+            abort();
+        }
+        results->paths = new_paths;
+        results->capacity = new_capacity;
+    }
+
+    char *copy = (char *)arena_alloc(&results->arena, len + 2);
+    copy[0] = (char)type;
+    memcpy(copy + 1, path, len + 1);
+    results->paths[results->count++] = copy + 1;
+
+    if (results->mem_limit > 0) {
+        results->mem_used += len + 2 + sizeof(char *) + sizeof(sort_record_t);
+        if (results->mem_used > results->mem_limit && !results->checkpoint_runs) {
+            spill_results(results, run_create(results->tmp_dir));
+        }
+    }
+}
+
+/*
+ * init_results: Allocates the initial results array (or node array in compact mode).
+ *
+ * Parameters:
+ *   results   - Pointer to the results_t structure.
+ *   compact   - Flag: store results as path nodes.
+ *   mem_limit - Memory budget before sorted runs are spilled, or 0 for none
+ *               (default storage mode only).
+ *   tmp_dir   - Directory for spilled runs.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+void init_results(results_t *results, int compact, size_t mem_limit, const char *tmp_dir) {
+    memset(results, 0, sizeof(*results));
+    results->compact = compact;
+    results->mem_limit = mem_limit;
+    results->tmp_dir = tmp_dir;
+    results->dir_node = PATH_NODE_NONE;
+    results->last_node = PATH_NODE_NONE;
+    if (compact) {
+        results->nodes = (path_node_t *)malloc(INITIAL_RESULTS_CAPACITY * sizeof(path_node_t));
+        if (results->nodes == NULL) {
+            perror("Error allocating initial node array");
+            abort();
+        }
+        results->node_capacity = INITIAL_RESULTS_CAPACITY;
+        return;
+    }
+    results->paths = (char **)malloc(INITIAL_RESULTS_CAPACITY * sizeof(char *));
+    if (results->paths == NULL) {
+        perror("Error allocating initial results array");
+        abort();
+    }
+    results->capacity = INITIAL_RESULTS_CAPACITY;
+}
+
+/*
+ * free_results: Frees the memory allocated for the results array and its contents.
+ *               The path strings are released chunk by chunk with the arena.
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+void free_results(results_t *results) {
+    if (results == NULL) {
+        return;
+    }
+    arena_free(&results->arena);
+    arena_free(&results->keys);
+    free(results->paths);
+    free(results->nodes);
+    free(results->records);
+    free(results->order);
+    for (size_t i = 0; i < results->run_count; ++i) {
+        fclose(results->runs[i].file);
+    }
+    free(results->runs);
+    results->runs = NULL;
+    results->run_count = 0;
+    results->run_capacity = 0;
+    results->paths = NULL;
+    results->nodes = NULL;
+    results->records = NULL;
+    results->order = NULL;
+    results->count = 0;
+    results->capacity = 0;
+    results->node_count = 0;
+    results->node_capacity = 0;
+}
+
+/*
+ * add_node: Appends a node to the compact path store, resizing if necessary.
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure (compact mode).
+ *   parent  - Index of the parent node, or PATH_NODE_NONE for a root.
+ *   name    - The name (or, for a root, the path prefix); copied into the arena
+ *             unless it already lives there.
+ *   len     - Length of name.
+ *   type    - DT_* type of the entry if the node is itself a result, or -1.
+ *
+ * Returns:
+ *   Index of the new node. Aborts on memory allocation failure or overflow.
+ */
+uint32_t add_node(results_t *results, uint32_t parent, const char *name, size_t len, int type) {
+    if (results->node_count >= results->node_capacity) {
+        size_t new_capacity = results->node_capacity * 2;
+        if (new_capacity >= PATH_NODE_NONE) {
+            new_capacity = PATH_NODE_NONE - 1;
+        }
+        if (new_capacity <= results->node_capacity) {
+            fprintf(stderr, "Error: Node capacity overflow for compact results\n");
+            abort();
+        }
+        path_node_t *new_nodes = (path_node_t *)realloc(results->nodes, new_capacity * sizeof(path_node_t));
+        if (new_nodes == NULL) {
+            perror("Error reallocating node array");
+            free_results(results);
+            abort();
+        }
+        results->nodes = new_nodes;
+        results->node_capacity = new_capacity;
+    }
+
+    if (len > PATH_NODE_LEN_MASK) {
+        fprintf(stderr, "Error: Name too long for compact results\n");
+        abort();
+    }
+
+    path_node_t *node = &results->nodes[results->node_count];
+    if (type >= 0) {
+        char *copy = (char *)arena_alloc(&results->arena, len);
+        memcpy(copy, name, len);
+        node->name = copy;
+        results->count++;
+    } else {
+        node->name = name;
+    }
+    node->parent = parent;
+    node->name_len = (uint32_t)len;
+    if (type >= 0) {
+        node->name_len |= PATH_NODE_LISTED | ((uint32_t)type << PATH_NODE_TYPE_SHIFT);
+    }
+    return (uint32_t)results->node_count++;
+}
+
+/*
+ * node_path: Rebuilds the full path of a node from the chain of its ancestors.
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure (compact mode).
+ *   node    - Index of the node.
+ *   out     - Path buffer receiving the NUL-terminated path.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void node_path(const results_t *results, uint32_t node, path_buf_t *out) {
+    size_t len = 0;
+
+    // First pass: measure, using the same separator rule as path_push.
+    for (uint32_t id = node; id != PATH_NODE_NONE; id = results->nodes[id].parent) {
+        const path_node_t *current = &results->nodes[id];
+        len += current->name_len & PATH_NODE_LEN_MASK;
+        if (current->parent != PATH_NODE_NONE) {
+            const path_node_t *parent = &results->nodes[current->parent];
+            size_t parent_len = parent->name_len & PATH_NODE_LEN_MASK;
+            if (parent_len == 0 || parent->name[parent_len - 1] != '/') {
+                len++;
+            }
+        }
+    }
+
+    path_reserve(out, len + 1);
+    out->len = len;
+    out->data[len] = '\0';
+
+    // Second pass: fill from the end.
+    for (uint32_t id = node; id != PATH_NODE_NONE; id = results->nodes[id].parent) {
+        const path_node_t *current = &results->nodes[id];
+        size_t name_len = current->name_len & PATH_NODE_LEN_MASK;
+        len -= name_len;
+        memcpy(out->data + len, current->name, name_len);
+        if (current->parent != PATH_NODE_NONE) {
+            const path_node_t *parent = &results->nodes[current->parent];
+            size_t parent_len = parent->name_len & PATH_NODE_LEN_MASK;
+            if (parent_len == 0 || parent->name[parent_len - 1] != '/') {
+                out->data[--len] = '/';
+            }
+        }
+    }
+}
+
+// Context of compare_nodes: the store being sorted and two scratch buffers.
+// Thread-local so that separate stores can be sorted concurrently.
+static _Thread_local const results_t *sort_nodes_store = NULL;
+static _Thread_local path_buf_t sort_nodes_left;
+static _Thread_local path_buf_t sort_nodes_right;
+
+/*
+ * compare_nodes: Comparison function for qsort over node indices in compact mode.
+ *                Rebuilds both full paths and compares them with compare_strings,
+ *                so the order is exactly that of the default storage mode.
+ *
+ * Parameters:
+ *   a - Pointer to the first node index (uint32_t *).
+ *   b - Pointer to the second node index (uint32_t *).
+ *
+ * Returns:
+ *   An integer based on compare_strings of the two full paths.
+ */
+static int compare_nodes(const void *a, const void *b) {
+    const char *left;
+    const char *right;
+
+    node_path(sort_nodes_store, *(const uint32_t *)a, &sort_nodes_left);
+    node_path(sort_nodes_store, *(const uint32_t *)b, &sort_nodes_right);
+    left = sort_nodes_left.data;
+    right = sort_nodes_right.data;
+    return compare_strings(&left, &right);
+}
+
+/*
+ * collation_is_bytewise: Tells whether the current LC_COLLATE orders strings by
+ *                        their bytes, in which case strcoll is equivalent to strcmp.
+ *                        Besides C and POSIX, that holds for locales such as
+ *                        C.UTF-8, whose strxfrm leaves strings unchanged; a
+ *                        collating locale turns them into longer weight strings.
+ *
+ * Parameters:
+ *   None.
+ *
+ * Returns:
+ *   1 for the C and POSIX locales and for locales whose strxfrm is the
+ *   identity on a probe of mixed case, digits, punctuation and UTF-8 text,
+ *   0 otherwise.
+ */
+static int collation_is_bytewise(void) {
+    static const char probe[] = "Aa_-.Zz09 ~/\x7f\xc3\xa9\xe2\x82\xac";
+    char transformed[4 * sizeof(probe)];
+    const char *name = setlocale(LC_COLLATE, NULL);
+    size_t len;
+
+    if (name == NULL || strcmp(name, "C") == 0 || strcmp(name, "POSIX") == 0) {
+        return 1;
+    }
+    len = strxfrm(transformed, probe, sizeof(transformed));
+    return len == sizeof(probe) - 1 && memcmp(transformed, probe, len) == 0;
+}
+
+/*
+ * compare_records_from: Compares two sort records whose keys are known to be
+ *                       equal before the given depth. Equal keys are ordered by
+ *                       their paths, like compare_strings does.
+ *
+ * Parameters:
+ *   a     - Pointer to the first record.
+ *   b     - Pointer to the second record.
+ *   depth - Number of leading key bytes already known to be equal.
+ *
+ * Returns:
+ *   A negative, zero or positive integer, as for strcmp.
+ */
+static int compare_records_from(const sort_record_t *a, const sort_record_t *b, size_t depth) {
+    int result = strcmp((const char *)a->key + depth, (const char *)b->key + depth);
+    if (result != 0 || a->key == (const unsigned char *)a->path) {
+        return result;
+    }
+    return strcmp(a->path, b->path);
+}
+
+/*
+ * radix_sort_records: Sorts records by key with an in-place MSD radix sort
+ *                     (American flag sort). Each pass distributes a range by one
+ *                     key byte, touching the records sequentially; small ranges
+ *                     are finished with insertion sort. Pending ranges are kept
+ *                     on a heap stack, so long shared prefixes cannot exhaust
+ *                     the call stack.
+ *
+ * Parameters:
+ *   records - Array of records to sort.
+ *   count   - Number of records.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void radix_sort_records(sort_record_t *records, size_t count) {
+    radix_range_t *stack = NULL;
+    size_t stack_count = 0;
+    size_t stack_capacity = 256;
+    size_t bucket_count[256];
+    size_t bucket_next[256];
+    size_t bucket_end[256];
+
+    if (count < 2) {
+        return;
+    }
+
+    stack = (radix_range_t *)malloc(stack_capacity * sizeof(radix_range_t));
+    if (stack == NULL) {
+        perror("Error allocating sort stack");
+        abort();
+    }
+    stack[stack_count++] = (radix_range_t){0, count, 0};
+
+    while (stack_count > 0) {
+        radix_range_t range = stack[--stack_count];
+        size_t n = range.hi - range.lo;
+        sort_record_t *base = records + range.lo;
+
+        if (n < RADIX_INSERTION_THRESHOLD) {
+            for (size_t i = 1; i < n; ++i) {
+                sort_record_t current = base[i];
+                size_t j = i;
+                while (j > 0 && compare_records_from(&base[j - 1], &current, range.depth) > 0) {
+                    base[j] = base[j - 1];
+                    j--;
+                }
+                base[j] = current;
+            }
+            continue;
+        }
+
+        memset(bucket_count, 0, sizeof(bucket_count));
+        for (size_t i = 0; i < n; ++i) {
+            bucket_count[base[i].key[range.depth]]++;
+        }
+
+        // All records share this byte: move on to the next one without a pass.
+        unsigned char first = base[0].key[range.depth];
+        if (first != 0 && bucket_count[first] == n) {
+            range.depth++;
+            stack[stack_count++] = range;
+            continue;
+        }
+
+        size_t offset = 0;
+        for (size_t b = 0; b < 256; ++b) {
+            bucket_next[b] = offset;
+            offset += bucket_count[b];
+            bucket_end[b] = offset;
+        }
+
+        // Permute in place: move each record into its bucket by following cycles.
+        for (size_t b = 0; b < 256; ++b) {
+            while (bucket_next[b] < bucket_end[b]) {
+                sort_record_t current = base[bucket_next[b]];
+                unsigned char byte = current.key[range.depth];
+                while (byte != b) {
+                    sort_record_t displaced = base[bucket_next[byte]];
+                    base[bucket_next[byte]++] = current;
+                    current = displaced;
+                    byte = current.key[range.depth];
+                }
+                base[bucket_next[b]++] = current;
+            }
+        }
+
+        // Bucket 0 holds keys that end here. They are all equal, so only the
+        // path tie-break is left to apply.
+        if (bucket_count[0] > 1) {
+            for (size_t i = 1; i < bucket_count[0]; ++i) {
+                sort_record_t current = base[i];
+                size_t j = i;
+                while (j > 0 && strcmp(base[j - 1].path, current.path) > 0) {
+                    base[j] = base[j - 1];
+                    j--;
+                }
+                base[j] = current;
+            }
+        }
+
+        if (stack_count + 256 > stack_capacity) {
+            stack_capacity *= 2;
+            radix_range_t *new_stack = (radix_range_t *)realloc(stack, stack_capacity * sizeof(radix_range_t));
+            if (new_stack == NULL) {
+                perror("Error reallocating sort stack");
+                abort();
+            }
+            stack = new_stack;
+        }
+        for (size_t b = 1; b < 256; ++b) {
+            if (bucket_count[b] > 1) {
+                size_t lo = range.lo + bucket_end[b] - bucket_count[b];
+                stack[stack_count++] = (radix_range_t){lo, lo + bucket_count[b], range.depth + 1};
+            }
+        }
+    }
+
+    free(stack);
+}
+
+/*
+ * sort_paths: Sorts the paths of a results array in compare_strings order.
+ *             Every path gets its sort key once (itself for bytewise
+ *             collation, otherwise its strxfrm transformation), and the
+ *             records are radix sorted on those keys. The sorted records
+ *             replace the paths array and keep their keys for merging.
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure (default storage mode).
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void sort_paths(results_t *results) {
+    size_t count = results->count;
+    sort_record_t *records;
+    arena_t *keys = &results->keys;
+    char *scratch = NULL;
+    size_t scratch_size = 0;
+
+    records = (sort_record_t *)malloc((count > 0 ? count : 1) * sizeof(sort_record_t));
+    if (records == NULL) {
+        perror("Error allocating sort records");
+        abort();
+    }
+
+    if (collation_is_bytewise()) {
+        for (size_t i = 0; i < count; ++i) {
+            records[i].key = (const unsigned char *)results->paths[i];
+            records[i].path = results->paths[i];
+        }
+    } else {
+        scratch_size = INITIAL_PATH_CAPACITY;
+        scratch = (char *)malloc(scratch_size);
+        if (scratch == NULL) {
+            perror("Error allocating sort key buffer");
+            abort();
+        }
+        for (size_t i = 0; i < count; ++i) {
+            size_t key_len = strxfrm(scratch, results->paths[i], scratch_size);
+            if (key_len >= scratch_size) {
+                while (scratch_size <= key_len) {
+                    scratch_size *= 2;
+                }
+                free(scratch);
+                scratch = (char *)malloc(scratch_size);
+                if (scratch == NULL) {
+                    perror("Error allocating sort key buffer");
+                    abort();
+                }
+                strxfrm(scratch, results->paths[i], scratch_size);
+            }
+            unsigned char *key = (unsigned char *)arena_alloc(keys, key_len + 1);
+            memcpy(key, scratch, key_len + 1);
+            records[i].key = key;
+            records[i].path = results->paths[i];
+        }
+        free(scratch);
+    }
+
+    radix_sort_records(records, count);
+
+    free(results->paths);
+    results->paths = NULL;
+    results->capacity = 0;
+    results->records = records;
+}
+
+/*
+ * sort_nodes: Sorts the listed nodes of a compact results array in
+ *             compare_strings order of their full paths, into results->order.
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure (compact mode).
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void sort_nodes(results_t *results) {
+    uint32_t *order = (uint32_t *)malloc((results->count > 0 ? results->count : 1) * sizeof(uint32_t));
+    if (order == NULL) {
+        perror("Error allocating sort order");
+        abort();
+    }
+    size_t listed = 0;
+    for (size_t i = 0; i < results->node_count; ++i) {
+        if (results->nodes[i].name_len & PATH_NODE_LISTED) {
+            order[listed++] = (uint32_t)i;
+        }
+    }
+
+    path_init(&sort_nodes_left);
+    path_init(&sort_nodes_right);
+    sort_nodes_store = results;
+    qsort(order, listed, sizeof(uint32_t), compare_nodes);
+    sort_nodes_store = NULL;
+    path_free(&sort_nodes_left);
+    path_free(&sort_nodes_right);
+
+    results->order = order;
+}
+
+/*
+ * sort_results: Sorts a results array (one shard in parallel mode) in place,
+ *               using the method of its storage mode. Safe to call from the
+ *               worker thread that owns the shard.
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+void sort_results(results_t *results) {
+    if (results->sorted) {
+        return;
+    }
+    if (results->compact) {
+        sort_nodes(results);
+    } else {
+        sort_paths(results);
+    }
+    results->sorted = 1;
+}
+
+/*
+ * run_create: Creates an anonymous run file for the external sort (or for the
+ *             output a starting path holds back with -j). The file is
+ *             unlinked right away, so it disappears once closed, even if the
+ *             program is killed.
+ *
+ * Parameters:
+ *   tmp_dir - Directory in which to create the file.
+ *
+ * Returns:
+ *   The open run file. Exits with failure if it cannot be created.
+ */
+static FILE *run_create(const char *tmp_dir) {
+    size_t size = strlen(tmp_dir) + sizeof("/dirwalk-run-XXXXXX");
+    char *name = (char *)malloc(size);
+    if (name == NULL) {
+        perror("Error allocating run file name");
+        abort();
+    }
+    snprintf(name, size, "%s/dirwalk-run-XXXXXX", tmp_dir);
+
+    int fd = mkstemp(name);
+    if (fd == -1) {
+        fprintf(stderr, "Error creating temporary file in '%s': %s\n", tmp_dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    unlink(name);
+    free(name);
+
+    FILE *file = fdopen(fd, "w+b");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening temporary file in '%s': %s\n", tmp_dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(file, NULL, _IOFBF, RUN_BUFFER_SIZE);
+    return file;
+}
+
+/*
+ * run_write: Appends one record to a run file.
+ *
+ * Parameters:
+ *   file - The run file.
+ *   path - The path of the record.
+ *   key  - Its sort key, or the path itself (or NULL) for bytewise collation.
+ *   type - DT_* type of the entry.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing fails.
+ */
+static void run_write(FILE *file, const char *path, const unsigned char *key, int type) {
+    run_record_header_t header;
+
+    memset(&header, 0, sizeof(header));
+    header.type = (uint8_t)type;
+    header.path_len = (uint32_t)strlen(path);
+    header.key_len = (key == NULL || key == (const unsigned char *)path) ? 0 : (uint32_t)strlen((const char *)key);
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(path, 1, header.path_len, file) != header.path_len ||
+        fwrite(key, 1, header.key_len, file) != header.key_len) {
+        perror("Error writing sort run");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * run_finish: Flushes a fully written run file and rewinds it for merging.
+ *
+ * Parameters:
+ *   file - The run file.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if flushing fails.
+ */
+static void run_finish(FILE *file) {
+    if (fflush(file) != 0 || fseek(file, 0, SEEK_SET) != 0) {
+        perror("Error writing sort run");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * spill_results: Sorts the paths collected so far, writes them out as a new
+ *                run and empties the in-memory results, then merges the
+ *                newest runs while SORT_MERGE_FANIN of them share a level
+ *                (unless the runs belong to a --checkpoint).
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure (default storage mode).
+ *   file    - Empty run file receiving the paths; it passes to the results.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure; exits with failure on I/O errors.
+ */
+void spill_results(results_t *results, FILE *file) {
+    size_t capacity = results->capacity;
+    sort_run_t run = {file, results->count, 0};
+
+    sort_paths(results);
+    for (size_t i = 0; i < results->count; ++i) {
+        run_write(file, results->records[i].path, results->records[i].key,
+                  (unsigned char)results->records[i].path[-1]);
+    }
+    run_finish(file);
+    results_add_run(results, &run);
+
+    // Start over with an empty array of the same capacity.
+    arena_free(&results->arena);
+    arena_free(&results->keys);
+    free(results->records);
+    results->records = NULL;
+    results->paths = (char **)malloc(capacity * sizeof(char *));
+    if (results->paths == NULL) {
+        perror("Error allocating results array");
+        abort();
+    }
+    results->capacity = capacity;
+    results->count = 0;
+    results->mem_used = 0;
+
+    while (!results->checkpoint_runs && results->run_count >= SORT_MERGE_FANIN &&
+           results->runs[results->run_count - SORT_MERGE_FANIN].level ==
+           results->runs[results->run_count - 1].level) {
+        merge_runs(results);
+    }
+}
+
+/*
+ * results_add_run: Appends a sorted run to the runs of the results, growing
+ *                  the array if necessary.
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure.
+ *   run     - The run; its file passes to the results.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+void results_add_run(results_t *results, const sort_run_t *run) {
+    if (results->run_count >= results->run_capacity) {
+        size_t new_capacity = results->run_capacity > 0 ? results->run_capacity * 2 : SORT_MERGE_FANIN;
+        sort_run_t *new_runs = (sort_run_t *)realloc(results->runs, new_capacity * sizeof(sort_run_t));
+        if (new_runs == NULL) {
+            perror("Error reallocating sort runs");
+            abort();
+        }
+        results->runs = new_runs;
+        results->run_capacity = new_capacity;
+    }
+    results->runs[results->run_count++] = *run;
+}
+
+/*
+ * merge_runs: Merges the newest SORT_MERGE_FANIN runs into a single run of
+ *             the next level.
+ *
+ * Parameters:
+ *   results - Pointer to the results_t structure owning the runs.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure; exits with failure on I/O errors.
+ */
+static void merge_runs(results_t *results) {
+    merge_cursor_t cursors[SORT_MERGE_FANIN];
+    sort_run_t *first = &results->runs[results->run_count - SORT_MERGE_FANIN];
+    sort_run_t merged = {run_create(results->tmp_dir), 0, first->level + 1};
+
+    memset(cursors, 0, sizeof(cursors));
+    for (size_t i = 0; i < SORT_MERGE_FANIN; ++i) {
+        cursors[i].run = first[i].file;
+        cursors[i].count = first[i].count;
+        merged.count += first[i].count;
+    }
+    merge_cursors(cursors, SORT_MERGE_FANIN, merged.file, NULL, NULL);
+    run_finish(merged.file);
+
+    for (size_t i = 0; i < SORT_MERGE_FANIN; ++i) {
+        fclose(first[i].file);
+    }
+    results->run_count -= SORT_MERGE_FANIN;
+    results->runs[results->run_count++] = merged;
+}
+
+/*
+ * cursor_load: Loads the next item of a sorted shard or run into a merge cursor.
+ *
+ * Parameters:
+ *   cursor - Pointer to the merge_cursor_t structure.
+ *
+ * Returns:
+ *   Nothing. Sets cursor->path to NULL once the shard is exhausted.
+ *   Exits with failure if a run cannot be read.
+ */
+static void cursor_load(merge_cursor_t *cursor) {
+    results_t *shard = cursor->shard;
+
+    if (cursor->next >= cursor->count) {
+        cursor->path = NULL;
+        cursor->key = NULL;
+        return;
+    }
+    if (shard == NULL) {
+        run_record_header_t header;
+        int ok;
+        if (cursor->scratch.data == NULL) {
+            path_init(&cursor->scratch);
+            path_init(&cursor->key_scratch);
+        }
+        ok = fread(&header, sizeof(header), 1, cursor->run) == 1;
+        if (ok) {
+            path_reserve(&cursor->scratch, (size_t)header.path_len + 1);
+            path_reserve(&cursor->key_scratch, (size_t)header.key_len + 1);
+            ok = fread(cursor->scratch.data, 1, header.path_len, cursor->run) == header.path_len &&
+                 fread(cursor->key_scratch.data, 1, header.key_len, cursor->run) == header.key_len;
+        }
+        if (!ok) {
+            fprintf(stderr, "Error reading sort run: %s\n",
+                    ferror(cursor->run) ? strerror(errno) : "unexpected end of file");
+            exit(EXIT_FAILURE);
+        }
+        cursor->scratch.data[header.path_len] = '\0';
+        cursor->key_scratch.data[header.key_len] = '\0';
+        cursor->path = cursor->scratch.data;
+        cursor->type = header.type;
+        cursor->key = header.key_len > 0 ? (const unsigned char *)cursor->key_scratch.data
+                                        : (const unsigned char *)cursor->scratch.data;
+    } else if (shard->compact) {
+        uint32_t name_len = shard->nodes[shard->order[cursor->next]].name_len;
+        node_path(shard, shard->order[cursor->next], &cursor->scratch);
+        cursor->path = cursor->scratch.data;
+        cursor->type = (unsigned char)((name_len & ~PATH_NODE_LISTED) >> PATH_NODE_TYPE_SHIFT);
+        cursor->key = NULL;
+    } else {
+        cursor->path = shard->records[cursor->next].path;
+        cursor->type = (unsigned char)cursor->path[-1];
+        cursor->key = shard->records[cursor->next].key;
+    }
+    cursor->next++;
+}
+
+/*
+ * compare_cursors: Orders two non-exhausted merge cursors by their current items,
+ *                  consistently with compare_strings.
+ *
+ * Parameters:
+ *   a - Pointer to the first cursor.
+ *   b - Pointer to the second cursor.
+ *
+ * Returns:
+ *   A negative, zero or positive integer, as for strcmp.
+ */
+static int compare_cursors(const merge_cursor_t *a, const merge_cursor_t *b) {
+    if (a->key != NULL && b->key != NULL) {
+        int result = strcmp((const char *)a->key, (const char *)b->key);
+        return result != 0 ? result : strcmp(a->path, b->path);
+    }
+    return compare_strings(&a->path, &b->path);
+}
+
+/*
+ * merge_cursors: Streams the k-way merge of sorted cursors, keeping the
+ *                cursors in a binary min-heap ordered by their current items.
+ *                The scratch buffers of the cursors are freed afterwards.
+ *
+ * Parameters:
+ *   cursors      - Array of cursors, each set up on a shard or a run but not
+ *                  loaded yet.
+ *   cursor_count - Number of cursors.
+ *   run          - Run file receiving the merged records, or NULL to print
+ *                  the paths instead.
+ *   listing      - Listing receiving the paths when run is NULL, or NULL to
+ *                  print them to out.
+ *   out          - Output buffer for the paths when run and listing are NULL.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing the output fails.
+ */
+void merge_cursors(merge_cursor_t *cursors, size_t cursor_count, FILE *run, listing_t *listing,
+                          out_buf_t *out) {
+    size_t *heap;
+    size_t heap_size = 0;
+
+    heap = (size_t *)malloc((cursor_count > 0 ? cursor_count : 1) * sizeof(size_t));
+    if (heap == NULL) {
+        perror("Error allocating merge heap");
+        abort();
+    }
+
+    for (size_t i = 0; i < cursor_count; ++i) {
+        merge_cursor_t *cursor = &cursors[i];
+        cursor_load(cursor);
+        if (cursor->path == NULL) {
+            continue;
+        }
+        // Sift the new cursor up.
+        size_t pos = heap_size++;
+        while (pos > 0 && compare_cursors(cursor, &cursors[heap[(pos - 1) / 2]]) < 0) {
+            heap[pos] = heap[(pos - 1) / 2];
+            pos = (pos - 1) / 2;
+        }
+        heap[pos] = i;
+    }
+
+    while (heap_size > 0) {
+        size_t moving = heap[0];
+        merge_cursor_t *top = &cursors[moving];
+        if (run != NULL) {
+            run_write(run, top->path, top->key, top->type);
+        } else if (listing != NULL) {
+            listing_add(listing, top->path, strlen(top->path), top->type);
+        } else {
+            out_entry(out, top->path, strlen(top->path), top->type);
+        }
+
+        cursor_load(top);
+        if (top->path == NULL) {
+            // Cursor exhausted: replace the root with the last heap element.
+            moving = heap[--heap_size];
+            if (heap_size == 0) {
+                break;
+            }
+        }
+
+        // Sift the cursor at the root down.
+        size_t pos = 0;
+        for (;;) {
+            size_t child = 2 * pos + 1;
+            if (child >= heap_size) {
+                break;
+            }
+            if (child + 1 < heap_size && compare_cursors(&cursors[heap[child + 1]], &cursors[heap[child]]) < 0) {
+                child++;
+            }
+            if (compare_cursors(&cursors[heap[child]], &cursors[moving]) >= 0) {
+                break;
+            }
+            heap[pos] = heap[child];
+            pos = child;
+        }
+        heap[pos] = moving;
+    }
+
+    for (size_t i = 0; i < cursor_count; ++i) {
+        if (cursors[i].scratch.data != NULL) {
+            path_free(&cursors[i].scratch);
+        }
+        if (cursors[i].key_scratch.data != NULL) {
+            path_free(&cursors[i].key_scratch);
+        }
+    }
+    free(heap);
+}
+
+// Serializes flushes of the output buffers of all threads
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters of every thread of a --stats run
+stats_registry_t stats_registry = {PTHREAD_MUTEX_INITIALIZER, 0, NULL, 0, {0}, 0, 0};
+
+// Counters of the calling thread, or NULL without --stats
+_Thread_local thread_stats_t *current_stats = NULL;
+
+// Error logs of every thread that reported errors while walking
+error_registry_t error_registry = {PTHREAD_MUTEX_INITIALIZER, NULL, SIZE_MAX, 0, 0};
+
+// Error log of the calling thread, or NULL before its first error
+_Thread_local error_log_t *current_errors = NULL;
+
+/*
+ * out_write_all: Writes a vector of buffers to stdout completely, retrying
+ *                after short writes and interruptions. The caller holds
+ *                output_lock.
+ *
+ * Parameters:
+ *   iov       - Array of buffers; advanced in place as bytes are written.
+ *   iov_count - Number of buffers.
+ *
+ * Returns:
+ *   Nothing. Exits with write_failure_status if writing to stdout fails.
+ */
+void out_write_all(struct iovec *iov, int iov_count) {
+    while (iov_count > 0) {
+        uint64_t started = stats_clock();
+        ssize_t written = iov_count == 1 ? write(STDOUT_FILENO, iov[0].iov_base, iov[0].iov_len)
+                                         : writev(STDOUT_FILENO, iov, iov_count);
+        stats_record(STATS_WRITE, started);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error writing to stdout");
+            exit(write_failure_status);
+        }
+        size_t done = (size_t)written;
+        if (current_stats != NULL) {
+            current_stats->bytes_written += done;
+        }
+        while (iov_count > 0 && done >= iov[0].iov_len) {
+            done -= iov[0].iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov[0].iov_base = (char *)iov[0].iov_base + done;
+            iov[0].iov_len -= done;
+        }
+    }
+}
+
+/*
+ * out_write: Writes a vector of buffers to the destination of an output
+ *            buffer: stdout, or the stream of its starting path.
+ *
+ * Parameters:
+ *   out       - Pointer to the out_buf_t structure.
+ *   iov       - Array of buffers; advanced in place as bytes are written.
+ *   iov_count - Number of buffers.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing fails.
+ */
+static void out_write(out_buf_t *out, struct iovec *iov, int iov_count) {
+    if (out->stream != NULL) {
+        root_stream_write(out->stream, iov, iov_count);
+        return;
+    }
+    uint64_t started = stats_clock();
+    pthread_mutex_lock(&output_lock);
+    stats_record(STATS_LOCK, started);
+    out_write_all(iov, iov_count);
+    pthread_mutex_unlock(&output_lock);
+}
+
+/*
+ * out_flush: Writes out all pending entries of an output buffer.
+ *
+ * Parameters:
+ *   out - Pointer to the out_buf_t structure.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing to stdout fails.
+ */
+void out_flush(out_buf_t *out) {
+    struct iovec iov;
+
+    if (out->len == 0) {
+        return;
+    }
+    iov.iov_base = out->data;
+    iov.iov_len = out->len;
+    out_write(out, &iov, 1);
+    out->len = 0;
+}
+
+/*
+ * out_entry: Appends one entry to an output buffer in its format: the path
+ *            followed by a newline or NUL, or a binary record header followed
+ *            by the path, the path starting with the change prefix under
+ *            --watch. The buffer is flushed first when the entry does not
+ *            fit (or grown, while it holds its entries back); an entry
+ *            larger than the whole buffer is written together with the
+ *            pending bytes in a single writev.
+ *
+ * Parameters:
+ *   out  - Pointer to the out_buf_t structure.
+ *   path - The path, not necessarily NUL-terminated.
+ *   len  - Length of path.
+ *   type - DT_* type of the entry (used by the binary format).
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing to stdout fails.
+ */
+void out_entry(out_buf_t *out, const char *path, size_t len, int type) {
+    char header[BINARY_RECORD_HEADER_SIZE];
+    size_t header_len = 0;
+    size_t prefix_len = out->prefix != '\0' ? 1 : 0;
+    const char *suffix = out->format == OUTPUT_NUL ? "" : "\n";
+    size_t suffix_len = 1;
+
+    if (out->format == OUTPUT_BINARY) {
+        uint32_t path_len = (uint32_t)(prefix_len + len);
+        memcpy(header, &path_len, sizeof(path_len));
+        header[sizeof(path_len)] = (char)type;
+        header_len = sizeof(header);
+        suffix_len = 0;
+    }
+
+    size_t size = header_len + prefix_len + len + suffix_len;
+    if (size > out->capacity - out->len && out->hold) {
+        size_t new_capacity = out->capacity * 2 > out->len + size ? out->capacity * 2 : out->len + size;
+        char *new_data = (char *)realloc(out->data, new_capacity);
+        if (new_data == NULL) {
+            perror("Error reallocating output buffer");
+            abort();
+        }
+        out->data = new_data;
+        out->capacity = new_capacity;
+    } else if (size > out->capacity - out->len) {
+        if (size > out->capacity) {
+            struct iovec iov[5];
+            int iov_count = 0;
+            if (out->len > 0) {
+                iov[iov_count].iov_base = out->data;
+                iov[iov_count++].iov_len = out->len;
+            }
+            if (header_len > 0) {
+                iov[iov_count].iov_base = header;
+                iov[iov_count++].iov_len = header_len;
+            }
+            if (prefix_len > 0) {
+                iov[iov_count].iov_base = &out->prefix;
+                iov[iov_count++].iov_len = prefix_len;
+            }
+            iov[iov_count].iov_base = (char *)path;
+            iov[iov_count++].iov_len = len;
+            if (suffix_len > 0) {
+                iov[iov_count].iov_base = (char *)suffix;
+                iov[iov_count++].iov_len = suffix_len;
+            }
+            out_write(out, iov, iov_count);
+            out->len = 0;
+            return;
+        }
+        out_flush(out);
+    }
+
+    char *dest = out->data + out->len;
+    memcpy(dest, header, header_len);
+    dest += header_len;
+    if (prefix_len > 0) {
+        *dest++ = out->prefix;
+    }
+    memcpy(dest, path, len);
+    if (suffix_len > 0) {
+        dest[len] = suffix[0];
+    }
+    out->len += size;
+    if (out->line_buffered && !out->hold) {
+        out_flush(out);
+    }
+}
+
+/*
+ * path_init: Initializes an empty path buffer.
+ *
+ * Parameters:
+ *   path - Pointer to the path_buf_t structure.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+void path_init(path_buf_t *path) {
+    path->data = (char *)malloc(INITIAL_PATH_CAPACITY);
+    if (path->data == NULL) {
+        perror("Error allocating path buffer");
+        abort();
+    }
+    path->data[0] = '\0';
+    path->len = 0;
+    path->capacity = INITIAL_PATH_CAPACITY;
+}
+
+/*
+ * path_reserve: Grows the path buffer so that it can hold at least needed bytes.
+ *
+ * Parameters:
+ *   path   - Pointer to the path_buf_t structure.
+ *   needed - Required capacity in bytes, including the terminator.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+void path_reserve(path_buf_t *path, size_t needed) {
+    if (needed > path->capacity) {
+        size_t new_capacity = path->capacity;
+        while (new_capacity < needed) {
+            new_capacity *= 2;
+        }
+        char *new_data = (char *)realloc(path->data, new_capacity);
+        if (new_data == NULL) {
+            perror("Error reallocating path buffer");
+            abort();
+        }
+        path->data = new_data;
+        path->capacity = new_capacity;
+    }
+}
+
+/*
+ * path_push: Appends a name component to the path buffer, inserting a '/'
+ *            separator unless the buffer is empty or already ends with one.
+ *
+ * Parameters:
+ *   path - Pointer to the path_buf_t structure.
+ *   name - The component to append.
+ *
+ * Returns:
+ *   The previous length of the path, to be passed to path_pop.
+ *   Aborts on memory allocation failure.
+ */
+size_t path_push(path_buf_t *path, const char *name) {
+    size_t old_len = path->len;
+    int needs_slash = (old_len > 0 && path->data[old_len - 1] != '/');
+    size_t name_len = strlen(name);
+
+    path_reserve(path, old_len + (needs_slash ? 1 : 0) + name_len + 1);
+
+    if (needs_slash) {
+        path->data[path->len++] = '/';
+    }
+    memcpy(path->data + path->len, name, name_len + 1);
+    path->len += name_len;
+    return old_len;
+}
+
+/*
+ * path_pop: Truncates the path buffer back to a length returned by path_push.
+ *
+ * Parameters:
+ *   path    - Pointer to the path_buf_t structure.
+ *   old_len - The length to restore.
+ *
+ * Returns:
+ *   Nothing.
+ */
+void path_pop(path_buf_t *path, size_t old_len) {
+    path->len = old_len;
+    path->data[old_len] = '\0';
+}
+
+/*
+ * path_free: Releases the memory held by a path buffer.
+ *
+ * Parameters:
+ *   path - Pointer to the path_buf_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+void path_free(path_buf_t *path) {
+    free(path->data);
+    path->data = NULL;
+    path->len = 0;
+    path->capacity = 0;
+}
+
+// Set once the warning about --uring being unavailable has been printed
+static atomic_int uring_warning_printed = 0;
+
+#if !DIRWALK_USE_GETDENTS
+// Set once the warning about --prefetch being unsupported has been printed
+static atomic_int prefetch_warning_printed = 0;
+
+#endif
+/*
+ * dirent_buf_init: Initializes a per-worker directory entry buffer. With the
+ *                  readdir backend the buffer is unused and nothing is allocated.
+ *
+ * Parameters:
+ *   buf       - Pointer to the dirent_buf_t structure.
+ *   use_uring - Flag: set up an io_uring to resolve unknown entry types. If
+ *               that is not possible, a warning is printed (once) and the
+ *               buffer works without it.
+ *   prefetch  - Number of stat prefetch threads to start, or 0.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+void dirent_buf_init(dirent_buf_t *buf, int use_uring, size_t prefetch) {
+    const char *reason = "not supported by this build";
+
+    buf->data = NULL;
+    buf->top = 0;
+    buf->capacity = 0;
+    buf->ring = NULL;
+    buf->prefetch = NULL;
+#if DIRWALK_USE_GETDENTS
+    buf->data = (char *)malloc(INITIAL_DIRENT_BUFFER_SIZE);
+    if (buf->data == NULL) {
+        perror("Error allocating directory entry buffer");
+        abort();
+    }
+    buf->capacity = INITIAL_DIRENT_BUFFER_SIZE;
+    if (prefetch > 0) {
+        buf->prefetch = (prefetch_t *)malloc(sizeof(prefetch_t));
+        if (buf->prefetch == NULL) {
+            perror("Error allocating prefetch stage");
+            abort();
+        }
+        prefetch_init(buf->prefetch, prefetch);
+    }
+#else
+    if (prefetch > 0 && atomic_exchange(&prefetch_warning_printed, 1) == 0) {
+        fprintf(stderr, "Warning: --prefetch is not supported by this build, using fstatat.\n");
+    }
+#endif
+    if (!use_uring) {
+        return;
+    }
+#if DIRWALK_USE_IO_URING
+    buf->ring = (stat_ring_t *)malloc(sizeof(stat_ring_t));
+    if (buf->ring == NULL) {
+        perror("Error allocating io_uring");
+        abort();
+    }
+    if (stat_ring_init(buf->ring) == 0) {
+        return;
+    }
+    reason = strerror(errno);
+    free(buf->ring);
+    buf->ring = NULL;
+#endif
+    if (atomic_exchange(&uring_warning_printed, 1) == 0) {
+        fprintf(stderr, "Warning: io_uring is unavailable (%s), using fstatat.\n", reason);
+    }
+}
+
+/*
+ * dirent_buf_free: Releases the memory held by a directory entry buffer.
+ *
+ * Parameters:
+ *   buf - Pointer to the dirent_buf_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+void dirent_buf_free(dirent_buf_t *buf) {
+#if DIRWALK_USE_GETDENTS
+    if (buf->prefetch != NULL) {
+        prefetch_destroy(buf->prefetch);
+        free(buf->prefetch);
+        buf->prefetch = NULL;
+    }
+#endif
+#if DIRWALK_USE_IO_URING
+    if (buf->ring != NULL) {
+        stat_ring_free(buf->ring);
+        free(buf->ring);
+        buf->ring = NULL;
+    }
+#endif
+    free(buf->data);
+    buf->data = NULL;
+    buf->top = 0;
+    buf->capacity = 0;
+}
+
+#if DIRWALK_USE_IO_URING
+/*
+ * stat_ring_init: Sets up an io_uring instance and maps its rings.
+ *
+ * Parameters:
+ *   ring - Pointer to the stat_ring_t structure to initialize.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if io_uring is unavailable, with errno set; nothing is left allocated.
+ */
+static int stat_ring_init(stat_ring_t *ring) {
+    struct io_uring_params params;
+    int single_mmap;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(SYS_io_uring_setup, STAT_RING_ENTRIES, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+
+    single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (single_mmap) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    void *sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    void *cq_map = single_mmap ? sq_map
+                               : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqes == MAP_FAILED) {
+        int saved_errno = errno;
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, ring->sqes_size);
+        }
+        if (!single_mmap && cq_map != MAP_FAILED) {
+            munmap(cq_map, ring->cq_map_size);
+        }
+        if (sq_map != MAP_FAILED) {
+            munmap(sq_map, ring->sq_map_size);
+        }
+        close(ring->fd);
+        errno = saved_errno;
+        return -1;
+    }
+    ring->sq_map = sq_map;
+    ring->cq_map = cq_map;
+    ring->sqes = (struct io_uring_sqe *)sqes;
+
+    ring->sq_tail = (unsigned *)((char *)sq_map + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)sq_map + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)sq_map + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)cq_map + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)cq_map + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)cq_map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(void *)((char *)cq_map + params.cq_off.cqes);
+
+    ring->results = (struct statx *)malloc(ring->entries * sizeof(struct statx));
+    ring->records = (struct linux_dirent64 **)malloc(ring->entries * sizeof(struct linux_dirent64 *));
+    if (ring->results == NULL || ring->records == NULL) {
+        perror("Error allocating io_uring buffers");
+        abort();
+    }
+    return 0;
+}
+
+/*
+ * stat_ring_free: Closes an io_uring instance and unmaps its rings.
+ *
+ * Parameters:
+ *   ring - Pointer to the stat_ring_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void stat_ring_free(stat_ring_t *ring) {
+    close(ring->fd);
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    free(ring->results);
+    free(ring->records);
+}
+
+/*
+ * stat_ring_wait: Submits the queued requests and reaps completions until none
+ *                 is in flight, copying each resolved type into its record.
+ *                 If io_uring_enter fails, the ring is marked broken and the
+ *                 remaining entries keep DT_UNKNOWN.
+ *
+ * Parameters:
+ *   ring      - Pointer to the stat_ring_t structure.
+ *   to_submit - Number of queued, not yet submitted requests.
+ *   in_flight - Number of requests whose completions are outstanding.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void stat_ring_wait(stat_ring_t *ring, unsigned to_submit, unsigned in_flight) {
+    while (in_flight > 0) {
+        uint64_t started = stats_clock();
+        long submitted = syscall(SYS_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_record(STATS_URING, started);
+        if (submitted == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            ring->broken = 1;
+            return;
+        }
+        to_submit -= (unsigned)submitted;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire);
+        while (head != tail) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->res == 0 && (ring->results[cqe->user_data].stx_mask & STATX_TYPE)) {
+                ring->records[cqe->user_data]->d_type =
+                    (unsigned char)IFTODT(ring->results[cqe->user_data].stx_mode);
+                if (current_stats != NULL) {
+                    current_stats->ahead_stats++;
+                }
+            }
+            head++;
+            in_flight--;
+        }
+        atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head, memory_order_release);
+    }
+}
+
+/*
+ * stat_ring_resolve: Resolves the type of every DT_UNKNOWN record of a
+ *                    getdents64 batch with statx requests, run concurrently
+ *                    in groups of up to one per submission queue entry.
+ *
+ * Parameters:
+ *   ring   - Pointer to the stat_ring_t structure.
+ *   dir_fd - Descriptor of the directory the batch was read from.
+ *   batch  - The batch of linux_dirent64 records.
+ *   len    - Length of the batch in bytes.
+ *
+ * Returns:
+ *   Nothing. Records that could not be resolved keep DT_UNKNOWN.
+ */
+static void stat_ring_resolve(stat_ring_t *ring, int dir_fd, char *batch, size_t len) {
+    unsigned queued = 0;
+
+    for (size_t pos = 0; pos < len && !ring->broken; ) {
+        struct linux_dirent64 *record = (struct linux_dirent64 *)(void *)(batch + pos);
+        pos += record->d_reclen;
+        if (record->d_type != DT_UNKNOWN) {
+            continue;
+        }
+
+        unsigned tail = *ring->sq_tail;
+        unsigned index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dir_fd;
+        sqe->addr = (uint64_t)(uintptr_t)record->d_name;
+        sqe->len = STATX_TYPE;
+        sqe->off = (uint64_t)(uintptr_t)&ring->results[queued];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = queued;
+        ring->records[queued] = record;
+        ring->sq_array[index] = index;
+        atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail + 1, memory_order_release);
+
+        if (++queued == ring->entries) {
+            stat_ring_wait(ring, queued, queued);
+            queued = 0;
+        }
+    }
+    if (queued > 0) {
+        stat_ring_wait(ring, queued, queued);
+    }
+}
+
+#endif
+#if DIRWALK_USE_GETDENTS
+/*
+ * prefetch_init: Initializes a stat prefetch stage and starts its threads.
+ *
+ * Parameters:
+ *   prefetch     - Pointer to the prefetch_t structure.
+ *   thread_count - Number of threads, which is also how far ahead they stat.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure or if a thread cannot be created.
+ */
+static void prefetch_init(prefetch_t *prefetch, size_t thread_count) {
+    memset(prefetch, 0, sizeof(*prefetch));
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->work_cond, NULL);
+    pthread_cond_init(&prefetch->done_cond, NULL);
+    prefetch->dir_fd = -1;
+    prefetch->capacity = INITIAL_RESULTS_CAPACITY;
+    prefetch->records = (struct linux_dirent64 **)malloc(prefetch->capacity * sizeof(struct linux_dirent64 *));
+    prefetch->states = (unsigned char *)malloc(prefetch->capacity);
+    prefetch->threads = (pthread_t *)malloc(thread_count * sizeof(pthread_t));
+    if (prefetch->records == NULL || prefetch->states == NULL || prefetch->threads == NULL) {
+        perror("Error allocating prefetch stage");
+        abort();
+    }
+    for (size_t i = 0; i < thread_count; ++i) {
+        int rc = pthread_create(&prefetch->threads[i], NULL, prefetch_main, prefetch);
+        if (rc != 0) {
+            fprintf(stderr, "Error creating prefetch thread: %s\n", strerror(rc));
+            abort();
+        }
+        prefetch->thread_count++;
+    }
+}
+
+/*
+ * prefetch_destroy: Stops the threads of a stat prefetch stage and frees it.
+ *
+ * Parameters:
+ *   prefetch - Pointer to the prefetch_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void prefetch_destroy(prefetch_t *prefetch) {
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->stop = 1;
+    pthread_cond_broadcast(&prefetch->work_cond);
+    pthread_mutex_unlock(&prefetch->lock);
+    for (size_t i = 0; i < prefetch->thread_count; ++i) {
+        pthread_join(prefetch->threads[i], NULL);
+    }
+    pthread_cond_destroy(&prefetch->done_cond);
+    pthread_cond_destroy(&prefetch->work_cond);
+    pthread_mutex_destroy(&prefetch->lock);
+    free(prefetch->threads);
+    free(prefetch->records);
+    free(prefetch->states);
+}
+
+/*
+ * prefetch_main: Thread entry point of a stat prefetch thread. Claims queued
+ *                records in order, no further than the prefetch depth ahead
+ *                of the walker, and resolves their types with fstatat.
+ *
+ * Parameters:
+ *   arg - Pointer to the prefetch_t structure.
+ *
+ * Returns:
+ *   NULL.
+ */
+static void *prefetch_main(void *arg) {
+    prefetch_t *prefetch = (prefetch_t *)arg;
+
+    stats_attach();
+    pthread_mutex_lock(&prefetch->lock);
+    for (;;) {
+        while (!prefetch->stop &&
+               (prefetch->next_claim >= prefetch->count ||
+                prefetch->next_claim >= prefetch->consumed + prefetch->thread_count)) {
+            pthread_cond_wait(&prefetch->work_cond, &prefetch->lock);
+        }
+        if (prefetch->stop) {
+            break;
+        }
+
+        size_t index = prefetch->next_claim++;
+        struct linux_dirent64 *record = prefetch->records[index];
+        int dir_fd = prefetch->dir_fd;
+        prefetch->states[index] = PREFETCH_CLAIMED;
+        prefetch->active++;
+        pthread_mutex_unlock(&prefetch->lock);
+
+        struct stat stat_buf;
+        uint64_t started = stats_clock();
+        int rc = fstatat(dir_fd, record->d_name, &stat_buf, AT_SYMLINK_NOFOLLOW);
+        stats_record(STATS_STAT, started);
+
+        pthread_mutex_lock(&prefetch->lock);
+        if (rc == 0) {
+            record->d_type = (unsigned char)IFTODT(stat_buf.st_mode);
+            if (current_stats != NULL) {
+                current_stats->ahead_stats++;
+            }
+        }
+        prefetch->states[index] = PREFETCH_DONE;
+        prefetch->active--;
+        pthread_cond_broadcast(&prefetch->done_cond);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+    return NULL;
+}
+
+/*
+ * prefetch_clear: Empties the queue of a stat prefetch stage once no stat is
+ *                 in flight, after which the queued records may be discarded.
+ *
+ * Parameters:
+ *   prefetch - Pointer to the prefetch_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void prefetch_clear(prefetch_t *prefetch) {
+    pthread_mutex_lock(&prefetch->lock);
+    while (prefetch->active > 0) {
+        pthread_cond_wait(&prefetch->done_cond, &prefetch->lock);
+    }
+    prefetch->owner = NULL;
+    prefetch->dir_fd = -1;
+    prefetch->count = 0;
+    prefetch->next_claim = 0;
+    prefetch->consumed = 0;
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+/*
+ * prefetch_publish: Replaces the queue of a stat prefetch stage with the
+ *                   DT_UNKNOWN records of a batch and wakes the threads.
+ *
+ * Parameters:
+ *   prefetch - Pointer to the prefetch_t structure.
+ *   owner    - Reader the batch belongs to.
+ *   dir_fd   - Descriptor of the reader's directory.
+ *   batch    - The linux_dirent64 records still to be returned by the reader.
+ *   len      - Length of batch in bytes.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void prefetch_publish(prefetch_t *prefetch, const void *owner, int dir_fd, char *batch, size_t len) {
+    prefetch_clear(prefetch);
+
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->owner = owner;
+    prefetch->dir_fd = dir_fd;
+    for (size_t pos = 0; pos < len; ) {
+        struct linux_dirent64 *record = (struct linux_dirent64 *)(void *)(batch + pos);
+        pos += record->d_reclen;
+        // "." and ".." are never returned by the reader, so they must not hold up the queue.
+        if (record->d_type != DT_UNKNOWN ||
+            (record->d_name[0] == '.' &&
+             (record->d_name[1] == '\0' || (record->d_name[1] == '.' && record->d_name[2] == '\0')))) {
+            continue;
+        }
+        if (prefetch->count >= prefetch->capacity) {
+            size_t new_capacity = prefetch->capacity * 2;
+            struct linux_dirent64 **new_records = (struct linux_dirent64 **)realloc(
+                prefetch->records, new_capacity * sizeof(struct linux_dirent64 *));
+            unsigned char *new_states = new_records == NULL ? NULL
+                : (unsigned char *)realloc(prefetch->states, new_capacity);
+            if (new_records == NULL || new_states == NULL) {
+                perror("Error reallocating prefetch queue");
+                abort();
+            }
+            prefetch->records = new_records;
+            prefetch->states = new_states;
+            prefetch->capacity = new_capacity;
+        }
+        prefetch->records[prefetch->count] = record;
+        prefetch->states[prefetch->count] = PREFETCH_QUEUED;
+        prefetch->count++;
+    }
+    if (prefetch->count > 0) {
+        pthread_cond_broadcast(&prefetch->work_cond);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+/*
+ * prefetch_wait: Called by the walker for each record it is about to return.
+ *                If the record is queued, waits until a thread has resolved it
+ *                (or takes it back if no thread has claimed it yet, leaving it
+ *                to the synchronous path) and moves the prefetch window on.
+ *
+ * Parameters:
+ *   prefetch - Pointer to the prefetch_t structure.
+ *   record   - The record about to be returned.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void prefetch_wait(prefetch_t *prefetch, const struct linux_dirent64 *record) {
+    // The queue and consumed are only written by the walker, so this check needs no lock.
+    if (prefetch->consumed >= prefetch->count || prefetch->records[prefetch->consumed] != record) {
+        return;
+    }
+
+    pthread_mutex_lock(&prefetch->lock);
+    size_t index = prefetch->consumed;
+    while (prefetch->states[index] == PREFETCH_CLAIMED) {
+        pthread_cond_wait(&prefetch->done_cond, &prefetch->lock);
+    }
+    if (prefetch->next_claim <= index) {
+        prefetch->states[index] = PREFETCH_DONE;
+        prefetch->next_claim = index + 1;
+    }
+    prefetch->consumed = index + 1;
+    pthread_cond_broadcast(&prefetch->work_cond);
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+#endif
+#if DIRWALK_USE_GETDENTS
+/*
+ * dirent_buf_reserve: Grows a directory entry buffer so that a full batch fits
+ *                     after the given offset.
+ *
+ * Parameters:
+ *   buf  - Pointer to the dirent_buf_t structure.
+ *   base - Offset where the next batch is to be read.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void dirent_buf_reserve(dirent_buf_t *buf, size_t base) {
+    if (buf->capacity - base < DIRENT_BATCH_SIZE) {
+        size_t new_capacity = buf->capacity;
+        while (new_capacity - base < DIRENT_BATCH_SIZE) {
+            new_capacity *= 2;
+        }
+        char *new_data = (char *)realloc(buf->data, new_capacity);
+        if (new_data == NULL) {
+            perror("Error reallocating directory entry buffer");
+            abort();
+        }
+        buf->data = new_data;
+        buf->capacity = new_capacity;
+    }
+}
+
+#endif
+/*
+ * dir_reader_open: Starts reading the entries of an open directory.
+ *
+ * Parameters:
+ *   reader - Pointer to the dir_reader_t structure to initialize.
+ *   dir_fd - Open descriptor of the directory. Ownership passes to the reader,
+ *            even on failure.
+ *   buf    - Per-worker entry buffer (used by the getdents64 backend only).
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 on failure, with errno set; dir_fd has been closed.
+ */
+int dir_reader_open(dir_reader_t *reader, int dir_fd, dirent_buf_t *buf) {
+    reader->spill = NULL;
+    reader->spill_pos = 0;
+    reader->spill_len = 0;
+    reader->spill_capacity = 0;
+    reader->spill_errno = 0;
+#if DIRWALK_USE_GETDENTS
+    reader->fd = dir_fd;
+    reader->buf = buf;
+    reader->base = buf->top;
+    reader->pos = buf->top;
+    reader->end = buf->top;
+    return 0;
+#else
+    (void)buf;
+    reader->fd = -1;
+    reader->stream = fdopendir(dir_fd);
+    if (reader->stream == NULL) {
+        int saved_errno = errno;
+        close(dir_fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+/*
+ * dir_reader_next: Returns the next entry of a directory, skipping "." and "..".
+ *                  The name points into the reader's storage and stays valid
+ *                  until the next call on this reader; it is never copied.
+ *
+ * Parameters:
+ *   reader - Pointer to an open dir_reader_t structure.
+ *   name   - Receives a pointer to the entry name.
+ *   d_type - Receives the entry type reported by the file system (may be DT_UNKNOWN).
+ *
+ * Returns:
+ *    1 if an entry was returned.
+ *    0 at the end of the directory.
+ *   -1 on a read error, with errno set.
+ */
+int dir_reader_next(dir_reader_t *reader, const char **name, unsigned char *d_type) {
+    if (reader->spill != NULL) {
+        if (reader->spill_pos >= reader->spill_len) {
+            if (reader->spill_errno != 0) {
+                errno = reader->spill_errno;
+                reader->spill_errno = 0;
+                return -1;
+            }
+            return 0;
+        }
+        *d_type = (unsigned char)reader->spill[reader->spill_pos];
+        *name = reader->spill + reader->spill_pos + 1;
+        reader->spill_pos += strlen(*name) + 2;
+        return 1;
+    }
+
+#if DIRWALK_USE_GETDENTS
+    dirent_buf_t *buf = reader->buf;
+
+    for (;;) {
+        if (reader->pos >= reader->end) {
+            // Refill this directory's region. Any subdirectory read in the meantime
+            // has already released the space after it.
+            if (buf->prefetch != NULL) {
+                prefetch_clear(buf->prefetch);
+            }
+            dirent_buf_reserve(buf, reader->base);
+            uint64_t started = stats_clock();
+            long nread = syscall(SYS_getdents64, reader->fd, buf->data + reader->base,
+                                 DIRENT_BATCH_SIZE);
+            stats_record(STATS_READ, started);
+            if (nread < 0) {
+                return -1;
+            }
+            if (nread == 0) {
+                return 0;
+            }
+            reader->pos = reader->base;
+            reader->end = reader->base + (size_t)nread;
+            buf->top = reader->end;
+#if DIRWALK_USE_IO_URING
+            if (buf->ring != NULL) {
+                stat_ring_resolve(buf->ring, reader->fd, buf->data + reader->base, (size_t)nread);
+            }
+#endif
+            if (buf->prefetch != NULL) {
+                prefetch_publish(buf->prefetch, reader, reader->fd, buf->data + reader->base, (size_t)nread);
+            }
+        } else if (buf->prefetch != NULL && buf->prefetch->owner != reader) {
+            // Back from a subdirectory: prefetch the rest of this batch again.
+            prefetch_publish(buf->prefetch, reader, reader->fd, buf->data + reader->pos,
+                             reader->end - reader->pos);
+        }
+
+        struct linux_dirent64 *record = (struct linux_dirent64 *)(void *)(buf->data + reader->pos);
+        reader->pos += record->d_reclen;
+
+        if (record->d_name[0] == '.' &&
+            (record->d_name[1] == '\0' || (record->d_name[1] == '.' && record->d_name[2] == '\0'))) {
+            continue;
+        }
+        if (buf->prefetch != NULL) {
+            prefetch_wait(buf->prefetch, record);
+        }
+        *name = record->d_name;
+        *d_type = record->d_type;
+        return 1;
+    }
+#else
+    struct dirent *entry;
+
+    for (;;) {
+        uint64_t started = stats_clock();
+        errno = 0;
+        entry = readdir(reader->stream);
+        stats_record(STATS_READ, started);
+        if (entry == NULL) {
+            return errno != 0 ? -1 : 0;
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        *name = entry->d_name;
+        *d_type = entry->d_type;
+        return 1;
+    }
+#endif
+}
+
+/*
+ * dir_reader_fd: Returns the descriptor of the directory being read, for use
+ *                with openat and fstatat.
+ *
+ * Parameters:
+ *   reader - Pointer to an open dir_reader_t structure.
+ *
+ * Returns:
+ *   The directory descriptor.
+ */
+int dir_reader_fd(const dir_reader_t *reader) {
+#if DIRWALK_USE_GETDENTS
+    return reader->fd;
+#else
+    return reader->stream != NULL ? dirfd(reader->stream) : reader->fd;
+#endif
+}
+
+/*
+ * dir_reader_release: Stops reading a directory and returns its region of the
+ *                     per-worker buffer. The descriptor stays open, so entries
+ *                     can still be opened relative to it until dir_reader_close.
+ *                     Must be called by the thread that owns the buffer.
+ *
+ * Parameters:
+ *   reader - Pointer to an open dir_reader_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+void dir_reader_release(dir_reader_t *reader) {
+#if DIRWALK_USE_GETDENTS
+    if (reader->buf->prefetch != NULL && reader->buf->prefetch->owner == reader) {
+        prefetch_clear(reader->buf->prefetch);
+    }
+    reader->buf->top = reader->base;
+    reader->buf = NULL;
+#else
+    (void)reader;
+#endif
+}
+
+/*
+ * dir_reader_close: Closes the descriptor of a released directory reader and
+ *                   frees its buffered entries. May be called from any thread.
+ *
+ * Parameters:
+ *   reader - Pointer to a dir_reader_t structure passed to dir_reader_release.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if closing the descriptor failed, with errno set.
+ */
+int dir_reader_close(dir_reader_t *reader) {
+    uint64_t started;
+    int rc;
+
+    if (reader->spill_capacity > 0) {
+        free(reader->spill);
+    }
+    reader->spill = NULL;
+    started = stats_clock();
+#if DIRWALK_USE_GETDENTS
+    rc = reader->fd != -1 ? close(reader->fd) : 0;
+#else
+    if (reader->stream != NULL) {
+        rc = closedir(reader->stream);
+    } else {
+        rc = reader->fd != -1 ? close(reader->fd) : 0;
+    }
+#endif
+    stats_record(STATS_CLOSE, started);
+    return rc;
+}
+
+/*
+ * dir_reader_spill: Appends one entry to the buffered entries of a reader
+ *                   being detached.
+ *
+ * Parameters:
+ *   reader - Pointer to the dir_reader_t structure.
+ *   d_type - Type of the entry (may be DT_UNKNOWN).
+ *   name   - Name of the entry.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void dir_reader_spill(dir_reader_t *reader, unsigned char d_type, const char *name) {
+    size_t len = strlen(name);
+
+    if (reader->spill_capacity - reader->spill_len < len + 2) {
+        size_t new_capacity = reader->spill_capacity > 0 ? reader->spill_capacity : INITIAL_SPILL_CAPACITY;
+        while (new_capacity - reader->spill_len < len + 2) {
+            new_capacity *= 2;
+        }
+        char *new_spill = (char *)realloc(reader->spill, new_capacity);
+        if (new_spill == NULL) {
+            perror("Error reallocating buffered directory entries");
+            abort();
+        }
+        reader->spill = new_spill;
+        reader->spill_capacity = new_capacity;
+    }
+    reader->spill[reader->spill_len] = (char)d_type;
+    memcpy(reader->spill + reader->spill_len + 1, name, len + 1);
+    reader->spill_len += len + 2;
+}
+
+/*
+ * dir_reader_buffer: Reads all remaining entries of a directory into the
+ *                    reader's own buffer, which it then returns them from.
+ *                    The descriptor stays open. A read error is kept and
+ *                    reported once the buffered entries are consumed. Must be
+ *                    called by the thread that owns the entry buffer.
+ *
+ * Parameters:
+ *   reader - Pointer to an attached dir_reader_t structure.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+void dir_reader_buffer(dir_reader_t *reader) {
+#if DIRWALK_USE_GETDENTS
+    dirent_buf_t *buf = reader->buf;
+    int on_top = buf->top == reader->end; // No subdirectory's region follows this one
+    char *scratch = NULL;
+
+    if (buf->prefetch != NULL && buf->prefetch->owner == reader) {
+        prefetch_clear(buf->prefetch);
+    }
+
+    // First the rest of the current batch, then everything not read yet. The
+    // space after this directory's region belongs to its subdirectories, so
+    // the remaining batches are read into a separate scratch buffer, unless
+    // the region is the last one (as for a directory just opened).
+    if (on_top) {
+        dirent_buf_reserve(buf, reader->base);
+    } else {
+        scratch = (char *)malloc(DIRENT_BATCH_SIZE);
+        if (scratch == NULL) {
+            perror("Error allocating directory entry buffer");
+            abort();
+        }
+    }
+    char *batch = buf->data;
+    size_t pos = reader->pos;
+    size_t end = reader->end;
+    for (;;) {
+        while (pos < end) {
+            struct linux_dirent64 *record = (struct linux_dirent64 *)(void *)(batch + pos);
+            pos += record->d_reclen;
+            if (record->d_name[0] == '.' &&
+                (record->d_name[1] == '\0' || (record->d_name[1] == '.' && record->d_name[2] == '\0'))) {
+                continue;
+            }
+            dir_reader_spill(reader, record->d_type, record->d_name);
+        }
+        batch = on_top ? buf->data + reader->base : scratch;
+        uint64_t started = stats_clock();
+        long nread = syscall(SYS_getdents64, reader->fd, batch, DIRENT_BATCH_SIZE);
+        stats_record(STATS_READ, started);
+        if (nread <= 0) {
+            if (nread < 0) {
+                reader->spill_errno = errno;
+            }
+            break;
+        }
+        pos = 0;
+        end = (size_t)nread;
+    }
+    free(scratch);
+    reader->pos = reader->end;
+#else
+    struct dirent *entry;
+
+    for (;;) {
+        uint64_t started = stats_clock();
+        errno = 0;
+        entry = readdir(reader->stream);
+        stats_record(STATS_READ, started);
+        if (entry == NULL) {
+            reader->spill_errno = errno;
+            break;
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        dir_reader_spill(reader, entry->d_type, entry->d_name);
+    }
+#endif
+
+    // An empty buffer still marks the entries as buffered.
+    if (reader->spill == NULL) {
+        reader->spill = (char *)malloc(1);
+        if (reader->spill == NULL) {
+            perror("Error allocating buffered directory entries");
+            abort();
+        }
+        reader->spill_capacity = 1;
+    }
+}
+
+/*
+ * dir_reader_detach: Reads all remaining entries of a directory into the
+ *                    reader's own buffer and closes its descriptor, so the
+ *                    walk can continue later without it. Must be called by
+ *                    the thread that owns the entry buffer.
+ *
+ * Parameters:
+ *   reader - Pointer to a dir_reader_t structure with an open descriptor.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 if closing the descriptor failed, with errno set.
+ */
+int dir_reader_detach(dir_reader_t *reader) {
+    int rc;
+
+    // Reattached after an earlier detach, or served from the index: the
+    // entries are buffered already.
+    if (reader->spill != NULL) {
+#if DIRWALK_USE_GETDENTS
+        rc = close(reader->fd);
+#else
+        rc = reader->stream != NULL ? closedir(reader->stream) : close(reader->fd);
+        reader->stream = NULL;
+#endif
+        reader->fd = -1;
+        return rc;
+    }
+
+    dir_reader_buffer(reader);
+#if DIRWALK_USE_GETDENTS
+    rc = close(reader->fd);
+#else
+    rc = closedir(reader->stream);
+    reader->stream = NULL;
+#endif
+    reader->fd = -1;
+    return rc;
+}
+
+/*
+ * dir_reader_reattach: Gives a detached reader a reopened descriptor of its
+ *                      directory, for fstatat and openat on the buffered entries.
+ *
+ * Parameters:
+ *   reader - Pointer to a detached dir_reader_t structure.
+ *   fd     - New descriptor of the directory; ownership passes to the reader.
+ *
+ * Returns:
+ *   Nothing.
+ */
+void dir_reader_reattach(dir_reader_t *reader, int fd) {
+    reader->fd = fd;
+}
+
+/*
+ * visited_init: Initializes an empty visited directory set.
+ *
+ * Parameters:
+ *   set - Pointer to the visited_set_t structure.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+void visited_init(visited_set_t *set) {
+    set->slots = (visited_slot_t *)calloc(INITIAL_VISITED_CAPACITY, sizeof(visited_slot_t));
+    if (set->slots == NULL) {
+        perror("Error allocating visited directory set");
+        abort();
+    }
+    set->capacity = INITIAL_VISITED_CAPACITY;
+    set->count = 0;
+    pthread_mutex_init(&set->lock, NULL);
+}
+
+/*
+ * visited_free: Frees the memory of a visited directory set.
+ *
+ * Parameters:
+ *   set - Pointer to the visited_set_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+void visited_free(visited_set_t *set) {
+    free(set->slots);
+    set->slots = NULL;
+    set->capacity = 0;
+    set->count = 0;
+    pthread_mutex_destroy(&set->lock);
+}
+
+/*
+ * visited_hash: Mixes a (device, inode) pair into a slot hash. Inode numbers
+ *               are often sequential, so the bits are spread with the
+ *               splitmix64 finalizer before masking.
+ *
+ * Parameters:
+ *   dev - Device of the directory.
+ *   ino - Inode of the directory.
+ *
+ * Returns:
+ *   The hash value.
+ */
+static size_t visited_hash(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t)ino ^ ((uint64_t)dev * 0x9E3779B97F4A7C15ULL);
+
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return (size_t)h;
+}
+
+/*
+ * visited_insert: Adds a directory to the visited set unless it is already
+ *                 there, doubling the table when it gets half full.
+ *                 Thread-safe.
+ *
+ * Parameters:
+ *   set - Pointer to the visited_set_t structure.
+ *   dev - Device of the directory.
+ *   ino - Inode of the directory (never 0 on Linux file systems).
+ *
+ * Returns:
+ *   1 if the directory was added, 0 if it had been visited before.
+ *   Aborts on memory allocation failure.
+ */
+static int visited_insert(visited_set_t *set, dev_t dev, ino_t ino) {
+    size_t mask;
+    size_t i;
+    int added = 0;
+
+    pthread_mutex_lock(&set->lock);
+    if ((set->count + 1) * 2 > set->capacity) {
+        size_t new_capacity = set->capacity * 2;
+        visited_slot_t *new_slots = (visited_slot_t *)calloc(new_capacity, sizeof(visited_slot_t));
+        if (new_slots == NULL) {
+            perror("Error reallocating visited directory set");
+            abort();
+        }
+        for (size_t j = 0; j < set->capacity; ++j) {
+            const visited_slot_t *slot = &set->slots[j];
+            if (slot->ino == 0) {
+                continue;
+            }
+            i = visited_hash(slot->dev, slot->ino) & (new_capacity - 1);
+            while (new_slots[i].ino != 0) {
+                i = (i + 1) & (new_capacity - 1);
+            }
+            new_slots[i] = *slot;
+        }
+        free(set->slots);
+        set->slots = new_slots;
+        set->capacity = new_capacity;
+    }
+
+    mask = set->capacity - 1;
+    i = visited_hash(dev, ino) & mask;
+    while (set->slots[i].ino != 0 && (set->slots[i].ino != ino || set->slots[i].dev != dev)) {
+        i = (i + 1) & mask;
+    }
+    if (set->slots[i].ino == 0) {
+        set->slots[i].dev = dev;
+        set->slots[i].ino = ino;
+        set->count++;
+        added = 1;
+    }
+    pthread_mutex_unlock(&set->lock);
+    return added;
+}
+
+/*
+ * index_hash: Hashes a directory path for the index table (64-bit FNV-1a).
+ *
+ * Parameters:
+ *   path - The path bytes.
+ *   len  - Length of the path.
+ *
+ * Returns:
+ *   The hash.
+ */
+uint64_t index_hash(const char *path, size_t len) {
+    return hash_bytes(FNV_OFFSET_BASIS, path, len);
+}
+
+/*
+ * hash_bytes: Continues a 64-bit FNV-1a hash over more bytes.
+ *
+ * Parameters:
+ *   hash - The hash so far (FNV_OFFSET_BASIS to start).
+ *   data - The bytes.
+ *   len  - Number of bytes.
+ *
+ * Returns:
+ *   The updated hash.
+ */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * enter_directory: Decides whether a directory just opened should be walked.
+ *                  Without -L or --xdev every directory is walked. With -L,
+ *                  only those not entered before, as identified by fstat;
+ *                  with --xdev, only those on the starting directory's device.
+ *
+ * Parameters:
+ *   config - Walk configuration.
+ *   dir_fd - Open descriptor of the directory.
+ *   path   - Path of the directory, used for the error message.
+ *
+ * Returns:
+ *   1 if the directory should be walked.
+ *   0 if it was walked already, is on another device, or fstat failed (an
+ *   error message is printed).
+ */
+int enter_directory(const walk_config_t *config, int dir_fd, const char *path) {
+    struct stat stat_buf;
+
+    uint64_t started;
+    int rc;
+
+    if (!config->follow_links && !config->xdev && config->watch == NULL) {
+        return 1;
+    }
+    started = stats_clock();
+    rc = fstat(dir_fd, &stat_buf);
+    stats_record(STATS_STAT, started);
+    if (rc == -1) {
+        walk_error(errno, "getting status for", path, strlen(path));
+        return 0;
+    }
+    if (config->xdev && stat_buf.st_dev != config->root_dev) {
+        return 0;
+    }
+    if (config->follow_links && !visited_insert(config->visited, stat_buf.st_dev, stat_buf.st_ino)) {
+        return 0;
+    }
+    if (config->watch != NULL) {
+        watch_directory(config->watch, dir_fd, path, stat_buf.st_dev);
+    }
+    return 1;
+}
+
+/*
+ * directory_open_flags: Returns the open flags for directories to walk, which
+ *                       refuse symbolic links unless -L is given.
+ *
+ * Parameters:
+ *   config - Walk configuration.
+ *
+ * Returns:
+ *   Flags for open or openat.
+ */
+int directory_open_flags(const walk_config_t *config) {
+    return O_RDONLY | O_DIRECTORY | O_CLOEXEC | (config->follow_links ? 0 : O_NOFOLLOW);
+}
+
+/*
+ * resolve_entry_type: Determines the type of a directory entry, following
+ *                     symbolic links only with -L. The d_type reported by readdir
+ *                     is trusted when known; only DT_UNKNOWN (and, with -L,
+ *                     DT_LNK) costs a fstatat call.
+ *
+ * Parameters:
+ *   dir_fd       - Descriptor of the parent directory (or AT_FDCWD).
+ *   name         - Name of the entry relative to dir_fd.
+ *   d_type       - Type reported by readdir, or DT_UNKNOWN.
+ *   follow_links - Flag: report the type of a link's target (-L). Links
+ *                  whose target cannot be reached are still reported as DT_LNK.
+ *   parent       - Path of the parent directory, used for the error message.
+ *
+ * Returns:
+ *   The entry type as a DT_* value, or -1 if fstatat fails.
+ *   Prints an error message to stderr if fstatat fails.
+ */
+static int resolve_entry_type(int dir_fd, const char *name, unsigned char d_type, int follow_links,
+                              path_buf_t *parent) {
+    struct stat stat_buf;
+    uint64_t started;
+    int rc;
+
+    if (follow_links && (d_type == DT_LNK || d_type == DT_UNKNOWN)) {
+        started = stats_clock();
+        rc = fstatat(dir_fd, name, &stat_buf, 0);
+        stats_record(STATS_STAT, started);
+        if (rc == 0) {
+            return IFTODT(stat_buf.st_mode);
+        }
+    }
+    if (d_type != DT_UNKNOWN) {
+        return d_type;
+    }
+
+    started = stats_clock();
+    rc = fstatat(dir_fd, name, &stat_buf, AT_SYMLINK_NOFOLLOW);
+    stats_record(STATS_STAT, started);
+    if (rc == -1) {
+        int saved_errno = errno;
+        size_t parent_len = path_push(parent, name);
+        walk_error(saved_errno, "getting status for", parent->data, parent->len);
+        path_pop(parent, parent_len);
+        errno = saved_errno;
+        return -1;
+    }
+    return IFTODT(stat_buf.st_mode);
+}
+
+/*
+ * stat_entry: Reads the requested metadata of one entry. With statx, only the
+ *             fields the filters need are requested, so file systems that
+ *             compute some of them lazily (network, FUSE) can skip the work.
+ *
+ * Parameters:
+ *   dir_fd - Descriptor of the parent directory (or AT_FDCWD).
+ *   name   - Name of the entry relative to dir_fd.
+ *   flags  - 0 or AT_SYMLINK_NOFOLLOW.
+ *   fields - META_* fields to read.
+ *   meta   - Receives the metadata.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 on failure, with errno set.
+ */
+static int stat_entry(int dir_fd, const char *name, int flags, unsigned fields, entry_meta_t *meta) {
+    struct stat stat_buf;
+    uint64_t started = stats_clock();
+    int rc;
+
+#if DIRWALK_USE_STATX
+    struct statx statx_buf;
+    unsigned mask = ((fields & META_TYPE) ? STATX_TYPE : 0) | ((fields & META_SIZE) ? STATX_SIZE : 0) |
+                    ((fields & META_MTIME) ? STATX_MTIME : 0) | ((fields & META_UID) ? STATX_UID : 0) |
+                    ((fields & META_BLOCKS) ? STATX_BLOCKS : 0) |
+                    ((fields & META_INODE) ? STATX_INO | STATX_NLINK : 0);
+
+    rc = (int)syscall(SYS_statx, dir_fd, name, flags, mask, &statx_buf);
+    stats_record(STATS_STAT, started);
+    if (rc == 0) {
+        // A file system may leave out fields it cannot provide; fstatat below
+        // then gets them the traditional way.
+        if ((statx_buf.stx_mask & mask) == mask) {
+            meta->type = IFTODT(statx_buf.stx_mode);
+            meta->size = statx_buf.stx_size;
+            meta->mtime_sec = statx_buf.stx_mtime.tv_sec;
+            meta->mtime_nsec = (long)statx_buf.stx_mtime.tv_nsec;
+            meta->uid = (uid_t)statx_buf.stx_uid;
+            meta->blocks = statx_buf.stx_blocks;
+            meta->dev = makedev(statx_buf.stx_dev_major, statx_buf.stx_dev_minor);
+            meta->ino = (ino_t)statx_buf.stx_ino;
+            meta->nlink = statx_buf.stx_nlink;
+            return 0;
+        }
+    } else if (errno != ENOSYS) {
+        return -1;
+    }
+#else
+    (void)fields;
+#endif
+
+    started = stats_clock();
+    rc = fstatat(dir_fd, name, &stat_buf, flags);
+    stats_record(STATS_STAT, started);
+    if (rc == -1) {
+        return -1;
+    }
+    meta->type = IFTODT(stat_buf.st_mode);
+    meta->size = (uint64_t)stat_buf.st_size;
+    meta->mtime_sec = (int64_t)stat_buf.st_mtim.tv_sec;
+    meta->mtime_nsec = stat_buf.st_mtim.tv_nsec;
+    meta->uid = stat_buf.st_uid;
+    meta->blocks = (uint64_t)stat_buf.st_blocks;
+    meta->dev = stat_buf.st_dev;
+    meta->ino = stat_buf.st_ino;
+    meta->nlink = (uint64_t)stat_buf.st_nlink;
+    return 0;
+}
+
+/*
+ * entry_metadata: Reads the metadata of an entry for the metadata filters,
+ *                 following symbolic links with -L (a link whose target is
+ *                 missing is then described by the link itself).
+ *
+ * Parameters:
+ *   dir_fd       - Descriptor of the parent directory (or AT_FDCWD).
+ *   name         - Name of the entry relative to dir_fd.
+ *   follow_links - Flag: describe the target of a link (-L).
+ *   fields       - META_* fields to read.
+ *   meta         - Receives the metadata.
+ *   parent       - Path of the parent directory, used for the error message.
+ *
+ * Returns:
+ *    0 on success.
+ *   -1 on failure. Prints an error message to stderr.
+ */
+static int entry_metadata(int dir_fd, const char *name, int follow_links, unsigned fields,
+                          entry_meta_t *meta, path_buf_t *parent) {
+    if (follow_links && stat_entry(dir_fd, name, 0, fields, meta) == 0) {
+        return 0;
+    }
+    if (stat_entry(dir_fd, name, AT_SYMLINK_NOFOLLOW, fields, meta) == -1) {
+        int saved_errno = errno;
+        size_t parent_len = path_push(parent, name);
+        walk_error(saved_errno, "getting status for", parent->data, parent->len);
+        path_pop(parent, parent_len);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * meta_filter_match: Applies the metadata tests to an entry, the way find
+ *                    evaluates -size, -mtime, -newer and -user.
+ *
+ * Parameters:
+ *   filter - The metadata filters.
+ *   meta   - Metadata of the entry, with at least filter->fields read.
+ *
+ * Returns:
+ *   1 if every test holds, 0 otherwise.
+ */
+static int meta_filter_match(const meta_filter_t *filter, const entry_meta_t *meta) {
+    for (size_t i = 0; i < filter->count; ++i) {
+        const meta_test_t *test = &filter->tests[i];
+        int64_t actual;
+
+        switch (test->kind) {
+            case META_TEST_SIZE:
+                // Sizes are rounded up to whole units, so "--size=-1M" only matches empty files.
+                actual = (int64_t)((meta->size + (uint64_t)test->unit - 1) / (uint64_t)test->unit);
+                break;
+            case META_TEST_MTIME: {
+                int64_t age = filter->now - meta->mtime_sec;
+                actual = age >= 0 ? age / 86400 : -((-age + 86399) / 86400);
+                break;
+            }
+            case META_TEST_NEWER:
+                if (meta->mtime_sec != test->value) {
+                    actual = meta->mtime_sec;
+                } else {
+                    actual = meta->mtime_nsec > test->unit ? test->value + 1 : test->value;
+                }
+                break;
+            default: // META_TEST_USER
+                actual = (int64_t)meta->uid;
+                break;
+        }
+
+        if ((test->cmp > 0 && actual <= test->value) || (test->cmp < 0 && actual >= test->value) ||
+            (test->cmp == 0 && actual != test->value)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * shard_owns: Tells whether an entry at most --shard-depth levels below the
+ *             starting path belongs to the shard that is listed. The path
+ *             below the starting path is hashed, so the answer is the same
+ *             for every run and machine; the starting path itself belongs to
+ *             the first shard.
+ *
+ * Parameters:
+ *   config - Walk configuration (shard, starting path length).
+ *   parent - Path of the parent directory; the entry's path is appended
+ *            temporarily to hash it.
+ *   name   - Name of the entry.
+ *   depth  - Depth of the entry below the starting path, at most shard_depth.
+ *
+ * Returns:
+ *   1 if the entry belongs to the listed shard, 0 otherwise.
+ */
+static int shard_owns(const walk_config_t *config, path_buf_t *parent, const char *name, size_t depth) {
+    size_t parent_len;
+    size_t start;
+    uint64_t hash;
+
+    if (depth == 0) {
+        return config->shard_index == 0;
+    }
+    parent_len = path_push(parent, name);
+    start = config->root_len;
+    while (start < parent->len && parent->data[start] == '/') {
+        start++;
+    }
+    hash = index_hash(parent->data + start, parent->len - start);
+    path_pop(parent, parent_len);
+    // The low bits of FNV-1a only depend on the low bits of the bytes, so
+    // the high half is folded in before taking the remainder.
+    hash ^= hash >> 32;
+    return hash % config->shard_count == config->shard_index;
+}
+
+/*
+ * classify_entry: Checks a file system entry against the filters and learns
+ *                 its type, for process_entry and the library walker. The type
+ *                 comes from resolve_entry_type, so known d_type values need
+ *                 no stat at all.
+ *
+ * Parameters:
+ *   dir_fd               - Descriptor of the parent directory (or AT_FDCWD).
+ *   name                 - Name of the entry relative to dir_fd.
+ *   d_type               - Type reported by readdir, or DT_UNKNOWN.
+ *   depth                - Depth of the entry below the starting path (0 for
+ *                          the starting path itself).
+ *   parent               - Path of the parent directory; the entry's full path is
+ *                          appended temporarily only when the filters need it.
+ *   config               - Walk configuration (type filters, sorting, -L).
+ *   counted              - With --summarize, receives what the entry adds to
+ *                          the totals of its directory instead of it being
+ *                          listed (all zero if it is filtered out or is a
+ *                          further link to a file counted already); may be
+ *                          NULL otherwise.
+ *   listed               - Receives whether the entry passes the filters and
+ *                          is to be listed.
+ *
+ * Returns:
+ *   The resolved entry type (DT_*), so callers can decide whether to descend
+ *   without examining the entry again, -1 if the type could not be determined,
+ *   or ENTRY_PRUNED for a directory matching --prune or an entry at the
+ *   --shard-depth level of another shard, which was not listed and must not
+ *   be entered.
+ */
+static int classify_entry(int dir_fd, const char *name, unsigned char d_type, size_t depth,
+                          path_buf_t *parent, const walk_config_t *config, dir_sum_t *counted,
+                          int *listed) {
+    // The depth and name filters need no metadata, so they go first. The type
+    // is still resolved for entries they reject, since the caller needs it to descend.
+    int name_matches = depth >= config->min_depth && name_filter_match(config->names, name);
+    unsigned meta_fields = config->meta->fields | (config->summarize ? SUMMARY_FIELDS : 0);
+    int have_meta = 0;
+    entry_meta_t meta;
+    int type;
+
+    *listed = 0;
+    if (counted != NULL) {
+        counted->apparent = 0;
+        counted->allocated = 0;
+        counted->entries = 0;
+    }
+    if (current_stats != NULL) {
+        current_stats->entries++;
+        if (d_type != DT_UNKNOWN && !(config->follow_links && d_type == DT_LNK)) {
+            current_stats->typed_entries++;
+        }
+    }
+
+    // With --shard, an entry at the hashed level of another shard is dropped
+    // with its subtree before anything is known about it. Those above it are
+    // still walked, since their subtrees are split, but listed by one shard.
+    if (config->shard_count > 1 && depth <= config->shard_depth) {
+        int owned = shard_owns(config, parent, name, depth);
+        if (!owned && depth == config->shard_depth) {
+            return ENTRY_PRUNED;
+        }
+        name_matches = name_matches && owned;
+    }
+
+    // When a stat is needed for the type anyway and the metadata filters will
+    // run, one call fetches both.
+    if (name_matches && meta_fields != 0 &&
+        (d_type == DT_UNKNOWN || (config->follow_links && d_type == DT_LNK))) {
+        if (entry_metadata(dir_fd, name, config->follow_links, meta_fields | META_TYPE, &meta, parent) == -1) {
+            return -1;
+        }
+        type = meta.type;
+        have_meta = 1;
+    } else {
+        type = resolve_entry_type(dir_fd, name, d_type, config->follow_links, parent);
+    }
+
+    if (type == -1) {
+        return -1;
+    }
+
+    // A pruned directory is dropped with its subtree before it is ever opened.
+    if (type == DT_DIR && config->prune->count > 0 && name_filter_match(config->prune, name)) {
+        return ENTRY_PRUNED;
+    }
+
+    // Without -l, -d or -f every type is listed; with them, only those types
+    // (sockets, fifos, etc. then never are).
+    int should_output = name_matches && ((config->type_mask >> type) & 1u);
+
+    // Metadata filters last: entries rejected by name or type are never stat'ed for them.
+    if (should_output && meta_fields != 0) {
+        if (!have_meta && entry_metadata(dir_fd, name, config->follow_links, meta_fields, &meta, parent) == -1) {
+            should_output = 0;
+        } else {
+            should_output = meta_filter_match(config->meta, &meta);
+        }
+    }
+
+    // --summarize counts the entry instead. Without -L directories are met
+    // once, so only other files with several links need the (dev, ino) set.
+    if (config->summarize) {
+        if (should_output && ((type == DT_DIR && !config->follow_links) || meta.nlink < 2 ||
+                              visited_insert(config->links, meta.dev, meta.ino))) {
+            counted->apparent = meta.size;
+            counted->allocated = meta.blocks * 512;
+            counted->entries = 1;
+        }
+    }
+    *listed = should_output;
+    return type;
+}
+
+/*
+ * process_entry: Checks a file system entry against the filters (see
+ *                classify_entry) and either prints its path or adds it to the
+ *                results list.
+ *
+ * Parameters:
+ *   dir_fd  - Descriptor of the parent directory (or AT_FDCWD).
+ *   name    - Name of the entry relative to dir_fd.
+ *   d_type  - Type reported by readdir, or DT_UNKNOWN.
+ *   depth   - Depth of the entry below the starting path.
+ *   parent  - Path of the parent directory; the entry's full path is
+ *             appended temporarily only when it is printed or stored.
+ *   config  - Walk configuration.
+ *   results - Pointer to the results_t structure (if sorting).
+ *   out     - Output buffer receiving the path (if not sorting).
+ *   counted - With --summarize, receives what the entry adds to the totals
+ *             of its directory; may be NULL otherwise.
+ *
+ * Returns:
+ *   As classify_entry: the DT_* type, -1, or ENTRY_PRUNED.
+ */
+int process_entry(int dir_fd, const char *name, unsigned char d_type, size_t depth,
+                         path_buf_t *parent, const walk_config_t *config, results_t *results,
+                         out_buf_t *out, dir_sum_t *counted) {
+    int should_output;
+    int type = classify_entry(dir_fd, name, d_type, depth, parent, config, counted, &should_output);
+    size_t parent_len;
+
+    if (type < 0 || config->summarize) {
+        return type;
+    }
+    if (config->sort_output && results->compact) {
+        // Compact mode: record only the name under the current directory node.
+        results->last_node = should_output
+            ? add_node(results, results->dir_node, name, strlen(name), type)
+            : PATH_NODE_NONE;
+    } else if (should_output) {
+        parent_len = path_push(parent, name);
+        if (config->sort_output) {
+            add_result(results, parent->data, parent->len, type);
+        } else {
+            out_entry(out, parent->data, parent->len, type);
+        }
+        path_pop(parent, parent_len);
+    }
+    return type;
+}
+
+/*
+ * list_entry: Lists an entry that only the type filters apply to. This is
+ *             process_entry without the checks for options that are not in
+ *             effect, so for the plain modes (all types, -f, -s -f, ...) an
+ *             entry of known type costs one mask test before it is listed.
+ *             sorted is a constant in each of the variants below, which the
+ *             compiler specializes.
+ *
+ * Parameters:
+ *   As process_entry; counted is unused.
+ *   sorted - Flag: add the entry to results (full paths) instead of out.
+ *
+ * Returns:
+ *   The DT_* type, or -1 if the type could not be determined.
+ */
+static inline int list_entry(int dir_fd, const char *name, unsigned char d_type, path_buf_t *parent,
+                             const walk_config_t *config, results_t *results, out_buf_t *out, int sorted) {
+    int type = d_type;
+    size_t parent_len;
+
+    if (d_type == DT_UNKNOWN || (d_type == DT_LNK && config->follow_links)) {
+        type = resolve_entry_type(dir_fd, name, d_type, config->follow_links, parent);
+        if (type == -1) {
+            return -1;
+        }
+    }
+    if ((config->type_mask >> type) & 1u) {
+        parent_len = path_push(parent, name);
+        if (sorted) {
+            add_result(results, parent->data, parent->len, type);
+        } else {
+            out_entry(out, parent->data, parent->len, type);
+        }
+        path_pop(parent, parent_len);
+    }
+    return type;
+}
+
+/*
+ * list_entry_unsorted: Entry handler of the plain modes without -s (see list_entry).
+ *
+ * Parameters:
+ *   As process_entry.
+ *
+ * Returns:
+ *   The DT_* type, or -1 if the type could not be determined.
+ */
+static int list_entry_unsorted(int dir_fd, const char *name, unsigned char d_type, size_t depth,
+                               path_buf_t *parent, const walk_config_t *config, results_t *results,
+                               out_buf_t *out, dir_sum_t *counted) {
+    (void)depth;
+    (void)counted;
+    return list_entry(dir_fd, name, d_type, parent, config, results, out, 0);
+}
+
+/*
+ * list_entry_sorted: Entry handler of the plain modes with -s (see list_entry).
+ *
+ * Parameters:
+ *   As process_entry.
+ *
+ * Returns:
+ *   The DT_* type, or -1 if the type could not be determined.
+ */
+static int list_entry_sorted(int dir_fd, const char *name, unsigned char d_type, size_t depth,
+                             path_buf_t *parent, const walk_config_t *config, results_t *results,
+                             out_buf_t *out, dir_sum_t *counted) {
+    (void)depth;
+    (void)counted;
+    return list_entry(dir_fd, name, d_type, parent, config, results, out, 1);
+}
+
+/*
+ * select_entry_handler: Picks the entry handler for a walk configuration once,
+ *                       so that the walk loops do not re-check options that
+ *                       are not in effect for every entry. The plain handlers
+ *                       apply when only the type filters, -L and --maxdepth
+ *                       are in effect; everything else (and --stats, which
+ *                       counts the entries) goes through process_entry.
+ *
+ * Parameters:
+ *   config  - Walk configuration, complete but for handle_entry.
+ *   compact - Flag: sorted results are stored as --compact nodes.
+ *
+ * Returns:
+ *   The entry handler.
+ */
+entry_handler_t select_entry_handler(const walk_config_t *config, int compact) {
+    int plain = config->names->count == 0 && config->meta->fields == 0 && config->prune->count == 0 &&
+                config->min_depth == 0 && config->shard_count <= 1 && !config->summarize &&
+                !stats_registry.enabled;
+
+    if (!plain) {
+        return process_entry;
+    }
+    if (!config->sort_output) {
+        return list_entry_unsorted;
+    }
+    return compact ? process_entry : list_entry_sorted;
+}
+
+/*
+ * reopen_parent: Reopens a detached directory through ".." of its child, which
+ *                needs no path and so works below PATH_MAX. The descriptor is
+ *                kept only if it refers to the directory that was detached
+ *                (it may have been moved or replaced meanwhile).
+ *
+ * Parameters:
+ *   parent   - Pointer to the detached frame.
+ *   child_fd - Open descriptor of a subdirectory of it, or -1.
+ *
+ * Returns:
+ *   Nothing. On failure the parent stays detached without error messages.
+ */
+void reopen_parent(walk_frame_t *parent, int child_fd) {
+    struct stat st;
+    int fd;
+
+    if (child_fd == -1) {
+        return;
+    }
+    fd = stats_openat(child_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(fd, &st) == -1 || st.st_dev != parent->dev || st.st_ino != parent->ino) {
+        close(fd);
+        return;
+    }
+    dir_reader_reattach(&parent->reader, fd);
+}
+
+/*
+ * root_stream_write: Hands output of a starting path to its stream. The
+ *                    first unfinished path writes to stdout; the others hold
+ *                    it back, in memory up to ROOT_HOLD_SIZE and in a
+ *                    temporary file beyond. Thread-safe.
+ *
+ * Parameters:
+ *   stream    - Pointer to the root_stream_t structure.
+ *   iov       - Array of buffers holding whole entries; advanced in place.
+ *   iov_count - Number of buffers.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing fails. Aborts on memory allocation failure.
+ */
+static void root_stream_write(root_stream_t *stream, struct iovec *iov, int iov_count) {
+    root_order_t *order = stream->order;
+    size_t total = 0;
+
+    pthread_mutex_lock(&order->lock);
+    if (stream->index == order->head) {
+        pthread_mutex_lock(&output_lock);
+        out_write_all(iov, iov_count);
+        pthread_mutex_unlock(&output_lock);
+        pthread_mutex_unlock(&order->lock);
+        return;
+    }
+
+    for (int i = 0; i < iov_count; ++i) {
+        total += iov[i].iov_len;
+    }
+    if (stream->held_len + total > ROOT_HOLD_SIZE) {
+        // The memory held so far goes to the file first, then the new output.
+        if (stream->spill == NULL) {
+            stream->spill = run_create(order->tmp_dir);
+        }
+        int ok = fwrite(stream->held, 1, stream->held_len, stream->spill) == stream->held_len;
+        for (int i = 0; ok && i < iov_count; ++i) {
+            ok = fwrite(iov[i].iov_base, 1, iov[i].iov_len, stream->spill) == iov[i].iov_len;
+        }
+        if (!ok) {
+            perror("Error writing held output");
+            exit(EXIT_FAILURE);
+        }
+        stream->held_len = 0;
+    } else {
+        if (stream->held_len + total > stream->held_capacity) {
+            size_t new_capacity = stream->held_capacity == 0 ? RUN_BUFFER_SIZE : stream->held_capacity;
+            while (new_capacity < stream->held_len + total) {
+                new_capacity *= 2;
+            }
+            char *new_held = (char *)realloc(stream->held, new_capacity);
+            if (new_held == NULL) {
+                perror("Error reallocating held output");
+                abort();
+            }
+            stream->held = new_held;
+            stream->held_capacity = new_capacity;
+        }
+        for (int i = 0; i < iov_count; ++i) {
+            memcpy(stream->held + stream->held_len, iov[i].iov_base, iov[i].iov_len);
+            stream->held_len += iov[i].iov_len;
+        }
+    }
+    pthread_mutex_unlock(&order->lock);
+}
+
+/*
+ * stats_attach: Gives the calling thread its own --stats counters, if the
+ *               report is enabled. Must be called before the thread does any
+ *               work worth counting; the counters outlive the thread.
+ *
+ * Parameters:
+ *   None.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+void stats_attach(void) {
+    thread_stats_t *stats;
+
+    if (!stats_registry.enabled) {
+        return;
+    }
+    stats = (thread_stats_t *)calloc(1, sizeof(thread_stats_t));
+    if (stats == NULL) {
+        perror("Error allocating statistics");
+        abort();
+    }
+    pthread_mutex_lock(&stats_registry.lock);
+    stats->next = stats_registry.threads;
+    stats_registry.threads = stats;
+    pthread_mutex_unlock(&stats_registry.lock);
+    current_stats = stats;
+}
+
+/*
+ * stats_clock: Reads the monotonic clock for --stats.
+ *
+ * Parameters:
+ *   None.
+ *
+ * Returns:
+ *   The time in nanoseconds, or 0 when the calling thread has no counters,
+ *   so call sites cost a single test with --stats off.
+ */
+uint64_t stats_clock(void) {
+    struct timespec now;
+
+    if (current_stats == NULL) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * stats_record: Adds the latency of one system call to the histogram of its
+ *               class in the calling thread's counters. errno is preserved,
+ *               so the call may sit between a failed call and its error message.
+ *
+ * Parameters:
+ *   class_id - STATS_* class of the call.
+ *   started  - Value of stats_clock before the call.
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void stats_record(int class_id, uint64_t started) {
+    thread_stats_t *stats = current_stats;
+    latency_hist_t *hist;
+    uint64_t elapsed;
+    int saved_errno = errno;
+
+    if (stats == NULL) {
+        return;
+    }
+    elapsed = stats_clock() - started;
+    hist = &stats->latency[class_id];
+    hist->count++;
+    hist->total += elapsed;
+    if (elapsed > hist->max) {
+        hist->max = elapsed;
+    }
+    hist->buckets[stats_bucket(elapsed)]++;
+    errno = saved_errno;
+}
+
+/*
+ * stats_error: Counts a reported error by its errno value for --stats.
+ *
+ * Parameters:
+ *   errnum - The errno value.
+ *
+ * Returns:
+ *   Nothing. errno is left unchanged.
+ */
+static void stats_error(int errnum) {
+    if (current_stats == NULL) {
+        return;
+    }
+    current_stats->errors[errnum > 0 && errnum < STATS_ERRNO_LIMIT ? errnum : STATS_ERRNO_LIMIT - 1]++;
+}
+
+/*
+ * stats_openat: Opens a directory with openat, counting it and its latency
+ *               for --stats.
+ *
+ * Parameters:
+ *   dir_fd - Descriptor of the parent directory, or AT_FDCWD.
+ *   path   - Path of the directory relative to dir_fd.
+ *   flags  - Open flags.
+ *
+ * Returns:
+ *   The new descriptor, or -1 with errno set.
+ */
+int stats_openat(int dir_fd, const char *path, int flags) {
+    uint64_t started = stats_clock();
+    int fd = openat(dir_fd, path, flags);
+
+    stats_record(STATS_OPEN, started);
+    if (fd != -1 && current_stats != NULL) {
+        current_stats->dirs_opened++;
+    }
+    return fd;
+}
+
+/*
+ * stats_bucket: Returns the histogram bucket of a latency.
+ *
+ * Parameters:
+ *   value - Latency in nanoseconds.
+ *
+ * Returns:
+ *   Index into latency_hist_t.buckets.
+ */
+static size_t stats_bucket(uint64_t value) {
+    unsigned msb = 0;
+
+    if (value < STATS_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+    for (unsigned step = 32; step > 0; step /= 2) {
+        if (value >> (msb + step) != 0) {
+            msb += step;
+        }
+    }
+    return (size_t)(msb - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS +
+           (size_t)((value >> (msb - STATS_SUB_BUCKET_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+/*
+ * error_log_get: Returns the error log of the calling thread, creating and
+ *                registering it on the first error the thread reports.
+ *
+ * Parameters:
+ *   None.
+ *
+ * Returns:
+ *   The log. Aborts on memory allocation failure.
+ */
+static error_log_t *error_log_get(void) {
+    error_log_t *log = current_errors;
+
+    if (log != NULL) {
+        return log;
+    }
+    log = (error_log_t *)calloc(1, sizeof(error_log_t));
+    if (log == NULL || (log->pending = (char *)malloc(ERROR_BUFFER_SIZE)) == NULL) {
+        perror("Error allocating error log");
+        abort();
+    }
+    log->pending_capacity = ERROR_BUFFER_SIZE;
+    pthread_mutex_lock(&error_registry.lock);
+    log->next = error_registry.logs;
+    error_registry.logs = log;
+    pthread_mutex_unlock(&error_registry.lock);
+    current_errors = log;
+    return log;
+}
+
+/*
+ * error_count: Counts an error for the --max-errors summary, by errno and
+ *              under the directory holding the failing path.
+ *
+ * Parameters:
+ *   log      - Error log of the calling thread.
+ *   errnum   - The errno value.
+ *   path     - Path that failed, or NULL.
+ *   path_len - Length of path.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+void error_count(error_log_t *log, int errnum, const char *path, size_t path_len) {
+    size_t dir_len = 0;
+    uint64_t hash;
+    size_t slot;
+
+    log->by_errno[errnum > 0 && errnum < STATS_ERRNO_LIMIT ? errnum : STATS_ERRNO_LIMIT - 1]++;
+    if (path == NULL) {
+        log->other_dirs++;
+        return;
+    }
+    // The directory is everything before the last '/' ("/" itself for a
+    // top-level path, and "." for a path without any).
+    for (size_t i = path_len; i > 0; --i) {
+        if (path[i - 1] == '/') {
+            dir_len = i - 1 > 0 ? i - 1 : 1;
+            break;
+        }
+    }
+    if (dir_len == 0) {
+        path = ".";
+        dir_len = 1;
+    }
+
+    if (log->dirs == NULL) {
+        log->dirs = (error_dir_t *)calloc(ERROR_DIR_SLOTS, sizeof(error_dir_t));
+        if (log->dirs == NULL) {
+            perror("Error allocating error log");
+            abort();
+        }
+    }
+    hash = hash_bytes(FNV_OFFSET_BASIS, path, dir_len);
+    slot = (size_t)(hash ^ (hash >> 32)) & (ERROR_DIR_SLOTS - 1);
+    while (log->dirs[slot].path != NULL) {
+        error_dir_t *dir = &log->dirs[slot];
+        if (dir->hash == hash && dir->len == dir_len && memcmp(dir->path, path, dir_len) == 0) {
+            dir->count++;
+            return;
+        }
+        slot = (slot + 1) & (ERROR_DIR_SLOTS - 1);
+    }
+    // The table stays at most half full; errors past that are summed up.
+    if (log->dir_count >= ERROR_DIR_SLOTS / 2) {
+        log->other_dirs++;
+        return;
+    }
+    log->dirs[slot].path = (char *)malloc(dir_len + 1);
+    if (log->dirs[slot].path == NULL) {
+        perror("Error allocating error log");
+        abort();
+    }
+    memcpy(log->dirs[slot].path, path, dir_len);
+    log->dirs[slot].path[dir_len] = '\0';
+    log->dirs[slot].len = dir_len;
+    log->dirs[slot].hash = hash;
+    log->dirs[slot].count = 1;
+    log->dir_count++;
+}
+
+/*
+ * walk_error: Reports an error met while walking, as
+ *             "Error <action> '<path>': <strerror>". The message is built in
+ *             the thread's error log and written with write(2), right away
+ *             when stderr is a terminal and otherwise once the log's buffer
+ *             is full or the walk is done, so that failing trees cost neither
+ *             the stdio lock nor a write per error. Beyond --max-errors,
+ *             errors are only counted for the summary at exit.
+ *
+ * Parameters:
+ *   errnum   - The errno value.
+ *   action   - What failed, e.g. "opening directory".
+ *   path     - Path it failed on, or NULL.
+ *   path_len - Length of path (messages may show just a prefix of a buffer).
+ *
+ * Returns:
+ *   Nothing. errno is left unchanged. Aborts on memory allocation failure.
+ */
+void walk_error(int errnum, const char *action, const char *path, size_t path_len) {
+    int saved_errno = errno;
+    error_log_t *log = error_log_get();
+    size_t reported = atomic_fetch_add(&error_registry.reported, 1);
+    const char *text;
+    size_t action_len;
+    size_t text_len;
+    size_t needed;
+    char *end;
+
+    stats_error(errnum);
+    if (error_registry.limit != SIZE_MAX) {
+        error_count(log, errnum, path, path_len);
+    }
+    if (reported >= error_registry.limit) {
+        errno = saved_errno;
+        return;
+    }
+
+    text = strerror(errnum);
+    action_len = strlen(action);
+    text_len = strlen(text);
+    needed = sizeof("Error ") - 1 + action_len + (path != NULL ? path_len + 3 : 0) + 2 + text_len + 1;
+    if (log->pending_len + needed > log->pending_capacity) {
+        error_flush();
+        if (needed > log->pending_capacity) {
+            char *grown = (char *)realloc(log->pending, needed);
+            if (grown == NULL) {
+                perror("Error allocating error log");
+                abort();
+            }
+            log->pending = grown;
+            log->pending_capacity = needed;
+        }
+    }
+    end = log->pending + log->pending_len;
+    memcpy(end, "Error ", sizeof("Error ") - 1);
+    end += sizeof("Error ") - 1;
+    memcpy(end, action, action_len);
+    end += action_len;
+    if (path != NULL) {
+        memcpy(end, " '", 2);
+        memcpy(end + 2, path, path_len);
+        end += path_len + 2;
+        *end++ = '\'';
+    }
+    memcpy(end, ": ", 2);
+    memcpy(end + 2, text, text_len);
+    end += text_len + 2;
+    *end++ = '\n';
+    log->pending_len = (size_t)(end - log->pending);
+    if (!error_registry.buffered) {
+        error_flush();
+    }
+    errno = saved_errno;
+}
+
+/*
+ * error_flush: Writes the messages held in the calling thread's error log.
+ *
+ * Parameters:
+ *   None.
+ *
+ * Returns:
+ *   Nothing. Failures to write to stderr are ignored.
+ */
+void error_flush(void) {
+    error_log_t *log = current_errors;
+    size_t done = 0;
+
+    if (log == NULL) {
+        return;
+    }
+    while (done < log->pending_len) {
+        ssize_t written = write(STDERR_FILENO, log->pending + done, log->pending_len - done);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            break;
+        }
+        done += (size_t)written;
+    }
+    log->pending_len = 0;
+}
+
+/*
+ * watch_directory: Makes sure changes in a directory entered by the walk are
+ *                  reported: with fanotify by marking its file system if it
+ *                  is a new one, with inotify by adding a watch for it.
+ *                  Called by the -j workers concurrently.
+ *
+ * Parameters:
+ *   watch  - Pointer to the watch_t structure.
+ *   dir_fd - Open descriptor of the directory.
+ *   path   - Printed path of the directory.
+ *   dev    - Device of the directory.
+ *
+ * Returns:
+ *   Nothing. Prints a warning if the directory cannot be watched.
+ */
+static void watch_directory(watch_t *watch, int dir_fd, const char *path, dev_t dev) {
+    pthread_mutex_lock(&watch->lock);
+#if DIRWALK_USE_FANOTIFY
+    if (watch->backend == WATCH_FANOTIFY && watch_add_mount(watch, dir_fd, dev) == -1) {
+        fprintf(stderr, "Warning: Cannot watch '%s': %s\n", path, strerror(errno));
+    }
+#endif
+#if DIRWALK_USE_INOTIFY
+    if (watch->backend == WATCH_INOTIFY) {
+        watch_add_inotify(watch, dir_fd, path);
+    }
+#endif
+#if !DIRWALK_USE_FANOTIFY
+    (void)dev;
+#endif
+#if !DIRWALK_USE_WATCH
+    (void)dir_fd;
+    (void)path;
+#endif
+    pthread_mutex_unlock(&watch->lock);
+}
+
+#if DIRWALK_USE_FANOTIFY
+/*
+ * watch_add_mount: Marks the file system of a directory for fanotify, unless
+ *                  it was already tried. A file system that cannot be marked
+ *                  is remembered too, so it is reported once.
+ *
+ * Parameters:
+ *   watch  - Pointer to the watch_t structure.
+ *   dir_fd - Open descriptor of a directory on the file system.
+ *   dev    - Device of the directory.
+ *
+ * Returns:
+ *   0 on success or if the file system was tried before, -1 (errno set) if
+ *   it cannot be marked. Aborts on memory allocation failure.
+ */
+int watch_add_mount(watch_t *watch, int dir_fd, dev_t dev) {
+    struct statfs fs;
+    watch_mount_t *mount;
+    int saved_errno = 0;
+    int fd = -1;
+
+    for (size_t i = 0; i < watch->mount_count; ++i) {
+        if (watch->mounts[i].dev == dev) {
+            return 0;
+        }
+    }
+
+    if (fstatfs(dir_fd, &fs) == -1 ||
+        fanotify_mark(watch->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                      FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR, dir_fd, NULL) == -1 ||
+        (fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+        saved_errno = errno;
+    }
+
+    if (watch->mount_count == watch->mount_capacity) {
+        size_t new_capacity = watch->mount_capacity == 0 ? 4 : watch->mount_capacity * 2;
+        watch_mount_t *new_mounts = (watch_mount_t *)realloc(watch->mounts, new_capacity * sizeof(watch_mount_t));
+        if (new_mounts == NULL) {
+            perror("Error reallocating file system list");
+            abort();
+        }
+        watch->mounts = new_mounts;
+        watch->mount_capacity = new_capacity;
+    }
+    mount = &watch->mounts[watch->mount_count++];
+    memset(mount->fsid, 0, sizeof(mount->fsid));
+    if (saved_errno == 0) {
+        memcpy(mount->fsid, &fs.f_fsid, sizeof(mount->fsid) < sizeof(fs.f_fsid) ? sizeof(mount->fsid) : sizeof(fs.f_fsid));
+    }
+    mount->dev = dev;
+    mount->fd = fd;
+    if (saved_errno != 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+#endif
+#if DIRWALK_USE_INOTIFY
+/*
+ * watch_node_home: Finds the preferred slot of a watch descriptor in the
+ *                  inotify watch table.
+ *
+ * Parameters:
+ *   watch - Pointer to the watch_t structure.
+ *   wd    - The watch descriptor.
+ *
+ * Returns:
+ *   The slot index.
+ */
+size_t watch_node_home(const watch_t *watch, int wd) {
+    return ((size_t)(unsigned)wd * 2654435761u) & (watch->node_capacity - 1);
+}
+
+/*
+ * watch_node_find: Looks up a watch descriptor in the inotify watch table.
+ *
+ * Parameters:
+ *   watch - Pointer to the watch_t structure.
+ *   wd    - The watch descriptor.
+ *
+ * Returns:
+ *   The node, or NULL if the descriptor is not in the table.
+ */
+watch_node_t *watch_node_find(const watch_t *watch, int wd) {
+    size_t mask = watch->node_capacity - 1;
+
+    for (size_t i = watch_node_home(watch, wd); watch->nodes[i].wd != -1; i = (i + 1) & mask) {
+        if (watch->nodes[i].wd == wd) {
+            return &watch->nodes[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * watch_node_insert: Adds a watch descriptor to the inotify watch table,
+ *                    growing it at three quarters load.
+ *
+ * Parameters:
+ *   watch - Pointer to the watch_t structure.
+ *   wd    - The watch descriptor, not yet in the table.
+ *
+ * Returns:
+ *   The new node, without name or parent. Aborts on memory allocation failure.
+ */
+static watch_node_t *watch_node_insert(watch_t *watch, int wd) {
+    size_t mask;
+    size_t i;
+
+    if ((watch->node_count + 1) * 4 > watch->node_capacity * 3) {
+        watch_node_t *old_nodes = watch->nodes;
+        size_t old_capacity = watch->node_capacity;
+        watch->node_capacity *= 2;
+        watch->nodes = (watch_node_t *)malloc(watch->node_capacity * sizeof(watch_node_t));
+        if (watch->nodes == NULL) {
+            perror("Error reallocating watch table");
+            abort();
+        }
+        for (i = 0; i < watch->node_capacity; ++i) {
+            watch->nodes[i].wd = -1;
+        }
+        mask = watch->node_capacity - 1;
+        for (size_t j = 0; j < old_capacity; ++j) {
+            if (old_nodes[j].wd != -1) {
+                for (i = watch_node_home(watch, old_nodes[j].wd); watch->nodes[i].wd != -1; i = (i + 1) & mask) {
+                }
+                watch->nodes[i] = old_nodes[j];
+            }
+        }
+        free(old_nodes);
+    }
+
+    mask = watch->node_capacity - 1;
+    for (i = watch_node_home(watch, wd); watch->nodes[i].wd != -1; i = (i + 1) & mask) {
+    }
+    watch->nodes[i].wd = wd;
+    watch->nodes[i].parent_wd = -1;
+    watch->nodes[i].moved = 0;
+    watch->nodes[i].name = NULL;
+    watch->node_count++;
+    return &watch->nodes[i];
+}
+
+/*
+ * watch_add_inotify: Adds an inotify watch for a directory entered by the
+ *                    walk and records it under its parent. The walk enters a
+ *                    directory right after its parent or a sibling, so the
+ *                    parent's watch is usually known from the previous call;
+ *                    otherwise adding a watch for the parent's path returns
+ *                    its existing watch.
+ *
+ * Parameters:
+ *   watch  - Pointer to the watch_t structure.
+ *   dir_fd - Open descriptor of the directory.
+ *   path   - Printed path of the directory.
+ *
+ * Returns:
+ *   Nothing. Prints a warning if the watch cannot be added (once when the
+ *   watch limit is reached). Aborts on memory allocation failure.
+ */
+static void watch_add_inotify(watch_t *watch, int dir_fd, const char *path) {
+    char link[32];
+    int wd;
+    int parent_wd = -1;
+    const char *name;
+    size_t path_len = strlen(path);
+    size_t parent_len;
+    watch_node_t *node;
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+    wd = inotify_add_watch(watch->fd, link, WATCH_INOTIFY_MASK);
+    if (wd == -1 && errno == ENOENT) {
+        wd = inotify_add_watch(watch->fd, path, WATCH_INOTIFY_MASK); // No /proc
+    }
+    if (wd == -1) {
+        if (errno != ENOSPC) {
+            fprintf(stderr, "Warning: Cannot watch '%s': %s\n", path, strerror(errno));
+        } else if (!watch->limit_warned) {
+            fprintf(stderr, "Warning: Cannot watch '%s' and further directories: out of inotify watches "
+                    "(see fs.inotify.max_user_watches)\n", path);
+            watch->limit_warned = 1;
+        }
+        return;
+    }
+
+    node = watch_node_find(watch, wd);
+    if (watch->root_wd == -1) {
+        if (node == NULL) {
+            node = watch_node_insert(watch, wd);
+        }
+        node->name = strdup(watch->root);
+        if (node->name == NULL) {
+            perror("Error allocating path");
+            abort();
+        }
+        watch->root_wd = wd;
+        parent_len = SIZE_MAX;
+    } else {
+        if (wd == watch->root_wd) {
+            return;
+        }
+        name = strrchr(path, '/');
+        if (name == NULL) {
+            if (node == NULL) {
+                inotify_rm_watch(watch->fd, wd);
+            }
+            return;
+        }
+        parent_len = (size_t)(name - path);
+        name++;
+
+        if (watch->last_wd != -1 && watch->last_path.len == parent_len &&
+            memcmp(watch->last_path.data, path, parent_len) == 0) {
+            parent_wd = watch->last_wd;
+        } else if (watch->last_parent_wd != -1 && watch->last_parent_len == parent_len &&
+                   memcmp(watch->last_path.data, path, parent_len) == 0) {
+            parent_wd = watch->last_parent_wd;
+        } else {
+            size_t len = parent_len > 0 ? parent_len : 1; // The parent of "/x" is "/"
+            path_reserve(&watch->parent_path, len + 1);
+            memcpy(watch->parent_path.data, path, len);
+            path_pop(&watch->parent_path, len);
+            parent_wd = inotify_add_watch(watch->fd, watch->parent_path.data, WATCH_INOTIFY_MASK);
+            if (parent_wd != -1 && watch_node_find(watch, parent_wd) == NULL) {
+                inotify_rm_watch(watch->fd, parent_wd); // The parent is not watched itself
+                parent_wd = -1;
+            }
+        }
+        if (parent_wd == -1) {
+            if (node == NULL) {
+                inotify_rm_watch(watch->fd, wd);
+            }
+            return;
+        }
+
+        // A directory entered again (after a rename) is moved in the table.
+        if (node == NULL) {
+            node = watch_node_insert(watch, wd);
+        }
+        free(node->name);
+        node->name = strdup(name);
+        if (node->name == NULL) {
+            perror("Error allocating path");
+            abort();
+        }
+        node->parent_wd = parent_wd;
+    }
+
+    path_reserve(&watch->last_path, path_len + 1);
+    memcpy(watch->last_path.data, path, path_len + 1);
+    watch->last_path.len = path_len;
+    watch->last_wd = wd;
+    watch->last_parent_len = parent_len;
+    watch->last_parent_wd = parent_wd;
+}
+
+#endif
+/*
+ * listing_put_varint: Appends a LEB128 variable-length integer to a buffer
+ *                     (7 bits per byte, low bits first).
+ *
+ * Parameters:
+ *   buf   - Buffer; its capacity is grown as needed.
+ *   value - The integer.
+ *
+ * Returns:
+ *   Nothing. Aborts on memory allocation failure.
+ */
+static void listing_put_varint(path_buf_t *buf, uint64_t value) {
+    path_reserve(buf, buf->len + LISTING_VARINT_MAX + 1);
+    while (value >= 0x80) {
+        buf->data[buf->len++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buf->data[buf->len++] = (char)value;
+}
+
+/*
+ * listing_get_varint: Reads a LEB128 variable-length integer.
+ *
+ * Parameters:
+ *   pos   - Read position; advanced past the integer.
+ *   end   - End of the readable bytes.
+ *   value - Receives the integer.
+ *
+ * Returns:
+ *   0 on success, -1 if the integer is truncated or too long.
+ */
+int listing_get_varint(const unsigned char **pos, const unsigned char *end, uint64_t *value) {
+    uint64_t result = 0;
+
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (*pos >= end) {
+            return -1;
+        }
+        unsigned char byte = *(*pos)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * listing_write: Writes bytes of a listing to stdout.
+ *
+ * Parameters:
+ *   listing - Pointer to the listing_t structure.
+ *   iov     - Array of buffers to write.
+ *   count   - Number of buffers.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing to stdout fails.
+ */
+void listing_write(listing_t *listing, struct iovec *iov, int count) {
+    for (int i = 0; i < count; ++i) {
+        listing->offset += iov[i].iov_len;
+    }
+    pthread_mutex_lock(&output_lock);
+    out_write_all(iov, count);
+    pthread_mutex_unlock(&output_lock);
+}
+
+/*
+ * listing_add: Appends the next sorted entry to a listing. It is stored as
+ *              the length of the prefix it shares with the entry before it in
+ *              the block, followed by the rest; the first entry of a block
+ *              shares nothing, so every block decodes on its own. A block
+ *              ends after an entry once it holds LISTING_BLOCK_MIN bytes and
+ *              the hash of the entry's path has its LISTING_CUT_MASK bits
+ *              clear (or at LISTING_BLOCK_MAX bytes), so block boundaries
+ *              depend on the paths, not on their positions: after a change,
+ *              two listings of the same tree fall back to identical blocks.
+ *
+ * Parameters:
+ *   listing - Pointer to the listing_t structure.
+ *   path    - Path of the entry.
+ *   len     - Length of path.
+ *   type    - DT_* type of the entry.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing to stdout fails.
+ */
+static void listing_add(listing_t *listing, const char *path, size_t len, int type) {
+    path_buf_t *block = &listing->block;
+    path_buf_t *previous = &listing->previous;
+    size_t shared = 0;
+
+    if (listing->block_entries > 0) {
+        size_t limit = len < previous->len ? len : previous->len;
+        while (shared < limit && previous->data[shared] == path[shared]) {
+            shared++;
+        }
+    }
+    listing_put_varint(block, shared);
+    listing_put_varint(block, len - shared);
+    path_reserve(block, block->len + 1 + (len - shared));
+    block->data[block->len++] = (char)type;
+    memcpy(block->data + block->len, path + shared, len - shared);
+    block->len += len - shared;
+    listing->block_entries++;
+
+    path_reserve(previous, len + 1);
+    memcpy(previous->data + shared, path + shared, len - shared);
+    previous->len = len;
+
+    if (block->len >= LISTING_BLOCK_MAX) {
+        listing_flush_block(listing);
+    } else if (block->len >= LISTING_BLOCK_MIN) {
+        // FNV-1a hardly spreads the last bytes of a path, where neighbouring
+        // paths differ, so its hash goes through the splitmix64 finalizer.
+        uint64_t hash = hash_bytes(FNV_OFFSET_BASIS, path, len);
+        hash ^= hash >> 30;
+        hash *= 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 27;
+        hash *= 0x94D049BB133111EBULL;
+        hash ^= hash >> 31;
+        if ((hash & LISTING_CUT_MASK) == 0) {
+            listing_flush_block(listing);
+        }
+    }
+}
+
+/*
+ * listing_flush_block: Writes the block being filled, compressed if that
+ *                      makes it smaller, and records it in the block index.
+ *
+ * Parameters:
+ *   listing - Pointer to the listing_t structure.
+ *
+ * Returns:
+ *   Nothing. Exits with failure if writing to stdout fails.
+ */
+void listing_flush_block(listing_t *listing) {
+    path_buf_t *block = &listing->block;
+    listing_block_header_t header;
+    const char *stored = block->data;
+    const unsigned char *first;
+    uint64_t first_len = 0;
+    struct iovec iov[2];
+
+    if (listing->block_entries == 0) {
+        return;
+    }
+    header.stored_len = (uint32_t)block->len;
+    header.raw_len = (uint32_t)block->len;
+    header.entries = listing->block_entries;
+    header.flags = 0;
+#if DIRWALK_USE_ZSTD
+    if (listing->compress) {
+        size_t bound = ZSTD_compressBound(block->len);
+        path_reserve(&listing->packed, bound);
+        size_t packed = ZSTD_compress(listing->packed.data, bound, block->data, block->len, LISTING_ZSTD_LEVEL);
+        if (!ZSTD_isError(packed) && packed < block->len) {
+            stored = listing->packed.data;
+            header.stored_len = (uint32_t)packed;
+            header.flags = LISTING_BLOCK_ZSTD;
+        }
+    }
+#endif
+
+    // Index entry: offset, block header and first path (which follows the
+    // shared length 0, its length and its type at the start of the block).
+    first = (const unsigned char *)block->data + 1;
+    listing_get_varint(&first, (const unsigned char *)block->data + block->len, &first_len);
+    first++;
+    path_reserve(&listing->index, listing->index.len + sizeof(uint64_t) + sizeof(header));
+    memcpy(listing->index.data + listing->index.len, &listing->offset, sizeof(uint64_t));
+    memcpy(listing->index.data + listing->index.len + sizeof(uint64_t), &header, sizeof(header));
+    listing->index.len += sizeof(uint64_t) + sizeof(header);
+    listing_put_varint(&listing->index, first_len);
+    path_reserve(&listing->index, listing->index.len + first_len);
+    memcpy(listing->index.data + listing->index.len, first, first_len);
+    listing->index.len += first_len;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)stored;
+    iov[1].iov_len = header.stored_len;
+    listing_write(listing, iov, 2);
+
+    listing->block_count++;
+    listing->entry_count += listing->block_entries;
+    listing->block_entries = 0;
+    block->len = 0;
+    listing->previous.len = 0;
+}
+
+/*
+ * dirwalk_options_init: Sets library options to the defaults of the program:
+ *                       every type, unsorted, no links followed, no limits.
+ *
+ * Parameters:
+ *   options - Pointer to the dirwalk_options_t structure.
+ *
+ * Returns:
+ *   Nothing.
+ */
+void dirwalk_options_init(dirwalk_options_t *options) {
+    options->types = 0;
+    options->sort = 0;
+    options->follow_links = 0;
+    options->xdev = 0;
+    options->max_depth = SIZE_MAX;
+    options->min_depth = 0;
+    options->max_open_dirs = 0;
+}
+
+/*
+ * dirwalk_open: Starts a library walk. The starting path is examined as
+ *               walk_root does it, and its directory becomes the first frame
+ *               of the walker's stack.
+ *
+ * Parameters:
+ *   path    - The starting path.
+ *   options - Pointer to the options, or NULL for the defaults.
+ *
+ * Returns:
+ *   The walker, or NULL with errno set if path cannot be examined (the
+ *   error is also reported on stderr). Aborts on memory allocation failure.
+ */
+dirwalk_t *dirwalk_open(const char *path, const dirwalk_options_t *options) {
+    dirwalk_options_t defaults;
+    dirwalk_t *walker;
+    walk_config_t *config;
+    int listed;
+
+    if (options == NULL) {
+        dirwalk_options_init(&defaults);
+        options = &defaults;
+    }
+    // The empty name, metadata and prune filters are all zero.
+    walker = (dirwalk_t *)calloc(1, sizeof(dirwalk_t));
+    if (walker == NULL || (walker->root = strdup(path)) == NULL) {
+        perror("Error allocating walker");
+        abort();
+    }
+    walker->root_len = strlen(path);
+
+    config = &walker->config;
+    config->type_mask = TYPE_MASK_ALL;
+    if (options->types != 0) {
+        config->type_mask = (options->types & DIRWALK_TYPE_LINK ? TYPE_BIT(DT_LNK) : 0) |
+                            (options->types & DIRWALK_TYPE_DIR ? TYPE_BIT(DT_DIR) : 0) |
+                            (options->types & DIRWALK_TYPE_FILE ? TYPE_BIT(DT_REG) : 0);
+    }
+    config->sort_output = options->sort;
+    config->follow_links = options->follow_links;
+    config->visited = NULL;
+    config->names = &walker->names;
+    config->meta = &walker->meta;
+    config->max_depth = options->max_depth;
+    config->min_depth = options->min_depth;
+    config->xdev = options->xdev;
+    config->root_dev = 0;
+    config->prune = &walker->prune;
+    config->index = NULL;
+    config->watch = NULL;
+    config->summarize = 0;
+    config->links = NULL;
+    config->shard_index = 0;
+    config->shard_count = 1;
+    config->shard_depth = 1;
+    config->root_len = walker->root_len;
+    config->handle_entry = select_entry_handler(config, 0);
+    if (config->follow_links) {
+        visited_init(&walker->visited);
+        config->visited = &walker->visited;
+    }
+
+    path_init(&walker->path);
+    dirent_buf_init(&walker->entries, 0, 0);
+    walker->capacity = INITIAL_WALK_STACK_CAPACITY;
+    walker->stack = (walk_frame_t *)malloc(walker->capacity * sizeof(walk_frame_t));
+    if (walker->stack == NULL) {
+        perror("Error allocating traversal stack");
+        abort();
+    }
+    walker->max_open_dirs = options->max_open_dirs > 0 ? options->max_open_dirs : default_max_open_dirs();
+    walker->open_flags = directory_open_flags(config);
+    walker->pop_len = SIZE_MAX;
+    if (config->sort_output) {
+        init_results(&walker->results, 0, 0, NULL);
+    }
+
+    walker->root_type = classify_entry(AT_FDCWD, walker->root, DT_UNKNOWN, 0, &walker->path, config, NULL,
+                                       &listed);
+    if (walker->root_type == -1) {
+        int saved_errno = errno;
+        dirwalk_close(walker);
+        errno = saved_errno;
+        return NULL;
+    }
+    walker->root_listed = listed;
+    path_push(&walker->path, walker->root);
+
+    // Like the program, an unreadable starting directory is still listed.
+    if (walker->root_type == DT_DIR && config->max_depth > 0) {
+        struct stat start_stat;
+        int start_fd = stats_openat(AT_FDCWD, walker->root, walker->open_flags);
+
+        if (start_fd == -1) {
+            walker->errors++;
+            walk_error(errno, "opening directory", walker->root, walker->root_len);
+        } else {
+            if (config->xdev && fstat(start_fd, &start_stat) == 0) {
+                config->root_dev = start_stat.st_dev;
+            }
+            if (!enter_directory(config, start_fd, walker->root)) {
+                close(start_fd);
+            } else {
+                library_push(walker, start_fd, 0);
+            }
+        }
+    }
+    return walker;
+}
+
+/*
+ * library_push: Pushes an entered directory onto the stack of a library walk,
+ *               closing the outermost open ancestor first when the walk would
+ *               exceed its budget of open directories, as
+ *               walk_directory_contents does.
+ *
+ * Parameters:
+ *   walker     - Pointer to the walker; its path holds the directory's path.
+ *   dir_fd     - Open descriptor of the directory (taken over).
+ *   parent_len - Length of the path before the directory's name.
+ *
+ * Returns:
+ *   1 if the directory was pushed, 0 on error (reported on stderr), in which
+ *   case the path is left for the caller to cut back.
+ */
+static int library_push(dirwalk_t *walker, int dir_fd, size_t parent_len) {
+    walk_frame_t *child;
+
+    if (walker->depth + 1 - walker->lowest_open > walker->max_open_dirs && walker->lowest_open < walker->depth) {
+        walk_frame_t *ancestor = &walker->stack[walker->lowest_open];
+        struct stat st;
+        if (fstat(dir_reader_fd(&ancestor->reader), &st) == 0) {
+            ancestor->dev = st.st_dev;
+            ancestor->ino = st.st_ino;
+        } else {
+            ancestor->dev = 0;
+            ancestor->ino = 0;
+        }
+        if (dir_reader_detach(&ancestor->reader) == -1) {
+            walker->errors++;
+            walk_error(errno, "closing directory", walker->path.data, ancestor->path_len);
+        }
+        walker->lowest_open++;
+    }
+
+    if (walker->depth >= walker->capacity) {
+        walker->capacity *= 2;
+        walk_frame_t *new_stack = (walk_frame_t *)realloc(walker->stack, walker->capacity * sizeof(walk_frame_t));
+        if (new_stack == NULL) {
+            perror("Error reallocating traversal stack");
+            abort();
+        }
+        walker->stack = new_stack;
+    }
+    child = &walker->stack[walker->depth];
+    if (dir_reader_open(&child->reader, dir_fd, &walker->entries) == -1) {
+        walker->errors++;
+        walk_error(errno, "opening directory", walker->path.data, walker->path.len);
+        return 0;
+    }
+    child->parent_len = parent_len;
+    child->path_len = walker->path.len;
+    child->parent_node = PATH_NODE_NONE;
+    walker->depth++;
+    return 1;
+}
+
+/*
+ * library_next: Advances a library walk to its next listed entry, in the
+ *               order of the directory reads. This is the loop of
+ *               walk_directory_contents, left at every listed entry and
+ *               resumed at the next call.
+ *
+ * Parameters:
+ *   walker - Pointer to the walker.
+ *   entry  - Receives the entry.
+ *
+ * Returns:
+ *   1 if an entry was returned, 0 at the end of the walk.
+ */
+static int library_next(dirwalk_t *walker, dirwalk_entry_t *entry) {
+    const walk_config_t *config = &walker->config;
+    const char *name = NULL;
+    unsigned char d_type = DT_UNKNOWN;
+
+    if (walker->root_listed) {
+        walker->root_listed = 0;
+        entry->path = walker->root;
+        entry->path_len = walker->root_len;
+        entry->name = walker->root;
+        entry->type = walker->root_type;
+        return 1;
+    }
+    // The entry returned last is dropped from the path, unless it was
+    // entered: then its frame owns the path.
+    if (walker->pop_len != SIZE_MAX) {
+        path_pop(&walker->path, walker->pop_len);
+        walker->pop_len = SIZE_MAX;
+    }
+
+    while (walker->depth > 0) {
+        walk_frame_t *frame = &walker->stack[walker->depth - 1];
+        int status;
+
+        // A detached directory back on top whose reopening through ".."
+        // failed is reopened by path.
+        if (walker->depth - 1 < walker->lowest_open) {
+            int fd = stats_openat(AT_FDCWD, walker->path.data, walker->open_flags);
+            if (fd == -1) {
+                walker->errors++;
+                walk_error(errno, "reopening directory", walker->path.data, walker->path.len);
+                status = 0;
+            } else {
+                dir_reader_reattach(&frame->reader, fd);
+                walker->lowest_open = walker->depth - 1;
+                status = dir_reader_next(&frame->reader, &name, &d_type);
+            }
+        } else {
+            status = dir_reader_next(&frame->reader, &name, &d_type);
+        }
+
+        // At the end of the directory, pop it and resume its parent.
+        if (status != 1) {
+            if (status == -1) {
+                walker->errors++;
+                walk_error(errno, "reading directory", walker->path.data, walker->path.len);
+            }
+            if (walker->depth - 1 == walker->lowest_open && walker->lowest_open > 0) {
+                reopen_parent(&walker->stack[walker->depth - 2], dir_reader_fd(&frame->reader));
+                if (dir_reader_fd(&walker->stack[walker->depth - 2].reader) != -1) {
+                    walker->lowest_open--;
+                }
+            }
+            dir_reader_release(&frame->reader);
+            if (dir_reader_close(&frame->reader) == -1) {
+                walker->errors++;
+                walk_error(errno, "closing directory", walker->path.data, walker->path.len);
+            }
+            path_pop(&walker->path, frame->parent_len);
+            walker->depth--;
+            continue;
+        }
+
+        int frame_fd = dir_reader_fd(&frame->reader);
+        int listed;
+        int type = classify_entry(frame_fd, name, d_type, walker->depth, &walker->path, config, NULL, &listed);
+        int enter = type == DT_DIR && walker->depth < config->max_depth;
+        int entered = 0;
+
+        if (type == -1) {
+            walker->errors++;
+            continue;
+        }
+        if (!listed && !enter) {
+            continue;
+        }
+        size_t name_len = strlen(name);
+        size_t parent_len = path_push(&walker->path, name);
+        if (enter) {
+            int child_fd = stats_openat(frame_fd, name, walker->open_flags);
+            if (child_fd == -1) {
+                walker->errors++;
+                walk_error(errno, "opening directory", walker->path.data, walker->path.len);
+            } else if (!enter_directory(config, child_fd, walker->path.data)) {
+                close(child_fd);
+            } else {
+                entered = library_push(walker, child_fd, parent_len);
+            }
+        }
+        if (!listed) {
+            if (!entered) {
+                path_pop(&walker->path, parent_len);
+            }
+            continue;
+        }
+        entry->path = walker->path.data;
+        entry->path_len = walker->path.len;
+        entry->name = walker->path.data + walker->path.len - name_len;
+        entry->type = type;
+        walker->pop_len = entered ? SIZE_MAX : parent_len;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * dirwalk_next_entry: Returns the next entry of a library walk. With the
+ *                     sort option, the first call collects the whole walk
+ *                     into the results, as -s does, and later calls return
+ *                     them in order.
+ *
+ * Parameters:
+ *   walker - Pointer to the walker.
+ *   entry  - Receives the entry; its strings belong to the walker.
+ *
+ * Returns:
+ *   1 if an entry was returned, 0 once the walk is done.
+ */
+int dirwalk_next_entry(dirwalk_t *walker, dirwalk_entry_t *entry) {
+    char *path;
+
+    if (!walker->config.sort_output) {
+        return library_next(walker, entry);
+    }
+    if (!walker->collected) {
+        while (library_next(walker, entry) == 1) {
+            add_result(&walker->results, entry->path, entry->path_len, entry->type);
+        }
+        sort_results(&walker->results);
+        walker->collected = 1;
+    }
+    if (walker->next_result >= walker->results.count) {
+        return 0;
+    }
+    path = walker->results.records[walker->next_result++].path;
+    entry->path = path;
+    entry->path_len = strlen(path);
+    entry->type = (unsigned char)path[-1];
+    // Only the starting path has its own length; all others end in a name.
+    entry->name = entry->path_len == walker->root_len ? path : strrchr(path, '/') + 1;
+    return 1;
+}
+
+/*
+ * dirwalk_error_count: Returns the number of errors a library walk reported.
+ *
+ * Parameters:
+ *   walker - Pointer to the walker.
+ *
+ * Returns:
+ *   The number of errors.
+ */
+size_t dirwalk_error_count(const dirwalk_t *walker) {
+    return walker->errors;
+}
+
+/*
+ * dirwalk_close: Ends a library walk and frees the walker, closing the
+ *                directories still open, innermost first.
+ *
+ * Parameters:
+ *   walker - Pointer to the walker, or NULL.
+ *
+ * Returns:
+ *   Nothing.
+ */
+void dirwalk_close(dirwalk_t *walker) {
+    if (walker == NULL) {
+        return;
+    }
+    while (walker->depth > 0) {
+        walk_frame_t *frame = &walker->stack[--walker->depth];
+        dir_reader_release(&frame->reader);
+        dir_reader_close(&frame->reader);
+    }
+    free(walker->stack);
+    path_free(&walker->path);
+    dirent_buf_free(&walker->entries);
+    if (walker->config.follow_links) {
+        visited_free(&walker->visited);
+    }
+    if (walker->config.sort_output) {
+        free_results(&walker->results);
+    }
+    free(walker->root);
+    free(walker);
+}
@@ -0,0 +1,157 @@
+#!/bin/sh
+#
+# checkpoint.sh: Checks that walks interrupted with --checkpoint and resumed
+#                print every entry exactly once. Each trial kills a walk of
+#                the smalldirs and symlinks trees of gen_tree.sh a few times
+#                at random moments, lets the last run finish and compares
+#                the appended output with that of an uninterrupted walk:
+#                sorted, without -s, and byte for byte, with -s. It also
+#                checks that a resume with other filters is refused.
+#
+# Usage: checkpoint.sh [-w WORKDIR] [-n TRIALS] [-k KILLS] DIRWALK
+#   -w WORKDIR: Directory holding the generated trees and the outputs
+#               (default: /tmp/dirwalk-check).
+#   -n TRIALS:  Trials per mode (default: 10).
+#   -k KILLS:   Interruptions per trial (default: 5).
+#   DIRWALK:    The dirwalk binary to check.
+#
+# Prints one line per mode and exits with status 1 if any trial failed.
+#
+set -eu
+
+workdir=/tmp/dirwalk-check
+trials=10
+kills=5
+while getopts w:n:k: opt; do
+    case $opt in
+        w) workdir=$OPTARG ;;
+        n) trials=$OPTARG ;;
+        k) kills=$OPTARG ;;
+        *) exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 [-w WORKDIR] [-n TRIALS] [-k KILLS] DIRWALK" >&2
+    exit 2
+fi
+# Absolute, as the walks run in the work directory
+dirwalk=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+tests_dir=$(cd "$(dirname "$0")" && pwd)
+export LC_ALL=C
+
+mkdir -p "$workdir"
+cd "$workdir"
+for shape in smalldirs symlinks; do
+    if [ ! -d "$shape" ]; then
+        rm -rf "$shape.tmp"
+        "$tests_dir/../bench/gen_tree.sh" "$shape" "$shape.tmp"
+        mv "$shape.tmp" "$shape"
+    fi
+done
+
+# delays COUNT: prints COUNT random delays of 10 to 90 ms, for sleep
+delays() {
+    awk -v count="$1" -v seed="$$$(date +%N)" 'BEGIN {
+        srand(seed); for (i = 0; i < count; i++) printf "0.0%d\n", 1 + int(rand() * 9) }'
+}
+
+# interrupt OPTIONS...: starts a walk and kills it after 10 ms, until one is
+# killed before it completes (at most 10 tries); fails if none was
+interrupt() {
+    tries=0
+    while [ $tries -lt 10 ]; do
+        rm -f ckpt ckpt.*
+        "$dirwalk" smalldirs symlinks "$@" --checkpoint=ckpt > /dev/null 2>&1 &
+        pid=$!
+        sleep 0.01
+        kill -9 $pid 2>/dev/null || true
+        wait $pid 2>/dev/null || true
+        if [ -e ckpt ]; then
+            return 0
+        fi
+        tries=$((tries + 1))
+    done
+    return 1
+}
+
+# refused OPTIONS -- OTHER...: interrupts a walk with OPTIONS, then fails
+# unless resuming it with OTHER is refused without output
+refused() {
+    first=
+    while [ "$1" != -- ]; do
+        first="$first $1"
+        shift
+    done
+    shift
+    # The options are split into words on purpose.
+    interrupt $first || return 1
+    if "$dirwalk" smalldirs symlinks "$@" --checkpoint=ckpt > resumed 2> err; then
+        return 1
+    fi
+    [ ! -s resumed ] && grep -q "was written for other starting paths or options" err
+}
+
+# trial OPTIONS...: interrupts and resumes one walk; fails if its output
+# differs from that of an uninterrupted one
+trial() {
+    rm -f ckpt ckpt.* resumed
+    : > resumed
+    finished=0
+    for delay in $(delays "$kills"); do
+        "$dirwalk" smalldirs symlinks "$@" --checkpoint=ckpt >> resumed 2>/dev/null &
+        pid=$!
+        sleep "$delay"
+        kill -9 $pid 2>/dev/null || true
+        wait $pid 2>/dev/null || true
+        # A walk that completed before the kill removed its checkpoint.
+        if [ ! -e ckpt ]; then
+            finished=1
+            break
+        fi
+    done
+    if [ $finished = 0 ]; then
+        "$dirwalk" smalldirs symlinks "$@" --checkpoint=ckpt >> resumed 2>/dev/null || true
+    fi
+    case " $* " in
+        *" -s "*) cmp -s resumed expected ;;
+        *) sort resumed | cmp -s - expected ;;
+    esac
+}
+
+status=0
+for mode in "" "-s" "-j4" "-s -j4 --sort-mem=256K"; do
+    # The options of a mode are split into words on purpose.
+    case " $mode " in
+        *" -s "*) "$dirwalk" smalldirs symlinks $mode > expected 2>/dev/null || true ;;
+        *) "$dirwalk" smalldirs symlinks $mode 2>/dev/null | sort > expected || true ;;
+    esac
+    failed=0
+    run=0
+    while [ $run -lt "$trials" ]; do
+        if ! trial $mode; then
+            failed=$((failed + 1))
+            cp resumed "failed-$failed.txt"
+        fi
+        run=$((run + 1))
+    done
+    if [ $failed = 0 ]; then
+        echo "ok: ${mode:-default}: $trials trials"
+    else
+        echo "FAILED: ${mode:-default}: $failed of $trials trials (outputs in $workdir/failed-*.txt)"
+        status=1
+    fi
+done
+
+# A resume must not splice the listings of two different filters.
+for change in "--name=f000000 -- --name=f000001" "--size=-1k -- --size=+1k" "--mtime=-1 -- --mtime=+1" \
+              "--prune=t000001 -- --prune=t000002" "-j4 --name=f000000 -- -j4"; do
+    if refused $change; then
+        echo "ok: refused resume: $change"
+    else
+        echo "FAILED: refused resume: $change"
+        status=1
+    fi
+done
+rm -f ckpt ckpt.* resumed expected err
+exit $status
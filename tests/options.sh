@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# options.sh: Checks the messages and exit statuses of dirwalk for option
+#             arguments it must refuse or handle specially, on a small tree
+#             made in the work directory.
+#
+# Usage: options.sh [-w WORKDIR] DIRWALK
+#   -w WORKDIR: Directory holding the tree and the outputs
+#               (default: /tmp/dirwalk-check).
+#   DIRWALK:    The dirwalk binary to check.
+#
+# Prints one line per check and exits with status 1 if any check failed.
+#
+set -eu
+
+workdir=/tmp/dirwalk-check
+while getopts w: opt; do
+    case $opt in
+        w) workdir=$OPTARG ;;
+        *) exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 [-w WORKDIR] DIRWALK" >&2
+    exit 2
+fi
+# Absolute, as the checks run in the work directory
+dirwalk=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+export LC_ALL=C
+
+mkdir -p "$workdir"
+cd "$workdir"
+rm -rf options
+mkdir -p options/a/b
+touch options/a/f options/a/b/g
+
+status=0
+
+# check NAME CONDITION...: prints the result of a check; a failed check
+# makes the script fail
+check() {
+    name=$1
+    shift
+    if "$@"; then
+        echo "ok: $name"
+    else
+        echo "FAILED: $name"
+        status=1
+    fi
+}
+
+# lines PATTERN FILE: prints the number of lines of FILE holding PATTERN
+lines() {
+    grep -c -- "$1" "$2" || true
+}
+
+# An unknown user name is reported once, not also as a malformed number.
+"$dirwalk" options --user=nosuchuser-dirwalk > out 2> err && rc=0 || rc=$?
+check "--user=NAME unknown: one error" [ "$(lines "^Error" err)" = 1 ]
+check "--user=NAME unknown: Unknown user" [ "$(lines "Unknown user 'nosuchuser-dirwalk'" err)" = 1 ]
+check "--user=NAME unknown: status 1" [ $rc = 1 ]
+"$dirwalk" options --user="$(id -u)" > out 2> err && rc=0 || rc=$?
+check "--user=ID: status 0" [ $rc = 0 ]
+check "--user=ID: lists the entries" [ "$(wc -l < out)" = 5 ]
+
+# --diff exits as diff(1): 0 for the same entries, 1 if they differ, 2 on errors.
+"$dirwalk" options --front-coded > old.fc
+"$dirwalk" options --front-coded > same.fc
+touch options/a/h
+"$dirwalk" options --front-coded > new.fc
+"$dirwalk" --diff old.fc same.fc > out 2> err && rc=0 || rc=$?
+check "--diff of equal listings: status 0" [ $rc = 0 ]
+check "--diff of equal listings: no output" [ ! -s out ]
+"$dirwalk" --diff old.fc new.fc > out 2> err && rc=0 || rc=$?
+check "--diff of different listings: status 1" [ $rc = 1 ]
+check "--diff of different listings: +path" [ "$(cat out)" = "+options/a/h" ]
+"$dirwalk" --diff old.fc missing.fc > out 2> err && rc=0 || rc=$?
+check "--diff of a missing listing: status 2" [ $rc = 2 ]
+"$dirwalk" --diff old.fc > out 2> err && rc=0 || rc=$?
+check "--diff of one listing: status 2" [ $rc = 2 ]
+
+rm -rf options out err old.fc same.fc new.fc
+exit $status